@@ -37,6 +37,11 @@ LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
     twrpTar.cpp \
+    twrpTarPipeline.cpp \
+    twrpImageCopy.cpp \
+    twrpChunkStore.cpp \
+    twrpFileManifest.cpp \
+    twrpSizeCache.cpp \
     exclude.cpp \
     find_file.cpp \
     infomanager.cpp \
@@ -102,6 +102,22 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 					return std::vector<std::string>();
 				}
 			}
+			//skip over the data of version 4 frames so it is not mistaken for headers
+			else if (cmdtype == TWDATAFRAME) {
+				struct AdbBackupDataFrame frame;
+				uint32_t crc, framecrc;
+
+				memcpy(&frame, buf, sizeof(frame));
+				framecrc = frame.crc;
+				memset(&frame.crc, 0, sizeof(frame.crc));
+				crc = crc32(0L, Z_NULL, 0);
+				crc = crc32(crc, (const unsigned char*) &frame, sizeof(frame));
+				if (crc == framecrc && lseek64(fd, frame.size, SEEK_CUR) < 0) {
+					printf("Unable to seek past data frame: %s\n", strerror(errno));
+					close(fd);
+					return std::vector<std::string>();
+				}
+			}
 			else if (cmdtype == TWIMG || cmdtype == TWFN) {
 				struct twfilehdr twfilehdr;
 				uint32_t crc, twfilehdrcrc;
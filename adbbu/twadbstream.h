@@ -36,11 +36,17 @@
 #define TWEOF "tweof"					//End of File for Image/File
 #define MD5TRAILER "md5trailer"				//Image/File MD5 Trailer
 #define TWDATA "twdatablock"				// twrp adb backup data block header
+#define TWDATAFRAME "twdataframe"			//Length prefixed data frame (version 4 and later)
 #define TWMD5 "twverifymd5"				//This command is compared to the md5trailer by ORS to verify transfer
 #define TWENDADB "twendadb"				//End Protocol
 #define TWERROR "twerror"				//Send error
-#define ADB_BACKUP_VERSION 3				//Backup Version
-#define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header
+#define ADB_BACKUP_VERSION 4				//Backup Version
+#define ADB_BACKUP_MIN_VERSION 3			//Oldest backup version that can still be restored
+#define ADB_FRAMED_VERSION 4				//First version that sends file data in AdbBackupDataFrame frames
+#define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header (version 3)
+#define ADB_FRAME_SIZE 4194304				//Maximum amount of data in one AdbBackupDataFrame
+#define ADB_FRAME_PIPE_SIZE 1048576			//Size requested for the data fifos so frames fill up quickly
+#define ADB_FRAME_WAIT_MS 10				//How long to wait for more data before sending a partial frame
 #define MAX_ADB_READ 512				//align with default tar size for amount to read fom adb stream
 
 /*
@@ -60,6 +66,14 @@ struct but not really a command
   | File Data              |
   | File/Image MD5 Trailer |
   | etc...                 |
+
+  version 4 and later replace the File Data and MD5 Trailer with frames:
+  | TW File Stream Header  |
+  | TW Data Frame Header   |
+  | up to ADB_FRAME_SIZE bytes of File Data |
+  | TW Data Frame Header   |
+  | File Data              |
+  | TW Data Frame Header with a size of 0 marking the end of the file |
 */
 
 //determine whether struct is 512 bytes, if not fail compilation
@@ -99,6 +113,17 @@ struct AdbBackupFileTrailer {
 	char space[440];				//stores space to align the struct to 512 bytes
 };
 
+//header in front of each block of file data in version 4 streams, each
+//frame carries the crc of its own data instead of an md5 for the whole file
+struct AdbBackupDataFrame {
+	char start_of_header[8];			//stores the magic value #define TWRP
+	char type[16];					//stores the AdbBackupDataFrame type TWDATAFRAME
+	uint64_t size;					//stores the number of data bytes following this header, 0 marks the end of the file
+	uint32_t data_crc;				//stores the zlib 32 bit crc of the data following this header
+	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupDataFrame struct to allow for making sure we are processing metadata
+	char space[472];				//stores space to align the struct to 512 bytes
+};
+
 //info for version and number of partitions backed up
 struct AdbBackupStreamHeader {
 	char start_of_header[8];			//stores the magic value #define TWRP
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <zlib.h>
 #include <ctype.h>
 #include <semaphore.h>
@@ -52,6 +53,7 @@ twrpback::twrpback(void) {
 	ors_fd = 0;
 	debug_adb_fd = 0;
 	firstPart = true;
+	streamVersion = 0;
 	createFifos();
 	adbloginit();
 }
@@ -206,6 +208,7 @@ bool twrpback::backup(std::string command) {
 		close_backup_fds();
 		return false;
 	}
+	fcntl(adb_read_fd, F_SETPIPE_SZ, ADB_FRAME_PIPE_SIZE);
 
 	//loop until TWENDADB sent
 	while (true) {
@@ -234,7 +237,11 @@ bool twrpback::backup(std::string command) {
 			}
 			//we recieved the TWSTREAMHDR structure metadata to write to adb
 			else if (cmdtype == TWSTREAMHDR) {
+				struct AdbBackupStreamHeader twhdr;
+
 				writedata = false;
+				memcpy(&twhdr, cmd, sizeof(cmd));
+				streamVersion = twhdr.version;
 				adblogwrite("writing TWSTREAMHDR\n");
 				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
 					std::string msg = "Error writing TWSTREAMHDR to adbd";
@@ -302,6 +309,17 @@ bool twrpback::backup(std::string command) {
 				fflush(adbd_fp);
 				writedata = true;
 			}
+			//Version 4 streams end the file with an empty frame instead of padding and an md5 trailer
+			else if (cmdtype == TWEOF && streamVersion >= ADB_FRAMED_VERSION) {
+				adblogwrite("received TWEOF\n");
+				if (!writeDataFrames(true, &totalbytes) || !writeFrame(NULL, 0)) {
+					close_backup_fds();
+					return false;
+				}
+				writedata = false;
+				firstDataPacket = true;
+				fileBytes = 0;
+			}
 			/*
 			We received the command that we are done with the file stream.
 			We will flush the remaining data stream.
@@ -399,7 +417,13 @@ bool twrpback::backup(std::string command) {
 		//This will allow us to not write data after a command structure has been written
 		//to the adb stream.
 		//If the stream is compressed, we need to always write the data.
-		if (writedata || compressed) {
+		if ((writedata || compressed) && streamVersion >= ADB_FRAMED_VERSION) {
+			if (!writeDataFrames(false, &totalbytes)) {
+				close_backup_fds();
+				return false;
+			}
+		}
+		else if (writedata || compressed) {
 			while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream))) > 0) {
 				if (firstDataPacket) {
 					if (!twadbbu::Write_TWDATA(adbd_fp)) {
@@ -719,6 +743,7 @@ bool twrpback::restore(void) {
 
 					adblogwrite("opening TW_ADB_RESTORE\n");
 					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					fcntl(adb_write_fd, F_SETPIPE_SZ, ADB_FRAME_PIPE_SIZE);
 				}
 				//Tell TWRP we are sending a tar stream
 				else if (cmdtype == TWFN) {
@@ -767,6 +792,26 @@ bool twrpback::restore(void) {
 					compressed = twfilehdr.compressed == 1 ? true: false;
 					adblogwrite("opening TW_ADB_RESTORE\n");
 					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					fcntl(adb_write_fd, F_SETPIPE_SZ, ADB_FRAME_PIPE_SIZE);
+				}
+				//Version 4 file data, an empty frame ends the file
+				else if (cmdtype == TWDATAFRAME) {
+					struct AdbBackupDataFrame frame;
+
+					memcpy(&frame, readAdbStream, sizeof(frame));
+					if (!restoreDataFrame(&frame, &totalbytes)) {
+						close_restore_fds();
+						return false;
+					}
+					if (frame.size == 0) {
+						close(adb_write_fd);
+						if (tweofrcvd) {
+							read_from_adb = true;
+							tweofrcvd = false;
+						}
+						else
+							read_from_adb = false; //don't read from adb until TWRP sends TWEOF
+					}
 				}
 				else if (cmdtype == MD5TRAILER) {
 					if (fileBytes >= md5fnsize)
@@ -933,3 +978,141 @@ bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpMD5
 	}
 	return false;
 }
+
+bool twrpback::writeFrame(const char *data, uint64_t size) {
+	struct AdbBackupDataFrame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	strncpy(frame.start_of_header, TWRP, sizeof(frame.start_of_header));
+	strncpy(frame.type, TWDATAFRAME, sizeof(frame.type));
+	frame.size = size;
+	frame.data_crc = crc32(0L, Z_NULL, 0);
+	if (size > 0)
+		frame.data_crc = crc32(frame.data_crc, (const unsigned char*) data, size);
+	frame.crc = crc32(0L, Z_NULL, 0);
+	frame.crc = crc32(frame.crc, (const unsigned char*) &frame, sizeof(frame));
+
+	if (fwrite(&frame, 1, sizeof(frame), adbd_fp) != sizeof(frame)) {
+		adblogwrite("Error writing data frame to adbd\n");
+		return false;
+	}
+	if (size > 0 && fwrite(data, 1, size, adbd_fp) != size) {
+		adblogwrite("Error writing backup data to adbd\n");
+		return false;
+	}
+	#ifdef _DEBUG_ADB_BACKUP
+	if (size > 0 && write(debug_adb_fd, data, size) < 1) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+	fflush(adbd_fp);
+	return true;
+}
+
+/*
+Read what TWRP has written to TW_ADB_BACKUP and send it to adbd in frames
+of up to ADB_FRAME_SIZE. A partial frame is sent once TWRP has not written
+anything for ADB_FRAME_WAIT_MS. When draining we keep going until TWRP
+closes the fifo, otherwise we return as soon as there is no data waiting.
+*/
+bool twrpback::writeDataFrames(bool drain, uint64_t *totalbytes) {
+	struct pollfd pfd;
+	size_t fill = 0;
+	ssize_t bytes;
+
+	if (frameBuffer.size() != ADB_FRAME_SIZE)
+		frameBuffer.resize(ADB_FRAME_SIZE);
+	pfd.fd = adb_read_fd;
+	pfd.events = POLLIN;
+
+	while (true) {
+		bytes = read(adb_read_fd, &frameBuffer[fill], ADB_FRAME_SIZE - fill);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0 && errno != EAGAIN) {
+			std::string msg = "Cannot read from TW_ADB_BACKUP: ";
+			printErrMsg(msg, errno);
+			return false;
+		}
+		if (bytes > 0) {
+			fill += bytes;
+			if (fill < ADB_FRAME_SIZE)
+				continue;
+		}
+		else if (bytes < 0 && fill > 0) {
+			pfd.revents = 0;
+			if (poll(&pfd, 1, ADB_FRAME_WAIT_MS) > 0 && (pfd.revents & POLLIN))
+				continue;
+		}
+		if (fill > 0) {
+			if (!writeFrame(&frameBuffer[0], fill))
+				return false;
+			*totalbytes += fill;
+			fill = 0;
+			if (bytes != 0)
+				continue;
+		}
+		if (bytes == 0 || !drain)
+			return true;
+		poll(&pfd, 1, 100);
+	}
+}
+
+bool twrpback::restoreDataFrame(struct AdbBackupDataFrame *frame, uint64_t *totalbytes) {
+	struct AdbBackupDataFrame hdr;
+	uint32_t crc, data_crc;
+	size_t len, pos;
+	ssize_t bytes;
+
+	memcpy(&hdr, frame, sizeof(hdr));
+	memset(&hdr.crc, 0, sizeof(hdr.crc));
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*) &hdr, sizeof(hdr));
+	if (crc != frame->crc) {
+		adblogwrite("ADB TWDATAFRAME crc header doesn't match\n");
+		return false;
+	}
+
+	if (frame->size > ADB_FRAME_SIZE) {
+		adblogwrite("ADB TWDATAFRAME is larger than ADB_FRAME_SIZE\n");
+		return false;
+	}
+
+	// The whole frame is checked before any of it reaches TWRP
+	if (frameBuffer.size() != ADB_FRAME_SIZE)
+		frameBuffer.resize(ADB_FRAME_SIZE);
+	len = (size_t)frame->size;
+	if (fread(&frameBuffer[0], 1, len, adbd_fp) != len) {
+		adblogwrite("Unexpected end of adb stream in data frame\n");
+		return false;
+	}
+	data_crc = crc32(0L, Z_NULL, 0);
+	data_crc = crc32(data_crc, (const unsigned char*) &frameBuffer[0], len);
+	if (len > 0 && data_crc != frame->data_crc) {
+		adblogwrite("ADB TWDATAFRAME data crc doesn't match\n");
+		return false;
+	}
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &frameBuffer[0], len) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+	for (pos = 0; pos < len; pos += bytes) {
+		bytes = write(adb_write_fd, &frameBuffer[pos], len - pos);
+		if (bytes < 0 && errno == EINTR) {
+			bytes = 0;
+			continue;
+		}
+		if (bytes < 1) {
+			std::string msg = "Cannot write to TWRP ADB FIFO: ";
+			printErrMsg(msg, errno);
+			return false;
+		}
+	}
+	*totalbytes += len;
+	return true;
+}
@@ -18,6 +18,8 @@
 #define _TWRPBACK_HPP
 
 #include <fstream>
+#include <vector>
+#include "twadbstream.h"
 #include "../twrpDigest/twrpMD5.hpp"
 
 class twrpback {
@@ -44,6 +46,8 @@ private:
 	int adb_write_fd;                                                        // adb write data stream
 	int debug_adb_fd;                                                        // fd to write debug tars
 	bool firstPart;                                                          // first partition in the stream
+	uint64_t streamVersion;                                                  // version from the stream header
+	std::vector<char> frameBuffer;                                           // data for one version 4 frame
 	FILE *adbd_fp;                                                           // file pointer for adb stream
 	char cmd[512];                                                           // store result of commands
 	char operation[512];                                                     // operation to send to ors
@@ -55,6 +59,9 @@ private:
 	void close_backup_fds();                                                 // close backup resources
 	void close_restore_fds();                                                // close restore resources
 	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpMD5* digest); // Check MD5 Trailer
+	bool writeDataFrames(bool drain, uint64_t *totalbytes);                 // send TWRP's data to adbd as version 4 frames
+	bool writeFrame(const char *data, uint64_t size);                        // send one version 4 frame, size 0 ends the file
+	bool restoreDataFrame(struct AdbBackupDataFrame *frame, uint64_t *totalbytes); // check a version 4 frame and pass its data to TWRP
 	void printErrMsg(std::string msg, int errNum);                          // print error msg to adb log
 };
 
@@ -153,7 +153,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -245,12 +249,48 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// Calls |work| for every index in [0, count) from |threads| threads, or one per CPU if |threads| is
+// 0. Returns false if any of the calls failed. The callers keep the results per index and put
+// them together afterwards, so the output doesn't depend on the thread count.
+static bool RunInParallel(size_t count, size_t threads, const std::function<bool(size_t)>& work) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (!work(i)) return false;
+    }
+    return true;
+  }
+
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next++) < count) {
+      if (!work(i)) failed = true;
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; t++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  return !failed;
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "threads", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
@@ -377,7 +417,7 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
+bool ImageChunk::ReconstructDeflateChunk(bool parallel_levels) {
   if (type_ != CHUNK_DEFLATE) {
     LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
@@ -385,6 +425,19 @@ bool ImageChunk::ReconstructDeflateChunk() {
 
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
   // (the maximum).
+  if (parallel_levels) {
+    // Level 6 still takes precedence when both of them match.
+    bool level9 = false;
+    std::thread probe([this, &level9]() { level9 = TryReconstruction(9); });
+    bool level6 = TryReconstruction(6);
+    probe.join();
+    if (level6 || level9) {
+      compress_level_ = level6 ? 6 : 9;
+      return true;
+    }
+    return false;
+  }
+
   for (int level = 6; level <= 9; level += 3) {
     if (TryReconstruction(level)) {
       compress_level_ = level;
@@ -400,13 +453,14 @@ bool ImageChunk::ReconstructDeflateChunk() {
  * in the chunk, and checks that it matches exactly the compressed data we started with (also
  * stored in the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(int level) const {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
   strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
+  // deflate() doesn't write to the input; zlib just doesn't declare it const.
+  strm.next_in = const_cast<uint8_t*>(uncompressed_data_.data());
   int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
@@ -886,8 +940,50 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
-bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
-  for (auto& tgt_chunk : *tgt_image) {
+// Reconstructs the deflate chunks of |tgt_image| listed in |indices| on |threads| threads, and
+// stores whether that worked for each of them in |reconstructed|; the other chunks are left
+// unset. Reconstruction only depends on the chunk itself, so the chunks can be done in any order.
+static void ReconstructDeflateChunks(Image* tgt_image, const std::vector<size_t>& indices,
+                                     size_t threads,
+                                     std::vector<std::optional<bool>>* reconstructed) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // With fewer chunks than threads, the spare threads probe the compression levels instead.
+  bool parallel_levels = indices.size() < threads;
+
+  std::vector<char> results(indices.size(), 0);
+  RunInParallel(indices.size(), threads, [&](size_t i) {
+    results[i] = (*tgt_image)[indices[i]].ReconstructDeflateChunk(parallel_levels);
+    return true;
+  });
+
+  reconstructed->assign(tgt_image->NumOfChunks(), std::nullopt);
+  for (size_t i = 0; i < indices.size(); i++) {
+    (*reconstructed)[indices[i]] = results[i] != 0;
+  }
+}
+
+bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                         size_t threads) {
+  // Reconstructing the target deflate chunks is the slow part; do it up front for every chunk that
+  // will need it. The loop below then makes the same decisions as it would one chunk at a time.
+  std::vector<size_t> to_reconstruct;
+  for (size_t i = 0; i < tgt_image->NumOfChunks(); i++) {
+    const auto& tgt_chunk = (*tgt_image)[i];
+    if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
+      continue;
+    }
+    const ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk != nullptr && tgt_chunk != *src_chunk) {
+      to_reconstruct.push_back(i);
+    }
+  }
+  std::vector<std::optional<bool>> reconstructed;
+  ReconstructDeflateChunks(tgt_image, to_reconstruct, threads, &reconstructed);
+
+  for (size_t i = 0; i < tgt_image->NumOfChunks(); i++) {
+    auto& tgt_chunk = (*tgt_image)[i];
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
     }
@@ -902,7 +998,7 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!(reconstructed[i] ? *reconstructed[i] : tgt_chunk.ReconstructDeflateChunk())) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
       LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
@@ -1123,53 +1219,84 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks, size_t threads) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+  // Finds the source of every chunk that needs a patch. Those without a matching deflate chunk are
+  // diffed against the whole source file.
+  size_t num_chunks = tgt_image.NumOfChunks();
+  std::vector<char> needs_patch(num_chunks, 0);
+  std::vector<const ImageChunk*> src_chunks(num_chunks, nullptr);
+  std::optional<ImageChunk> pseudo_source;
+  size_t first_pseudo_source_chunk = num_chunks;
+  for (size_t i = 0; i < num_chunks; i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
+    needs_patch[i] = 1;
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    if (tgt_chunk.GetType() == CHUNK_DEFLATE) {
+      src_chunks[i] = src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    }
+    if (src_chunks[i] == nullptr && !pseudo_source) {
+      pseudo_source = src_image.PseudoSource();
+      first_pseudo_source_chunk = i;
+    }
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
+  std::vector<std::vector<uint8_t>> patches(num_chunks);
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  auto make_patch = [&](size_t i) {
+    const auto& src_ref = (src_chunks[i] == nullptr) ? *pseudo_source : *src_chunks[i];
     bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
-      LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
+        (src_chunks[i] == nullptr) ? &bsdiff_cache : nullptr;
+    if (!ImageChunk::MakePatch(tgt_image[i], src_ref, &patches[i], bsdiff_cache_ptr)) {
+      LOG(ERROR) << "Failed to generate patch, name: " << tgt_image[i].GetEntryName();
       return false;
     }
+    return true;
+  };
+
+  // The first diff against the whole source file builds its suffix array into bsdiff_cache. The
+  // other chunks only read it, so they can share it across the threads.
+  bool success = first_pseudo_source_chunk == num_chunks || make_patch(first_pseudo_source_chunk);
+  success = success && RunInParallel(num_chunks, threads, [&](size_t i) {
+              return !needs_patch[i] || i == first_pseudo_source_chunk || make_patch(i);
+            });
+  delete bsdiff_cache;
+  if (!success) {
+    return false;
+  }
+
+  for (size_t i = 0; i < num_chunks; i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (!needs_patch[i]) {
+      patch_chunks->emplace_back(tgt_chunk);
+      continue;
+    }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      const auto& src_ref = (src_chunks[i] == nullptr) ? *pseudo_source : *src_chunks[i];
+      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
+                                   const std::string& patch_name, size_t threads) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, threads);
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1188,7 +1315,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir, size_t threads) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
   android::base::unique_fd patch_fd(
@@ -1202,7 +1329,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
     std::vector<PatchChunk> patch_chunks;
     if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
+                                               &patch_chunks, threads)) {
       LOG(ERROR) << "Failed to generate split patch";
       return false;
     }
@@ -1398,7 +1525,8 @@ bool ImageModeImage::SetBonusData(const std::vector<uint8_t>& bonus_data) {
 
 // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
 // same sequence of deflate and normal chunks).
-bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image) {
+bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                           size_t threads) {
   // In image mode, merge the gzip header and footer in with any adjacent normal chunks.
   tgt_image->MergeAdjacentNormalChunks();
   src_image->MergeAdjacentNormalChunks();
@@ -1418,6 +1546,15 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     }
   }
 
+  std::vector<size_t> to_reconstruct;
+  for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
+    if ((*tgt_image)[i].GetType() == CHUNK_DEFLATE && (*tgt_image)[i] != (*src_image)[i]) {
+      to_reconstruct.push_back(i);
+    }
+  }
+  std::vector<std::optional<bool>> reconstructed;
+  ReconstructDeflateChunks(tgt_image, to_reconstruct, threads, &reconstructed);
+
   for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
     auto& tgt_chunk = (*tgt_image)[i];
     auto& src_chunk = (*src_image)[i];
@@ -1429,7 +1566,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!(reconstructed[i] ? *reconstructed[i] : tgt_chunk.ReconstructDeflateChunk())) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1456,11 +1593,26 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name, size_t threads) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
 
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  bool success = RunInParallel(tgt_image.NumOfChunks(), threads, [&](size_t i) {
+    if (PatchChunk::RawDataIsSmaller(tgt_image[i], 0)) {
+      return true;
+    }
+    if (!ImageChunk::MakePatch(tgt_image[i], src_image[i], &patches[i], nullptr)) {
+      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
+      return false;
+    }
+    return true;
+  });
+  if (!success) {
+    return false;
+  }
+
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
     const auto& src_chunk = src_image[i];
@@ -1470,18 +1622,13 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
       continue;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patches[i]));
     }
   }
 
@@ -1504,6 +1651,7 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  size_t threads = 0;
 
   int opt;
   int option_index;
@@ -1547,6 +1695,9 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "threads" && !android::base::ParseUint(optarg, &threads)) {
+          LOG(ERROR) << "Failed to parse thread count: " << optarg;
+          return 1;
         }
         break;
       }
@@ -1572,6 +1723,8 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --threads,        Number of threads computing the patches; 0 (the default) uses one\n"
+           "                    per CPU. The patch is the same for any number of threads.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
@@ -1587,7 +1740,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image, threads)) {
       return 1;
     }
 
@@ -1606,11 +1759,12 @@ int imgdiff(int argc, const char** argv) {
                                                &split_src_images, &split_src_ranges);
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir,
+                                         threads)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], threads)) {
       return 1;
     }
   } else {
@@ -1624,7 +1778,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
+    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image, threads)) {
       return 1;
     }
 
@@ -1632,7 +1786,7 @@ int imgdiff(int argc, const char** argv) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], threads)) {
       return 1;
     }
   }
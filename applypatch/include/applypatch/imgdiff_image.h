@@ -85,9 +85,10 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output. With |parallel_levels|, the candidate levels
+   * are tried at the same time on separate threads.
    */
-  bool ReconstructDeflateChunk();
+  bool ReconstructDeflateChunk(bool parallel_levels = false);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
@@ -101,7 +102,7 @@ class ImageChunk {
                         bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
 
  private:
-  bool TryReconstruction(int level);
+  bool TryReconstruction(int level) const;
 
   int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
   size_t start_;                                // offset of chunk in the original input file
@@ -230,12 +231,15 @@ class ZipModeImage : public Image {
   const ImageChunk* FindChunkByName(const std::string& name, bool find_normal = false) const;
 
   // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
-  // src and tgt are identical.
-  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
+  // src and tgt are identical. The chunks are reconstructed on |threads| threads (one per CPU if
+  // 0), with the same result as a serial run.
+  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                    size_t threads = 0);
 
-  // Compute the patch between tgt & src images, and write the data into |patch_name|.
+  // Compute the patch between tgt & src images, and write the data into |patch_name|. The chunk
+  // patches are computed on |threads| threads (one per CPU if 0); the output doesn't depend on it.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t threads = 0);
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
@@ -244,7 +248,7 @@ class ZipModeImage : public Image {
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir, size_t threads = 0);
 
   // Split the tgt chunks and src chunks based on the size limit.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
@@ -277,9 +281,11 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
-  // Function that actually iterates the tgt_chunks and makes patches.
+  // Function that actually iterates the tgt_chunks and makes patches. The chunks that diff against
+  // the whole source file share one suffix array of it, which is built before the other chunks
+  // start and only read afterwards.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks, size_t threads);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
@@ -297,12 +303,13 @@ class ImageModeImage : public Image {
 
   // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
   // same sequence of deflate and normal chunks).
-  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
+  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                    size_t threads = 0);
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
   // result to |patch_name|.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name, size_t threads = 0);
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
@@ -759,6 +759,9 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue(TW_SKIP_DIGEST_CHECK_VAR, "0");
 	mPersist.SetValue(TW_SKIP_DIGEST_CHECK_ZIP_VAR, "1");
 	mPersist.SetValue(TW_SKIP_DIGEST_GENERATE_VAR, "0");
+	mPersist.SetValue(TW_VERIFY_DIGEST_AFTER_WRITE_VAR, "0");
+	mPersist.SetValue(TW_INCREMENTAL_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_DEDUP_BACKUP_VAR, "0");
 	mPersist.SetValue(TW_SDEXT_SIZE, "0");
 	mPersist.SetValue(TW_SWAP_SIZE, "0");
 	mPersist.SetValue(TW_SDPART_FILE_SYSTEM, "ext3");
@@ -26,6 +26,7 @@ extern "C" {
 #include <string>
 #include <vector>
 #include "exclude.hpp"
+#include "twrpFileManifest.hpp"
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "twcommon.h"
@@ -59,34 +60,18 @@ void TWExclude::add_absolute_dir(const string& dir) {
 }
 
 uint64_t TWExclude::Get_Folder_Size(const string& Path) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	uint64_t dusize = 0;
-	string FullPath;
-
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		return 0;
-	}
+	return twrpFileManifest::Get_Folder_Size(Path, this);
+}
 
-	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
-			LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
-			continue;
-		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG || st.st_mode & S_IFLNK) {
-			dusize += (uint64_t)(st.st_size);
-		}
-	}
-	closedir(d);
-	return dusize;
+string TWExclude::signature() {
+	string ret = "relative:";
+
+	for (size_t i = 0; i < relativedir.size(); i++)
+		ret += relativedir[i] + "/";
+	ret += " absolute:";
+	for (size_t i = 0; i < absolutedir.size(); i++)
+		ret += absolutedir[i] + ":";
+	return ret;
 }
 
 bool TWExclude::check_relative_skip_dirs(const string& dir) {
@@ -28,13 +28,14 @@ class TWExclude {
 
 public:
 	TWExclude();
-	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
+	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size with a twrpFileManifest walk
 	void add_absolute_dir(const string& Path);
 	void add_relative_dir(const string& Path);
 	bool check_relative_skip_dirs(const string& dir);
 	bool check_absolute_skip_dirs(const string& path);
 	bool check_skip_dirs(const string& path);
 	void clear_relative_dir(string dir);
+	string signature();                            // Lists the exclusions, for caches of what a walk found
 private:
 	vector<string> absolutedir;
 	vector<string> relativedir;
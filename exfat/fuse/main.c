@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #ifndef DEBUG
@@ -45,6 +46,14 @@
 const char* default_options = "ro_fallback,allow_other,blkdev,big_writes,"
 		"default_permissions";
 
+/* requests the kernel may have queued at once, its default is 12 */
+#define MAX_BACKGROUND 64
+
+/*
+   Requests are handled on several threads. Everything but data I/O takes
+   ef.tree_lock, so that an ongoing read or write of a file only holds that
+   file's node lock and does not hold up lookups and listings.
+*/
 struct exfat ef;
 
 static struct exfat_node* get_node(const struct fuse_file_info* fi)
@@ -65,12 +74,19 @@ static int fuse_exfat_getattr(const char* path, struct stat* stbuf)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 
+	pthread_mutex_lock(&node->lock);
 	exfat_stat(&ef, node, stbuf);
+	pthread_mutex_unlock(&node->lock);
 	exfat_put_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
 	return 0;
 }
 
@@ -81,19 +97,27 @@ static int fuse_exfat_truncate(const char* path, loff_t size)
 
 	exfat_debug("[%s] %s, %"PRId64, __func__, path, size);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 
+	pthread_mutex_lock(&node->lock);
 	rc = exfat_truncate(&ef, node, size, true);
+	pthread_mutex_unlock(&node->lock);
 	if (rc != 0)
 	{
 		exfat_flush_node(&ef, node);	/* ignore return code */
 		exfat_put_node(&ef, node);
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
 	}
 	rc = exfat_flush_node(&ef, node);
 	exfat_put_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
 	return rc;
 }
 
@@ -108,12 +132,17 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &parent, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 	if (!(parent->flags & EXFAT_ATTRIB_DIR))
 	{
 		exfat_put_node(&ef, parent);
+		pthread_mutex_unlock(&ef.tree_lock);
 		exfat_error("'%s' is not a directory (0x%x)", path, parent->flags);
 		return -ENOTDIR;
 	}
@@ -125,20 +154,25 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 	if (rc != 0)
 	{
 		exfat_put_node(&ef, parent);
+		pthread_mutex_unlock(&ef.tree_lock);
 		exfat_error("failed to open directory '%s'", path);
 		return rc;
 	}
 	while ((node = exfat_readdir(&ef, &it)))
 	{
 		exfat_get_name(node, name, sizeof(name) - 1);
+		/* the size and clusters of an open file can change under a write */
+		pthread_mutex_lock(&node->lock);
 		exfat_debug("[%s] %s: %s, %"PRId64" bytes, cluster 0x%x", __func__,
 				name, IS_CONTIGUOUS(*node) ? "contiguous" : "fragmented",
 				node->size, node->start_cluster);
+		pthread_mutex_unlock(&node->lock);
 		filler(buffer, name, NULL, 0);
 		exfat_put_node(&ef, node);
 	}
 	exfat_closedir(&ef, &it);
 	exfat_put_node(&ef, parent);
+	pthread_mutex_unlock(&ef.tree_lock);
 	return 0;
 }
 
@@ -149,7 +183,9 @@ static int fuse_exfat_open(const char* path, struct fuse_file_info* fi)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
+	pthread_mutex_unlock(&ef.tree_lock);
 	if (rc != 0)
 		return rc;
 	set_node(fi, node);
@@ -164,10 +200,11 @@ static int fuse_exfat_create(const char* path, mode_t mode,
 
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_mknod(&ef, path);
-	if (rc != 0)
-		return rc;
-	rc = exfat_lookup(&ef, &node, path);
+	if (rc == 0)
+		rc = exfat_lookup(&ef, &node, path);
+	pthread_mutex_unlock(&ef.tree_lock);
 	if (rc != 0)
 		return rc;
 	set_node(fi, node);
@@ -183,8 +220,10 @@ static int fuse_exfat_release(const char* path, struct fuse_file_info* fi)
 	   See fuse_exfat_flush() below.
 	*/
 	exfat_debug("[%s] %s", __func__, path);
- 	exfat_flush_node(&ef, get_node(fi));
+	pthread_mutex_lock(&ef.tree_lock);
+	exfat_flush_node(&ef, get_node(fi));
 	exfat_put_node(&ef, get_node(fi));
+	pthread_mutex_unlock(&ef.tree_lock);
 	return 0; /* FUSE ignores this return value */
 }
 
@@ -196,8 +235,13 @@ static int fuse_exfat_flush(const char* path, struct fuse_file_info* fi)
 	   only on rmdir and unlink. If the FUSE implementation does not call this
 	   handler we will flush node on release. See fuse_exfat_relase() above.
 	*/
+	int rc;
+
 	exfat_debug("[%s] %s", __func__, path);
-	return exfat_flush_node(&ef, get_node(fi));
+	pthread_mutex_lock(&ef.tree_lock);
+	rc = exfat_flush_node(&ef, get_node(fi));
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_fsync(const char* path, int datasync,
@@ -206,7 +250,9 @@ static int fuse_exfat_fsync(const char* path, int datasync,
 	int rc;
 
 	exfat_debug("[%s] %s", __func__, path);
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_flush_nodes(&ef);
+	pthread_mutex_unlock(&ef.tree_lock);
 	if (rc != 0)
 		return rc;
 	rc = exfat_flush(&ef);
@@ -221,7 +267,9 @@ static int fuse_exfat_read(const char* path, char* buffer, size_t size,
 	ssize_t ret;
 
 	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
+	pthread_mutex_lock(&get_node(fi)->lock);
 	ret = exfat_generic_pread(&ef, get_node(fi), buffer, size, offset);
+	pthread_mutex_unlock(&get_node(fi)->lock);
 	if (ret < 0)
 		return -EIO;
 	return ret;
@@ -233,12 +281,44 @@ static int fuse_exfat_write(const char* path, const char* buffer, size_t size,
 	ssize_t ret;
 
 	exfat_debug("[%s] %s (%zu bytes)", __func__, path, size);
+	pthread_mutex_lock(&get_node(fi)->lock);
 	ret = exfat_generic_pwrite(&ef, get_node(fi), buffer, size, offset);
+	pthread_mutex_unlock(&get_node(fi)->lock);
 	if (ret < 0)
 		return -EIO;
 	return ret;
 }
 
+/*
+   Lets writers that know the final size grow the file at once, which gets
+   it a single run of clusters if there is one that large. exFAT cannot keep
+   clusters past the end of a file, so FALLOC_FL_KEEP_SIZE is not supported.
+*/
+static int fuse_exfat_fallocate(const char* path, int mode, loff_t offset,
+		loff_t length, struct fuse_file_info* fi)
+{
+	struct exfat_node* node = get_node(fi);
+	int rc = 0;
+
+	exfat_debug("[%s] %s (%"PRId64" bytes at %"PRId64")", __func__, path,
+			length, offset);
+
+	if (mode != 0)
+		return -EOPNOTSUPP;
+
+	pthread_mutex_lock(&ef.tree_lock);
+	pthread_mutex_lock(&node->lock);
+	if (offset + length > node->size)
+		rc = exfat_truncate(&ef, node, offset + length, true);
+	pthread_mutex_unlock(&node->lock);
+	if (rc != 0)
+		exfat_flush_node(&ef, node);	/* ignore return code */
+	else
+		rc = exfat_flush_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
+}
+
 static int fuse_exfat_unlink(const char* path)
 {
 	struct exfat_node* node;
@@ -246,15 +326,20 @@ static int fuse_exfat_unlink(const char* path)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 
 	rc = exfat_unlink(&ef, node);
 	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
+	if (rc == 0)
+		rc = exfat_cleanup_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_rmdir(const char* path)
@@ -264,33 +349,53 @@ static int fuse_exfat_rmdir(const char* path)
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 
 	rc = exfat_rmdir(&ef, node);
 	exfat_put_node(&ef, node);
-	if (rc != 0)
-		return rc;
-	return exfat_cleanup_node(&ef, node);
+	if (rc == 0)
+		rc = exfat_cleanup_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_mknod(const char* path, mode_t mode, dev_t dev)
 {
+	int rc;
+
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mknod(&ef, path);
+	pthread_mutex_lock(&ef.tree_lock);
+	rc = exfat_mknod(&ef, path);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_mkdir(const char* path, mode_t mode)
 {
+	int rc;
+
 	exfat_debug("[%s] %s 0%ho", __func__, path, mode);
-	return exfat_mkdir(&ef, path);
+	pthread_mutex_lock(&ef.tree_lock);
+	rc = exfat_mkdir(&ef, path);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_rename(const char* old_path, const char* new_path)
 {
+	int rc;
+
 	exfat_debug("[%s] %s => %s", __func__, old_path, new_path);
-	return exfat_rename(&ef, old_path, new_path);
+	pthread_mutex_lock(&ef.tree_lock);
+	rc = exfat_rename(&ef, old_path, new_path);
+	pthread_mutex_unlock(&ef.tree_lock);
+	return rc;
 }
 
 static int fuse_exfat_utimens(const char* path, const struct timespec tv[2])
@@ -300,13 +405,20 @@ static int fuse_exfat_utimens(const char* path, const struct timespec tv[2])
 
 	exfat_debug("[%s] %s", __func__, path);
 
+	pthread_mutex_lock(&ef.tree_lock);
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
+	{
+		pthread_mutex_unlock(&ef.tree_lock);
 		return rc;
+	}
 
+	pthread_mutex_lock(&node->lock);
 	exfat_utimes(node, tv);
+	pthread_mutex_unlock(&node->lock);
 	rc = exfat_flush_node(&ef, node);
 	exfat_put_node(&ef, node);
+	pthread_mutex_unlock(&ef.tree_lock);
 	return rc;
 }
 
@@ -359,6 +471,9 @@ static void* fuse_exfat_init(struct fuse_conn_info* fci)
 #ifdef FUSE_CAP_BIG_WRITES
 	fci->want |= FUSE_CAP_BIG_WRITES;
 #endif
+	/* max_write and max_readahead are left at their maximum, which FUSE
+	   caps to its receive buffer and to what the kernel offers */
+	fci->max_background = MAX_BACKGROUND;
 	return NULL;
 }
 
@@ -387,6 +502,7 @@ static struct fuse_operations fuse_exfat_ops =
 	.fsyncdir	= fuse_exfat_fsync,
 	.read		= fuse_exfat_read,
 	.write		= fuse_exfat_write,
+	.fallocate	= fuse_exfat_fallocate,
 	.unlink		= fuse_exfat_unlink,
 	.rmdir		= fuse_exfat_rmdir,
 	.mknod		= fuse_exfat_mknod,
@@ -604,7 +720,7 @@ int main(int argc, char* argv[])
 	   main loop */
 	if (fuse_daemonize(debug) == 0)
 	{
-		if (fuse_loop(fh) != 0)
+		if (fuse_loop_mt(fh) != 0)
 			exfat_error("FUSE loop failure");
 	}
 	else
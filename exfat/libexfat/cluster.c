@@ -70,6 +70,12 @@ static uint32_t bytes2clusters(const struct exfat* ef, uint64_t bytes)
 	return (bytes + cluster_size - 1) / cluster_size;
 }
 
+/*
+ * Limit of extents kept per file. A file that is fragmented further is walked
+ * from its last known extent, which is still cheap with the FAT in memory.
+ */
+#define EXTENTS_MAX 65536
+
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster)
 {
@@ -81,6 +87,12 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 
 	if (IS_CONTIGUOUS(*node))
 		return cluster + 1;
+	if (ef->fat != NULL)
+	{
+		if (cluster >= ef->fat_entries)
+			return EXFAT_CLUSTER_BAD;
+		return le32_to_cpu(ef->fat[cluster]);
+	}
 	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
 		+ cluster * sizeof(cluster_t);
 	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
@@ -89,51 +101,352 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 	return le32_to_cpu(next);
 }
 
-cluster_t exfat_advance_cluster(const struct exfat* ef,
-		struct exfat_node* node, uint32_t count)
+void exfat_free_extents(struct exfat_node* node)
 {
-	uint32_t i;
+	free(node->extents);
+	node->extents = NULL;
+	node->extents_count = 0;
+	node->extents_allocated = 0;
+	node->extents_clusters = 0;
+}
+
+/*
+ * Forgets the extents past the first "clusters" clusters of the file.
+ */
+static void trim_extents(struct exfat_node* node, uint32_t clusters)
+{
+	struct exfat_extent* last;
+
+	if (node->extents_clusters <= clusters)
+		return;
+	while (node->extents_count != 0 &&
+			node->extents[node->extents_count - 1].index >= clusters)
+		node->extents_count--;
+	if (node->extents_count != 0)
+	{
+		last = &node->extents[node->extents_count - 1];
+		last->count = MIN(last->count, clusters - last->index);
+	}
+	node->extents_clusters = clusters;
+}
+
+static bool append_extent(struct exfat_node* node, cluster_t cluster)
+{
+	struct exfat_extent* extents;
+	uint32_t allocated;
+
+	if (node->extents_count == node->extents_allocated)
+	{
+		if (node->extents_allocated >= EXTENTS_MAX)
+			return false;
+		allocated = MAX(node->extents_allocated * 2, 4);
+		extents = realloc(node->extents, allocated * sizeof(*extents));
+		if (extents == NULL)
+			return false;
+		node->extents = extents;
+		node->extents_allocated = allocated;
+	}
+	node->extents[node->extents_count].index = node->extents_clusters;
+	node->extents[node->extents_count].cluster = cluster;
+	node->extents[node->extents_count].count = 1;
+	node->extents_count++;
+	node->extents_clusters++;
+	return true;
+}
+
+/*
+ * Finds cluster "count" of a non-contiguous file among its extents, following
+ * the FAT past the last one when needed. "run" passes how many clusters from
+ * there the caller wants and receives how many of them follow each other on
+ * disk (at least one).
+ */
+static cluster_t find_extent(const struct exfat* ef,
+		struct exfat_node* node, uint32_t count, uint32_t* run)
+{
+	const struct exfat_extent* extent;
+	struct exfat_extent* last;
+	cluster_t cluster, next;
+	uint32_t end = count + MAX(*run, 1);
+	uint32_t index, lo, hi, mid;
+
+	if (node->extents_count == 0)
+	{
+		if (CLUSTER_INVALID(node->start_cluster))
+			return node->start_cluster;
+		if (!append_extent(node, node->start_cluster))
+		{
+			cluster = node->start_cluster;
+			index = 0;
+			goto walk;
+		}
+	}
+	last = &node->extents[node->extents_count - 1];
+	cluster = last->cluster + last->count - 1;
+	while (node->extents_clusters < end)
+	{
+		next = exfat_next_cluster(ef, node, cluster);
+		if (CLUSTER_INVALID(next))
+		{
+			if (count >= node->extents_clusters)
+				return next; /* the caller should handle this and print
+				                appropriate error message */
+			break;
+		}
+		last = &node->extents[node->extents_count - 1];
+		if (next == last->cluster + last->count)
+		{
+			last->count++;
+			node->extents_clusters++;
+		}
+		else if (!append_extent(node, next))
+			break;
+		cluster = next;
+	}
+	index = node->extents_clusters - 1;
+	if (count > index)
+		goto walk;
 
-	if (node->fptr_index > count)
+	lo = 0;
+	hi = node->extents_count - 1;
+	while (lo < hi)
 	{
-		node->fptr_index = 0;
-		node->fptr_cluster = node->start_cluster;
+		mid = lo + (hi - lo + 1) / 2;
+		if (node->extents[mid].index <= count)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
+	extent = &node->extents[lo];
+	*run = MIN(extent->count - (count - extent->index), end - count);
+	return extent->cluster + (count - extent->index);
 
-	for (i = node->fptr_index; i < count; i++)
+walk:
+	/* no room for more extents, follow the FAT from the last one */
+	while (index < count)
 	{
-		node->fptr_cluster = exfat_next_cluster(ef, node, node->fptr_cluster);
-		if (CLUSTER_INVALID(node->fptr_cluster))
-			break; /* the caller should handle this and print appropriate 
-			          error message */
+		cluster = exfat_next_cluster(ef, node, cluster);
+		if (CLUSTER_INVALID(cluster))
+			return cluster;
+		index++;
 	}
+	*run = 1;
+	return cluster;
+}
+
+cluster_t exfat_advance_extent(const struct exfat* ef,
+		struct exfat_node* node, uint32_t count, uint32_t* run)
+{
+	if (IS_CONTIGUOUS(*node))
+	{
+		node->fptr_cluster = node->start_cluster + count;
+		*run = MAX(*run, 1);
+	}
+	else
+		node->fptr_cluster = find_extent(ef, node, count, run);
 	node->fptr_index = count;
 	return node->fptr_cluster;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+cluster_t exfat_advance_cluster(const struct exfat* ef,
+		struct exfat_node* node, uint32_t count)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
-	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
+	uint32_t run = 1;
+
+	return exfat_advance_extent(ef, node, count, &run);
+}
+
+#define BMAP_BITS (sizeof(bitmap_t) * 8)
+
+/*
+ * Returns the bits of the bitmap word that holds the bit "index" which are
+ * free (or used if "free" is false), masked to [index, end).
+ */
+static bitmap_t word_bits(const bitmap_t* bitmap, size_t index, size_t end,
+		bool free)
+{
+	const size_t base = index - index % BMAP_BITS;
+	bitmap_t word = bitmap[index / BMAP_BITS];
+
+	if (free)
+		word = ~word;
+	word &= ~(bitmap_t) 0 << (index - base);
+	if (end - base < BMAP_BITS)
+		word &= ((bitmap_t) 1 << (end - base)) - 1;
+	return word;
+}
+
+/* returns the first free (or used) bit in [start, end), end if none */
+static size_t find_bit(const bitmap_t* bitmap, size_t start, size_t end,
+		bool free)
+{
+	size_t i = start;
+	bitmap_t word;
+
+	while (i < end)
+	{
+		word = word_bits(bitmap, i, end, free);
+		if (word != 0)
+			return i - i % BMAP_BITS + __builtin_ctzl(word);
+		i += BMAP_BITS - i % BMAP_BITS;
+	}
+	return end;
+}
+
+/*
+ * Keeps the EXFAT_FREE_RUNS largest runs offered to it. Returns the size a
+ * run has to exceed to be kept from now on.
+ */
+static uint32_t add_free_run(struct exfat* ef, uint32_t start, uint32_t count)
+{
+	int i;
+	int smallest = 0;
 
-	for (i = start_index; i < end_index; i++)
+	if (ef->cmap.runs_count < EXFAT_FREE_RUNS)
 	{
-		if (bitmap[i] == ~((bitmap_t) 0))
+		ef->cmap.runs[ef->cmap.runs_count].start = start;
+		ef->cmap.runs[ef->cmap.runs_count].count = count;
+		if (++ef->cmap.runs_count < EXFAT_FREE_RUNS)
+			return 0;
+	}
+	else
+	{
+		for (i = 1; i < EXFAT_FREE_RUNS; i++)
+			if (ef->cmap.runs[i].count < ef->cmap.runs[smallest].count)
+				smallest = i;
+		ef->cmap.runs[smallest].start = start;
+		ef->cmap.runs[smallest].count = count;
+	}
+	for (i = 1; i < EXFAT_FREE_RUNS; i++)
+		if (ef->cmap.runs[i].count < ef->cmap.runs[smallest].count)
+			smallest = i;
+	return ef->cmap.runs[smallest].count;
+}
+
+static void remove_free_run(struct exfat* ef, int i)
+{
+	ef->cmap.runs[i] = ef->cmap.runs[--ef->cmap.runs_count];
+}
+
+static void scan_free_clusters(struct exfat* ef)
+{
+	const size_t end = ef->cmap.chunk_size;
+	size_t start = 0;
+	size_t used;
+	uint32_t smallest = 0;
+
+	ef->cmap.free_count = 0;
+	ef->cmap.runs_count = 0;
+	while ((start = find_bit(ef->cmap.chunk, start, end, true)) < end)
+	{
+		used = find_bit(ef->cmap.chunk, start, end, false);
+		if (used - start > smallest)
+			smallest = add_free_run(ef, start, used - start);
+		ef->cmap.free_count += used - start;
+		start = used;
+	}
+	ef->cmap.runs_stale = false;
+}
+
+void exfat_scan_free_clusters(struct exfat* ef)
+{
+	pthread_mutex_lock(&ef->alloc_lock);
+	scan_free_clusters(ef);
+	pthread_mutex_unlock(&ef->alloc_lock);
+}
+
+/*
+ * Picks the largest known free run. Runs are shrunk by allocations that did
+ * not go through them, so each is checked against the bitmap first. Returns
+ * the index of the run or -1 if there are none.
+ */
+static int pick_free_run(struct exfat* ef)
+{
+	struct exfat_free_run* run;
+	size_t end;
+	int i;
+	int best = -1;
+
+	for (i = ef->cmap.runs_count - 1; i >= 0; i--)
+	{
+		run = &ef->cmap.runs[i];
+		end = (size_t) run->start + run->count;
+		run->start = find_bit(ef->cmap.chunk, run->start, end, true);
+		run->count = find_bit(ef->cmap.chunk, run->start, end, false) -
+				run->start;
+		if (run->count == 0)
+		{
+			remove_free_run(ef, i);
+			if (best == ef->cmap.runs_count)
+				best = i;
 			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
+		}
+		if (best == -1 || run->count > ef->cmap.runs[best].count)
+			best = i;
+	}
+	return best;
+}
+
+/*
+ * Allocates up to "wanted" clusters that follow each other. They start at
+ * "hint" if it is free, so that a growing file stays contiguous. Otherwise
+ * they are taken from the beginning of the largest free run. The rest of
+ * that run is given to the next file only from its middle on, leaving room
+ * for this one to grow. Returns the first cluster and stores
+ * the number of allocated clusters in "count".
+ */
+static cluster_t allocate_clusters(struct exfat* ef, cluster_t hint,
+		uint32_t wanted, uint32_t* count)
+{
+	const size_t end = ef->cmap.chunk_size;
+	struct exfat_free_run* run;
+	size_t start;
+	size_t rest;
+	size_t c;
+	int i;
+
+	hint -= EXFAT_FIRST_DATA_CLUSTER;
+
+	pthread_mutex_lock(&ef->alloc_lock);
+	if (hint < end && BMAP_GET(ef->cmap.chunk, hint) == 0)
+		start = hint;
+	else
+	{
+		i = pick_free_run(ef);
+		/* freed clusters could make up a better run, and once the runs
+		   have been used up the remaining free clusters are found again */
+		if (ef->cmap.runs_stale || i == -1)
+		{
+			if (i == -1 || ef->cmap.runs[i].count < wanted)
 			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
+				scan_free_clusters(ef);
+				i = pick_free_run(ef);
 			}
+		}
+		if (i == -1)
+		{
+			pthread_mutex_unlock(&ef->alloc_lock);
+			exfat_error("no free space left");
+			return EXFAT_CLUSTER_END;
+		}
+		run = &ef->cmap.runs[i];
+		start = run->start;
+		if (run->count <= wanted)
+			remove_free_run(ef, i);
+		else
+		{
+			rest = run->count - wanted;
+			run->start += wanted + rest / 2;
+			run->count = rest - rest / 2;
+		}
 	}
-	return EXFAT_CLUSTER_END;
+	*count = find_bit(ef->cmap.chunk, start, start + MIN(end - start, wanted),
+			false) - start;
+	for (c = start; c < start + *count; c++)
+		BMAP_SET(ef->cmap.chunk, c);
+	ef->cmap.free_count -= *count;
+	ef->cmap.dirty = true;
+	pthread_mutex_unlock(&ef->alloc_lock);
+	return start + EXFAT_FIRST_DATA_CLUSTER;
 }
 
 static int flush_nodes(struct exfat* ef, struct exfat_node* node)
@@ -156,60 +469,63 @@ int exfat_flush_nodes(struct exfat* ef)
 
 int exfat_flush(struct exfat* ef)
 {
+	pthread_mutex_lock(&ef->alloc_lock);
 	if (ef->cmap.dirty)
 	{
 		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
 				BMAP_SIZE(ef->cmap.chunk_size),
 				exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
 		{
+			pthread_mutex_unlock(&ef->alloc_lock);
 			exfat_error("failed to write clusters bitmap");
 			return -EIO;
 		}
 		ef->cmap.dirty = false;
 	}
+	pthread_mutex_unlock(&ef->alloc_lock);
 
 	return 0;
 }
 
-static bool set_next_cluster(const struct exfat* ef, bool contiguous,
-		cluster_t current, cluster_t next)
+/*
+ * Entries of a chain are only read by the holder of its node lock (or of
+ * the tree lock for directories), so readers of the FAT copy take no lock.
+ */
+static bool write_fat(struct exfat* ef, cluster_t first,
+		const le32_t* entries, size_t count)
 {
 	loff_t fat_offset;
-	le32_t next_le32;
 
-	if (contiguous)
-		return true;
 	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ current * sizeof(cluster_t);
-	next_le32 = cpu_to_le32(next);
-	if (exfat_pwrite(ef->dev, &next_le32, sizeof(next_le32), fat_offset) < 0)
+		+ first * sizeof(cluster_t);
+	pthread_mutex_lock(&ef->alloc_lock);
+	if (exfat_pwrite(ef->dev, entries, count * sizeof(le32_t),
+			fat_offset) < 0)
 	{
-		exfat_error("failed to write the next cluster %#x after %#x", next,
-				current);
+		pthread_mutex_unlock(&ef->alloc_lock);
 		return false;
 	}
+	if (ef->fat != NULL && first + count <= ef->fat_entries)
+		memcpy(ef->fat + first, entries, count * sizeof(le32_t));
+	pthread_mutex_unlock(&ef->alloc_lock);
 	return true;
 }
 
-static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
+static bool set_next_cluster(struct exfat* ef, bool contiguous,
+		cluster_t current, cluster_t next)
 {
-	cluster_t cluster;
-
-	hint -= EXFAT_FIRST_DATA_CLUSTER;
-	if (hint >= ef->cmap.chunk_size)
-		hint = 0;
+	le32_t next_le32;
 
-	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
-	if (cluster == EXFAT_CLUSTER_END)
-		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
-	if (cluster == EXFAT_CLUSTER_END)
+	if (contiguous)
+		return true;
+	next_le32 = cpu_to_le32(next);
+	if (!write_fat(ef, current, &next_le32, 1))
 	{
-		exfat_error("no free space left");
-		return EXFAT_CLUSTER_END;
+		exfat_error("failed to write the next cluster %#x after %#x", next,
+				current);
+		return false;
 	}
-
-	ef->cmap.dirty = true;
-	return cluster;
+	return true;
 }
 
 static void free_cluster(struct exfat* ef, cluster_t cluster)
@@ -220,18 +536,35 @@ static void free_cluster(struct exfat* ef, cluster_t cluster)
 		exfat_bug("freeing non-existing cluster 0x%x (0x%x)", cluster,
 				ef->cmap.size);
 
+	pthread_mutex_lock(&ef->alloc_lock);
+	if (BMAP_GET(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER))
+		ef->cmap.free_count++;
 	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
 	ef->cmap.dirty = true;
+	ef->cmap.runs_stale = true;
+	pthread_mutex_unlock(&ef->alloc_lock);
 }
 
-static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
+/* chains the clusters from first to last, writing many entries at once */
+static bool make_noncontiguous(struct exfat* ef, cluster_t first,
 		cluster_t last)
 {
+	le32_t chain[128];
 	cluster_t c;
+	size_t count;
+	size_t i;
 
-	for (c = first; c < last; c++)
-		if (!set_next_cluster(ef, false, c, c + 1))
+	for (c = first; c < last; c += count)
+	{
+		count = MIN(last - c, sizeof(chain) / sizeof(chain[0]));
+		for (i = 0; i < count; i++)
+			chain[i] = cpu_to_le32(c + i + 1);
+		if (!write_fat(ef, c, chain, count))
+		{
+			exfat_error("failed to chain clusters %#x-%#x", c, last);
 			return false;
+		}
+	}
 	return true;
 }
 
@@ -244,6 +577,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	uint32_t count;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -263,26 +597,27 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		if (node->fptr_index != 0)
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
-		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		   as many as possible of them in one run */
+		previous = allocate_clusters(ef, 0, difference, &allocated);
 		if (CLUSTER_INVALID(previous))
 			return -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
-		allocated = 1;
-		/* file consists of only one cluster, so it's contiguous */
+		previous += allocated - 1;
+		/* file consists of one run of clusters, so it's contiguous */
 		node->flags |= EXFAT_ATTRIB_CONTIGUOUS;
 	}
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = allocate_clusters(ef, previous + 1, difference - allocated,
+				&count);
 		if (CLUSTER_INVALID(next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
 			return -ENOSPC;
 		}
-		if (next != previous - 1 && IS_CONTIGUOUS(*node))
+		if (next != previous + 1 && IS_CONTIGUOUS(*node))
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
@@ -293,8 +628,11 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		}
 		if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous, next))
 			return -EIO;
-		previous = next;
-		allocated++;
+		if (!IS_CONTIGUOUS(*node) &&
+				!make_noncontiguous(ef, next, next + count - 1))
+			return -EIO;
+		previous = next + count - 1;
+		allocated += count;
 	}
 
 	if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous,
@@ -339,6 +677,7 @@ static int shrink_file(struct exfat* ef, struct exfat_node* node,
 	}
 	node->fptr_index = 0;
 	node->fptr_cluster = node->start_cluster;
+	trim_extents(node, current - difference);
 
 	/* free remaining clusters */
 	while (difference--)
@@ -438,14 +777,13 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
-uint32_t exfat_count_free_clusters(const struct exfat* ef)
+uint32_t exfat_count_free_clusters(struct exfat* ef)
 {
-	uint32_t free_clusters = 0;
-	uint32_t i;
+	uint32_t free_clusters;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
+	pthread_mutex_lock(&ef->alloc_lock);
+	free_clusters = ef->cmap.free_count;
+	pthread_mutex_unlock(&ef->alloc_lock);
 	return free_clusters;
 }
 
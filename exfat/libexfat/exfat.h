@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -69,12 +70,36 @@
    be corrupted with 32-bit off_t. So, we use loff_t here.*/
 STATIC_ASSERT(sizeof(loff_t) == 8);
 
+/* run of clusters that follow each other on disk, see exfat_advance_cluster() */
+struct exfat_extent
+{
+	uint32_t index;				/* of the first cluster in the file */
+	cluster_t cluster;
+	uint32_t count;
+};
+
+/* run of free clusters in the clusters bitmap, see allocate_clusters() */
+struct exfat_free_run
+{
+	uint32_t start;				/* bit index */
+	uint32_t count;
+};
+
+#define EXFAT_FREE_RUNS 64
+
 struct exfat_node
 {
 	struct exfat_node* parent;
 	struct exfat_node* child;
 	struct exfat_node* next;
 	struct exfat_node* prev;
+	struct exfat_node* hash_next;	/* in the parent's index */
+	struct exfat_node** index;	/* children by name hash, see node.c */
+	uint32_t index_size;		/* buckets, a power of 2 */
+	uint32_t children;
+	/* guards the size, clusters, times and flags against concurrent I/O on
+	   the node, while the rest of the node is guarded by exfat.tree_lock */
+	pthread_mutex_t lock;
 
 	int references;
 	uint32_t fptr_index;
@@ -82,9 +107,14 @@ struct exfat_node
 	cluster_t entry_cluster;
 	loff_t entry_offset;
 	cluster_t start_cluster;
+	struct exfat_extent* extents;	/* of a non-contiguous file, read lazily */
+	uint32_t extents_count;
+	uint32_t extents_allocated;
+	uint32_t extents_clusters;	/* clusters of the file the extents cover */
 	int flags;
 	uint64_t size;
 	time_t mtime, atime;
+	uint16_t name_hash;
 	le16_t name[EXFAT_NAME_MAX + 1];
 };
 
@@ -111,8 +141,20 @@ struct exfat
 		bitmap_t* chunk;
 		uint32_t chunk_size;		/* in bits */
 		bool dirty;
+		uint32_t free_count;		/* in bits */
+		/* largest free runs as of the last scan, shrunk as they are used */
+		struct exfat_free_run runs[EXFAT_FREE_RUNS];
+		int runs_count;
+		bool runs_stale;			/* clusters were freed since the scan */
 	}
 	cmap;
+	le32_t* fat;				/* copy of the FAT, NULL if it is read from disk */
+	uint32_t fat_entries;
+	/* nodes tree and directories, taken by multi-threaded users around
+	   everything but data I/O, which only takes the node lock */
+	pthread_mutex_t tree_lock;
+	/* clusters bitmap and FAT updates, taken by libexfat itself */
+	pthread_mutex_t alloc_lock;
 	char label[UTF8_BYTES(EXFAT_ENAME_MAX) + 1];
 	void* zero_cluster;
 	int dmask, fmask;
@@ -173,11 +215,15 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
+cluster_t exfat_advance_extent(const struct exfat* ef,
+		struct exfat_node* node, uint32_t count, uint32_t* run);
+void exfat_free_extents(struct exfat_node* node);
 int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
-uint32_t exfat_count_free_clusters(const struct exfat* ef);
+uint32_t exfat_count_free_clusters(struct exfat* ef);
+void exfat_scan_free_clusters(struct exfat* ef);
 int exfat_find_used_sectors(const struct exfat* ef, loff_t* a, loff_t* b);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
@@ -201,6 +247,7 @@ int utf8_to_utf16(le16_t* output, const char* input, size_t outsize,
 size_t utf16_length(const le16_t* str);
 
 struct exfat_node* exfat_get_node(struct exfat_node* node);
+void exfat_free_node(struct exfat_node* node);
 void exfat_put_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
@@ -350,6 +350,7 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, loff_t offset)
 {
 	cluster_t cluster;
+	uint32_t index, run;
 	char* bufp = buffer;
 	loff_t lsize, loffset, remainder;
 
@@ -358,23 +359,20 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 	if (size == 0)
 		return 0;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
-	{
-		exfat_error("invalid cluster 0x%x while reading", cluster);
-		return -1;
-	}
-
+	index = offset / CLUSTER_SIZE(*ef->sb);
 	loffset = offset % CLUSTER_SIZE(*ef->sb);
 	remainder = MIN(size, node->size - offset);
 	while (remainder > 0)
 	{
+		/* read all the clusters that follow each other at once */
+		run = DIV_ROUND_UP(loffset + remainder, CLUSTER_SIZE(*ef->sb));
+		cluster = exfat_advance_extent(ef, node, index, &run);
 		if (CLUSTER_INVALID(cluster))
 		{
 			exfat_error("invalid cluster 0x%x while reading", cluster);
 			return -1;
 		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
+		lsize = MIN((loff_t) run * CLUSTER_SIZE(*ef->sb) - loffset, remainder);
 		if (exfat_pread(ef->dev, bufp, lsize,
 					exfat_c2o(ef, cluster) + loffset) < 0)
 		{
@@ -382,9 +380,9 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 			return -1;
 		}
 		bufp += lsize;
+		index += run;
 		loffset = 0;
 		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
 	}
 	if (!ef->ro && !ef->noatime)
 		exfat_update_atime(node);
@@ -395,6 +393,7 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, loff_t offset)
 {
 	cluster_t cluster;
+	uint32_t index, run;
 	const char* bufp = buffer;
 	loff_t lsize, loffset, remainder;
 
@@ -407,23 +406,20 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 	if (size == 0)
 		return 0;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
-	{
-		exfat_error("invalid cluster 0x%x while writing", cluster);
-		return -1;
-	}
-
+	index = offset / CLUSTER_SIZE(*ef->sb);
 	loffset = offset % CLUSTER_SIZE(*ef->sb);
 	remainder = size;
 	while (remainder > 0)
 	{
+		/* write all the clusters that follow each other at once */
+		run = DIV_ROUND_UP(loffset + remainder, CLUSTER_SIZE(*ef->sb));
+		cluster = exfat_advance_extent(ef, node, index, &run);
 		if (CLUSTER_INVALID(cluster))
 		{
 			exfat_error("invalid cluster 0x%x while writing", cluster);
 			return -1;
 		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
+		lsize = MIN((loff_t) run * CLUSTER_SIZE(*ef->sb) - loffset, remainder);
 		if (exfat_pwrite(ef->dev, bufp, lsize,
 				exfat_c2o(ef, cluster) + loffset) < 0)
 		{
@@ -431,9 +427,9 @@ ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 			return -1;
 		}
 		bufp += lsize;
+		index += run;
 		loffset = 0;
 		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
 	}
 	exfat_update_mtime(node);
 	return size - remainder;
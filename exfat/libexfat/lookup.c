@@ -85,6 +85,8 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 {
 	struct exfat_iterator it;
 	le16_t buffer[EXFAT_NAME_MAX + 1];
+	uint16_t hash;
+	struct exfat_node* p;
 	int rc;
 
 	*node = NULL;
@@ -96,6 +98,21 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 	rc = exfat_opendir(ef, parent, &it);
 	if (rc != 0)
 		return rc;
+	if (parent->index != NULL)
+	{
+		/* equal names have equal hashes, as both are taken upcased */
+		hash = le16_to_cpu(exfat_calc_name_hash(ef, buffer));
+		for (p = parent->index[hash & (parent->index_size - 1)]; p != NULL;
+				p = p->hash_next)
+			if (p->name_hash == hash && compare_name(ef, buffer, p->name) == 0)
+			{
+				*node = exfat_get_node(p);
+				exfat_closedir(ef, &it);
+				return 0;
+			}
+		exfat_closedir(ef, &it);
+		return -ENOENT;
+	}
 	while ((*node = exfat_readdir(ef, &it)))
 	{
 		if (compare_name(ef, buffer, (*node)->name) == 0)
@@ -105,6 +105,48 @@ static void parse_options(struct exfat* ef, const char* options)
 	ef->noatime = match_option(options, "noatime");
 }
 
+/*
+ * Limit of the FAT copy kept in memory: 16 MB covers 4 million clusters, e.g.
+ * a 512 GB card with 128 KB clusters.
+ */
+#define FAT_MIRROR_MAX (16 * 1024 * 1024)
+
+/*
+ * Reads the FAT once so that following cluster chains costs no I/O. Every
+ * FAT update goes through set_next_cluster(), which keeps the copy current.
+ * A FAT too large for the copy is read from disk as needed.
+ */
+static void load_fat_mirror(struct exfat* ef)
+{
+	uint64_t entries = (uint64_t) le32_to_cpu(ef->sb->cluster_count) +
+		EXFAT_FIRST_DATA_CLUSTER;
+	uint64_t size = entries * sizeof(le32_t);
+
+	if (size > FAT_MIRROR_MAX || size > (uint64_t)
+			le32_to_cpu(ef->sb->fat_sector_count) * SECTOR_SIZE(*ef->sb))
+		return;
+	ef->fat = malloc(size);
+	if (ef->fat == NULL)
+		return;
+	if (exfat_pread(ef->dev, ef->fat, size,
+			(loff_t) le32_to_cpu(ef->sb->fat_sector_start) <<
+			ef->sb->sector_bits) < 0)
+	{
+		exfat_warn("failed to read FAT, it will be read as needed");
+		free(ef->fat);
+		ef->fat = NULL;
+		return;
+	}
+	ef->fat_entries = entries;
+}
+
+static void free_fat_mirror(struct exfat* ef)
+{
+	free(ef->fat);
+	ef->fat = NULL;
+	ef->fat_entries = 0;
+}
+
 static bool verify_vbr_checksum(struct exfat_dev* dev, void* sector,
 		loff_t sector_size)
 {
@@ -172,6 +214,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 
 	exfat_tzset();
 	memset(ef, 0, sizeof(struct exfat));
+	pthread_mutex_init(&ef->tree_lock, NULL);
+	pthread_mutex_init(&ef->alloc_lock, NULL);
 
 	parse_options(ef, options);
 
@@ -277,9 +321,12 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 				exfat_get_size(ef->dev));
 	}
 
+	load_fat_mirror(ef);
+
 	ef->root = malloc(sizeof(struct exfat_node));
 	if (ef->root == NULL)
 	{
+		free_fat_mirror(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -287,6 +334,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		return -ENOMEM;
 	}
 	memset(ef->root, 0, sizeof(struct exfat_node));
+	pthread_mutex_init(&ef->root->lock, NULL);
 	ef->root->flags = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
@@ -294,7 +342,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	ef->root->size = rootdir_size(ef);
 	if (ef->root->size == 0)
 	{
-		free(ef->root);
+		exfat_free_node(ef->root);
+		free_fat_mirror(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -328,7 +377,8 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 error:
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
+	exfat_free_node(ef->root);
+	free_fat_mirror(ef);
 	free(ef->zero_cluster);
 	exfat_close(ef->dev);
 	free(ef->sb);
@@ -363,8 +413,9 @@ void exfat_unmount(struct exfat* ef)
 	exfat_flush(ef);		/* ignore return code */
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
+	exfat_free_node(ef->root);
 	ef->root = NULL;
+	free_fat_mirror(ef);
 	finalize_super_block(ef);
 	exfat_close(ef->dev);	/* close descriptor immediately after fsync */
 	ef->dev = NULL;
@@ -377,4 +428,6 @@ void exfat_unmount(struct exfat* ef)
 	free(ef->upcase);
 	ef->upcase = NULL;
 	ef->upcase_chars = 0;
+	pthread_mutex_destroy(&ef->alloc_lock);
+	pthread_mutex_destroy(&ef->tree_lock);
 }
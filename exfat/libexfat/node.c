@@ -36,8 +36,8 @@ struct iterator
 
 struct exfat_node* exfat_get_node(struct exfat_node* node)
 {
-	/* if we switch to multi-threaded mode we will need atomic
-	   increment here and atomic decrement in exfat_put_node() */
+	/* multi-threaded users hold exfat.tree_lock here and in
+	   exfat_put_node() */
 	node->references++;
 	return node;
 }
@@ -79,7 +79,7 @@ int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 		/* free all clusters and node structure itself */
 		rc = exfat_truncate(ef, node, 0, true);
 		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		exfat_free_node(node);
 	}
 	return rc;
 }
@@ -163,9 +163,20 @@ static struct exfat_node* allocate_node(void)
 		return NULL;
 	}
 	memset(node, 0, sizeof(struct exfat_node));
+	pthread_mutex_init(&node->lock, NULL);
 	return node;
 }
 
+void exfat_free_node(struct exfat_node* node)
+{
+	if (node == NULL)
+		return;
+	exfat_free_extents(node);
+	free(node->index);
+	pthread_mutex_destroy(&node->lock);
+	free(node);
+}
+
 static void init_node_meta1(struct exfat_node* node,
 		const struct exfat_entry_meta1* meta1)
 {
@@ -439,6 +450,7 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
 				goto error;
 			}
+			exfat_scan_free_clusters(ef);
 			break;
 
 		case EXFAT_ENTRY_LABEL:
@@ -478,11 +490,120 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 	/* we never reach here */
 
 error:
-	free(*node);
+	exfat_free_node(*node);
 	*node = NULL;
 	return rc;
 }
 
+/*
+ * Directories keep their cached children in a hash table by the exFAT name
+ * hash, which is calculated over the upcased name, so that a lookup only
+ * compares the names that hash alike. A directory whose table could not be
+ * allocated has none and is searched through its list of children.
+ */
+#define INDEX_MIN_SIZE 16
+#define INDEX_MAX_SIZE 65536	/* name hashes are 16-bit */
+
+static void index_insert(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** bucket =
+			&dir->index[node->name_hash & (dir->index_size - 1)];
+
+	node->hash_next = *bucket;
+	*bucket = node;
+}
+
+static void index_resize(struct exfat_node* dir, uint32_t size)
+{
+	struct exfat_node** old = dir->index;
+	uint32_t old_size = dir->index_size;
+	struct exfat_node* node;
+	struct exfat_node* next;
+	uint32_t i;
+
+	dir->index = calloc(size, sizeof(struct exfat_node*));
+	if (dir->index == NULL)
+	{
+		/* keep the table we have, the chains just get longer */
+		dir->index = old;
+		return;
+	}
+	dir->index_size = size;
+	for (i = 0; i < old_size; i++)
+		for (node = old[i]; node != NULL; node = next)
+		{
+			next = node->hash_next;
+			index_insert(dir, node);
+		}
+	free(old);
+}
+
+static void index_add(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
+{
+	node->name_hash = le16_to_cpu(exfat_calc_name_hash(ef, node->name));
+	dir->children++;
+	if (dir->index == NULL)
+		return;
+	if (dir->children > dir->index_size && dir->index_size < INDEX_MAX_SIZE)
+		index_resize(dir, dir->index_size * 2);
+	index_insert(dir, node);
+}
+
+static void index_remove(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** p;
+
+	dir->children--;
+	if (dir->index == NULL)
+		return;
+	for (p = &dir->index[node->name_hash & (dir->index_size - 1)]; *p != NULL;
+			p = &(*p)->hash_next)
+		if (*p == node)
+		{
+			*p = node->hash_next;
+			break;
+		}
+	node->hash_next = NULL;
+}
+
+/*
+ * Indexes the children that exfat_cache_directory() has just read. This is
+ * done once they are all read because the upcase table, which the hash
+ * depends on, is itself found among the children of the root directory.
+ */
+static void index_build(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* node;
+	uint32_t size = INDEX_MIN_SIZE;
+
+	dir->children = 0;
+	for (node = dir->child; node != NULL; node = node->next)
+		dir->children++;
+	while (size < dir->children && size < INDEX_MAX_SIZE)
+		size *= 2;
+	dir->index = calloc(size, sizeof(struct exfat_node*));
+	if (dir->index == NULL)
+	{
+		exfat_warn("failed to allocate directory index (%u entries)", size);
+		return;
+	}
+	dir->index_size = size;
+	for (node = dir->child; node != NULL; node = node->next)
+	{
+		node->name_hash = le16_to_cpu(exfat_calc_name_hash(ef, node->name));
+		index_insert(dir, node);
+	}
+}
+
+static void index_free(struct exfat_node* dir)
+{
+	free(dir->index);
+	dir->index = NULL;
+	dir->index_size = 0;
+	dir->children = 0;
+}
+
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 {
 	struct iterator it;
@@ -517,18 +638,21 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 		for (current = dir->child; current; current = node)
 		{
 			node = current->next;
-			free(current);
+			exfat_free_node(current);
 		}
 		dir->child = NULL;
 		return rc;
 	}
 
+	index_build(ef, dir);
 	dir->flags |= EXFAT_ATTRIB_CACHED;
 	return 0;
 }
 
-static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
+static void tree_attach(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
 {
+	index_add(ef, dir, node);
 	node->parent = dir;
 	if (dir->child)
 	{
@@ -540,6 +664,7 @@ static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 
 static void tree_detach(struct exfat_node* node)
 {
+	index_remove(node->parent, node);
 	if (node->prev)
 		node->prev->next = node->next;
 	else /* this is the first node in the list */
@@ -560,8 +685,9 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 		struct exfat_node* p = node->child;
 		reset_cache(ef, p);
 		tree_detach(p);
-		free(p);
+		exfat_free_node(p);
 	}
+	index_free(node);
 	node->flags &= ~EXFAT_ATTRIB_CACHED;
 	if (node->references != 0)
 	{
@@ -600,7 +726,7 @@ static bool next_entry(struct exfat* ef, const struct exfat_node* parent,
 	return true;
 }
 
-int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+static int flush_node(struct exfat* ef, struct exfat_node* node)
 {
 	cluster_t cluster;
 	loff_t offset;
@@ -667,6 +793,17 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 	return exfat_flush(ef);
 }
 
+int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+{
+	int rc;
+
+	/* the size and clusters can be changing under a concurrent write */
+	pthread_mutex_lock(&node->lock);
+	rc = flush_node(ef, node);
+	pthread_mutex_unlock(&node->lock);
+	return rc;
+}
+
 static bool erase_entry(struct exfat* ef, struct exfat_node* node)
 {
 	cluster_t cluster = node->entry_cluster;
@@ -765,7 +902,10 @@ static int delete(struct exfat* ef, struct exfat_node* node)
 	exfat_update_mtime(parent);
 	tree_detach(node);
 	rc = shrink_directory(ef, parent, deleted_offset);
+	/* an open file can be written and marked dirty at the same time */
+	pthread_mutex_lock(&node->lock);
 	node->flags |= EXFAT_ATTRIB_UNLINKED;
+	pthread_mutex_unlock(&node->lock);
 	if (rc != 0)
 	{
 		exfat_flush_node(ef, parent);
@@ -921,7 +1061,7 @@ static int write_entry(struct exfat* ef, struct exfat_node* dir,
 	init_node_meta1(node, &meta1);
 	init_node_meta2(node, &meta2);
 
-	tree_attach(dir, node);
+	tree_attach(ef, dir, node);
 	exfat_update_mtime(dir);
 	return 0;
 }
@@ -1067,7 +1207,7 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 
 	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
 	tree_detach(node);
-	tree_attach(dir, node);
+	tree_attach(ef, dir, node);
 	return 0;
 }
 
@@ -40,6 +40,12 @@
 // Note that only the minimal set of file operations needed for these
 // two files is implemented.  In particular, you can't opendir() or
 // readdir() on the "/sideload" directory; ls on it won't work.
+//
+// Verified blocks are kept in an LRU cache, since zip lookups keep
+// going back to the central directory at the end of the package. A
+// fetch thread owns the provider: it serves cache misses, reads ahead
+// of sequential access, and checks the hashes, so the FUSE thread
+// can keep replying from the cache in the meantime.
 
 #include "fuse_sideload.h"
 
@@ -57,8 +63,16 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/stringprintf.h>
@@ -71,8 +85,293 @@ static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
+// Memory given to the block cache when the caller doesn't pick a size.
+static constexpr size_t DEFAULT_CACHE_BYTES = 16 << 20;
+// A straddling read pins two blocks, and the fetch thread needs a free slot besides those.
+static constexpr uint32_t MIN_CACHE_BLOCKS = 4;
+
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+// Holds the most recently used blocks of the package. All the provider reads happen on one fetch
+// thread, as providers such as the adb one can only have a single request in flight.
+class BlockCache {
+ public:
+  BlockCache(FuseDataProvider* provider, uint64_t file_size, uint32_t block_size,
+             uint32_t file_blocks, uint32_t capacity);
+  ~BlockCache();
+
+  // Allocates the blocks and starts the fetch thread. Returns false if the allocation fails.
+  bool Start();
+
+  // Returns the data of |block|, waiting for it to be fetched and verified if it isn't cached. The
+  // data stays valid until the matching Release(). Returns nullptr and sets |error| on failure.
+  const uint8_t* Acquire(uint32_t block, int* error);
+  void Release(uint32_t block);
+
+ private:
+  enum class SlotState { EMPTY, LOADING, READY, FAILED };
+
+  struct Slot {
+    SlotState state = SlotState::EMPTY;
+    uint32_t block = 0;
+    uint32_t pins = 0;
+    int error = 0;
+    std::list<size_t>::iterator lru;
+  };
+
+  uint8_t* slot_data(size_t slot) const {
+    return data_.get() + slot * block_size_;
+  }
+
+  void ScheduleReadAhead(uint32_t block);
+  size_t FindVictim() const;
+  void FetchLoop();
+  int FetchBlock(uint32_t block, uint8_t* buffer);
+
+  FuseDataProvider* provider_;
+  const uint64_t file_size_;
+  const uint32_t block_size_;
+  const uint32_t file_blocks_;
+  const uint32_t capacity_;
+  // Number of blocks fetched ahead of a sequential reader.
+  const uint32_t readahead_;
+
+  // SHA-256 hash of each block (all zeros if block hasn't been read yet). Only the fetch thread
+  // touches them.
+  std::vector<SHA256Digest> hashes_;
+  std::unique_ptr<uint8_t[]> data_;
+  // Returned for reads past the end of the file.
+  std::vector<uint8_t> zero_block_;
+
+  std::mutex mutex_;
+  // Wakes up the fetch thread when there is something to fetch.
+  std::condition_variable work_cv_;
+  // Wakes up the FUSE thread when a fetch has finished.
+  std::condition_variable done_cv_;
+  std::vector<Slot> slots_;
+  std::unordered_map<uint32_t, size_t> index_;
+  // Slot indices, most recently used first.
+  std::list<size_t> lru_;
+  // Blocks the FUSE thread is waiting for; they go ahead of the read-ahead ones.
+  std::deque<uint32_t> demand_;
+  std::deque<uint32_t> readahead_queue_;
+  // The block most recently read, and the number of reads in a row that moved one block forward.
+  uint32_t last_block_ = UINT32_MAX - 1;
+  uint32_t run_length_ = 0;
+  // The last block read by the sequential reader being read ahead for.
+  uint32_t stream_block_ = UINT32_MAX - 1;
+  // One past the last block queued for read-ahead.
+  uint32_t readahead_end_ = 0;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+BlockCache::BlockCache(FuseDataProvider* provider, uint64_t file_size, uint32_t block_size,
+                       uint32_t file_blocks, uint32_t capacity)
+    : provider_(provider),
+      file_size_(file_size),
+      block_size_(block_size),
+      file_blocks_(file_blocks),
+      capacity_(capacity),
+      readahead_(std::max(1u, capacity / 4)),
+      hashes_(file_blocks),
+      zero_block_(block_size, 0),
+      slots_(capacity) {
+  for (size_t i = 0; i < slots_.size(); i++) {
+    slots_[i].lru = lru_.insert(lru_.end(), i);
+  }
+}
+
+BlockCache::~BlockCache() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  // A fetch in flight finishes first, which keeps the provider's stream in sync for the caller.
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+bool BlockCache::Start() {
+  data_.reset(new (std::nothrow) uint8_t[static_cast<size_t>(capacity_) * block_size_]);
+  if (data_ == nullptr) {
+    fprintf(stderr, "failed to allocate %u blocks of %u bytes for the block cache\n", capacity_,
+            block_size_);
+    return false;
+  }
+  thread_ = std::thread(&BlockCache::FetchLoop, this);
+  return true;
+}
+
+// Keeps the read-ahead window in front of the sequential reader. Reads elsewhere, such as the
+// zip central directory lookups in between, leave the window alone, unless they turn into a
+// sequential run of their own. Called with |mutex_| held.
+void BlockCache::ScheduleReadAhead(uint32_t block) {
+  if (block != last_block_) {
+    run_length_ = (block == last_block_ + 1) ? run_length_ + 1 : 0;
+    last_block_ = block;
+  }
+  if (block == stream_block_) {
+    return;
+  }
+  if (block != stream_block_ + 1) {
+    // A straddling read touches two blocks in a row, so it takes a third one to start a stream.
+    if (run_length_ < 2) {
+      return;
+    }
+    readahead_queue_.clear();
+    readahead_end_ = 0;
+  }
+  stream_block_ = block;
+
+  uint32_t end = std::min<uint64_t>(file_blocks_, static_cast<uint64_t>(block) + 1 + readahead_);
+  for (uint32_t next = std::max(block + 1, readahead_end_); next < end; next++) {
+    if (index_.find(next) == index_.end()) {
+      readahead_queue_.push_back(next);
+    }
+  }
+  readahead_end_ = std::max(readahead_end_, end);
+  work_cv_.notify_one();
+}
+
+// Returns the least recently used slot that can be reused. The FUSE thread pins at most two slots
+// and the fetch thread loads one at a time, so MIN_CACHE_BLOCKS guarantees there is one. Called
+// with |mutex_| held.
+size_t BlockCache::FindVictim() const {
+  for (auto it = lru_.rbegin(); it != lru_.rend(); it++) {
+    const Slot& slot = slots_[*it];
+    if (slot.pins == 0 && slot.state != SlotState::LOADING) {
+      return *it;
+    }
+  }
+  __builtin_unreachable();
+}
+
+void BlockCache::FetchLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock,
+                  [this] { return stop_ || !demand_.empty() || !readahead_queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+
+    bool demanded = !demand_.empty();
+    std::deque<uint32_t>& queue = demanded ? demand_ : readahead_queue_;
+    uint32_t block = queue.front();
+    queue.pop_front();
+    if (index_.find(block) != index_.end()) {
+      continue;
+    }
+
+    size_t index = FindVictim();
+    Slot& slot = slots_[index];
+    if (slot.state != SlotState::EMPTY) {
+      index_.erase(slot.block);
+    }
+    slot.state = SlotState::LOADING;
+    slot.block = block;
+    index_[block] = index;
+    lru_.splice(lru_.begin(), lru_, slot.lru);
+
+    lock.unlock();
+    int result = FetchBlock(block, slot_data(index));
+    lock.lock();
+
+    if (result == 0) {
+      slot.state = SlotState::READY;
+    } else if (demanded) {
+      slot.state = SlotState::FAILED;
+      slot.error = result;
+    } else {
+      // Leaves it to a demand fetch to retry the block and report the error.
+      slot.state = SlotState::EMPTY;
+      index_.erase(block);
+      lru_.splice(lru_.end(), lru_, slot.lru);
+    }
+    done_cv_.notify_all();
+  }
+}
+
+// Fetch a block from the host into |buffer| and verify it.
+// Returns 0 on successful fetch, negative otherwise.
+int BlockCache::FetchBlock(uint32_t block, uint8_t* buffer) {
+  uint32_t fetch_size = block_size_;
+  if (static_cast<uint64_t>(block) * block_size_ + fetch_size > file_size_) {
+    // If we're reading the last (partial) block of the file, expect a shorter response from the
+    // host, and pad the rest of the block with zeroes.
+    fetch_size = file_size_ - (static_cast<uint64_t>(block) * block_size_);
+    memset(buffer + fetch_size, 0, block_size_ - fetch_size);
+  }
+
+  if (!provider_->ReadBlockAlignedData(buffer, fetch_size, block)) {
+    return -EIO;
+  }
+
+  // Verify the hash of the block we just got from the host.
+  //
+  // - If the hash of the just-received data matches the stored hash for the block, accept it.
+  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+  //   time we've read this block).
+  // - Otherwise, return -EINVAL for the read.
+
+  SHA256Digest hash;
+  SHA256(buffer, block_size_, hash.data());
+
+  const SHA256Digest& blockhash = hashes_[block];
+  if (hash == blockhash) {
+    return 0;
+  }
+
+  for (uint8_t i : blockhash) {
+    if (i != 0) {
+      return -EIO;
+    }
+  }
+
+  hashes_[block] = hash;
+  return 0;
+}
+
+const uint8_t* BlockCache::Acquire(uint32_t block, int* error) {
+  if (block >= file_blocks_) {
+    return zero_block_.data();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  ScheduleReadAhead(block);
+  for (;;) {
+    auto it = index_.find(block);
+    if (it == index_.end()) {
+      // Requeues the block if it was dropped before this thread got to it.
+      demand_.push_back(block);
+      work_cv_.notify_one();
+    } else if (Slot& slot = slots_[it->second]; slot.state == SlotState::READY) {
+      slot.pins++;
+      lru_.splice(lru_.begin(), lru_, slot.lru);
+      return slot_data(it->second);
+    } else if (slot.state == SlotState::FAILED) {
+      *error = slot.error;
+      slot.state = SlotState::EMPTY;
+      lru_.splice(lru_.end(), lru_, slot.lru);
+      index_.erase(it);
+      return nullptr;
+    }
+    done_cv_.wait(lock);
+  }
+}
+
+void BlockCache::Release(uint32_t block) {
+  if (block >= file_blocks_) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  slots_[index_.at(block)].pins--;
+}
+
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
@@ -86,13 +385,7 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
-
-  std::vector<SHA256Digest>
-      hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+  std::unique_ptr<BlockCache> cache;  // verified blocks most recently read from the host
 };
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -223,59 +516,6 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint64_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
-  }
-
-  uint32_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
-  }
-
-  if (!fd->provider->ReadBlockAlignedData(fd->block_data, fetch_size, block)) {
-    return -EIO;
-  }
-
-  fd->curr_block = block;
-
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
-
-  SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
-
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
-  }
-
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
-    }
-  }
-
-  fd->hashes[block] = hash;
-  return 0;
-}
-
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
@@ -301,16 +541,17 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   vec[0].iov_len = sizeof(outhdr);
 
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
+  int result;
+  const uint8_t* block_data = fd->cache->Acquire(block, &result);
+  if (block_data == nullptr) return result;
 
   // Two cases:
   //
   //   - the read request is entirely within this block. In this case we can reply immediately.
   //
   //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
+  //     with max_read=block_size, a read can never span more than two blocks. In this case we also
+  //     pin the following block, and reply from both cache slots.
 
   uint32_t block_offset = offset - (block * fd->block_size);
 
@@ -318,19 +559,21 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (size + block_offset <= fd->block_size) {
     // First case: the read fits entirely in the first block.
 
-    vec[1].iov_base = fd->block_data + block_offset;
+    vec[1].iov_base = const_cast<uint8_t*>(block_data + block_offset);
     vec[1].iov_len = size;
     vec_used = 2;
   } else {
     // Second case: the read spills over into the next block.
 
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
+    vec[1].iov_base = const_cast<uint8_t*>(block_data + block_offset);
     vec[1].iov_len = fd->block_size - block_offset;
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
+    const uint8_t* next_data = fd->cache->Acquire(block + 1, &result);
+    if (next_data == nullptr) {
+      fd->cache->Release(block);
+      return result;
+    }
+    vec[2].iov_base = const_cast<uint8_t*>(next_data);
     vec[2].iov_len = size - vec[1].iov_len;
     vec_used = 3;
   }
@@ -338,10 +581,16 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (writev(fd->ffd, vec, vec_used) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
+
+  fd->cache->Release(block);
+  if (vec_used == 3) {
+    fd->cache->Release(block + 1);
+  }
   return NO_STATUS;
 }
 
-int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point) {
+int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char* mount_point,
+                      uint32_t cache_blocks) {
   // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
   // previous abnormal exit.)
   umount2(mount_point, MNT_FORCE);
@@ -372,21 +621,17 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
     goto done;
   }
 
-  // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
+  if (cache_blocks == 0) {
+    cache_blocks = DEFAULT_CACHE_BYTES / block_size;
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
+  // There is no point in holding more blocks than the file has.
+  cache_blocks = std::max(MIN_CACHE_BLOCKS, std::min(cache_blocks, fd.file_blocks));
+  fd.cache = std::make_unique<BlockCache>(provider.get(), file_size, block_size, fd.file_blocks,
+                                          cache_blocks);
+  if (!fd.cache->Start()) {
     result = -1;
     goto done;
   }
@@ -482,14 +727,13 @@ int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider, const char*
   }
 
 done:
+  // Stops the fetch thread before the provider goes away.
+  fd.cache.reset();
   provider->Close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
@@ -17,6 +17,8 @@
 #ifndef __FUSE_SIDELOAD_H
 #define __FUSE_SIDELOAD_H
 
+#include <stdint.h>
+
 #include <memory>
 
 #include "fuse_provider.h"
@@ -28,7 +30,11 @@ static constexpr const char* FUSE_SIDELOAD_HOST_PATHNAME = "/sideload/package.zi
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_FLAG = "exit";
 static constexpr const char* FUSE_SIDELOAD_HOST_EXIT_PATHNAME = "/sideload/exit";
 
+// Serves the data from |provider| as FUSE_SIDELOAD_HOST_FILENAME under |mount_point|, until the
+// exit flag is stat'd. |cache_blocks| is the number of verified blocks to keep in memory; 0 picks
+// a 16 MiB cache.
 int run_fuse_sideload(std::unique_ptr<FuseDataProvider>&& provider,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      uint32_t cache_blocks = 0);
 
 #endif
@@ -93,6 +93,7 @@ static void internal_gui_print(const char *color, char *buf)
 		gConsoleColor.push_back(color);
 	}
 	pthread_mutex_unlock(&console_lock);
+	gui_wake();
 }
 
 extern "C" void gui_print(const char *fmt, ...)
@@ -168,6 +169,7 @@ void gui_msg(Message msg)
 	pthread_mutex_lock(&console_lock);
 	gMessages.push_back(msg);
 	pthread_mutex_unlock(&console_lock);
+	gui_wake();
 }
 
 void GUIConsole::Translate_Now()
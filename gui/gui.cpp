@@ -24,9 +24,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -50,10 +53,21 @@ extern "C"
 #include "../openrecoveryscript.hpp"
 #include "../orscmd/orscmd.h"
 #include "blanktimer.hpp"
+#include "gui.hpp"
 #include "tw_atomic.hpp"
 
-// Enable to print render time of each frame to the log file
-//#define PRINT_RENDER_TIME 1
+// Render and flip times are summed up and logged every this many frames
+#define FRAME_STATS_FRAMES 1000
+
+// Frames are drawn TW_FRAMERATE times per second while the pages change,
+// once a second after this many frames without a change, so clocks and
+// battery levels stay current, and not at all while the screen is off
+#define IDLE_FRAMES 15
+#define IDLE_FRAME_INTERVAL_NS 1000000000LL
+#define FRAME_INTERVAL_NS (1000000000LL / TW_FRAMERATE)
+
+// Input events handled per wakeup before a frame gets its turn
+#define INPUT_EVENTS_PER_WAKE 256
 
 #ifdef _EVENT_LOGGING
 #define LOGEVENT(...) LOGERR(__VA_ARGS__)
@@ -78,7 +92,24 @@ int gGuiRunning = 0;
 int g_pty_fd = -1;  // set by terminal on init
 void terminal_pty_read();
 
-int select_fd = 0;
+// Everything the GUI thread waits for is in one epoll set, tagged with one
+// of these in epoll_event.data.u32
+enum gui_watch {
+	WATCH_INPUT = 0,  // the input devices, through ev_get_fd()
+	WATCH_FRAME,      // timerfd ticking frames
+	WATCH_WAKE,       // eventfd written by gui_wake()
+	WATCH_PTY,
+	WATCH_UEVENT,
+	WATCH_ORS,
+	WATCH_COUNT
+};
+
+static int gui_epoll_fd = -1;
+static int frame_timer_fd = -1;
+static int wake_fd = -1;
+static int watched_fds[WATCH_COUNT] = { -1, -1, -1, -1, -1, -1 };
+static long long frame_interval_ns = 0; // period of frame_timer_fd, 0 while stopped
+static TWAtomicInt gFdsChanged(1);
 
 static int gRecorder = -1;
 
@@ -96,6 +127,56 @@ static void flip(void)
 	gr_flip();
 }
 
+struct FrameStats
+{
+	unsigned frames;
+	unsigned partial;   // frames that redrew only the damaged areas
+	uint64_t render_us;
+	uint64_t flip_us;
+	uint64_t max_us;
+};
+static FrameStats frameStats;
+
+static uint64_t elapsed_us(const timespec& start, const timespec& end)
+{
+	return (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+// Draws a frame, redrawing only what the last update damaged unless full is
+// set, and keeps the frame time counters
+static void draw_frame(bool full, bool redraw)
+{
+	timespec start, rendered, flipped;
+	uint64_t render_us, flip_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (full)
+		PageManager::Render();
+	else
+		PageManager::RenderDamage(redraw);
+	clock_gettime(CLOCK_MONOTONIC, &rendered);
+	flip();
+	clock_gettime(CLOCK_MONOTONIC, &flipped);
+
+	render_us = elapsed_us(start, rendered);
+	flip_us = elapsed_us(rendered, flipped);
+	frameStats.frames++;
+	if (!full)
+		frameStats.partial++;
+	frameStats.render_us += render_us;
+	frameStats.flip_us += flip_us;
+	if (render_us + flip_us > frameStats.max_us)
+		frameStats.max_us = render_us + flip_us;
+	if (frameStats.frames >= FRAME_STATS_FRAMES) {
+		LOGINFO("GUI: %u frames (%u partial), render %llu us, flip %llu us average, slowest %llu us\n",
+			frameStats.frames, frameStats.partial,
+			(unsigned long long)(frameStats.render_us / frameStats.frames),
+			(unsigned long long)(frameStats.flip_us / frameStats.frames),
+			(unsigned long long)frameStats.max_us);
+		memset(&frameStats, 0, sizeof(frameStats));
+	}
+}
+
 void rapidxml::parse_error_handler(const char *what, void *where)
 {
 	fprintf(stderr, "Parser error: %s\n", what);
@@ -136,6 +217,16 @@ public:
 
 	void handleDrag();
 
+	// sends touch and key hold / repeat notices when they are due
+	void checkHoldAndRepeat()
+	{
+		if (touch_status || key_status)
+			processHoldAndRepeat();
+	}
+
+	// a touch or key is down and needs frames for hold and repeat
+	bool isHeld() const { return touch_status || key_status; }
+
 private:
 	// timeouts for touch/key hold and repeat
 	int touch_hold_ms;
@@ -401,18 +492,105 @@ void InputHandler::handleDrag()
 	}
 }
 
-void set_select_fd() {
-	select_fd = ors_read_fd + 1;
-	if (g_pty_fd >= select_fd)
-		select_fd = g_pty_fd + 1;
-	if (PartitionManager.uevent_pfd.fd >= select_fd)
-		select_fd = PartitionManager.uevent_pfd.fd + 1;
+void gui_wake()
+{
+	// the eventfd counter folds wakes that arrive before the loop reads it
+	if (wake_fd < 0)
+		return;
+	uint64_t one = 1;
+	write(wake_fd, &one, sizeof(one));
+}
+
+void gui_fds_changed()
+{
+	gFdsChanged.set_value(1);
+	gui_wake();
+}
+
+static void watch_fd(int tag, int fd)
+{
+	epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = tag;
+	if (fd >= 0 && epoll_ctl(gui_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		LOGINFO("Unable to watch fd %d: %s\n", fd, strerror(errno));
+		fd = -1;
+	}
+	watched_fds[tag] = fd;
+}
+
+// Brings the epoll set in line with the pty, uevent and ORS fds, which come
+// and go. A closed fd leaves the set by itself and its number can come back
+// for another one, so all of them are registered again after a change.
+static void update_watched_fds()
+{
+	int wanted[WATCH_COUNT];
+	bool changed = gFdsChanged.get_value() != 0;
+
+	wanted[WATCH_PTY] = g_pty_fd > 0 ? g_pty_fd : -1;
+	wanted[WATCH_UEVENT] = PartitionManager.uevent_pfd.fd > 0 ? PartitionManager.uevent_pfd.fd : -1;
+	wanted[WATCH_ORS] = -1;
+#ifndef TW_OEM_BUILD
+	if (ors_read_fd > 0 && !orsout) // orsout is non-NULL if a command is still running
+		wanted[WATCH_ORS] = ors_read_fd;
+#endif
+	for (int i = WATCH_PTY; i < WATCH_COUNT; i++)
+		changed |= wanted[i] != watched_fds[i];
+	if (!changed)
+		return;
+
+	gFdsChanged.set_value(0);
+	for (int i = WATCH_PTY; i < WATCH_COUNT; i++) {
+		if (watched_fds[i] >= 0)
+			epoll_ctl(gui_epoll_fd, EPOLL_CTL_DEL, watched_fds[i], NULL); // fails if it was closed
+		watched_fds[i] = -1;
+	}
+	for (int i = WATCH_PTY; i < WATCH_COUNT; i++)
+		watch_fd(i, wanted[i]);
+}
+
+static void set_frame_interval(long long interval_ns)
+{
+	itimerspec spec;
+
+	if (interval_ns == frame_interval_ns)
+		return;
+	memset(&spec, 0, sizeof(spec));
+	if (interval_ns) {
+		spec.it_interval.tv_sec = interval_ns / 1000000000LL;
+		spec.it_interval.tv_nsec = interval_ns % 1000000000LL;
+		// the first frame is due right away
+		spec.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(frame_timer_fd, 0, &spec, NULL) != 0)
+		LOGERR("Unable to set the GUI frame timer: %s\n", strerror(errno));
+	frame_interval_ns = interval_ns;
+}
+
+static bool gui_loop_init()
+{
+	if (gui_epoll_fd >= 0)
+		return true;
+
+	gui_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	frame_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (gui_epoll_fd < 0 || frame_timer_fd < 0 || wake_fd < 0) {
+		LOGERR("Unable to set up the GUI event loop: %s\n", strerror(errno));
+		return false;
+	}
+	watch_fd(WATCH_INPUT, ev_get_fd());
+	watch_fd(WATCH_FRAME, frame_timer_fd);
+	watch_fd(WATCH_WAKE, wake_fd);
+	return true;
 }
 
 static void setup_ors_command()
 {
 	ors_read_fd = -1;
-	set_select_fd();
+	gui_fds_changed();
 
 	unlink(ORS_INPUT_FILE);
 	if (mkfifo(ORS_INPUT_FILE, 06660) != 0) {
@@ -432,7 +610,7 @@ static void setup_ors_command()
 		unlink(ORS_INPUT_FILE);
 		unlink(ORS_OUTPUT_FILE);
 	}
-	set_select_fd();
+	gui_fds_changed();
 }
 
 // callback called after a CLI command was executed
@@ -464,7 +642,7 @@ static void ors_command_read()
 		if (!orsout) {
 			close(ors_read_fd);
 			ors_read_fd = -1;
-			set_select_fd();
+			gui_fds_changed();
 			LOGINFO("Unable to fopen %s\n", ORS_OUTPUT_FILE);
 			unlink(ORS_INPUT_FILE);
 			unlink(ORS_OUTPUT_FILE);
@@ -506,54 +684,14 @@ static void ors_command_read()
 				// put all things that need to be done after the command is finished into ors_command_done, not here
 			}
 		}
+	} else if (read_ret == 0) {
+		// The writer went away without sending anything. The fifo keeps
+		// reporting the hangup until it is opened again.
+		close(ors_read_fd);
+		setup_ors_command();
 	}
 }
 
-// Get and dispatch input events until it's time to draw the next frame
-// This special function will return immediately the first time, but then
-// always returns 1/30th of a second (or immediately if called later) from
-// the last time it was called
-static void loopTimer(int input_timeout_ms)
-{
-	static timespec lastCall;
-	static int initialized = 0;
-
-	if (!initialized)
-	{
-		clock_gettime(CLOCK_MONOTONIC, &lastCall);
-		initialized = 1;
-		return;
-	}
-
-	do
-	{
-		bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
-		timespec curTime;
-		clock_gettime(CLOCK_MONOTONIC, &curTime);
-
-		timespec diff = TWFunc::timespec_diff(lastCall, curTime);
-
-		// This is really 2 or TW_FRAMERATE times per second
-		// As long as we get events, increase the timeout so we can catch up with input
-		long timeout = got_event ? 500000000 : (1.0 / TW_FRAMERATE * 1000000000);
-
-		if (diff.tv_sec || diff.tv_nsec > timeout)
-		{
-			// int32_t input_time = TWFunc::timespec_diff_ms(lastCall, curTime);
-			// LOGINFO("loopTimer(): %u ms, count: %u\n", input_time, count);
-
-			lastCall = curTime;
-			input_handler.handleDrag(); // send only drag notices if needed
-			return;
-		}
-
-		// We need to sleep some period time microseconds
-		//unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-		//usleep(sleepTime); // removed so we can scan for input
-		input_timeout_ms = 0;
-	} while (1);
-}
-
 static int runPages(const char *page_name, const int stop_on_page_done)
 {
 	DataManager::SetValue("tw_page_done", 0);
@@ -568,40 +706,69 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
 	DataManager::SetValue("tw_loaded", 1);
 
-	struct timeval timeout;
-	fd_set fdset;
-	int has_data = 0;
-
-	int input_timeout_ms = 0;
+	if (!gui_loop_init())
+		return -1;
+	frame_interval_ns = -1; // start the frame timer again
 	int idle_frames = 0;
+	epoll_event events[WATCH_COUNT];
 
 	for (;;)
 	{
-		loopTimer(input_timeout_ms);
-		FD_ZERO(&fdset);
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 1;
-		if (g_pty_fd > 0) {
-			FD_SET(g_pty_fd, &fdset);
-		}
-		if (PartitionManager.uevent_pfd.fd > 0) {
-			FD_SET(PartitionManager.uevent_pfd.fd, &fdset);
-		}
-#ifndef TW_OEM_BUILD
-		if (ors_read_fd > 0 && !orsout) { // orsout is non-NULL if a command is still running
-			FD_SET(ors_read_fd, &fdset);
+		update_watched_fds();
+		if (blankTimer.isScreenOff() && !input_handler.isHeld())
+			set_frame_interval(0);
+		else if (idle_frames > IDLE_FRAMES && !input_handler.isHeld() && !gForceRender.get_value())
+			set_frame_interval(IDLE_FRAME_INTERVAL_NS);
+		else
+			set_frame_interval(FRAME_INTERVAL_NS);
+
+		int count = epoll_wait(gui_epoll_fd, events, WATCH_COUNT, -1);
+		if (count < 0) {
+			if (errno != EINTR) {
+				LOGERR("GUI epoll_wait failed: %s\n", strerror(errno));
+				usleep(1000000 / TW_FRAMERATE);
+			}
+			continue;
 		}
-#endif
-		// TODO: combine this select with the poll done by input handling
-		has_data = select(select_fd, &fdset, NULL, NULL, &timeout);
-		if (has_data > 0) {
-			if (g_pty_fd > 0 && FD_ISSET(g_pty_fd, &fdset))
-				terminal_pty_read();
-			if (PartitionManager.uevent_pfd.fd > 0 && FD_ISSET(PartitionManager.uevent_pfd.fd, &fdset))
-				PartitionManager.read_uevent();
-			if (ors_read_fd > 0 && !orsout && FD_ISSET(ors_read_fd, &fdset))
-				ors_command_read();
+
+		bool frame_due = false;
+		for (int i = 0; i < count; i++) {
+			uint64_t value;
+
+			switch (events[i].data.u32) {
+			case WATCH_FRAME:
+				read(frame_timer_fd, &value, sizeof(value));
+				frame_due = true;
+				continue;
+			case WATCH_INPUT:
+				// drag notices are only sent once per frame
+				for (int n = 0; n < INPUT_EVENTS_PER_WAKE && input_handler.processInput(0); n++)
+					;
+				break;
+			case WATCH_WAKE:
+				read(wake_fd, &value, sizeof(value));
+				break;
+			case WATCH_PTY:
+				if (g_pty_fd > 0)
+					terminal_pty_read();
+				break;
+			case WATCH_UEVENT:
+				if (PartitionManager.uevent_pfd.fd > 0)
+					PartitionManager.read_uevent();
+				break;
+			case WATCH_ORS:
+				if (ors_read_fd > 0 && !orsout)
+					ors_command_read();
+				break;
+			}
+			// something happened that the pages may want to show
+			idle_frames = 0;
 		}
+		if (!frame_due)
+			continue;
+
+		input_handler.checkHoldAndRepeat();
+		input_handler.handleDrag();
 
 		if (!gForceRender.get_value())
 		{
@@ -612,41 +779,15 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 				break; // Theme reload failure
 			else
 				idle_frames = 0;
-			// due to possible animation objects, we need to delay activating the input timeout
-			input_timeout_ms = idle_frames > 15 ? 1000 : 0;
-
-#ifndef PRINT_RENDER_TIME
-			if (ret > 1)
-				PageManager::Render();
 
 			if (ret > 0)
-				flip();
-#else
-			if (ret > 1)
-			{
-				timespec start, end;
-				int32_t render_t, flip_t;
-				clock_gettime(CLOCK_MONOTONIC, &start);
-				PageManager::Render();
-				clock_gettime(CLOCK_MONOTONIC, &end);
-				render_t = TWFunc::timespec_diff_ms(start, end);
-
-				flip();
-				clock_gettime(CLOCK_MONOTONIC, &start);
-				flip_t = TWFunc::timespec_diff_ms(end, start);
-
-				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
-			}
-			else if (ret > 0)
-				flip();
-#endif
+				draw_frame(false, ret > 1);
 		}
 		else
 		{
 			gForceRender.set_value(0);
-			PageManager::Render();
-			flip();
-			input_timeout_ms = 0;
+			draw_frame(true, true);
+			idle_frames = 0;
 		}
 
 		blankTimer.checkForTimeout();
@@ -662,7 +803,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 	if (ors_read_fd > 0)
 		close(ors_read_fd);
 	ors_read_fd = -1;
-	set_select_fd();
+	gui_fds_changed();
 	gGuiRunning = 0;
 	return 0;
 }
@@ -670,6 +811,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 int gui_forceRender(void)
 {
 	gForceRender.set_value(1);
+	gui_wake();
 	return 0;
 }
 
@@ -677,7 +819,7 @@ int gui_changePage(std::string newPage)
 {
 	LOGINFO("Set page: '%s'\n", newPage.c_str());
 	PageManager::ChangePage(newPage);
-	gForceRender.set_value(1);
+	gui_forceRender();
 	return 0;
 }
 
@@ -685,7 +827,7 @@ int gui_changeOverlay(std::string overlay)
 {
 	LOGINFO("Set overlay: '%s'\n", overlay.c_str());
 	PageManager::ChangeOverlay(overlay);
-	gForceRender.set_value(1);
+	gui_forceRender();
 	return 0;
 }
 
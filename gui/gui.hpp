@@ -21,7 +21,8 @@
 
 #include "twmsg.h"
 
-void set_select_fd();
+void gui_fds_changed(); // call after opening or closing an fd the GUI loop watches
+void gui_wake(); // makes the GUI loop look at its state again
 
 void gui_msg(const char* text);
 void gui_warn(const char* text);
@@ -71,6 +71,10 @@ public:
 	// GetRenderPos - Returns the current position of the object
 	virtual int GetRenderPos(int& x, int& y, int& w, int& h) { x = mRenderX; y = mRenderY; w = mRenderW; h = mRenderH; return 0; }
 
+	// GetDamageRect - Returns the area to redraw after Update() returned >0, covering both the old and new look
+	//  Return 0 on success, <0 if the whole screen has to be redrawn
+	virtual int GetDamageRect(int& x __unused, int& y __unused, int& w __unused, int& h __unused) { return -1; }
+
 	// SetRenderPos - Update the position of the object
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0) { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
@@ -202,6 +206,9 @@ public:
 	// Set maximum width in pixels
 	virtual int SetMaxWidth(unsigned width);
 
+	// The line the text may be drawn in, whatever its value
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
 	void SetText(string newtext);
 
 public:
@@ -486,6 +493,9 @@ public:
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
 
+	// The list only ever draws inside its box
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { return GetRenderPos(x, y, w, h); }
+
 	// SetPageFocus - Notify when a page gains or loses focus
 	virtual void SetPageFocus(int inFocus);
 
@@ -764,6 +774,9 @@ public:
 	virtual void RenderItem(size_t itemindex, int yPos, bool selected);
 	virtual void NotifySelect(size_t item_selected);
 
+	// Sliding the console in or out uncovers the rest of the page
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { return mSlideout ? -1 : GUIScrollList::GetDamageRect(x, y, w, h); }
+
 	static void Translate_Now();
 	static void Clear_For_Retranslation();
 protected:
@@ -843,6 +856,8 @@ public:
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
 
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { return GetRenderPos(x, y, w, h); }
+
 protected:
 	AnimationResource* mAnimation;
 	int mFrame;
@@ -870,6 +885,8 @@ public:
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
+	virtual int GetDamageRect(int& x, int& y, int& w, int& h) { return GetRenderPos(x, y, w, h); }
+
 protected:
 	ImageResource* mEmptyBar;
 	ImageResource* mFullBar;
@@ -47,6 +47,7 @@ extern "C" {
 #include "../twcommon.h"
 #include "gui.h"
 }
+#include "gui.hpp"
 #include "minuitwrp/minui.h"
 
 #include "rapidxml.hpp"
@@ -57,6 +58,9 @@ extern "C" {
 
 #define TW_THEME_VER_ERR -2
 
+// More damaged areas than this are redrawn as their bounding box
+#define MAX_DAMAGE_RECTS 8
+
 extern int gGuiRunning;
 GUITerminal* term = NULL;
 
@@ -66,6 +70,7 @@ MouseCursor *PageManager::mMouseCursor = NULL;
 HardwareKeyboard *PageManager::mHardwareKeyboard = NULL;
 bool PageManager::mReloadTheme = false;
 std::string PageManager::mStartPage = "main";
+GUIDamage PageManager::mDamage;
 std::vector<language_struct> Language_List;
 
 int tw_x_offset = 0;
@@ -520,23 +525,90 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
 	return true;
 }
 
-int Page::Render(void)
+static bool RectsTouch(const GUIRect& a, const GUIRect& b)
+{
+	return a.x <= b.x + b.w && b.x <= a.x + a.w && a.y <= b.y + b.h && b.y <= a.y + a.h;
+}
+
+static void MergeRect(GUIRect& dst, const GUIRect& src)
+{
+	int x1 = std::max(dst.x + dst.w, src.x + src.w);
+	int y1 = std::max(dst.y + dst.h, src.y + src.h);
+
+	dst.x = std::min(dst.x, src.x);
+	dst.y = std::min(dst.y, src.y);
+	dst.w = x1 - dst.x;
+	dst.h = y1 - dst.y;
+}
+
+void GUIDamage::Add(int x, int y, int w, int h)
+{
+	// A pixel of margin covers objects drawn at an offset on rotated panels
+	GUIRect rect = { x - 1, y - 1, w + 2, h + 2 };
+	std::vector<GUIRect>::iterator iter;
+
+	if (mAll || w <= 0 || h <= 0)
+		return;
+	if (rect.x < 0) {
+		rect.w += rect.x;
+		rect.x = 0;
+	}
+	if (rect.y < 0) {
+		rect.h += rect.y;
+		rect.y = 0;
+	}
+	rect.w = std::min(rect.w, gr_fb_width() - rect.x);
+	rect.h = std::min(rect.h, gr_fb_height() - rect.y);
+	if (rect.w <= 0 || rect.h <= 0)
+		return;
+
+	// Swallow every area the new one touches, the result may touch others
+	for (iter = mRects.begin(); iter != mRects.end(); )
+	{
+		if (RectsTouch(*iter, rect)) {
+			MergeRect(rect, *iter);
+			mRects.erase(iter);
+			iter = mRects.begin();
+		} else
+			iter++;
+	}
+	if (mRects.size() >= MAX_DAMAGE_RECTS) {
+		for (iter = mRects.begin(); iter != mRects.end(); iter++)
+			MergeRect(rect, *iter);
+		mRects.clear();
+	}
+	mRects.push_back(rect);
+}
+
+int Page::Render(const GUIRect* area)
 {
 	// Render background
 	gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
-	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+	if (area)
+		gr_fill(area->x, area->y, area->w, area->h);
+	else
+		gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
 	// Render remaining objects
 	std::vector<RenderObject*>::iterator iter;
 	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
 	{
+		if (area)
+		{
+			// Objects without a size, like text, may draw anywhere and are
+			// left to the clip, the others are skipped when outside the area
+			GUIRect pos;
+			(*iter)->GetRenderPos(pos.x, pos.y, pos.w, pos.h);
+			if (pos.w > 0 && pos.h > 0 && !RectsTouch(pos, *area))
+				continue;
+		}
 		if ((*iter)->Render())
 			LOGERR("A render request has failed.\n");
 	}
 	return 0;
 }
 
-int Page::Update(void)
+int Page::Update(GUIDamage* damage)
 {
 	int retCode = 0;
 
@@ -548,6 +620,15 @@ int Page::Update(void)
 			LOGERR("An update request has failed.\n");
 		else if (ret > retCode)
 			retCode = ret;
+
+		if (ret > 0 && damage)
+		{
+			int x, y, w, h;
+			if ((*iter)->GetDamageRect(x, y, w, h) == 0)
+				damage->Add(x, y, w, h);
+			else
+				damage->AddAll();
+		}
 	}
 
 	return retCode;
@@ -657,8 +738,14 @@ int Page::NotifyVarChange(std::string varName, std::string value)
 	std::vector<GUIObject*>::iterator iter;
 	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
 	{
+		bool visible = (*iter)->isConditionTrue();
+
 		if ((*iter)->NotifyVarChange(varName, value))
 			LOGERR("An action handler errored on NotifyVarChange.\n");
+		// Objects do not report appearing or disappearing as damage, and
+		// this may run on any thread, so ask for a full render instead
+		if ((*iter)->isConditionTrue() != visible)
+			gui_forceRender();
 	}
 	return 0;
 }
@@ -1102,36 +1189,36 @@ std::string PageSet::GetCurrentPage() const
 	return mCurrentPage ? mCurrentPage->GetName() : "";
 }
 
-int PageSet::Render(void)
+int PageSet::Render(const GUIRect* area)
 {
 	int ret;
 
-	ret = (mCurrentPage ? mCurrentPage->Render() : -1);
+	ret = (mCurrentPage ? mCurrentPage->Render(area) : -1);
 	if (ret < 0)
 		return ret;
 
 	std::vector<Page*>::iterator iter;
 
 	for (iter = mOverlays.begin(); iter != mOverlays.end(); iter++) {
-		ret = ((*iter) ? (*iter)->Render() : -1);
+		ret = ((*iter) ? (*iter)->Render(area) : -1);
 		if (ret < 0)
 			return ret;
 	}
 	return ret;
 }
 
-int PageSet::Update(void)
+int PageSet::Update(GUIDamage* damage)
 {
 	int ret;
 
-	ret = (mCurrentPage ? mCurrentPage->Update() : -1);
+	ret = (mCurrentPage ? mCurrentPage->Update(damage) : -1);
 	if (ret < 0 || ret > 1)
 		return ret;
 
 	std::vector<Page*>::iterator iter;
 
 	for (iter = mOverlays.begin(); iter != mOverlays.end(); iter++) {
-		ret = ((*iter) ? (*iter)->Update() : -1);
+		ret = ((*iter) ? (*iter)->Update(damage) : -1);
 		if (ret < 0)
 			return ret;
 	}
@@ -1578,6 +1665,7 @@ int PageManager::IsCurrentPage(Page* page)
 
 int PageManager::Render(void)
 {
+	mDamage.Clear();
 	if (blankTimer.isScreenOff())
 		return 0;
 
@@ -1587,6 +1675,43 @@ int PageManager::Render(void)
 	return res;
 }
 
+int PageManager::RenderDamage(bool redraw)
+{
+	int res = 0;
+
+	if (blankTimer.isScreenOff()) {
+		mDamage.Clear();
+		return 0;
+	}
+
+	const std::vector<GUIRect>& rects = mDamage.GetRects();
+	long long area = 0, screen = (long long)gr_fb_width() * gr_fb_height();
+	for (size_t i = 0; i < rects.size(); i++)
+		area += (long long)rects[i].w * rects[i].h;
+
+	// Without a damage report the flip copies the whole frame, and redrawing
+	// most of the screen piece by piece is slower than all of it
+	if (mDamage.IsAll() || mDamage.IsEmpty() || area * 4 > screen * 3) {
+		mDamage.Clear();
+		return (redraw ? Render() : 0);
+	}
+
+	for (size_t i = 0; i < rects.size(); i++) {
+		const GUIRect& rect = rects[i];
+
+		if (redraw) {
+			gr_frame_clip(rect.x, rect.y, rect.w, rect.h);
+			res = (mCurrentSet ? mCurrentSet->Render(&rect) : -1);
+			if (mMouseCursor)
+				mMouseCursor->Render();
+			gr_frame_noclip();
+		}
+		gr_damage(rect.x, rect.y, rect.w, rect.h);
+	}
+	mDamage.Clear();
+	return res;
+}
+
 HardwareKeyboard *PageManager::GetHardwareKeyboard()
 {
 	if (!mHardwareKeyboard)
@@ -1640,13 +1765,15 @@ int PageManager::Update(void)
 	if (RunReload())
 		return -2;
 
-	int res = (mCurrentSet ? mCurrentSet->Update() : -1);
+	int res = (mCurrentSet ? mCurrentSet->Update(&mDamage) : -1);
 
 	if (mMouseCursor)
 	{
 		int c_res = mMouseCursor->Update();
 		if (c_res > res)
 			res = c_res;
+		if (c_res > 0)
+			mDamage.AddAll();
 	}
 	return res;
 }
@@ -1688,4 +1815,5 @@ extern "C" void gui_notifyVarChange(const char *name, const char* value)
 		return;
 
 	PageManager::NotifyVarChange(name, value);
+	gui_wake();
 }
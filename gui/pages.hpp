@@ -65,6 +65,31 @@ int gui_forceRender(void);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
 
+// Area of the screen in GUI coordinates
+struct GUIRect {
+	int x, y, w, h;
+};
+
+// Collects the areas the objects changed during an Update() pass, so the
+// next frame only redraws and copies those. An object that cannot tell
+// where it changed marks the whole screen.
+class GUIDamage
+{
+public:
+	GUIDamage() { Clear(); }
+
+	void Add(int x, int y, int w, int h);
+	void AddAll() { mAll = true; }
+	void Clear() { mAll = false; mRects.clear(); }
+	bool IsAll() const { return mAll; }
+	bool IsEmpty() const { return !mAll && mRects.empty(); }
+	const std::vector<GUIRect>& GetRects() const { return mRects; }
+
+protected:
+	bool mAll;
+	std::vector<GUIRect> mRects;
+};
+
 class Resource;
 class ResourceManager;
 class RenderObject;
@@ -83,8 +108,8 @@ public:
 	std::string GetName(void)   { return mName; }
 
 public:
-	virtual int Render(void);
-	virtual int Update(void);
+	virtual int Render(const GUIRect* area = NULL);
+	virtual int Update(GUIDamage* damage = NULL);
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
 	virtual int NotifyKey(int key, bool down);
 	virtual int NotifyCharInput(int ch);
@@ -129,8 +154,8 @@ public:
 	std::string GetCurrentPage() const;
 
 	// These are routing routines
-	int Render(void);
-	int Update(void);
+	int Render(const GUIRect* area = NULL);
+	int Update(GUIDamage* damage = NULL);
 	int NotifyTouch(TOUCH_STATE state, int x, int y);
 	int NotifyKey(int key, bool down);
 	int NotifyCharInput(int ch);
@@ -177,6 +202,7 @@ public:
 
 	// These are routing routines
 	static int Render(void);
+	static int RenderDamage(bool redraw);   // redraws what the last Update() changed if redraw is set, and reports it for the flip
 	static int Update(void);
 	static int NotifyTouch(TOUCH_STATE state, int x, int y);
 	static int NotifyKey(int key, bool down);
@@ -207,6 +233,7 @@ protected:
 	static bool mReloadTheme;
 	static std::string mStartPage;
 	static LoadingContext* currentLoadingContext;
+	static GUIDamage mDamage;
 };
 
 #endif  // _PAGES_HEADER_HPP
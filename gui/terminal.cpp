@@ -85,7 +85,7 @@ public:
 			// and write it to the terminal
 			// this currently works through gui.cpp calling terminal_pty_read below
 			g_pty_fd = fdMaster;
-			set_select_fd();
+			gui_fds_changed();
 			return true;
 		}
 		else {
@@ -177,7 +177,7 @@ public:
 		}
 		close(fdMaster);
 		g_pty_fd = fdMaster = -1;
-		set_select_fd();
+		gui_fds_changed();
 		int status;
 		waitpid(pid, &status, WNOHANG); // avoid zombies but don't hang if the child is still alive and we got here due to some error
 		pid = 0;
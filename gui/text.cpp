@@ -164,6 +164,28 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 	return 0;
 }
 
+int GUIText::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+	// Only scaled text is kept inside maxWidth
+	if (!maxWidth || !scaleWidth)
+		return -1;
+
+	w = maxWidth;
+	h = mFontHeight;
+	x = mRenderX;
+	if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY)
+		x -= maxWidth / 2;
+	else if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT && mPlacement != TEXT_ONLY_RIGHT)
+		x -= maxWidth;
+
+	y = mRenderY;
+	if (mPlacement == CENTER || mPlacement == TEXT_ONLY_RIGHT)
+		y -= mFontHeight / 2;
+	else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT)
+		y -= mFontHeight;
+	return 0;
+}
+
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
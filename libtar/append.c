@@ -77,12 +77,6 @@ int
 tar_append_file(TAR *t, const char *realname, const char *savename)
 {
 	struct stat s;
-	int i;
-	libtar_hashptr_t hp;
-	tar_dev_t *td = NULL;
-	tar_ino_t *ti = NULL;
-	char path[MAXPATHLEN];
-	int filefd;
 
 #ifdef DEBUG
 	LOG("==> tar_append_file(TAR=0x%p (\"%s\"), realname=\"%s\", "
@@ -98,12 +92,28 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 		return -1;
 	}
 
+	return tar_append_file_stat(t, realname, savename, &s);
+}
+
+
+/* appends a file to the tar archive using lstat() data the caller already has */
+int
+tar_append_file_stat(TAR *t, const char *realname, const char *savename,
+		     struct stat *s)
+{
+	int i;
+	libtar_hashptr_t hp;
+	tar_dev_t *td = NULL;
+	tar_ino_t *ti = NULL;
+	char path[MAXPATHLEN];
+	int filefd;
+
 	/* set header block */
 #ifdef DEBUG
 	LOG("tar_append_file(): setting header block...");
 #endif
 	memset(&(t->th_buf), 0, sizeof(struct tar_header));
-	th_set_from_stat(t, &s);
+	th_set_from_stat(t, s);
 
 	/* set the header path */
 #ifdef DEBUG
@@ -246,17 +256,17 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	LOG("tar_append_file(): checking inode cache for hardlink...");
 #endif
 	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(t->h, &hp, &(s.st_dev),
+	if (libtar_hash_getkey(t->h, &hp, &(s->st_dev),
 			       (libtar_matchfunc_t)dev_match) != 0)
 		td = (tar_dev_t *)libtar_hashptr_data(&hp);
 	else
 	{
 #ifdef DEBUG
 		LOG("+++ adding hash for device (0x%x, 0x%x)...\n",
-		       major(s.st_dev), minor(s.st_dev));
+		       major(s->st_dev), minor(s->st_dev));
 #endif
 		td = (tar_dev_t *)calloc(1, sizeof(tar_dev_t));
-		td->td_dev = s.st_dev;
+		td->td_dev = s->st_dev;
 		td->td_h = libtar_hash_new(256, (libtar_hashfunc_t)ino_hash);
 		if (td->td_h == NULL)
 			return -1;
@@ -264,7 +274,7 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 			return -1;
 	}
 	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(td->td_h, &hp, &(s.st_ino),
+	if (libtar_hash_getkey(td->td_h, &hp, &(s->st_ino),
 			       (libtar_matchfunc_t)ino_match) != 0)
 	{
 		ti = (tar_ino_t *)libtar_hashptr_data(&hp);
@@ -279,13 +289,13 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	{
 #ifdef DEBUG
 		LOG("+++ adding entry: device (0x%d,0x%x), inode %lu"
-		       "(\"%s\")...\n", major(s.st_dev), minor(s.st_dev),
-		       (unsigned long) s.st_ino, realname);
+		       "(\"%s\")...\n", major(s->st_dev), minor(s->st_dev),
+		       (unsigned long) s->st_ino, realname);
 #endif
 		ti = (tar_ino_t *)calloc(1, sizeof(tar_ino_t));
 		if (ti == NULL)
 			return -1;
-		ti->ti_ino = s.st_ino;
+		ti->ti_ino = s->st_ino;
 		snprintf(ti->ti_name, sizeof(ti->ti_name), "%s",
 			 savename ? savename : realname);
 		libtar_hash_add(td->td_h, ti);
@@ -39,7 +39,8 @@
 char *
 openbsd_dirname(const char* path)
 {
-	static char bname[MAXPATHLEN];
+	/* per thread, twrpTar extracts several archives at once */
+	static __thread char bname[MAXPATHLEN];
 	register const char *endp;
 
 	/* Empty or NULL string gets treated as "." */
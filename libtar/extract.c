@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <utime.h>
+#include <time.h>
 
 #include <sys/capability.h>
 #include <sys/xattr.h>
@@ -45,7 +46,66 @@
 
 #include "android_utils.h"
 
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
+/* file data is read from the archive in chunks of this many bytes */
+#define EXTRACT_BUF_SIZE	(1024 * 1024)
+/* files at least this large get their blocks allocated up front */
+#define EXTRACT_PREALLOC_SIZE	(1024 * 1024)
+/* progress is reported after this many bytes or milliseconds, whichever comes first */
+#define PROGRESS_BYTES		(4 * 1024 * 1024)
+#define PROGRESS_MSEC		100
+
+
+static unsigned long long
+monotonic_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* send the bytes extracted since the last report, never 0 since that counts a file */
+static void
+report_progress(const int *progress_fd, unsigned long long *pending,
+		unsigned long long *last_report)
+{
+	if (*progress_fd != 0 && *pending != 0)
+		write(*progress_fd, pending, sizeof(*pending));
+	*pending = 0;
+	*last_report = monotonic_msec();
+}
+
+/* read exactly len bytes of file data, the read function may return less */
+static ssize_t
+tar_data_read(TAR *t, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t k;
+
+	while (done < len)
+	{
+		k = (*(t->type->readfunc))(t->fd, buf + done, len - done);
+		if (k == -1 && errno == EINTR)
+			continue;
+		if (k <= 0)
+		{
+			if (k == 0)
+				errno = EINVAL;
+			return -1;
+		}
+		done += k;
+	}
+	return done;
+}
+
+static char *
+tar_extract_buf(TAR *t)
+{
+	if (t->extract_buf == NULL
+	    && posix_memalign((void **)&t->extract_buf, 4096, EXTRACT_BUF_SIZE) != 0)
+		t->extract_buf = NULL;
+	return t->extract_buf;
+}
 
 static int
 tar_set_file_perms(TAR *t, const char *realname)
@@ -211,10 +271,12 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 {
 	int64_t size, i;
 	ssize_t k;
+	size_t len, want, done;
 	int fdout;
-	char buf[T_BLOCKSIZE];
+	char *buf;
 	const char *filename;
 	char *pn;
+	unsigned long long pending = 0, last_report;
 
 #ifdef DEBUG
 	LOG("  ==> tar_extract_regfile(realname=\"%s\")\n", realname);
@@ -230,6 +292,10 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 	filename = (realname ? realname : pn);
 	size = th_get_size(t);
 
+	buf = tar_extract_buf(t);
+	if (buf == NULL)
+		return -1;
+
 	if (mkdirhier(dirname(filename)) == -1)
 		return -1;
 
@@ -249,31 +315,42 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 		return -1;
 	}
 
-	/* extract the file */
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	if (size >= EXTRACT_PREALLOC_SIZE)
+		fallocate(fdout, 0, 0, size); /* not supported everywhere, only a hint */
+
+	/* extract the file, whole blocks at a time including the padding */
+	last_report = monotonic_msec();
+	for (i = size; i > 0; i -= len)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		len = (i + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+		if (len > EXTRACT_BUF_SIZE)
+			len = EXTRACT_BUF_SIZE;
+		if (tar_data_read(t, buf, len) == -1)
 		{
-			if (k != -1)
-				errno = EINVAL;
 			close(fdout);
 			return -1;
 		}
 
-		/* write block to output file */
-		if (write(fdout, buf,
-			  ((i > T_BLOCKSIZE) ? T_BLOCKSIZE : i)) == -1)
+		/* write data to output file */
+		want = (i > (int64_t)len) ? len : (size_t)i;
+		for (done = 0; done < want; done += k)
 		{
-			close(fdout);
-			return -1;
-		}
-		else
-		{
-			if (*progress_fd != 0)
-				write(*progress_fd, &progress_size, sizeof(progress_size));
+			k = write(fdout, buf + done, want - done);
+			if (k == -1 && errno == EINTR)
+				k = 0;
+			else if (k <= 0)
+			{
+				close(fdout);
+				return -1;
+			}
 		}
+
+		pending += len;
+		if (pending >= PROGRESS_BYTES
+		    || monotonic_msec() - last_report >= PROGRESS_MSEC)
+			report_progress(progress_fd, &pending, &last_report);
 	}
+	report_progress(progress_fd, &pending, &last_report);
 
 	/* close output file */
 	if (close(fdout) == -1)
@@ -292,8 +369,8 @@ int
 tar_skip_regfile(TAR *t)
 {
 	int64_t size, i;
-	ssize_t k;
-	char buf[T_BLOCKSIZE];
+	size_t len;
+	char *buf;
 
 	if (!TH_ISREG(t))
 	{
@@ -301,16 +378,18 @@ tar_skip_regfile(TAR *t)
 		return -1;
 	}
 
+	buf = tar_extract_buf(t);
+	if (buf == NULL)
+		return -1;
+
 	size = th_get_size(t);
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	for (i = size; i > 0; i -= len)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
-		{
-			if (k != -1)
-				errno = EINVAL;
+		len = (i + T_BLOCKSIZE - 1) / T_BLOCKSIZE * T_BLOCKSIZE;
+		if (len > EXTRACT_BUF_SIZE)
+			len = EXTRACT_BUF_SIZE;
+		if (tar_data_read(t, buf, len) == -1)
 			return -1;
-		}
 	}
 
 	return 0;
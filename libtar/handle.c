@@ -124,6 +124,8 @@ tar_close(TAR *t)
 					: (libtar_freefunc_t)tar_dev_free));
 	if (t->th_pathname != NULL)
 		free(t->th_pathname);
+	if (t->extract_buf != NULL)
+		free(t->extract_buf);
 	free(t);
 
 	return i;
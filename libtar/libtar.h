@@ -113,6 +113,9 @@ typedef struct
 
 	/* introduced in libtar 1.2.21 */
 	char *th_pathname;
+
+	/* TWRP: buffer for reading file data in large chunks during extraction */
+	char *extract_buf;
 }
 TAR;
 
@@ -171,6 +174,10 @@ void tar_dev_free(struct tar_dev *tdp);
  */
 int tar_append_file(TAR *t, const char *realname, const char *savename);
 
+/* same as tar_append_file(), using lstat() results the caller already has */
+int tar_append_file_stat(TAR *t, const char *realname, const char *savename,
+			 struct stat *s);
+
 /* write EOF indicator */
 int tar_append_eof(TAR *t);
 
@@ -18,6 +18,9 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include <sys/poll.h>
 #include <limits.h>
 #include <linux/input.h>
@@ -57,6 +60,7 @@ static std::atomic_int vib_on_count = 0;
 //#define _EVENT_LOGGING
 
 #define MAX_DEVICES         32
+#define RELOAD_CHECK_SECS   2    /* how often /dev/input is checked without inotify */
 
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
@@ -128,6 +132,10 @@ static unsigned ev_count = 0;
 static struct timeval lastInputStat;
 static time_t lastInputMTime;
 static int has_mouse = 0;
+// All input devices and the /dev/input watch, for callers waiting on one fd
+static int ev_epoll_fd = -1;
+static int ev_inotify_fd = -1;
+static int ev_reload_timer_fd = -1;    // ticks the /dev/input check when there is no inotify
 
 static inline int ABS(int x) {
     return x<0?-x:x;
@@ -377,6 +385,36 @@ int ev_init(void)
 
     has_mouse = 0;
 
+    if (ev_epoll_fd < 0) {
+        ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        // Devices coming and going wake the caller instead of being
+        // polled for every couple of seconds
+        ev_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ev_inotify_fd >= 0 && inotify_add_watch(ev_inotify_fd, "/dev/input", IN_CREATE | IN_DELETE) < 0) {
+            close(ev_inotify_fd);
+            ev_inotify_fd = -1;
+        }
+        if (ev_inotify_fd < 0) {
+            // Otherwise a caller that only calls ev_get() once the fd is
+            // readable would never get to the stat of /dev/input
+            ev_reload_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (ev_reload_timer_fd >= 0) {
+                struct itimerspec spec;
+                memset(&spec, 0, sizeof(spec));
+                spec.it_value.tv_sec = RELOAD_CHECK_SECS;
+                spec.it_interval.tv_sec = RELOAD_CHECK_SECS;
+                timerfd_settime(ev_reload_timer_fd, 0, &spec, NULL);
+            }
+        }
+        int reload_fd = ev_inotify_fd >= 0 ? ev_inotify_fd : ev_reload_timer_fd;
+        if (ev_epoll_fd >= 0 && reload_fd >= 0) {
+            struct epoll_event ee;
+            memset(&ee, 0, sizeof(ee));
+            ee.events = EPOLLIN;
+            epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, reload_fd, &ee);
+        }
+    }
+
 	dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -397,6 +435,13 @@ int ev_init(void)
             if (!evs[ev_count].ignored)
                 check_mouse(fd, evs[ev_count].deviceName);
 
+            if (ev_epoll_fd >= 0) {
+                struct epoll_event ee;
+                memset(&ee, 0, sizeof(ee));
+                ee.events = EPOLLIN;
+                epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &ee);
+            }
+
             ev_count++;
             if(ev_count == MAX_DEVICES) break;
         }
@@ -411,6 +456,12 @@ int ev_init(void)
     return 0;
 }
 
+int ev_get_fd(void)
+{
+    return ev_epoll_fd;
+}
+
+// Closed devices drop out of ev_epoll_fd by themselves
 void ev_exit(void)
 {
 	while (ev_count-- > 0) {
@@ -808,14 +859,31 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 0;
 }
 
-int ev_get(struct input_event *ev, int timeout_ms)
+// Reopens the input devices when /dev/input changed
+static void ev_check_reload(void)
 {
-    int r;
-    unsigned n;
     struct timeval curr;
 
+    if (ev_inotify_fd >= 0) {
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+        bool changed = false;
+
+        while (read(ev_inotify_fd, buf, sizeof(buf)) > 0)
+            changed = true;
+        if (changed) {
+            LOGI("Reloading input devices\n");
+            ev_exit();
+            ev_init();
+        }
+        return;
+    }
+
+    if (ev_reload_timer_fd >= 0) {
+        uint64_t expirations;
+        read(ev_reload_timer_fd, &expirations, sizeof(expirations));
+    }
     gettimeofday(&curr, NULL);
-    if(curr.tv_sec - lastInputStat.tv_sec >= 2)
+    if(curr.tv_sec - lastInputStat.tv_sec >= RELOAD_CHECK_SECS)
     {
         struct stat st;
         stat("/dev/input", &st);
@@ -828,6 +896,14 @@ int ev_get(struct input_event *ev, int timeout_ms)
         }
         lastInputStat = curr;
     }
+}
+
+int ev_get(struct input_event *ev, int timeout_ms)
+{
+    int r;
+    unsigned n;
+
+    ev_check_reload();
 
     r = poll(ev_fds, ev_count, timeout_ms);
 
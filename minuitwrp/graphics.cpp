@@ -36,6 +36,7 @@
 #include "gui/placement.h"
 #include "minuitwrp/minui.h"
 #include "graphics.h"
+#include "graphics_simd.h"
 // For std::min and std::max
 #include <algorithm>
 #include "minuitwrp/truetype.hpp"
@@ -61,9 +62,27 @@ GRSurface* gr_draw = NULL;
 static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
+// gr_color() in the byte order pixelflinger writes it, alpha on top
+static uint32_t gr_current_color = 0xffffffff;
+
+// The scissor given to pixelflinger in surface pixels, for the kernels
+static GRRect gr_scissor;
+static bool gr_scissor_enabled = false;
 
 unsigned int gr_rotation = 0;
 
+// Set while the GUI redraws a damaged area. gr_clip() is limited to it and
+// gr_noclip() returns to it, so objects that clip themselves stay inside.
+static bool frame_clip = false;
+static int frame_clip_x, frame_clip_y, frame_clip_w, frame_clip_h;
+
+// What changed on the draw surface since the last flip, the whole surface
+// unless gr_damage() was called, and what each front buffer is missing
+static bool frame_damaged = false;
+static GRRect frame_damage;
+static GRRect flip_damage;
+static GRRect buffer_damage[GR_MAX_BUFFERS];
+
 int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, int placement, int scale)
 {
     GGLContext *gl = gr_context;
@@ -114,34 +133,187 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
     return twrpTruetype::gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, measured_width + x, -1, gr_draw);
 }
 
-void gr_clip(int x, int y, int w, int h)
+static void set_scissor(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    int l, t, sw, sh;
 
     switch (gr_rotation) {
         case 90:
-            gl->scissor(gl, gr_draw->width - y - h, x, h, w);
+            l = gr_draw->width - y - h; t = x; sw = h; sh = w;
             break;
         case 180:
-            gl->scissor(gl, gr_draw->width - x - w, gr_draw->height - y - h, w, h);
+            l = gr_draw->width - x - w; t = gr_draw->height - y - h; sw = w; sh = h;
             break;
         case 270:
-            gl->scissor(gl, y, gr_draw->height - x - w, h, w);
+            l = y; t = gr_draw->height - x - w; sw = h; sh = w;
             break;
         default:
-            gl->scissor(gl, x, y, w, h);
+            l = x; t = y; sw = w; sh = h;
             break;
     }
+    gl->scissor(gl, l, t, sw, sh);
     gl->enable(gl, GGL_SCISSOR_TEST);
+    gr_scissor.x0 = l;
+    gr_scissor.y0 = t;
+    gr_scissor.x1 = l + sw;
+    gr_scissor.y1 = t + sh;
+    gr_scissor_enabled = true;
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    if (frame_clip) {
+        int x1 = std::min(x + w, frame_clip_x + frame_clip_w);
+        int y1 = std::min(y + h, frame_clip_y + frame_clip_h);
+
+        x = std::max(x, frame_clip_x);
+        y = std::max(y, frame_clip_y);
+        w = std::max(x1 - x, 0);
+        h = std::max(y1 - y, 0);
+    }
+    set_scissor(x, y, w, h);
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
+
+    if (frame_clip) {
+        set_scissor(frame_clip_x, frame_clip_y, frame_clip_w, frame_clip_h);
+        return;
+    }
     gl->scissor(gl, 0, 0,
                 gr_draw->width - 2 * overscan_offset_x,
                 gr_draw->height - 2 * overscan_offset_y);
     gl->disable(gl, GGL_SCISSOR_TEST);
+    gr_scissor_enabled = false;
+}
+
+void gr_frame_clip(int x, int y, int w, int h)
+{
+    frame_clip = false;
+    gr_clip(x, y, w, h);
+    frame_clip_x = x;
+    frame_clip_y = y;
+    frame_clip_w = w;
+    frame_clip_h = h;
+    frame_clip = true;
+}
+
+void gr_frame_noclip()
+{
+    frame_clip = false;
+    gr_noclip();
+}
+
+static void add_rect(GRRect* dst, const GRRect* src)
+{
+    if (src->x0 >= src->x1 || src->y0 >= src->y1)
+        return;
+    if (dst->x0 >= dst->x1 || dst->y0 >= dst->y1) {
+        *dst = *src;
+        return;
+    }
+    dst->x0 = std::min(dst->x0, src->x0);
+    dst->y0 = std::min(dst->y0, src->y0);
+    dst->x1 = std::max(dst->x1, src->x1);
+    dst->y1 = std::max(dst->y1, src->y1);
+}
+
+void gr_damage(int x, int y, int w, int h)
+{
+    GRRect rect;
+
+    if (w <= 0 || h <= 0)
+        return;
+    if (!frame_damaged) {
+        frame_damage.x0 = frame_damage.x1 = 0;
+        frame_damage.y0 = frame_damage.y1 = 0;
+        frame_damaged = true;
+    }
+    // The same area gr_clip() limits drawing to
+    switch (gr_rotation) {
+        case 90:
+            rect.x0 = gr_draw->width - y - h;
+            rect.y0 = x;
+            rect.x1 = rect.x0 + h;
+            rect.y1 = rect.y0 + w;
+            break;
+        case 180:
+            rect.x0 = gr_draw->width - x - w;
+            rect.y0 = gr_draw->height - y - h;
+            rect.x1 = rect.x0 + w;
+            rect.y1 = rect.y0 + h;
+            break;
+        case 270:
+            rect.x0 = y;
+            rect.y0 = gr_draw->height - x - w;
+            rect.x1 = rect.x0 + h;
+            rect.y1 = rect.y0 + w;
+            break;
+        default:
+            rect.x0 = x;
+            rect.y0 = y;
+            rect.x1 = x + w;
+            rect.y1 = y + h;
+            break;
+    }
+    rect.x0 = std::max(rect.x0, 0);
+    rect.y0 = std::max(rect.y0, 0);
+    rect.x1 = std::min(rect.x1, gr_draw->width);
+    rect.y1 = std::min(rect.y1, gr_draw->height);
+    add_rect(&frame_damage, &rect);
+}
+
+void gr_take_damage(int buffer, GRRect* rect)
+{
+    if (buffer < 0 || buffer >= GR_MAX_BUFFERS) {
+        rect->x0 = rect->y0 = 0;
+        rect->x1 = gr_draw->width;
+        rect->y1 = gr_draw->height;
+        return;
+    }
+    *rect = buffer_damage[buffer];
+    buffer_damage[buffer].x0 = buffer_damage[buffer].x1 = 0;
+    buffer_damage[buffer].y0 = buffer_damage[buffer].y1 = 0;
+}
+
+void gr_frame_damage(GRRect* rect)
+{
+    *rect = flip_damage;
+}
+
+void gr_swap_red_blue(GRSurface* surface, const GRRect* rect)
+{
+    for (int y = rect->y0; y < rect->y1; y++) {
+        unsigned char* px = surface->data + (size_t)y * surface->row_bytes + (size_t)rect->x0 * 4;
+
+        for (int x = rect->x0; x < rect->x1; x++, px += 4) {
+            unsigned char tmp = px[0];
+            px[0] = px[2];
+            px[2] = tmp;
+        }
+    }
+}
+
+void gr_copy_damage(GRSurface* dst, const GRSurface* src, const GRRect* rect)
+{
+    size_t offset, len;
+
+    if (rect->x0 >= rect->x1 || rect->y0 >= rect->y1)
+        return;
+    // Whole rows are one contiguous copy
+    if (rect->x0 == 0 && rect->x1 == src->width && dst->row_bytes == src->row_bytes) {
+        offset = (size_t)rect->y0 * src->row_bytes;
+        memcpy(dst->data + offset, src->data + offset, (size_t)(rect->y1 - rect->y0) * src->row_bytes);
+        return;
+    }
+    len = (size_t)(rect->x1 - rect->x0) * src->pixel_bytes;
+    for (int y = rect->y0; y < rect->y1; y++) {
+        memcpy(dst->data + (size_t)y * dst->row_bytes + (size_t)rect->x0 * dst->pixel_bytes,
+               src->data + (size_t)y * src->row_bytes + (size_t)rect->x0 * src->pixel_bytes, len);
+    }
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -208,17 +380,101 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[1] = ((g << 8) | g) + 1;
     color[2] = ((r << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
+    gr_current_color = (uint32_t)b | (uint32_t)g << 8 | (uint32_t)r << 16 | (uint32_t)a << 24;
 #else
     color[0] = ((r << 8) | r) + 1;
     color[1] = ((g << 8) | g) + 1;
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
+    gr_current_color = (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16 | (uint32_t)a << 24;
 #endif
     gl->color4xv(gl, color);
 
     gr_is_curr_clr_opaque = (a == 255);
 }
 
+// The kernels write the draw surface themselves when its bytes are in the
+// same order as the image surfaces and the current color, which is when
+// pixelflinger would not convert them either. Anything else still goes
+// through pixelflinger.
+static bool gr_direct_target()
+{
+    return gr_draw->pixel_bytes == 4 &&
+           (gr_mem_surface.format == GGL_PIXEL_FORMAT_RGBA_8888 ||
+            gr_mem_surface.format == GGL_PIXEL_FORMAT_RGBX_8888);
+}
+
+// Limits rect to the draw surface and the scissor, false if nothing is left
+static bool gr_clip_rect(GRRect* rect)
+{
+    rect->x0 = std::max(rect->x0, 0);
+    rect->y0 = std::max(rect->y0, 0);
+    rect->x1 = std::min(rect->x1, gr_draw->width);
+    rect->y1 = std::min(rect->y1, gr_draw->height);
+    if (gr_scissor_enabled) {
+        rect->x0 = std::max(rect->x0, gr_scissor.x0);
+        rect->y0 = std::max(rect->y0, gr_scissor.y0);
+        rect->x1 = std::min(rect->x1, gr_scissor.x1);
+        rect->y1 = std::min(rect->y1, gr_scissor.y1);
+    }
+    return rect->x0 < rect->x1 && rect->y0 < rect->y1;
+}
+
+static uint32_t* gr_draw_pixel(int x, int y)
+{
+    return (uint32_t*)(gr_draw->data + (size_t)y * gr_draw->row_bytes) + x;
+}
+
+// Draws texture over the surface rect (l, t) - (r, b), with texture pixel
+// (s, t) + (x, y) landing on surface pixel (x, y) like texCoord2i(). False
+// when the kernels cannot do it, including rects reaching outside the
+// texture, which pixelflinger wraps.
+static bool gr_blit_direct(const GGLSurface* texture, int s, int t, int l, int top, int r, int b)
+{
+    GRRect rect = { l, top, r, b };
+    int sx, sy, w, h;
+
+    if (!gr_direct_target())
+        return false;
+    if (texture->format != GGL_PIXEL_FORMAT_RGBA_8888 &&
+        texture->format != GGL_PIXEL_FORMAT_RGBX_8888 &&
+        texture->format != GGL_PIXEL_FORMAT_A_8)
+        return false;
+    if (!gr_clip_rect(&rect))
+        return true;
+
+    sx = rect.x0 + s;
+    sy = rect.y0 + t;
+    w = rect.x1 - rect.x0;
+    h = rect.y1 - rect.y0;
+    if (sx < 0 || sy < 0 || sx + w > (int)texture->width || sy + h > (int)texture->height)
+        return false;
+
+    const gr_kernels* k = gr_get_kernels();
+    uint32_t* dst = gr_draw_pixel(rect.x0, rect.y0);
+    int dst_stride = gr_draw->row_bytes / 4;
+
+    if (texture->format == GGL_PIXEL_FORMAT_A_8) {
+        k->mask_blend(dst, dst_stride, texture->data + (size_t)sy * texture->stride + sx,
+                      texture->stride, w, h, gr_current_color);
+    } else if (texture->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        // Blending is off for opaque images
+        const uint32_t* src = (const uint32_t*)texture->data + (size_t)sy * texture->stride + sx;
+
+        for (int y = 0; y < h; y++, dst += dst_stride, src += texture->stride)
+            memcpy(dst, src, (size_t)w * 4);
+    } else {
+        k->blit_blend(dst, dst_stride, (const uint32_t*)texture->data + (size_t)sy * texture->stride + sx,
+                      texture->stride, w, h);
+    }
+    return true;
+}
+
+bool gr_blit_mask(gr_surface mask, int s, int t, int l, int top, int r, int b)
+{
+    return gr_blit_direct((const GGLSurface*)mask, s, t, l, top, r, b);
+}
+
 void gr_clear()
 {
     if (gr_draw->pixel_bytes == 2) {
@@ -260,7 +516,22 @@ void gr_fill(int x, int y, int w, int h)
     r_disp = std::max(x0_disp, x1_disp);
     t_disp = std::min(y0_disp, y1_disp);
     b_disp = std::max(y0_disp, y1_disp);
-    gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
+
+    if (gr_direct_target()) {
+        GRRect rect = { l_disp, t_disp, r_disp, b_disp };
+
+        if (gr_clip_rect(&rect)) {
+            const gr_kernels* k = gr_get_kernels();
+            uint32_t* dst = gr_draw_pixel(rect.x0, rect.y0);
+
+            if (gr_is_curr_clr_opaque)
+                k->fill(dst, gr_draw->row_bytes / 4, rect.x1 - rect.x0, rect.y1 - rect.y0, gr_current_color);
+            else
+                k->fill_blend(dst, gr_draw->row_bytes / 4, rect.x1 - rect.x0, rect.y1 - rect.y0, gr_current_color);
+        }
+    } else {
+        gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
+    }
 
     if(gr_is_curr_clr_opaque)
         gl->enable(gl, GGL_BLEND);
@@ -305,19 +576,19 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
         surface_rotated.format  = surface->format;
         surface_rotated.data    = (GGLubyte*) malloc(surface_rotated.stride * surface_rotated.height * 4);
         surface_ROTATION_transform((gr_surface) &surface_rotated, (const gr_surface) surface, 4);
-
-        gl->bindTexture(gl, &surface_rotated);
-    } else {
-        gl->bindTexture(gl, surface);
     }
-
-    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-    gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, sx - l_disp, sy - t_disp);
-    gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
-    gl->disable(gl, GGL_TEXTURE_2D);
+    GGLSurface *texture = (gr_rotation != 0) ? &surface_rotated : surface;
+
+    if (!gr_blit_direct(texture, sx - l_disp, sy - t_disp, l_disp, t_disp, r_disp, b_disp)) {
+        gl->bindTexture(gl, texture);
+        gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+        gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+        gl->enable(gl, GGL_TEXTURE_2D);
+        gl->texCoord2i(gl, sx - l_disp, sy - t_disp);
+        gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
+        gl->disable(gl, GGL_TEXTURE_2D);
+    }
 
     if (gr_rotation != 0)
         free(surface_rotated.data);
@@ -341,6 +612,13 @@ unsigned int gr_get_height(gr_surface surface) {
 }
 
 void gr_flip() {
+    GRRect full = { 0, 0, gr_draw->width, gr_draw->height };
+
+    flip_damage = frame_damaged ? frame_damage : full;
+    for (int i = 0; i < GR_MAX_BUFFERS; i++)
+        add_rect(&buffer_damage[i], &flip_damage);
+    frame_damaged = false;
+
     gr_draw = gr_backend->flip(gr_backend);
     // On double buffered back ends, when we flip, we need to tell
     // pixel flinger to draw to the other buffer
@@ -400,6 +678,9 @@ int gr_init(void)
             printf("Using fbdev graphics.\n");
     }
 
+    gr_kernels_init();
+    printf("Using %s pixel kernels.\n", gr_get_kernels()->name);
+
     overscan_offset_x = gr_draw->width * overscan_percent / 100;
     overscan_offset_y = gr_draw->height * overscan_percent / 100;
 
@@ -36,6 +36,27 @@ struct minui_backend {
     void (*exit)(minui_backend*);
 };
 
+// Part of the draw surface in surface pixels, x1 and y1 are exclusive
+struct GRRect {
+    int x0, y0, x1, y1;
+};
+
+#define GR_MAX_BUFFERS 2
+
+// Returns the part of the draw surface that front buffer n of the backend
+// has not received yet and marks it as received. Backends with buffers they
+// copy the draw surface into call this from flip().
+void gr_take_damage(int buffer, GRRect* rect);
+
+// Returns the part of the draw surface that was drawn for this flip.
+void gr_frame_damage(GRRect* rect);
+
+// Copies the rows of rect from the draw surface into dst.
+void gr_copy_damage(GRSurface* dst, const GRSurface* src, const GRRect* rect);
+
+// Swaps the red and blue bytes of the 32 bit pixels in rect.
+void gr_swap_red_blue(GRSurface* surface, const GRRect* rect);
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
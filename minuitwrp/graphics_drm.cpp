@@ -67,6 +67,12 @@
 
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(*(A)))
 
+// Layout of struct drm_mode_rect, the FB_DAMAGE_CLIPS blob entry, which
+// older libdrm headers do not have
+struct damage_rect {
+    int32_t x1, y1, x2, y2;
+};
+
 struct drm_surface {
     GRSurface base;
     uint32_t fb_id;
@@ -233,6 +239,7 @@ static int drm_fd = -1;
 
 static bool current_blank_state = true;
 static int fb_prop_id;
+static uint32_t damage_clips_prop_id;
 static struct Crtc crtc_res;
 static struct Connector conn_res;
 static struct Plane plane_res[NUM_PLANES];
@@ -898,8 +905,9 @@ static void disable_non_main_crtcs(int fd,
   drmModeAtomicFree(atomic_req);
 }
 
-static void update_plane_fb() {
-  uint32_t i, prop_id;
+static void update_plane_fb(const GRRect *damage) {
+  uint32_t i, prop_id, damage_blob = 0;
+  struct damage_rect clip;
 
   /* Set atomic req */
   drmModeAtomicReqPtr atomic_req = drmModeAtomicAlloc();
@@ -919,12 +927,29 @@ static void update_plane_fb() {
     drmModeAtomicAddProperty(atomic_req, plane_res[i].plane->plane_id,
                              fb_prop_id, drm_surfaces[current_buffer]->fb_id);
 
+  /* Tell drivers that support it which part of the new fb changed */
+  if (damage_clips_prop_id && damage->x0 < damage->x1 && damage->y0 < damage->y1) {
+    clip.x1 = damage->x0;
+    clip.y1 = damage->y0;
+    clip.x2 = damage->x1;
+    clip.y2 = damage->y1;
+    if (drmModeCreatePropertyBlob(drm_fd, &clip, sizeof(clip), &damage_blob) == 0) {
+      for(i = 0; i < number_of_lms; i++)
+        drmModeAtomicAddProperty(atomic_req, plane_res[i].plane->plane_id,
+                                 damage_clips_prop_id, damage_blob);
+    } else {
+      damage_blob = 0;
+    }
+  }
+
   /* Commit changes */
   int32_t ret;
   ret = drmModeAtomicCommit(drm_fd, atomic_req,
                  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
 
   drmModeAtomicFree(atomic_req);
+  if (damage_blob)
+    drmModeDestroyPropertyBlob(drm_fd, damage_blob);
 
   if (ret)
     printf("Atomic commit failed ret=%d\n", ret);
@@ -1140,6 +1165,9 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
   uint32_t prop_id;
   prop_id = find_plane_prop_id(plane_res[0].plane->plane_id, "FB_ID", plane_res);
   fb_prop_id = prop_id;
+  damage_clips_prop_id = find_plane_prop_id(plane_res[0].plane->plane_id, "FB_DAMAGE_CLIPS", plane_res);
+  if (damage_clips_prop_id)
+    printf("Using FB_DAMAGE_CLIPS\n");
 
   drm_blank(nullptr, false);
 
@@ -1147,9 +1175,12 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
 }
 
 static GRSurface* drm_flip(minui_backend* backend __unused) {
-    memcpy(drm_surfaces[current_buffer]->base.data,
-            draw_buf->data, draw_buf->height * draw_buf->row_bytes);
-    update_plane_fb();
+    GRRect damage;
+
+    // Only the rows this buffer has not received yet are copied
+    gr_take_damage(current_buffer, &damage);
+    gr_copy_damage(&drm_surfaces[current_buffer]->base, draw_buf, &damage);
+    update_plane_fb(&damage);
     current_buffer = 1 - current_buffer;
     return draw_buf;
 }
@@ -283,26 +283,22 @@ static GRSurface* fbdev_init(minui_backend* backend) {
 }
 
 static GRSurface* fbdev_flip(minui_backend* backend __unused) {
+    GRRect damage;
+    int target = double_buffered ? 1 - displayed_buffer : 0;
+
+    gr_take_damage(target, &damage);
 #if defined(RECOVERY_BGRA)
-    // In case of BGRA, do some byte swapping
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (int idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        unsigned char tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
-    }
+    // In case of BGRA, do some byte swapping. Only what was drawn for this
+    // frame is swapped, the rest of the surface was swapped by earlier flips.
+    GRRect drawn;
+
+    gr_frame_damage(&drawn);
+    gr_swap_red_blue(gr_draw, &drawn);
 #endif
-    if (double_buffered) {
-        // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[1-displayed_buffer].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
-        set_displayed_framebuffer(1-displayed_buffer);
-    } else {
-        // Copy from the in-memory surface to the framebuffer.
-        memcpy(gr_framebuffer[0].data, gr_draw->data,
-               gr_draw->height * gr_draw->row_bytes);
-    }
+    // Copy the rows that changed from the in-memory surface to the framebuffer.
+    gr_copy_damage(&gr_framebuffer[target], gr_draw, &damage);
+    if (double_buffered)
+        set_displayed_framebuffer(target);
     return gr_draw;
 }
 
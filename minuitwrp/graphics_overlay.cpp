@@ -499,14 +499,12 @@ int overlay_display_frame(int fd, void* data, size_t size)
 
 static GRSurface* overlay_flip(minui_backend* backend __unused) {
 #if defined(RECOVERY_BGRA)
-    // In case of BGRA, do some byte swapping
-    unsigned char* ucfb_vaddr = (unsigned char*)gr_draw->data;
-    for (int idx = 0 ; idx < (gr_draw->height * gr_draw->row_bytes);
-            idx += 4) {
-        unsigned char tmp = ucfb_vaddr[idx];
-        ucfb_vaddr[idx    ] = ucfb_vaddr[idx + 2];
-        ucfb_vaddr[idx + 2] = tmp;
-    }
+    // In case of BGRA, do some byte swapping. Only what was drawn for this
+    // frame is swapped, the rest of the surface was swapped by earlier flips.
+    GRRect drawn;
+
+    gr_frame_damage(&drawn);
+    gr_swap_red_blue(gr_draw, &drawn);
 #endif
     // Copy from the in-memory surface to the framebuffer.
     overlay_display_frame(fb_fd, gr_draw->data, frame_size);
@@ -0,0 +1,462 @@
+/*
+		Copyright 2013 to 2020 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GR_NEON 1
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GR_SSE2 1
+#endif
+
+#include "graphics_simd.h"
+
+// Rotation works on square tiles so both surfaces stay in the cache
+#define ROTATE_TILE 32
+
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint32_t blend_px(uint32_t s, uint32_t d, uint32_t a)
+{
+    uint32_t ia = 255 - a, res = 0;
+
+    for (int shift = 0; shift < 32; shift += 8)
+        res |= div255(((s >> shift) & 0xff) * a + ((d >> shift) & 0xff) * ia) << shift;
+    return res;
+}
+
+static void fill_c(uint32_t* dst, int dst_stride, int w, int h, uint32_t color)
+{
+    for (int y = 0; y < h; y++, dst += dst_stride)
+        for (int x = 0; x < w; x++)
+            dst[x] = color;
+}
+
+static void fill_blend_c(uint32_t* dst, int dst_stride, int w, int h, uint32_t color)
+{
+    uint32_t a = color >> 24;
+
+    if (a == 0)
+        return;
+    for (int y = 0; y < h; y++, dst += dst_stride)
+        for (int x = 0; x < w; x++)
+            dst[x] = blend_px(color, dst[x], a);
+}
+
+static void blit_blend_c(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int w, int h)
+{
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        for (int x = 0; x < w; x++) {
+            uint32_t a = src[x] >> 24;
+
+            if (a == 255)
+                dst[x] = src[x];
+            else if (a != 0)
+                dst[x] = blend_px(src[x], dst[x], a);
+        }
+    }
+}
+
+static void mask_blend_c(uint32_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w, int h, uint32_t color)
+{
+    color &= 0x00ffffff;
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        for (int x = 0; x < w; x++) {
+            uint32_t a = src[x];
+
+            if (a == 255)
+                dst[x] = color | 0xff000000;
+            else if (a != 0)
+                dst[x] = blend_px(color | (a << 24), dst[x], a);
+        }
+    }
+}
+
+// Rotates the part [x0, x1) x [y0, y1) of src, one pixel at a time
+template <typename T>
+static void rotate_area(T* dst, int dst_stride, const T* src, int src_stride, int src_w, int src_h,
+                        int rotation, int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        const T* ip = src + (size_t)y * src_stride;
+
+        for (int x = x0; x < x1; x++) {
+            switch (rotation) {
+                case 90:
+                    dst[(size_t)x * dst_stride + (src_h - y - 1)] = ip[x];
+                    break;
+                case 180:
+                    dst[(size_t)(src_h - y - 1) * dst_stride + (src_w - x - 1)] = ip[x];
+                    break;
+                default:
+                    dst[(size_t)(src_w - x - 1) * dst_stride + y] = ip[x];
+                    break;
+            }
+        }
+    }
+}
+
+template <typename T>
+static void rotate_tiled(T* dst, int dst_stride, const T* src, int src_stride, int src_w, int src_h, int rotation)
+{
+    for (int ty = 0; ty < src_h; ty += ROTATE_TILE) {
+        for (int tx = 0; tx < src_w; tx += ROTATE_TILE) {
+            int x1 = tx + ROTATE_TILE < src_w ? tx + ROTATE_TILE : src_w;
+            int y1 = ty + ROTATE_TILE < src_h ? ty + ROTATE_TILE : src_h;
+
+            rotate_area(dst, dst_stride, src, src_stride, src_w, src_h, rotation, tx, ty, x1, y1);
+        }
+    }
+}
+
+static void rotate32_c(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int src_w, int src_h, int rotation)
+{
+    rotate_tiled(dst, dst_stride, src, src_stride, src_w, src_h, rotation);
+}
+
+void gr_rotate8(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int src_w, int src_h, int rotation)
+{
+    rotate_tiled(dst, dst_stride, src, src_stride, src_w, src_h, rotation);
+}
+
+static const gr_kernels kernels_c = {
+    "scalar",
+    fill_c,
+    fill_blend_c,
+    blit_blend_c,
+    mask_blend_c,
+    rotate32_c,
+};
+
+#if defined(GR_NEON) || defined(GR_SSE2)
+
+// Four pixels per vector. The helpers below are all the kernels need from
+// the instruction set, so the loops are shared between NEON and SSE2.
+#ifdef GR_NEON
+typedef uint32x4_t vec4;
+
+static inline vec4 v_load(const uint32_t* p) { return vld1q_u32(p); }
+static inline void v_store(uint32_t* p, vec4 v) { vst1q_u32(p, v); }
+static inline vec4 v_dup(uint32_t px) { return vdupq_n_u32(px); }
+
+// Every byte of a pixel set to its alpha
+static inline vec4 v_alpha(vec4 s)
+{
+    return vmulq_n_u32(vshrq_n_u32(s, 24), 0x01010101);
+}
+
+static inline bool v_alpha_all(vec4 s, uint32_t a)
+{
+    uint64x2_t eq = vreinterpretq_u64_u32(vceqq_u32(vandq_u32(s, vdupq_n_u32(0xff000000)), vdupq_n_u32(a << 24)));
+
+    return (vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) == ~0ULL;
+}
+
+static inline vec4 v_blend(vec4 s, vec4 d, vec4 a)
+{
+    uint8x16_t s8 = vreinterpretq_u8_u32(s), d8 = vreinterpretq_u8_u32(d);
+    uint8x16_t a8 = vreinterpretq_u8_u32(a), ia8 = vmvnq_u8(a8);
+    uint16x8_t lo = vmull_u8(vget_low_u8(s8), vget_low_u8(a8));
+    uint16x8_t hi = vmull_u8(vget_high_u8(s8), vget_high_u8(a8));
+
+    lo = vmlal_u8(lo, vget_low_u8(d8), vget_low_u8(ia8));
+    hi = vmlal_u8(hi, vget_high_u8(d8), vget_high_u8(ia8));
+    // (x + ((x + 128) >> 8) + 128) >> 8, the same rounding as div255()
+    return vreinterpretq_u32_u8(vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8),
+                                            vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8)));
+}
+
+// Four coverage bytes widened to one per pixel
+static inline vec4 v_coverage(uint32_t cw)
+{
+    return vmovl_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(cw)))));
+}
+
+static inline vec4 v_or_shl24(vec4 rgb, vec4 c) { return vorrq_u32(rgb, vshlq_n_u32(c, 24)); }
+
+static inline vec4 v_reverse(vec4 v)
+{
+    v = vrev64q_u32(v);
+    return vcombine_u32(vget_high_u32(v), vget_low_u32(v));
+}
+
+static inline void v_transpose(vec4& r0, vec4& r1, vec4& r2, vec4& r3)
+{
+    uint32x4x2_t t01 = vtrnq_u32(r0, r1);
+    uint32x4x2_t t23 = vtrnq_u32(r2, r3);
+
+    r0 = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+    r1 = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+    r2 = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+    r3 = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+}
+#else
+typedef __m128i vec4;
+
+static inline vec4 v_load(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void v_store(uint32_t* p, vec4 v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline vec4 v_dup(uint32_t px) { return _mm_set1_epi32((int)px); }
+
+static inline vec4 v_alpha(vec4 s)
+{
+    vec4 a = _mm_srli_epi32(s, 24);
+
+    a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+    return _mm_or_si128(a, _mm_slli_epi32(a, 16));
+}
+
+static inline bool v_alpha_all(vec4 s, uint32_t a)
+{
+    vec4 mask = _mm_set1_epi32((int)0xff000000);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, mask), _mm_set1_epi32((int)(a << 24)))) == 0xffff;
+}
+
+static inline vec4 v_blend(vec4 s, vec4 d, vec4 a)
+{
+    const vec4 zero = _mm_setzero_si128();
+    const vec4 c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+    vec4 a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+    vec4 lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+                            _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(c255, a_lo)));
+    vec4 hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+                            _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(c255, a_hi)));
+
+    lo = _mm_add_epi16(lo, c128);
+    hi = _mm_add_epi16(hi, c128);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static inline vec4 v_coverage(uint32_t cw)
+{
+    const vec4 zero = _mm_setzero_si128();
+
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)cw), zero), zero);
+}
+
+static inline vec4 v_or_shl24(vec4 rgb, vec4 c) { return _mm_or_si128(rgb, _mm_slli_epi32(c, 24)); }
+
+static inline vec4 v_reverse(vec4 v) { return _mm_shuffle_epi32(v, 0x1b); }
+
+static inline void v_transpose(vec4& r0, vec4& r1, vec4& r2, vec4& r3)
+{
+    vec4 t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpacklo_epi32(r2, r3);
+    vec4 t2 = _mm_unpackhi_epi32(r0, r1), t3 = _mm_unpackhi_epi32(r2, r3);
+
+    r0 = _mm_unpacklo_epi64(t0, t1);
+    r1 = _mm_unpackhi_epi64(t0, t1);
+    r2 = _mm_unpacklo_epi64(t2, t3);
+    r3 = _mm_unpackhi_epi64(t2, t3);
+}
+#endif
+
+static void fill_v(uint32_t* dst, int dst_stride, int w, int h, uint32_t color)
+{
+    vec4 c = v_dup(color);
+
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+
+        for (; x + 4 <= w; x += 4)
+            v_store(dst + x, c);
+        for (; x < w; x++)
+            dst[x] = color;
+    }
+}
+
+static void fill_blend_v(uint32_t* dst, int dst_stride, int w, int h, uint32_t color)
+{
+    uint32_t a = color >> 24;
+    vec4 c = v_dup(color), va = v_alpha(c);
+
+    if (a == 0)
+        return;
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+
+        for (; x + 4 <= w; x += 4)
+            v_store(dst + x, v_blend(c, v_load(dst + x), va));
+        for (; x < w; x++)
+            dst[x] = blend_px(color, dst[x], a);
+    }
+}
+
+static void blit_blend_v(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int w, int h)
+{
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+
+        for (; x + 4 <= w; x += 4) {
+            vec4 s = v_load(src + x);
+
+            // Most of an image is either fully opaque or fully transparent
+            if (v_alpha_all(s, 255))
+                v_store(dst + x, s);
+            else if (!v_alpha_all(s, 0))
+                v_store(dst + x, v_blend(s, v_load(dst + x), v_alpha(s)));
+        }
+        for (; x < w; x++) {
+            uint32_t a = src[x] >> 24;
+
+            if (a == 255)
+                dst[x] = src[x];
+            else if (a != 0)
+                dst[x] = blend_px(src[x], dst[x], a);
+        }
+    }
+}
+
+static void mask_blend_v(uint32_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w, int h, uint32_t color)
+{
+    color &= 0x00ffffff;
+    vec4 rgb = v_dup(color), opaque = v_dup(color | 0xff000000);
+
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+
+        for (; x + 4 <= w; x += 4) {
+            uint32_t cw;
+
+            memcpy(&cw, src + x, sizeof(cw));
+            if (cw == 0)
+                continue;
+            if (cw == 0xffffffff) {
+                v_store(dst + x, opaque);
+                continue;
+            }
+            vec4 s = v_or_shl24(rgb, v_coverage(cw));
+            v_store(dst + x, v_blend(s, v_load(dst + x), v_alpha(s)));
+        }
+        for (; x < w; x++) {
+            uint32_t a = src[x];
+
+            if (a == 255)
+                dst[x] = color | 0xff000000;
+            else if (a != 0)
+                dst[x] = blend_px(color | (a << 24), dst[x], a);
+        }
+    }
+}
+
+static void rotate180_v(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int src_w, int src_h)
+{
+    for (int y = 0; y < src_h; y++) {
+        const uint32_t* ip = src + (size_t)y * src_stride;
+        uint32_t* op = dst + (size_t)(src_h - y - 1) * dst_stride;
+        int x = 0;
+
+        for (; x + 4 <= src_w; x += 4)
+            v_store(op + src_w - x - 4, v_reverse(v_load(ip + x)));
+        for (; x < src_w; x++)
+            op[src_w - x - 1] = ip[x];
+    }
+}
+
+// 4x4 blocks are transposed in registers, a source column becomes a
+// destination row (reversed for 90 degrees)
+static void rotate_block_v(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int src_w, int src_h,
+                           int rotation, int x, int y)
+{
+    const uint32_t* ip = src + (size_t)y * src_stride + x;
+    vec4 c[4];
+
+    c[0] = v_load(ip);
+    c[1] = v_load(ip + src_stride);
+    c[2] = v_load(ip + 2 * src_stride);
+    c[3] = v_load(ip + 3 * src_stride);
+    v_transpose(c[0], c[1], c[2], c[3]);
+    for (int j = 0; j < 4; j++) {
+        if (rotation == 90)
+            v_store(dst + (size_t)(x + j) * dst_stride + (src_h - y - 4), v_reverse(c[j]));
+        else
+            v_store(dst + (size_t)(src_w - x - j - 1) * dst_stride + y, c[j]);
+    }
+}
+
+static void rotate32_v(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int src_w, int src_h, int rotation)
+{
+    int w4 = src_w & ~3, h4 = src_h & ~3;
+
+    if (rotation == 180) {
+        rotate180_v(dst, dst_stride, src, src_stride, src_w, src_h);
+        return;
+    }
+    for (int ty = 0; ty < h4; ty += ROTATE_TILE) {
+        for (int tx = 0; tx < w4; tx += ROTATE_TILE) {
+            int x1 = tx + ROTATE_TILE < w4 ? tx + ROTATE_TILE : w4;
+            int y1 = ty + ROTATE_TILE < h4 ? ty + ROTATE_TILE : h4;
+
+            for (int y = ty; y < y1; y += 4)
+                for (int x = tx; x < x1; x += 4)
+                    rotate_block_v(dst, dst_stride, src, src_stride, src_w, src_h, rotation, x, y);
+        }
+    }
+    // The edges that do not fill a block
+    rotate_area(dst, dst_stride, src, src_stride, src_w, src_h, rotation, w4, 0, src_w, src_h);
+    rotate_area(dst, dst_stride, src, src_stride, src_w, src_h, rotation, 0, h4, w4, src_h);
+}
+
+static const gr_kernels kernels_v = {
+#ifdef GR_NEON
+    "neon",
+#else
+    "sse2",
+#endif
+    fill_v,
+    fill_blend_v,
+    blit_blend_v,
+    mask_blend_v,
+    rotate32_v,
+};
+#endif
+
+static const gr_kernels* kernels = &kernels_c;
+
+void gr_kernels_init(void)
+{
+#if defined(GR_NEON) && !defined(__aarch64__)
+    // NEON is optional on 32 bit ARM
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+        kernels = &kernels_v;
+#elif defined(GR_NEON) || defined(GR_SSE2)
+    kernels = &kernels_v;
+#endif
+}
+
+const gr_kernels* gr_get_kernels(void)
+{
+    return kernels;
+}
+
+const gr_kernels* gr_get_scalar_kernels(void)
+{
+    return &kernels_c;
+}
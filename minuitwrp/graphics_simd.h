@@ -0,0 +1,57 @@
+/*
+		Copyright 2013 to 2020 TeamWin
+		This file is part of TWRP/TeamWin Recovery Project.
+
+		TWRP is free software: you can redistribute it and/or modify
+		it under the terms of the GNU General Public License as published by
+		the Free Software Foundation, either version 3 of the License, or
+		(at your option) any later version.
+
+		TWRP is distributed in the hope that it will be useful,
+		but WITHOUT ANY WARRANTY; without even the implied warranty of
+		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+		GNU General Public License for more details.
+
+		You should have received a copy of the GNU General Public License
+		along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _GRAPHICS_SIMD_H_
+#define _GRAPHICS_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel kernels for 32 bit surfaces whose bytes are in the same order as
+// the source images, so nothing needs converting. Pixels are handled as
+// little endian words with the alpha byte on top, strides are in pixels
+// (bytes for 8 bit masks) and blending is src * a + dst * (255 - a) on all
+// four bytes, the same as pixelflinger's SRC_ALPHA, ONE_MINUS_SRC_ALPHA.
+struct gr_kernels {
+    const char* name;
+    // Stores color in every pixel
+    void (*fill)(uint32_t* dst, int dst_stride, int w, int h, uint32_t color);
+    // Blends color using its own alpha
+    void (*fill_blend)(uint32_t* dst, int dst_stride, int w, int h, uint32_t color);
+    // Blends src using the alpha of every source pixel
+    void (*blit_blend)(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int w, int h);
+    // Blends color using an 8 bit coverage mask as alpha (text)
+    void (*mask_blend)(uint32_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w, int h, uint32_t color);
+    // Turns src by 90, 180 or 270 degrees into dst, dst being src_h x src_w
+    // for 90 and 270. The rotation matches ROTATION_X_DISP / ROTATION_Y_DISP.
+    void (*rotate32)(uint32_t* dst, int dst_stride, const uint32_t* src, int src_stride, int src_w, int src_h, int rotation);
+};
+
+// Picks the fastest kernels the CPU supports, called from gr_init()
+void gr_kernels_init(void);
+
+// The kernels in use, the scalar ones until gr_kernels_init()
+const gr_kernels* gr_get_kernels(void);
+
+// The portable kernels, which the vector ones have to match exactly
+const gr_kernels* gr_get_scalar_kernels(void);
+
+// 8 bit rotation has no vector version, it is only used for text
+void gr_rotate8(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int src_w, int src_h, int rotation);
+
+#endif
@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "minuitwrp/minui.h"
+#include "graphics_simd.h"
 
 struct fb_var_screeninfo vi;
 extern GGLSurface gr_mem_surface;
@@ -138,46 +139,22 @@ int ROTATION_Y_DISP(int x, int y, int h) {
             (gr_rotation == 270) ? (h - (x) - 1) : -1);
 }
 
-#define MATRIX_ELEMENT(matrix, row, col, row_size, elem_size) \
-    (((uint8_t*) (matrix)) + (((row) * (elem_size)) * (row_size)) + ((col) * (elem_size)))
-
-#define DO_MATRIX_ROTATION(bits_per_pixel, bytes_per_pixel)                   \
-{                                                                             \
-    for (size_t y = 0; y < src->height; y++) {                                \
-        for (size_t x = 0; x < src->width; x++) {                             \
-            /* output pointer in dst->data */                                 \
-            uint##bits_per_pixel##_t       *op;                               \
-            /* input pointer from src->data */                                \
-            const uint##bits_per_pixel##_t *ip;                               \
-            /* Display coordinates (in dst) corresponding to (x, y) in src */ \
-            size_t x_disp = ROTATION_X_DISP(x, y, dst->width);                \
-            size_t y_disp = ROTATION_Y_DISP(x, y, dst->height);               \
-                                                                              \
-            ip = (const uint##bits_per_pixel##_t*)                            \
-                 MATRIX_ELEMENT(src->data, y, x,                              \
-                                src->stride, bytes_per_pixel);                \
-            op = (uint##bits_per_pixel##_t*)                                  \
-                 MATRIX_ELEMENT(dst->data, y_disp, x_disp,                    \
-                                dst->stride, bytes_per_pixel);                \
-            *op = *ip;                                                        \
-        }                                                                     \
-    }                                                                         \
-}
-
 void surface_ROTATION_transform(gr_surface dst_ptr, const gr_surface src_ptr,
                                   size_t num_bytes_per_pixel)
 {
     GGLSurface *dst = (GGLSurface*) dst_ptr;
     const GGLSurface *src = (GGLSurface*) src_ptr;
 
-    /* Handle duplicated code via a macro.
-     * This is currently used for rotating surfaces of graphical resources
+    /* This is currently used for rotating surfaces of graphical resources
      * (32-bit pixel format) and of font glyphs (8-bit pixel format).
      * If you need to add handling of other pixel formats feel free to do so.
      */
     if (num_bytes_per_pixel == 4) {
-        DO_MATRIX_ROTATION(32, 4);
+        gr_get_kernels()->rotate32((uint32_t*) dst->data, dst->stride,
+                                   (const uint32_t*) src->data, src->stride,
+                                   src->width, src->height, gr_rotation);
     } else if (num_bytes_per_pixel == 1) {
-        DO_MATRIX_ROTATION(8, 1);
+        gr_rotate8(dst->data, dst->stride, src->data, src->stride,
+                   src->width, src->height, gr_rotation);
     }
 }
@@ -47,6 +47,9 @@ void gr_fb_blank(bool blank);
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+void gr_frame_clip(int x, int y, int w, int h);
+void gr_frame_noclip();
+void gr_damage(int x, int y, int w, int h);
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -66,6 +69,10 @@ int gr_ttf_getMaxFontHeight(void *font);
 void gr_ttf_dump_stats(void);
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
+// Blends the current color through an 8 bit mask into the surface rect
+// (l, t) - (r, b) in display coordinates, mask pixel (s, t) + (x, y) going
+// to (x, y). Returns false if the caller has to draw it with pixelflinger.
+bool gr_blit_mask(gr_surface mask, int s, int t, int l, int top, int r, int b);
 unsigned int gr_get_width(gr_surface surface);
 unsigned int gr_get_height(gr_surface surface);
 int gr_get_surface(gr_surface* surface);
@@ -89,6 +96,8 @@ struct input_event;
 int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, int timeout_ms);
+// An fd that polls readable when ev_get() has something to do, -1 if none
+int ev_get_fd(void);
 int ev_has_mouse(void);
 
 // Resources
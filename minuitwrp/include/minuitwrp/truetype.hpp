@@ -17,8 +17,11 @@
 #ifndef _TWRP_TRUETYPE_HPP
 #define _TWRP_TRUETYPE_HPP
 
+#include <list>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <ft2build.h>
 #include <pthread.h>
 #include FT_FREETYPE_H
@@ -37,10 +40,29 @@ inline bool operator<(const TrueTypeFontKey &ttfkLeft, const TrueTypeFontKey &tt
 }
 
 typedef struct {
+    int char_index;         // -1 marks an empty slot in the glyph index
+    int advance;            // in pixels
+    int left;
+    int top;
+    int width;
+    int rows;
+    int page;               // atlas page holding the bitmap
+    int atlas_x;
+    int atlas_y;
     FT_BBox bbox;
-    FT_BitmapGlyph glyph;
 } TrueTypeCacheEntry;
 
+// Rendered glyphs of a font are packed into A8 pages in rows ("shelves")
+// as they are first used, instead of one FreeType bitmap per glyph.
+typedef struct {
+    uint8_t *data;
+    int width;
+    int height;
+    int shelf_x;            // next free column in the current shelf
+    int shelf_y;            // top of the current shelf
+    int shelf_h;            // height of the tallest glyph in the current shelf
+} TrueTypeAtlasPage;
+
 typedef struct StringCacheKey {
     int max_width;
     std::string text;
@@ -52,8 +74,11 @@ inline bool operator<(const StringCacheKey &sckLeft, const StringCacheKey &sckRi
 
 typedef struct StringCacheEntry {
     GGLSurface surface;
+    GGLSurface rotated;     // surface turned for gr_rotation, made on first draw
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
+    size_t bytes;           // memory used by both surfaces
     StringCacheKey *key;
+    std::list<struct StringCacheEntry*>::iterator lru;
 } StringCacheEntry;
 
 typedef struct {
@@ -64,8 +89,14 @@ typedef struct {
     int max_height;
     int base;
     FT_Face face;
-    std::map<int, TrueTypeCacheEntry*> glyph_cache;
+    TrueTypeCacheEntry *glyph_index;        // open addressed on char_index, power of two sized
+    int glyph_index_size;
+    int glyph_count;
+    std::vector<TrueTypeAtlasPage> atlas;
+    std::unordered_map<uint64_t, int> kerning_cache; // (left << 32 | right) glyph pair to pixels
     std::map<StringCacheKey, StringCacheEntry*> string_cache;
+    std::list<StringCacheEntry*> string_lru; // most recently used first
+    size_t string_cache_bytes;
     pthread_mutex_t mutex;
     TrueTypeFontKey *key;
 } TrueTypeFont;
@@ -77,7 +108,6 @@ typedef struct {
 } FontData;
 
 typedef std::map<StringCacheKey, StringCacheEntry*> StringCacheMap;
-typedef std::map<int, TrueTypeCacheEntry*> TrueTypeCacheEntryMap;
 typedef std::map<TrueTypeFontKey, TrueTypeFont*> TrueTypeFontMap;
 
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
@@ -89,7 +119,9 @@ static const uint32_t FNV_prime = 16777619U;
 static const uint32_t offset_basis = 2166136261U;
 
 #define STRING_CACHE_MAX_ENTRIES 400
-#define STRING_CACHE_TRUNCATE_ENTRIES 150
+#define STRING_CACHE_MAX_BYTES (4 * 1024 * 1024)
+#define GLYPH_INDEX_INITIAL_SIZE 256
+#define GLYPH_ATLAS_PAGE_SIZE 512
 
 class twrpTruetype {
 public:
@@ -100,11 +132,14 @@ public:
     static void gr_ttf_freeStringCache(void *key, void *value, void *context __unused);
     static void gr_ttf_freeFont(void *font);
     static TrueTypeCacheEntry* gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_index);
-    static TrueTypeCacheEntry* gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index);
-    static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base);
+    static TrueTypeCacheEntry* gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index); // valid until the next get
+    static void gr_ttf_glyph_index_grow(TrueTypeFont *font);
+    static bool gr_ttf_atlas_alloc(TrueTypeFont *font, int width, int rows, TrueTypeCacheEntry *ent);
+    static int gr_ttf_get_kerning(TrueTypeFont *font, int prev_index, int char_index);
+    static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, TrueTypeFont *font, const TrueTypeCacheEntry *ent, int offX, int offY, int base);
     static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f);
     static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const std::string text, int max_width);
-    static StringCacheEntry* gr_ttf_string_cache_peek(TrueTypeFont *font, const std::string text, __attribute__((unused)) int max_width);
+    static StringCacheEntry* gr_ttf_string_cache_peek(TrueTypeFont *font, const std::string text, int max_width);
     static StringCacheEntry* gr_ttf_string_cache_get(TrueTypeFont *font, const std::string text, int max_width);
     static int gr_ttf_measureEx(const char *s, void *font);
     static int gr_ttf_maxExW(const char *s, void *font, int max_width);
@@ -132,6 +132,12 @@ void* twrpTruetype::gr_ttf_loadFont(const char *filename, int size, int dpi) {
 	res->max_height = -1;
 	res->base = -1;
 	res->refcount = 1;
+	res->glyph_index_size = GLYPH_INDEX_INITIAL_SIZE;
+	res->glyph_count = 0;
+	res->glyph_index = new TrueTypeCacheEntry[res->glyph_index_size];
+	for (int i = 0; i < res->glyph_index_size; ++i)
+		res->glyph_index[i].char_index = -1;
+	res->string_cache_bytes = 0;
 
 	pthread_mutex_init(&res->mutex, 0);
 
@@ -162,20 +168,13 @@ void* twrpTruetype::gr_ttf_scaleFont(void *font, int max_width, int measured_wid
 	return gr_ttf_loadFont(file, new_size, dpi);
 }
 
-static bool gr_ttf_freeFontCache(void *value, void *context __unused)
-{
-	TrueTypeCacheEntry *e = (TrueTypeCacheEntry *)value;
-	FT_Done_Glyph((FT_Glyph)e->glyph);
-	delete e;
-	return true;
-}
-
 void twrpTruetype::gr_ttf_freeStringCache(void *key, void *value, void *context __unused) {
 	StringCacheKey *k = (StringCacheKey *)key;
 	delete k;
 
 	StringCacheEntry *e = (StringCacheEntry *)value;
 	free(e->surface.data);
+	free(e->rotated.data);
 	delete e;
 }
 
@@ -194,12 +193,11 @@ void twrpTruetype::gr_ttf_freeFont(void *font) {
 			gr_ttf_freeStringCache(stringCacheEntryIt->second->key, stringCacheEntryIt->second, nullptr);
 			stringCacheEntryIt = d->string_cache.erase(stringCacheEntryIt);
 		}
+		d->string_lru.clear();
 
-		TrueTypeCacheEntryMap::iterator ttcIt = d->glyph_cache.begin();
-		while(ttcIt != d->glyph_cache.end()) {
-			gr_ttf_freeFontCache(ttcIt->second, nullptr);
-			ttcIt = d->glyph_cache.erase(ttcIt);
-		}
+		for (size_t i = 0; i < d->atlas.size(); ++i)
+			free(d->atlas[i].data);
+		delete [] d->glyph_index;
 
 		pthread_mutex_destroy(&d->mutex);
 
@@ -212,69 +210,182 @@ void twrpTruetype::gr_ttf_freeFont(void *font) {
 	pthread_mutex_unlock(&font_data.mutex);
 }
 
+static inline unsigned int glyph_slot(int char_index, int size) {
+	return ((unsigned int)char_index * 2654435761U) & (size - 1);
+}
+
 TrueTypeCacheEntry* twrpTruetype::gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_index) {
-	TrueTypeCacheEntryMap::iterator glyphCacheItr = font->glyph_cache.find(char_index);
+	unsigned int slot = glyph_slot(char_index, font->glyph_index_size);
 
-	if(glyphCacheItr != font->glyph_cache.end()) {
-		return font->glyph_cache[char_index];
+	while (font->glyph_index[slot].char_index != -1) {
+		if (font->glyph_index[slot].char_index == char_index)
+			return &font->glyph_index[slot];
+		slot = (slot + 1) & (font->glyph_index_size - 1);
 	}
 	return nullptr;
 }
 
-TrueTypeCacheEntry* twrpTruetype::gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index) {
-	TrueTypeCacheEntryMap::iterator glyphCacheItr = font->glyph_cache.find(char_index);
-	TrueTypeCacheEntry* res = nullptr;
-	if(glyphCacheItr == font->glyph_cache.end())
-	{
-		int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
-		if(error)
-		{
-			fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
-			return nullptr;
-		}
+void twrpTruetype::gr_ttf_glyph_index_grow(TrueTypeFont *font) {
+	TrueTypeCacheEntry *old_index = font->glyph_index;
+	int old_size = font->glyph_index_size;
 
-		FT_BitmapGlyph glyph;
-		error = FT_Get_Glyph(font->face->glyph, (FT_Glyph*)&glyph);
-		if(error)
-		{
-			fprintf(stderr, "Failed to copy glyph %d: %d\n", char_index, error);
-			return nullptr;
-		}
+	font->glyph_index_size = old_size * 2;
+	font->glyph_index = new TrueTypeCacheEntry[font->glyph_index_size];
+	for (int i = 0; i < font->glyph_index_size; ++i)
+		font->glyph_index[i].char_index = -1;
 
-		res = new TrueTypeCacheEntry;
-		res->glyph = glyph;
-		FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
-		font->glyph_cache[char_index] = res;
+	for (int i = 0; i < old_size; ++i) {
+		if (old_index[i].char_index == -1)
+			continue;
+		unsigned int slot = glyph_slot(old_index[i].char_index, font->glyph_index_size);
+		while (font->glyph_index[slot].char_index != -1)
+			slot = (slot + 1) & (font->glyph_index_size - 1);
+		font->glyph_index[slot] = old_index[i];
 	}
-	else {
-		res = glyphCacheItr->second;
+	delete [] old_index;
+}
+
+// Finds room for a width x rows bitmap in the last atlas page, starting a
+// new shelf or a new page when it is full.
+bool twrpTruetype::gr_ttf_atlas_alloc(TrueTypeFont *font, int width, int rows, TrueTypeCacheEntry *ent) {
+	TrueTypeAtlasPage *page = font->atlas.empty() ? nullptr : &font->atlas.back();
+
+	if (page && page->shelf_x + width > page->width) {
+		page->shelf_y += page->shelf_h;
+		page->shelf_x = 0;
+		page->shelf_h = 0;
+	}
+	if (!page || page->shelf_x + width > page->width || page->shelf_y + rows > page->height) {
+		TrueTypeAtlasPage new_page;
+		new_page.width = MAX(GLYPH_ATLAS_PAGE_SIZE, width);
+		new_page.height = MAX(GLYPH_ATLAS_PAGE_SIZE, rows);
+		new_page.data = (uint8_t *)calloc(new_page.width * new_page.height, 1);
+		if (!new_page.data)
+			return false;
+		new_page.shelf_x = new_page.shelf_y = new_page.shelf_h = 0;
+		font->atlas.push_back(new_page);
+		page = &font->atlas.back();
 	}
 
-	return res;
+	ent->page = font->atlas.size() - 1;
+	ent->atlas_x = page->shelf_x;
+	ent->atlas_y = page->shelf_y;
+	page->shelf_x += width;
+	page->shelf_h = MAX(page->shelf_h, rows);
+	return true;
 }
 
-int twrpTruetype::gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base) {
-	unsigned y;
-	uint8_t *src_itr = glyph->bitmap.buffer;
-	uint8_t *dest_itr = dest->data;
+TrueTypeCacheEntry* twrpTruetype::gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index) {
+	TrueTypeCacheEntry *res = gr_ttf_glyph_cache_peek(font, char_index);
+	TrueTypeCacheEntry ent;
+
+	if (res)
+		return res;
 
-	if(glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY)
+	int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
+	if(error)
 	{
-		fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-		return -1;
+		fprintf(stderr, "Failed to load glyph idx %d: %d\n", char_index, error);
+		return nullptr;
+	}
+
+	FT_GlyphSlot slot = font->face->glyph;
+	if(slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY && slot->bitmap.rows > 0)
+	{
+		fprintf(stderr, "Unsupported pixel mode in glyph %d: %d\n", char_index, slot->bitmap.pixel_mode);
+		return nullptr;
+	}
+
+	ent.char_index = char_index;
+	ent.advance = slot->advance.x >> 6;
+	ent.left = slot->bitmap_left;
+	ent.top = slot->bitmap_top;
+	ent.width = slot->bitmap.width;
+	ent.rows = slot->bitmap.rows;
+	ent.page = -1;
+	ent.atlas_x = ent.atlas_y = 0;
+	ent.bbox.xMin = ent.left;
+	ent.bbox.xMax = ent.left + ent.width;
+	ent.bbox.yMin = ent.top - ent.rows;
+	ent.bbox.yMax = ent.top;
+
+	if (ent.width > 0 && ent.rows > 0) {
+		if (!gr_ttf_atlas_alloc(font, ent.width, ent.rows, &ent)) {
+			fprintf(stderr, "Failed to allocate glyph atlas page for glyph %d\n", char_index);
+			return nullptr;
+		}
+		TrueTypeAtlasPage *page = &font->atlas[ent.page];
+		uint8_t *src_itr = slot->bitmap.buffer;
+		uint8_t *dest_itr = page->data + ent.atlas_y * page->width + ent.atlas_x;
+		for (int y = 0; y < ent.rows; ++y) {
+			memcpy(dest_itr, src_itr, ent.width);
+			src_itr += slot->bitmap.pitch;
+			dest_itr += page->width;
+		}
 	}
 
-	dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
+	// keep the index at most 3/4 full so probe chains stay short
+	if ((font->glyph_count + 1) * 4 > font->glyph_index_size * 3)
+		gr_ttf_glyph_index_grow(font);
+
+	unsigned int i = glyph_slot(char_index, font->glyph_index_size);
+	while (font->glyph_index[i].char_index != -1)
+		i = (i + 1) & (font->glyph_index_size - 1);
+	font->glyph_index[i] = ent;
+	++font->glyph_count;
+	return &font->glyph_index[i];
+}
+
+int twrpTruetype::gr_ttf_get_kerning(TrueTypeFont *font, int prev_index, int char_index) {
+	if(!FT_HAS_KERNING(font->face) || !prev_index || !char_index)
+		return 0;
 
-	// FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-	// the result might end up being before the buffer - I'm not sure how to properly handle this.
-	if(dest_itr < dest->data)
-		dest_itr = dest->data;
+	uint64_t pair = ((uint64_t)(unsigned int)prev_index << 32) | (unsigned int)char_index;
+	std::unordered_map<uint64_t, int>::iterator kernIt = font->kerning_cache.find(pair);
+	if (kernIt != font->kerning_cache.end())
+		return kernIt->second;
 
-	for(y = 0; y < glyph->bitmap.rows; ++y)
+	FT_Vector delta;
+	int kerning = 0;
+	if (FT_Get_Kerning(font->face, prev_index, char_index, FT_KERNING_DEFAULT, &delta) == 0)
+		kerning = delta.x >> 6;
+	font->kerning_cache[pair] = kerning;
+	return kerning;
+}
+
+int twrpTruetype::gr_ttf_copy_glyph_to_surface(GGLSurface *dest, TrueTypeFont *font, const TrueTypeCacheEntry *ent, int offX, int offY, int base) {
+	if (ent->page < 0)
+		return 0;
+
+	const TrueTypeAtlasPage *page = &font->atlas[ent->page];
+	int dest_x = offX + ent->left;
+	int dest_y = offY + base - ent->top;
+	int src_x = 0, src_y = 0;
+	int width = ent->width, rows = ent->rows;
+
+	// glyphs reaching past the string surface (e.g. a negative left bearing
+	// on the first letter) are clipped to it
+	if (dest_x < 0) {
+		src_x = -dest_x;
+		width += dest_x;
+		dest_x = 0;
+	}
+	if (dest_y < 0) {
+		src_y = -dest_y;
+		rows += dest_y;
+		dest_y = 0;
+	}
+	width = MIN(width, (int)dest->width - dest_x);
+	rows = MIN(rows, (int)dest->height - dest_y);
+	if (width <= 0 || rows <= 0)
+		return 0;
+
+	const uint8_t *src_itr = page->data + (ent->atlas_y + src_y) * page->width + ent->atlas_x + src_x;
+	uint8_t *dest_itr = dest->data + dest_y * dest->stride + dest_x;
+	for (int y = 0; y < rows; ++y)
 	{
-		memcpy(dest_itr, src_itr, glyph->bitmap.width);
-		src_itr += glyph->bitmap.pitch;
+		memcpy(dest_itr, src_itr, width);
+		src_itr += page->width;
 		dest_itr += dest->stride;
 	}
 	return 0;
@@ -338,16 +449,17 @@ int twrpTruetype::gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, co
 	int bytes_rendered = 0, total_w = 0;
 	int utf_bytes = 0;
 	unsigned int unicode = 0;
-	int i, x, diff, char_idx, prev_idx = 0;
+	int kerning, diff, char_idx, prev_idx = 0;
 	int height;
-	FT_Vector delta;
 	uint8_t *data = NULL;
 	const char *text_itr = text.c_str();
-	int *char_idxs;
-	int char_idxs_len = 0;
+	std::vector<int> char_idxs;
+	std::vector<int> char_xs;
 
-	char_idxs = new int[text.length()];
+	char_idxs.reserve(text.length());
+	char_xs.reserve(text.length());
 
+	// Lay the glyphs out once, the copy pass below reuses the positions
 	while(*text_itr)
 	{
 		utf_bytes = utf8_to_unicode(text_itr, &unicode);
@@ -355,41 +467,32 @@ int twrpTruetype::gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, co
 		bytes_rendered += utf_bytes;
 
 		char_idx = FT_Get_Char_Index(f->face, unicode);
-		char_idxs[char_idxs_len] = char_idx;
+		kerning = 0;
 		ent = gr_ttf_glyph_cache_get(f, char_idx);
 		if(ent)
 		{
-			diff = ent->glyph->root.advance.x >> 16;
-
-			if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-			{
-				FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-				diff += delta.x >> 6;
-			}
+			kerning = gr_ttf_get_kerning(f, prev_idx, char_idx);
+			diff = ent->advance + kerning;
 
 			if(max_width != -1 && total_w + diff > max_width)
 				break;
-
-			total_w += diff;
 		}
+		char_idxs.push_back(char_idx);
+		char_xs.push_back(total_w + kerning);
+		if(ent)
+			total_w += diff;
 		prev_idx = char_idx;
-		++char_idxs_len;
 	}
 
 	if(font->max_height == -1)
 		gr_ttf_calcMaxFontHeight(font);
 
 	if(font->max_height == -1)
-	{
-		delete [] char_idxs;
 		return -1;
-	}
 
 	height = font->max_height;
 
-	data = (uint8_t *)malloc(total_w*height);
-    memset(data, 0, total_w*height);	x = 0;
-	prev_idx = 0;
+	data = (uint8_t *)calloc(total_w*height, 1);
 
 	surface->version = sizeof(*surface);
 	surface->width = total_w;
@@ -398,89 +501,72 @@ int twrpTruetype::gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, co
 	surface->data = (GGLubyte*)data;
 	surface->format = GGL_PIXEL_FORMAT_A_8;
 
-	for(i = 0; i < char_idxs_len; ++i)
+	for(size_t i = 0; i < char_idxs.size(); ++i)
 	{
-		char_idx = char_idxs[i];
-		if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-		{
-			FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-			x += delta.x >> 6;
-		}
-
-		ent = gr_ttf_glyph_cache_get(f, char_idx);
-		if(ent)
-		{
-			gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-			x += ent->glyph->root.advance.x >> 16;
-		}
-
-		prev_idx = char_idx;
+		ent = gr_ttf_glyph_cache_peek(f, char_idxs[i]);
+		if(ent && data)
+			gr_ttf_copy_glyph_to_surface(surface, f, ent, char_xs[i], 0, font->base);
 	}
 
-	delete [] char_idxs;
 	return bytes_rendered;
 }
 
-StringCacheEntry* twrpTruetype::gr_ttf_string_cache_peek(TrueTypeFont *font, 
-	const std::string text, 
-	__attribute__((unused)) int max_width) {
+StringCacheEntry* twrpTruetype::gr_ttf_string_cache_peek(TrueTypeFont *font,
+	const std::string text,
+	int max_width) {
 		StringCacheKey k = {
-			.text = text,
-			.max_width = max_width
+			.max_width = max_width,
+			.text = text
 		};
 		StringCacheMap::iterator stringCacheItr = font->string_cache.find(k);
 		if (stringCacheItr != font->string_cache.end()) {
-			return stringCacheItr->second;
+			StringCacheEntry *e = stringCacheItr->second;
+			font->string_lru.splice(font->string_lru.begin(), font->string_lru, e->lru);
+			return e;
 		}
 		else {
 			return nullptr;
 		}
 }
 
+// Drops the least recently used strings until the cache is back under its
+// entry and memory limits. The most recent entry is always kept.
 void twrpTruetype::gr_ttf_string_cache_truncate(TrueTypeFont *font) {
-	StringCacheMap::iterator stringCacheItr;
-
-	if (font->string_cache.size() == STRING_CACHE_MAX_ENTRIES) {
-		StringCacheEntry *truncateEntry = nullptr;
-		stringCacheItr = font->string_cache.begin();
-		int deleteCtr = 0;
-		while (stringCacheItr != font->string_cache.end() || deleteCtr == (STRING_CACHE_MAX_ENTRIES - 1)) {
-			truncateEntry = stringCacheItr->second;
-			gr_ttf_freeStringCache(truncateEntry->key, truncateEntry, nullptr);
-			stringCacheItr = font->string_cache.erase(stringCacheItr);
-			deleteCtr++;
-		}
+	while (font->string_lru.size() > 1 &&
+			(font->string_lru.size() > STRING_CACHE_MAX_ENTRIES || font->string_cache_bytes > STRING_CACHE_MAX_BYTES)) {
+		StringCacheEntry *truncateEntry = font->string_lru.back();
+		font->string_lru.pop_back();
+		font->string_cache.erase(*truncateEntry->key);
+		font->string_cache_bytes -= truncateEntry->bytes;
+		gr_ttf_freeStringCache(truncateEntry->key, truncateEntry, nullptr);
 	}
 }
 
 StringCacheEntry* twrpTruetype::gr_ttf_string_cache_get(TrueTypeFont *font, const std::string text, int max_width) {
-	StringCacheEntry *res = nullptr;
-	StringCacheMap::iterator stringCacheItr;
+	StringCacheEntry *res = gr_ttf_string_cache_peek(font, text, max_width);
 
-	StringCacheKey k = {
-		.text = text,
-		.max_width = max_width
-	};
+	if (res)
+		return res;
 
-	stringCacheItr = font->string_cache.find(k);
-	if (stringCacheItr == font->string_cache.end()) {
-		res = new StringCacheEntry;
-		res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
-		if(res->rendered_bytes < 0) {
-			delete res;
-			return nullptr;
-		}
-
-		StringCacheKey *new_key = new StringCacheKey;
-		new_key->max_width = max_width;
-		new_key->text = text;
-		res->key = new_key;
-		font->string_cache[*new_key] = res; 
-	}
-	else
-	{
-		res = stringCacheItr->second;
+	res = new StringCacheEntry;
+	memset(&res->rotated, 0, sizeof(res->rotated));
+	res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+	if(res->rendered_bytes < 0) {
+		delete res;
+		return nullptr;
 	}
+	res->bytes = res->surface.stride * res->surface.height;
+
+	StringCacheKey *new_key = new StringCacheKey;
+	new_key->max_width = max_width;
+	new_key->text = text;
+	res->key = new_key;
+	font->string_cache[*new_key] = res;
+	font->string_lru.push_front(res);
+	res->lru = font->string_lru.begin();
+	font->string_cache_bytes += res->bytes;
+
+	gr_ttf_string_cache_truncate(font);
 	return res;
 }
 
@@ -489,7 +575,6 @@ int twrpTruetype::gr_ttf_measureEx(const char *s, void *font) {
 	int res = -1;
 
 	pthread_mutex_lock(&f->mutex);
-	gr_ttf_string_cache_truncate(f);
 	StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
 	if(e)
 		res = e->surface.width;
@@ -505,7 +590,6 @@ int twrpTruetype::gr_ttf_maxExW(const char *s, void *font, int max_width) {
 	int utf_bytes, prev_utf_bytes = 0;
 	unsigned int unicode = 0;
 	int char_idx, prev_idx = 0;
-	FT_Vector delta;
 	StringCacheEntry *e;
 
 	pthread_mutex_lock(&f->mutex);
@@ -522,11 +606,7 @@ int twrpTruetype::gr_ttf_maxExW(const char *s, void *font, int max_width) {
 		s += utf_bytes;
 
 		char_idx = FT_Get_Char_Index(f->face, unicode);
-		if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-		{
-			FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-			total_w += delta.x >> 6;
-		}
+		total_w += gr_ttf_get_kerning(f, prev_idx, char_idx);
 		prev_idx = char_idx;
 
 		if(total_w > max_width)
@@ -539,7 +619,7 @@ int twrpTruetype::gr_ttf_maxExW(const char *s, void *font, int max_width) {
 		if(!ent)
 			continue;
 
-		total_w += ent->glyph->root.advance.x >> 16;
+		total_w += ent->advance;
 		max_bytes += utf_bytes;
 	}
 	pthread_mutex_unlock(&f->mutex);
@@ -570,19 +650,26 @@ int twrpTruetype::gr_ttf_textExWH(void *context, int x, int y,
 		return -1;
 	}
 
-	GGLSurface string_surface_rotated;
-	if (gr_rotation != 0) {
-		// Do not perform relatively expensive operation if not needed
-		string_surface_rotated.version = sizeof(string_surface_rotated);
+	GGLSurface *string_surface_rotated = &e->rotated;
+	if (gr_rotation != 0 && !string_surface_rotated->data) {
+		// Do not perform relatively expensive operation if not needed,
+		// the turned surface is kept with the string until it is evicted
+		string_surface_rotated->version = sizeof(*string_surface_rotated);
 		// Skip the **(gr_rotation == 0)** || (gr_rotation == 180) check
 		// because we are under a gr_rotation != 0 conditional compilation statement
-		string_surface_rotated.width   = (gr_rotation == 180) ? e->surface.width  : e->surface.height;
-		string_surface_rotated.height  = (gr_rotation == 180) ? e->surface.height : e->surface.width;
-		string_surface_rotated.stride  = string_surface_rotated.width;
-		string_surface_rotated.format  = e->surface.format;
+		string_surface_rotated->width   = (gr_rotation == 180) ? e->surface.width  : e->surface.height;
+		string_surface_rotated->height  = (gr_rotation == 180) ? e->surface.height : e->surface.width;
+		string_surface_rotated->stride  = string_surface_rotated->width;
+		string_surface_rotated->format  = e->surface.format;
 		// e->surface.format is GGL_PIXEL_FORMAT_A_8 (grayscale)
-		string_surface_rotated.data    = (GGLubyte*) malloc(string_surface_rotated.stride * string_surface_rotated.height * 1);
-		surface_ROTATION_transform((gr_surface) &string_surface_rotated, (const gr_surface) &e->surface, 1);
+		string_surface_rotated->data    = (GGLubyte*) malloc(string_surface_rotated->stride * string_surface_rotated->height * 1);
+		if (!string_surface_rotated->data && e->surface.width * e->surface.height > 0) {
+			pthread_mutex_unlock(&font->mutex);
+			return -1;
+		}
+		surface_ROTATION_transform((gr_surface) string_surface_rotated, (const gr_surface) &e->surface, 1);
+		e->bytes += string_surface_rotated->stride * string_surface_rotated->height;
+		font->string_cache_bytes += string_surface_rotated->stride * string_surface_rotated->height;
 	}
 
 	int y_bottom = y + e->surface.height;
@@ -613,24 +700,21 @@ int twrpTruetype::gr_ttf_textExWH(void *context, int x, int y,
 	t_disp = std::min(y0_disp, y1_disp);
 	b_disp = std::max(y0_disp, y1_disp);
 
-	if (gr_rotation != 0) {
-		gl->bindTexture(gl, &string_surface_rotated);
-	} else {
-		gl->bindTexture(gl, &e->surface);
-	}
-	gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
-	gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-	gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+	GGLSurface *texture = (gr_rotation != 0) ? string_surface_rotated : &e->surface;
 
-	gl->enable(gl, GGL_TEXTURE_2D);
-	gl->texCoord2i(gl, -l_disp, -t_disp);
-	gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
-	gl->disable(gl, GGL_TEXTURE_2D);
+	if (!gr_blit_mask((gr_surface) texture, -l_disp, -t_disp, l_disp, t_disp, r_disp, b_disp)) {
+		gl->bindTexture(gl, texture);
+		gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+		gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+		gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
 
-	if (gr_rotation != 0)
-		free(string_surface_rotated.data);
+		gl->enable(gl, GGL_TEXTURE_2D);
+		gl->texCoord2i(gl, -l_disp, -t_disp);
+		gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
+		gl->disable(gl, GGL_TEXTURE_2D);
+	}
 
-	pthread_mutex_unlock(&font->mutex);;
+	pthread_mutex_unlock(&font->mutex);
 	return res;
 }
 
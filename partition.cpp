@@ -44,6 +44,11 @@
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "twrpTar.hpp"
+#include "twrpDigestDriver.hpp"
+#include "twrpImageCopy.hpp"
+#include "twrpFileManifest.hpp"
+#include "twrpSizeCache.hpp"
+#include "twrpChunkStore.hpp"
 #include "exclude.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
@@ -2489,7 +2494,10 @@ bool TWPartition::Wipe_RMRF() {
 		PartitionManager.Remove_MTP_Storage(MTP_Storage_ID);
 
 	gui_msg(Msg("remove_all=Removing all files under '{1}'")(Mount_Point));
-	TWFunc::removeDir(Mount_Point, true);
+	TWFunc::removeDir(Mount_Point, true, [](uint64_t removed) {
+		gui_msg(Msg("remove_progress=Removed {1} files and folders...")(removed));
+		return true;
+	});
 	Recreate_AndSec_Folder();
 	return true;
 }
@@ -2613,40 +2621,17 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 #endif // ifdef TW_OEM_BUILD
 }
 
-bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent __unused) {
-	string dir;
-
-	DIR* d;
-	d = opendir(parent.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)	 continue;
-
-			dir = parent;
-			dir.append(de->d_name);
-			if (wipe_exclusions.check_skip_dirs(dir)) {
-				LOGINFO("skipped '%s'\n", dir.c_str());
-				continue;
-			}
-			if (de->d_type == DT_DIR) {
-				dir.append("/");
-				if (!Wipe_Data_Without_Wiping_Media_Func(dir)) {
-					closedir(d);
-					return false;
-				}
-				rmdir(dir.c_str());
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (unlink(dir.c_str()) != 0)
-					LOGINFO("Unable to unlink '%s': %s\n", dir.c_str(), strerror(errno));
-			}
-		}
-		closedir(d);
-
-		return true;
+bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent) {
+	if (!TWFunc::Path_Exists(parent)) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
+		return false;
 	}
-	gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
-	return false;
+	// Entries that cannot be removed are logged and left behind, they do not fail the wipe
+	TWFunc::removeDir(parent, true, [](uint64_t removed) {
+		gui_msg(Msg("remove_progress=Removed {1} files and folders...")(removed));
+		return true;
+	}, &wipe_exclusions);
+	return true;
 }
 
 void TWPartition::Wipe_Crypto_Key() {
@@ -2749,6 +2734,22 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	tar.setsize(Backup_Size);
 	tar.partition_name = Backup_Name;
 	tar.backup_folder = part_settings->Backup_Folder;
+	// Encrypted backups never get a manifest, it would list their contents in plain text
+	if (DataManager::GetIntValue(TW_INCREMENTAL_BACKUP_VAR) && !part_settings->adbbackup && !tar.use_encryption) {
+		tar.write_manifest = true;
+		tar.incremental_base = Find_Incremental_Base(part_settings->Backup_Folder);
+		if (!tar.incremental_base.empty()) {
+			// Restore_Tar refuses broken or overlong chains, so do not add to one
+			vector<string> chain;
+			if (!Get_Backup_Chain(tar.incremental_base, chain) || chain.size() >= MAX_INCREMENTAL_CHAIN - 1) {
+				gui_msg(Msg(msg::kWarning, "incremental_chain_full=Backing up all of {1} because the incremental backups leading to '{2}' are incomplete or too many.")(Backup_Display_Name)(TWFunc::Get_Filename(tar.incremental_base)));
+				tar.incremental_base.clear();
+			} else
+				gui_msg(Msg("incremental_backup=Backing up changes to {1} since backup '{2}'")(Backup_Display_Name)(TWFunc::Get_Filename(tar.incremental_base)));
+		}
+	}
+	if (DataManager::GetIntValue(TW_DEDUP_BACKUP_VAR) && !part_settings->adbbackup && !tar.use_encryption)
+		tar.use_chunk_store = true;
 	if (tar.createTarFork(tar_fork_pid) != 0)
 		return false;
 	return true;
@@ -2787,13 +2788,13 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 }
 
 bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
-	unsigned long long RW_Block_Size, Remain = Backup_Size;
-	int src_fd = -1, dest_fd = -1;
-	ssize_t bs;
-	bool ret = false;
-	void* buffer = NULL;
-	unsigned long long backedup_size = 0;
+	unsigned long long Remain = Backup_Size;
+	bool ret = false, copied;
 	string srcfn, destfn;
+	twrpDigestSink *digest_sink = NULL;
+	twrpChunkWriter *chunk_writer = NULL;
+	twrpChunkReader *chunk_reader = NULL;
+	int chunk_fd = -1;
 
 	if (part_settings->PM_Method == PM_BACKUP) {
 		srcfn = Actual_Block_Device;
@@ -2801,6 +2802,16 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 			destfn = TW_ADB_BACKUP;
 		else {
 			destfn = part_settings->Backup_Folder + "/" + Backup_FileName;
+			if (part_settings->generate_digest)
+				digest_sink = new twrpDigestSink(destfn);
+			if (DataManager::GetIntValue(TW_DEDUP_BACKUP_VAR)) {
+				// The image goes to the chunk store and destfn becomes its index
+				chunk_writer = new twrpChunkWriter(destfn);
+				chunk_writer->digest = digest_sink;
+				chunk_fd = chunk_writer->Start();
+				if (chunk_fd < 0)
+					goto exit;
+			}
 		}
 	}
 	else {
@@ -2812,77 +2823,55 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 			srcfn = TW_ADB_RESTORE;
 		} else {
 			srcfn = part_settings->Backup_Folder + "/" + Backup_FileName;
-			Remain = TWFunc::Get_File_Size(srcfn);
+			Remain = twrpChunkStore::Get_Stream_Size(srcfn);
+			if (twrpChunkStore::Is_Index(srcfn)) {
+				chunk_reader = new twrpChunkReader(srcfn);
+				chunk_fd = chunk_reader->Start();
+				if (chunk_fd < 0)
+					goto exit;
+			}
 		}
 	}
 
-	src_fd = open(srcfn.c_str(), O_RDONLY | O_LARGEFILE);
-	if (src_fd < 0) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(srcfn.c_str())(strerror(errno)));
-		return false;
-	}
-
-	dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
-	if (dest_fd < 0) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destfn.c_str())(strerror(errno)));
-		goto exit;
-	}
-
-	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
-
-	if (part_settings->adbbackup) {
-		RW_Block_Size = MAX_ADB_READ;
-		bs = MAX_ADB_READ;
-	}
-	else {
-		RW_Block_Size = 1048576LLU; // 1MB
-		bs = (ssize_t)(RW_Block_Size);
-	}
-
-	buffer = malloc((size_t)bs);
-	if (!buffer) {
-		LOGINFO("Raw_Read_Write failed to malloc\n");
-		goto exit;
-	}
-
 	if (part_settings->progress)
 		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
 
-	while (Remain > 0) {
-		if (Remain < RW_Block_Size)
-			bs = (ssize_t)(Remain);
-		if (read(src_fd, buffer, bs) != bs) {
-			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
-			goto exit;
-		}
-		if (write(dest_fd, buffer, bs) != bs) {
-			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
-			goto exit;
-		}
-		backedup_size += (unsigned long long)(bs);
-		Remain -= (unsigned long long)(bs);
-		if (part_settings->progress)
-			part_settings->progress->UpdateSize(backedup_size);
-		if (PartitionManager.Check_Backup_Cancel() != 0)
-			goto exit;
-	}
+	{
+		// Destroyed before the chunk store is finished so the stream is closed
+		twrpImageCopy image_copy(srcfn, destfn);
+		image_copy.digest = chunk_writer ? NULL : digest_sink;
+		image_copy.progress = part_settings->progress;
+		if (chunk_writer)
+			image_copy.Set_Destination_Fd(chunk_fd);
+		else if (chunk_reader)
+			image_copy.Set_Source_Fd(chunk_fd);
+		chunk_fd = -1;
+		copied = image_copy.Copy(Remain);
+	}
+	if (!copied)
+		goto exit;
+	if (chunk_writer && !chunk_writer->Finish())
+		goto exit;
+	if (chunk_reader && !chunk_reader->Finish())
+		goto exit;
 	if (part_settings->progress)
 		part_settings->progress->UpdateDisplayDetails(true);
-	fsync(dest_fd);
 
 	if (!part_settings->adbbackup && part_settings->PM_Method == PM_BACKUP) {
 		tw_set_default_metadata(destfn.c_str());
 		LOGINFO("Restored default metadata for %s\n", destfn.c_str());
 	}
 
+	if (digest_sink && !digest_sink->finish())
+		goto exit;
+
 	ret = true;
 exit:
-	if (src_fd >= 0)
-		close(src_fd);
-	if (dest_fd >= 0)
-		close(dest_fd);
-	if (buffer)
-		free(buffer);
+	if (chunk_fd >= 0)
+		close(chunk_fd);
+	delete chunk_writer;
+	delete chunk_reader;
+	delete digest_sink;
 	return ret;
 }
 
@@ -2914,11 +2903,100 @@ bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
 	return true;
 }
 
+// Returns the most recent other backup in the same backups folder that saved
+// a manifest of this partition, or an empty string when there is none.
+string TWPartition::Find_Incremental_Base(const string& Backup_Folder) {
+	string folder = TWFunc::Remove_Trailing_Slashes(Backup_Folder);
+	string backups = TWFunc::Get_Path(folder), current = TWFunc::Get_Filename(folder), base, path;
+	struct dirent *de;
+	struct stat st;
+	time_t newest = 0;
+	DIR *d;
+
+	d = opendir(backups.c_str());
+	if (d == NULL)
+		return "";
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' || current == de->d_name)
+			continue;
+		path = backups + de->d_name;
+		if (stat((path + "/" + Backup_Name + ".manifest").c_str(), &st) != 0 || !TWFunc::Path_Exists(path + "/" + Backup_Name + ".info"))
+			continue;
+		if (base.empty() || st.st_mtime > newest) {
+			base = path;
+			newest = st.st_mtime;
+		}
+	}
+	closedir(d);
+	return base;
+}
+
+// Fills chain with Backup_Folder followed by the backups it was taken
+// against, ending with the full backup.
+bool TWPartition::Get_Backup_Chain(const string& Backup_Folder, vector<string>& chain) {
+	string folder = TWFunc::Remove_Trailing_Slashes(Backup_Folder), base;
+
+	chain.clear();
+	while (chain.size() < MAX_INCREMENTAL_CHAIN) {
+		chain.push_back(folder);
+		InfoManager info(folder + "/" + Backup_Name + ".info");
+		if (info.LoadValues() != 0 || info.GetValue("incremental_base", base) != 0 || base.empty())
+			return true;
+		folder = TWFunc::Get_Path(folder) + base;
+		if (!TWFunc::Path_Exists(folder + "/" + Backup_Name + ".info")) {
+			gui_msg(Msg(msg::kError, "incremental_base_missing=Unable to find backup '{1}' that this incremental backup of {2} is based on.")(base)(Backup_Display_Name));
+			return false;
+		}
+	}
+	LOGERR("Incremental backup chain of '%s' is longer than %i backups\n", Backup_Folder.c_str(), MAX_INCREMENTAL_CHAIN);
+	return false;
+}
+
+// Removes what existed in the previous backup of the chain but was gone
+// when the incremental backup in Backup_Folder was taken.
+bool TWPartition::Restore_Deletions(const string& Backup_Folder) {
+	string deleted = Backup_Folder + "/" + Backup_Name + ".deleted";
+	twrpFileManifest list;
+	struct stat st;
+
+	if (!TWFunc::Path_Exists(deleted))
+		return true;
+	if (list.Load(deleted) != 0)
+		return false;
+	for (size_t i = 0; i < list.Count(); i++) {
+		const char *path = list.Path(i);
+
+		// Contents of a directory that was removed are listed after it
+		if (lstat(path, &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (TWFunc::removeDir(path, false) != 0)
+				return false;
+		} else if (unlink(path) != 0) {
+			LOGINFO("Unable to unlink '%s': %s\n", path, strerror(errno));
+			return false;
+		}
+	}
+	LOGINFO("Removed %zu items deleted since the previous backup\n", list.Count());
+	return true;
+}
+
 unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_settings) {
 	if (!part_settings->adbbackup) {
-		InfoManager restore_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
-		if (restore_info.LoadValues() == 0) {
-			if (restore_info.GetValue("backup_size", Restore_Size) == 0) {
+		vector<string> chain;
+		unsigned long long size;
+		size_t i;
+
+		// An incremental backup restores every backup it builds on
+		if (Get_Backup_Chain(part_settings->Backup_Folder, chain)) {
+			Restore_Size = 0;
+			for (i = 0; i < chain.size(); i++) {
+				InfoManager restore_info(chain[i] + "/" + Backup_Name + ".info");
+				if (restore_info.LoadValues() != 0 || restore_info.GetValue("backup_size", size) != 0)
+					break;
+				Restore_Size += size;
+			}
+			if (i == chain.size()) {
 				LOGINFO("Read info file, restore size is %llu\n", Restore_Size);
 				return Restore_Size;
 			}
@@ -2929,7 +3007,7 @@ unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_setting
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
 	if (Is_Image(Restore_File_System)) {
-		Restore_Size = TWFunc::Get_File_Size(Full_FileName);
+		Restore_Size = twrpChunkStore::Get_Stream_Size(Full_FileName);
 		return Restore_Size;
 	}
 
@@ -2954,6 +3032,12 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	string Full_FileName;
 	bool ret = false;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
+	vector<string> chain;
+	unsigned long long restored = 0, size;
+	size_t i;
+
+	if (!Get_Backup_Chain(part_settings->Backup_Folder, chain))
+		return false;
 
 	if (Has_Android_Secure) {
 		if (!Wipe_AndSec())
@@ -2976,23 +3060,36 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	if (!ReMount_RW(true))
 		return false;
 
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
-	twrpTar tar;
-	tar.part_settings = part_settings;
-	tar.setdir(Backup_Path);
-	tar.setfn(Full_FileName);
-	tar.backup_name = Backup_Name;
+	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
+	// Start from the full backup and apply each incremental backup on top of it
+	ret = true;
+	for (i = chain.size(); ret && i-- > 0;) {
+		Full_FileName = chain[i] + "/" + Backup_FileName;
+		if (i + 1 < chain.size()) {
+			LOGINFO("Applying incremental backup '%s'\n", chain[i].c_str());
+			if (!Restore_Deletions(chain[i])) {
+				ret = false;
+				break;
+			}
+		}
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(Full_FileName);
+		tar.backup_name = Backup_Name;
+		tar.restore_progress_base = restored;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	string Password;
-	DataManager::GetValue("tw_restore_password", Password);
-	if (!Password.empty())
-		tar.setpassword(Password);
+		string Password;
+		DataManager::GetValue("tw_restore_password", Password);
+		if (!Password.empty())
+			tar.setpassword(Password);
 #endif
-	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
-	if (tar.extractTarFork() != 0)
-		ret = false;
-	else
-		ret = true;
+		if (tar.extractTarFork() != 0)
+			ret = false;
+		InfoManager restore_info(chain[i] + "/" + Backup_Name + ".info");
+		if (restore_info.LoadValues() == 0 && restore_info.GetValue("backup_size", size) == 0)
+			restored += size;
+	}
 #ifdef HAVE_CAPABILITIES
 	// Restore capabilities to the run-as binary
 	if (Mount_Point == PartitionManager.Get_Android_Root_Path() && Mount(true) && TWFunc::Path_Exists("/system/bin/run-as")) {
@@ -3033,7 +3130,7 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 
 	if (Restore_File_System == "emmc") {
 		if (!part_settings->adbbackup)
-			part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
+			part_settings->total_restore_size = (uint64_t)(twrpChunkStore::Get_Stream_Size(Full_FileName));
 		if (!Raw_Read_Write(part_settings))
 			return false;
 	} else if (Restore_File_System == "mtd" || Restore_File_System == "bml") {
@@ -3087,7 +3184,10 @@ bool TWPartition::Update_Size(bool Display_Error) {
 
 	if (Has_Data_Media) {
 		if (Mount(Display_Error)) {
-			Used = backup_exclusions.Get_Folder_Size(Mount_Point);
+			// Shows the data size growing while a changed tree is walked
+			Used = twrpSizeCache::Get_Folder_Size(Mount_Point, &backup_exclusions, [](uint64_t done) {
+				DataManager::SetValue(TW_BACKUP_DATA_SIZE, (int)(done / 1048576LLU));
+			});
 			Backup_Size = Used;
 			int bak = (int)(Used / 1048576LLU);
 			int fre = (int)(Free / 1048576LLU);
@@ -3099,7 +3199,7 @@ bool TWPartition::Update_Size(bool Display_Error) {
 		}
 	} else if (Has_Android_Secure) {
 		if (Mount(Display_Error))
-			Backup_Size = backup_exclusions.Get_Folder_Size(Backup_Path);
+			Backup_Size = twrpSizeCache::Get_Folder_Size(Backup_Path, &backup_exclusions);
 		else {
 			if (!Was_Already_Mounted)
 				UnMount(false);
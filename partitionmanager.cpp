@@ -72,6 +72,8 @@
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
 #include "twrpDigestDriver.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpSizeCache.hpp"
 #include "twrpRepacker.hpp"
 #include "adbbu/libtwadbbu.hpp"
 
@@ -955,7 +957,7 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 		sync();
 		string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
 		if (!part_settings->adbbackup && part_settings->generate_digest) {
-			if (!twrpDigestDriver::Make_Digest(Full_Filename))
+			if (!Backup_Digest(part_settings, Full_Filename))
 				goto backup_error;
 		}
 
@@ -973,7 +975,7 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 					sync();
 					string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
 					if (!part_settings->adbbackup && part_settings->generate_digest) {
-						if (!twrpDigestDriver::Make_Digest(Full_Filename)) {
+						if (!Backup_Digest(part_settings, Full_Filename)) {
 							goto backup_error;
 						}
 					}
@@ -1003,6 +1005,18 @@ backup_error:
 	return false;
 }
 
+bool TWPartitionManager::Backup_Digest(PartitionSettings *part_settings, const string& Full_Filename) {
+	// Tar and image backups hash their files while writing them, so the
+	// files only need to be read back if the user asked for verification
+	if (part_settings->Part->Backup_Method == BM_FLASH_UTILS)
+		return twrpDigestDriver::Make_Digest(Full_Filename);
+	if (!part_settings->verify_digest)
+		return true;
+	TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
+	gui_msg("verifying_digest=Verifying Digest");
+	return twrpDigestDriver::Check_Digest(Full_Filename);
+}
+
 void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	DIR *d = opendir(Backup_Folder.c_str());
 	struct dirent *p;
@@ -1014,6 +1028,8 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	ext.push_back("md5");
 	ext.push_back("sha2");
 	ext.push_back("info");
+	ext.push_back("manifest");
+	ext.push_back("deleted");
 
 	gui_msg("backup_clean=Backup Failed. Cleaning Backup Folder.");
 
@@ -1060,7 +1076,11 @@ int TWPartitionManager::Cancel_Backup() {
 		}
 		LOGINFO("Backup_Run stopped and returning false, backup cancelled.\n");
 		LOGINFO("Removing directory %s\n", Full_Backup_Path.c_str());
-		TWFunc::removeDir(Full_Backup_Path, false);
+		// stop_backup is already set, so progress must not check it
+		TWFunc::removeDir(Full_Backup_Path, false, [](uint64_t removed) {
+			gui_msg(Msg("remove_progress=Removed {1} files and folders...")(removed));
+			return true;
+		});
 		tar_fork_pid = 0;
 	}
 
@@ -1091,6 +1111,8 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	part_settings.adbbackup = adbbackup;
 	time(&total_start);
 
+	// Files that grew in place since the last sizing would be missed
+	twrpSizeCache::Invalidate();
 	Update_System_Details();
 
 	if (!Mount_Current_Storage(true))
@@ -1101,8 +1123,12 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		part_settings.generate_digest = true;
 	else
 		part_settings.generate_digest = false;
+	part_settings.verify_digest = part_settings.generate_digest && DataManager::GetIntValue(TW_VERIFY_DIGEST_AFTER_WRITE_VAR) != 0;
 
 	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, part_settings.Backup_Folder);
+	// Drop chunks that only deleted or failed backups referred to
+	if (!adbbackup && DataManager::GetIntValue(TW_DEDUP_BACKUP_VAR))
+		twrpChunkStore::Collect(part_settings.Backup_Folder);
 	DataManager::GetValue(TW_BACKUP_NAME, Backup_Name);
 	if (Backup_Name == gui_lookup("curr_date", "(Current Date)")) {
 		Backup_Name = TWFunc::Get_Current_Date();
@@ -1270,6 +1296,8 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		DataManager::SetValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
 
 	gui_msg(Msg("total_backed_size=[{1} MB TOTAL BACKED UP]")(actual_backup_size));
+	// The backup just read every file, so a full walk is cheap here
+	twrpSizeCache::Invalidate();
 	Update_System_Details();
 	UnMount_Main_Partitions();
 	gui_msg(Msg(msg::kHighlight, "backup_completed=[BACKUP COMPLETED IN {1} SECONDS]")(total_time)); // the end
@@ -1335,6 +1363,7 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	time_t rStart, rStop;
 	time(&rStart);
 	string Restore_List, restore_path;
+	std::vector<string> digest_files;
 	size_t start_pos = 0, end_pos;
 
 	part_settings.Backup_Folder = Restore_Name;
@@ -1372,14 +1401,19 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					return false;
 				}
 
-				string Full_Filename = part_settings.Backup_Folder + "/" + part_settings.Part->Backup_FileName;
-
 				if (tw_get_default_metadata(Get_Android_Root_Path().c_str()) != 0) {
 					gui_msg(Msg(msg::kWarning, "restore_system_context=Unable to get default context for {1} -- Android may not boot.")(Get_Android_Root_Path()));
 				}
 
-				if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
+				// An incremental backup is restored on top of every backup it
+				// builds on, so all of them are checked before anything is wiped
+				vector<string> chain;
+				if (!part_settings.Part->Get_Backup_Chain(part_settings.Backup_Folder, chain))
 					return false;
+				if (check_digest > 0) {
+					for (size_t i = 0; i < chain.size(); i++)
+						digest_files.push_back(chain[i] + "/" + part_settings.Part->Backup_FileName);
+				}
 				part_settings.partition_count++;
 				part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 				if (part_settings.Part->Has_SubPartition) {
@@ -1389,8 +1423,6 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 						part_settings.Part = *subpart;
 						if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
-							if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-								return false;
 							part_settings.total_restore_size += (*subpart)->Get_Restore_Size(&part_settings);
 						}
 					}
@@ -1408,6 +1440,11 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		return false;
 	}
 
+	// All archives are hashed together so split archives and small partitions
+	// keep every verify thread busy
+	if (check_digest > 0 && !twrpDigestDriver::Check_Digests(digest_files, true))
+		return false;
+
 	gui_msg(Msg("restore_part_count=Restoring {1} partitions...")(part_settings.partition_count));
 	gui_msg(Msg("total_restore_size=Total restore size is {1}MB")(part_settings.total_restore_size / 1048576));
 	DataManager::SetProgress(0.0);
@@ -1802,7 +1839,10 @@ int TWPartitionManager::Wipe_Media_From_Data(void) {
 
 		gui_msg("wiping_datamedia=Wiping internal storage -- /data/media...");
 		Remove_MTP_Storage(dat->MTP_Storage_ID);
-		TWFunc::removeDir("/data/media", false);
+		TWFunc::removeDir("/data/media", false, [](uint64_t removed) {
+			gui_msg(Msg("remove_progress=Removed {1} files and folders...")(removed));
+			return true;
+		});
 		dat->Recreate_Media_Folder();
 		Add_MTP_Storage(dat->MTP_Storage_ID);
 		return true;
@@ -3419,7 +3459,7 @@ void TWPartitionManager::setup_uevent() {
 		LOGERR("Bind failed\n");
 		return;
 	}
-	set_select_fd();
+	gui_fds_changed();
 	Coldboot();
 }
 
@@ -32,6 +32,8 @@
 #include "twrpApex.hpp"
 
 #define MAX_FSTAB_LINE_LENGTH 2048
+#define MAX_INCREMENTAL_CHAIN 64
+#define TAR_MAX_THREAD_IDS 9                // split archives are named <thread ID><00 to 99>
 
 #define REPACK_ORIG_DIR "/tmp/repackorig/"
 #define REPACK_NEW_DIR "/tmp/repacknew/"
@@ -95,6 +97,7 @@ struct PartitionSettings {                                                    //
 	bool adb_compression;                                                     // 0 == uncompressed, 1 == compressed
 	bool generate_digest;                                                     // tell system to create digest for partitions
 	bool generate_md5;                                                        // tell system to create md5 for partitions
+	bool verify_digest;                                                       // re-read each backup file after it is written to check its digest
 	uint64_t total_restore_size;                                              // Total size of restored backup
 	uint64_t img_bytes_remaining;                                             // remaining img/emmc bytes to backup for progress indicator
 	uint64_t file_bytes_remaining;                                            // remaining file bytes to backup for progress indicator
@@ -219,6 +222,9 @@ private:
 	bool Backup_Dump_Image(PartitionSettings *part_settings);                 // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(PartitionSettings *part_settings);         // Returns the file system that was in place at the time of the backup
 	bool Restore_Tar(PartitionSettings *part_settings);                       // Restore using tar for file systems
+	string Find_Incremental_Base(const string& Backup_Folder);                // Finds the newest other backup with a manifest of this partition
+	bool Get_Backup_Chain(const string& Backup_Folder, std::vector<string>& chain); // Lists the backups an incremental backup builds on, newest first
+	bool Restore_Deletions(const string& Backup_Folder);                      // Removes files an incremental backup recorded as deleted
 	bool Restore_Image(PartitionSettings *part_settings);                     // Restore using dd for images
 	bool Check_Restore_File_MD5(const string& Filename);                      // Verifies MD5 matches for a file before restoration
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
@@ -414,6 +420,7 @@ private:
 	void Setup_Settings_Storage_Partition(TWPartition* Part);                 // Sets up settings storage
 	void Setup_Android_Secure_Location(TWPartition* Part);                    // Sets up .android_secure if needed
 	bool Backup_Partition(struct PartitionSettings *part_settings);           // Backup the partitions based on type
+	bool Backup_Digest(struct PartitionSettings *part_settings, const string& Full_Filename); // Create or verify the digest of a partition backup
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);         // Adds or removes an MTP Storage partition
 	TWPartition* Find_Next_Storage(string Path, bool Exclude_Data_Media);
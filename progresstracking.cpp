@@ -37,6 +37,7 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	current_size = 0;
 	current_count = 0;
 	previous_partitions_size = 0;
+	rate = 0;
 	display_file_count = false;
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
 }
@@ -44,6 +45,7 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 void ProgressTracking::SetPartitionSize(const unsigned long long part_size) {
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
+	rate = 0;
 	UpdateDisplayDetails(true);
 }
 
@@ -51,6 +53,7 @@ void ProgressTracking::SetSizeCount(const unsigned long long part_size, unsigned
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
 	file_count = f_count;
+	rate = 0;
 	display_file_count = (file_count != 0);
 	UpdateDisplayDetails(true);
 }
@@ -66,6 +69,10 @@ void ProgressTracking::UpdateSizeCount(const unsigned long long size, const unsi
 	UpdateDisplayDetails(false);
 }
 
+void ProgressTracking::SetRate(const unsigned long long bytes_per_second) {
+	rate = bytes_per_second;
+}
+
 void ProgressTracking::DisplayFileCount(const bool display) {
 	display_file_count = display;
 	UpdateDisplayDetails(true);
@@ -94,7 +101,13 @@ void ProgressTracking::UpdateDisplayDetails(const bool force) {
 	progress_percent = (display_percent / 100);
 	DataManager::SetProgress((float)(progress_percent));
 
-	if (!display_file_count || file_count == 0) {
+	if (rate != 0 && (!display_file_count || file_count == 0)) {
+		string speed_prog = gui_lookup("speed_progress", "%lluMB/s");
+		char speed_progress[1024];
+
+		sprintf(speed_progress, speed_prog.c_str(), rate / 1048576);
+		DataManager::SetValue("tw_file_progress", speed_progress);
+	} else if (!display_file_count || file_count == 0) {
 		DataManager::SetValue("tw_file_progress", "");
 	} else {
 		string file_prog = gui_lookup("file_progress", "%llu of %llu files, %i%%");
@@ -33,6 +33,7 @@ public:
 	void UpdateSize(const unsigned long long size);
 	void UpdateSizeCount(const unsigned long long size, const unsigned long long count);
 
+	void SetRate(const unsigned long long bytes_per_second);
 	void DisplayFileCount(const bool display);
 	void UpdateDisplayDetails(const bool force);
 
@@ -47,6 +48,8 @@ private:
 
 	unsigned long long previous_partitions_size;       // Total data already backed up from previous partitions (for the progress bar)
 
+	unsigned long long rate;                           // Bytes per second of the current raw image copy, 0 when not copying an image
+
 	bool display_file_count;                           // Inidicates if we will display the file count text
 	timespec last_update;                              // Tracks last update of the displayed progress (frequent updates tax the CPU and slow us down)
 };
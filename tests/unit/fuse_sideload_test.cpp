@@ -14,14 +14,19 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_provider.h"
@@ -58,33 +63,21 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(std::move(provider_too_many_blocks)));
 }
 
-TEST(SideloadTest, run_fuse_sideload) {
-  const std::vector<std::string> blocks = {
-    std::string(2048, 'a') + std::string(2048, 'b'),
-    std::string(2048, 'c') + std::string(2048, 'd'),
-    std::string(2048, 'e') + std::string(2048, 'f'),
-    std::string(2048, 'g') + std::string(2048, 'h'),
-  };
-  const std::string content = android::base::Join(blocks, "");
-  ASSERT_EQ(16384U, content.size());
-
-  TemporaryFile temp_file;
-  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
-
-  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
-  ASSERT_TRUE(provider->Valid());
-  TemporaryDir mount_point;
-  pid_t pid = fork();
-  if (pid == 0) {
-    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point.path));
+// Runs the fuse sideload of |provider| in a child process, and waits for the package to show up
+// under |mount_point|.
+static void StartFuseSideload(std::unique_ptr<FuseDataProvider> provider, const char* mount_point,
+                              uint32_t cache_blocks, pid_t* pid) {
+  *pid = fork();
+  if (*pid == 0) {
+    ASSERT_EQ(0, run_fuse_sideload(std::move(provider), mount_point, cache_blocks));
     _exit(EXIT_SUCCESS);
   }
 
-  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  std::string package = std::string(mount_point) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
   int status;
   static constexpr int kSideloadInstallTimeout = 10;
   for (int i = 0; i < kSideloadInstallTimeout; ++i) {
-    ASSERT_NE(-1, waitpid(pid, &status, WNOHANG));
+    ASSERT_NE(-1, waitpid(*pid, &status, WNOHANG));
 
     struct stat sb;
     if (stat(package.c_str(), &sb) == 0) {
@@ -97,16 +90,75 @@ TEST(SideloadTest, run_fuse_sideload) {
     }
     FAIL() << "Timed out waiting for the fuse-provided package.";
   }
+}
 
-  std::string content_via_fuse;
-  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
-  ASSERT_EQ(content, content_via_fuse);
-
-  std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+// Unmounts the sideload filesystem through the exit flag, and checks the child exits cleanly.
+static void StopFuseSideload(const char* mount_point, pid_t pid) {
+  std::string exit_flag = std::string(mount_point) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
   struct stat sb;
   ASSERT_EQ(0, stat(exit_flag.c_str(), &sb));
 
+  int status;
   waitpid(pid, &status, 0);
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload) {
+  const std::vector<std::string> blocks = {
+    std::string(2048, 'a') + std::string(2048, 'b'),
+    std::string(2048, 'c') + std::string(2048, 'd'),
+    std::string(2048, 'e') + std::string(2048, 'f'),
+    std::string(2048, 'g') + std::string(2048, 'h'),
+  };
+  const std::string content = android::base::Join(blocks, "");
+  ASSERT_EQ(16384U, content.size());
+
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, 0, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  std::string content_via_fuse;
+  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+  ASSERT_EQ(content, content_via_fuse);
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
+
+TEST(SideloadTest, run_fuse_sideload_evicting_cache) {
+  // Reads 96 blocks through a 4-block cache, alternating between the end of the file and a
+  // sequential pass, with reads straddling two blocks and a partial last block.
+  std::string content(96 * 4096 + 100, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>(i * 7 + i / 4096);
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  auto provider = std::make_unique<FuseFileDataProvider>(temp_file.path, 4096);
+  ASSERT_TRUE(provider->Valid());
+  TemporaryDir mount_point;
+  pid_t pid;
+  ASSERT_NO_FATAL_FAILURE(StartFuseSideload(std::move(provider), mount_point.path, 4, &pid));
+
+  std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+  android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+  ASSERT_NE(-1, fd);
+  std::string buffer(6000, '\0');
+  for (size_t offset = 0; offset < content.size(); offset += 3000) {
+    for (size_t read_offset : { content.size() - 300, offset }) {
+      size_t size = std::min(buffer.size(), content.size() - read_offset);
+      ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), size, read_offset));
+      ASSERT_EQ(content.substr(read_offset, size), buffer.substr(0, size)) << read_offset;
+    }
+  }
+  fd.reset();
+
+  ASSERT_NO_FATAL_FAILURE(StopFuseSideload(mount_point.path, pid));
+}
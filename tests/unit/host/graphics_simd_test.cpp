@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <gtest/gtest.h>
+#include <pixelflinger/pixelflinger.h>
+
+#include "minuitwrp/graphics_simd.h"
+
+// Pixels are left around every area so writes past its edges show up.
+static constexpr int kPadding = 5;
+
+// Returns |count| pixels with alpha in runs of 0, 255 and anything else, so the vector kernels
+// see groups that can skip the blend as well as groups that cannot.
+static std::vector<uint32_t> RandomPixels(size_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint32_t> pixels(count);
+  uint32_t mode = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i % 8 == 0) mode = rng() % 3;
+    uint32_t rgb = rng() & 0x00ffffff;
+    uint32_t alpha = mode == 0 ? 0 : mode == 1 ? 255 : rng() & 0xff;
+    pixels[i] = rgb | alpha << 24;
+  }
+  return pixels;
+}
+
+static std::vector<uint8_t> RandomMask(size_t count, uint32_t seed) {
+  std::vector<uint32_t> pixels = RandomPixels(count, seed);
+  std::vector<uint8_t> mask(count);
+  for (size_t i = 0; i < count; i++) {
+    mask[i] = pixels[i] >> 24;
+  }
+  return mask;
+}
+
+static const gr_kernels* VectorKernels() {
+  gr_kernels_init();
+  return gr_get_kernels();
+}
+
+// Runs |draw| with the scalar and the vector kernels on the same w x h area of a padded surface
+// and expects the whole surfaces to match.
+static void ExpectSameDraw(int w, int h,
+                           const std::function<void(const gr_kernels*, uint32_t*, int)>& draw) {
+  int stride = w + 2 * kPadding;
+  std::vector<uint32_t> expected = RandomPixels(static_cast<size_t>(stride) * (h + 2 * kPadding),
+                                                w * 131 + h);
+  std::vector<uint32_t> actual = expected;
+  size_t origin = static_cast<size_t>(kPadding) * stride + kPadding;
+
+  draw(gr_get_scalar_kernels(), expected.data() + origin, stride);
+  draw(VectorKernels(), actual.data() + origin, stride);
+  ASSERT_EQ(expected, actual) << w << "x" << h;
+}
+
+static void ForEachSize(const std::function<void(int, int)>& test) {
+  for (int w : { 1, 3, 4, 7, 8, 17, 37, 64 }) {
+    for (int h : { 1, 2, 5, 33 }) {
+      test(w, h);
+    }
+  }
+}
+
+// The per-pixel rotation that surface_ROTATION_transform() did before the kernels, with the
+// display coordinates computed out of line like graphics_utils.cpp does.
+static int __attribute__((noinline)) RotationXDisp(int rotation, int x, int y, int w) {
+  return rotation == 90 ? w - y - 1 : rotation == 180 ? w - x - 1 : rotation == 270 ? y : x;
+}
+
+static int __attribute__((noinline)) RotationYDisp(int rotation, int x, int y, int h) {
+  return rotation == 90 ? x : rotation == 180 ? h - y - 1 : rotation == 270 ? h - x - 1 : y;
+}
+
+template <typename T>
+static void RotatePerPixel(T* dst, int dst_stride, const T* src, int src_stride, int src_w,
+                           int src_h, int rotation) {
+  int dst_w = rotation == 180 ? src_w : src_h;
+  int dst_h = rotation == 180 ? src_h : src_w;
+  for (int y = 0; y < src_h; y++) {
+    for (int x = 0; x < src_w; x++) {
+      int x_disp = RotationXDisp(rotation, x, y, dst_w);
+      int y_disp = RotationYDisp(rotation, x, y, dst_h);
+      dst[static_cast<size_t>(y_disp) * dst_stride + x_disp] =
+          src[static_cast<size_t>(y) * src_stride + x];
+    }
+  }
+}
+
+TEST(GraphicsSimdTest, fill) {
+  ForEachSize([](int w, int h) {
+    ExpectSameDraw(w, h, [w, h](const gr_kernels* k, uint32_t* dst, int stride) {
+      k->fill(dst, stride, w, h, 0x80402010);
+    });
+  });
+}
+
+TEST(GraphicsSimdTest, fill_blend) {
+  for (uint32_t alpha : { 0, 1, 127, 128, 254, 255 }) {
+    ForEachSize([alpha](int w, int h) {
+      ExpectSameDraw(w, h, [w, h, alpha](const gr_kernels* k, uint32_t* dst, int stride) {
+        k->fill_blend(dst, stride, w, h, 0x00c08040 | alpha << 24);
+      });
+    });
+  }
+}
+
+TEST(GraphicsSimdTest, blit_blend) {
+  ForEachSize([](int w, int h) {
+    int src_stride = w + 3;
+    std::vector<uint32_t> src = RandomPixels(static_cast<size_t>(src_stride) * h, w + h * 7);
+    ExpectSameDraw(w, h, [&](const gr_kernels* k, uint32_t* dst, int stride) {
+      k->blit_blend(dst, stride, src.data(), src_stride, w, h);
+    });
+  });
+}
+
+TEST(GraphicsSimdTest, mask_blend) {
+  ForEachSize([](int w, int h) {
+    int src_stride = w + 3;
+    std::vector<uint8_t> src = RandomMask(static_cast<size_t>(src_stride) * h, w * 7 + h);
+    ExpectSameDraw(w, h, [&](const gr_kernels* k, uint32_t* dst, int stride) {
+      // The alpha of the color is ignored, the mask is the coverage
+      k->mask_blend(dst, stride, src.data(), src_stride, w, h, 0x12345678);
+    });
+  });
+}
+
+TEST(GraphicsSimdTest, rotate32) {
+  for (int rotation : { 90, 180, 270 }) {
+    ForEachSize([rotation](int w, int h) {
+      std::vector<uint32_t> src = RandomPixels(static_cast<size_t>(w + 1) * h, w + h);
+      int dst_w = rotation == 180 ? w : h;
+      int dst_h = rotation == 180 ? h : w;
+      int dst_stride = dst_w + 2;
+      std::vector<uint32_t> expected(static_cast<size_t>(dst_stride) * dst_h, 0xdeadbeef);
+      RotatePerPixel(expected.data(), dst_stride, src.data(), w + 1, w, h, rotation);
+
+      for (const gr_kernels* k : { gr_get_scalar_kernels(), VectorKernels() }) {
+        std::vector<uint32_t> actual(expected.size(), 0xdeadbeef);
+        k->rotate32(actual.data(), dst_stride, src.data(), w + 1, w, h, rotation);
+        ASSERT_EQ(expected, actual) << k->name << " " << rotation << " " << w << "x" << h;
+      }
+    });
+  }
+}
+
+TEST(GraphicsSimdTest, rotate8) {
+  for (int rotation : { 90, 180, 270 }) {
+    ForEachSize([rotation](int w, int h) {
+      std::vector<uint8_t> src = RandomMask(static_cast<size_t>(w) * h, w + h);
+      int dst_w = rotation == 180 ? w : h;
+      int dst_h = rotation == 180 ? h : w;
+      std::vector<uint8_t> expected(static_cast<size_t>(dst_w) * dst_h);
+      std::vector<uint8_t> actual(expected.size());
+      RotatePerPixel(expected.data(), dst_w, src.data(), w, w, h, rotation);
+      gr_rotate8(actual.data(), dst_w, src.data(), w, w, h, rotation);
+      ASSERT_EQ(expected, actual) << rotation << " " << w << "x" << h;
+    });
+  }
+}
+
+// Times |draw| over |runs| calls, in milliseconds per call.
+static double TimeDraw(int runs, const std::function<void()>& draw) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < runs; i++) {
+    draw();
+  }
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / runs;
+}
+
+static GGLSurface MakeSurface(void* data, int w, int h, int format) {
+  GGLSurface surface = {};
+  surface.version = sizeof(GGLSurface);
+  surface.width = w;
+  surface.height = h;
+  surface.stride = w;
+  surface.data = static_cast<GGLubyte*>(data);
+  surface.format = format;
+  return surface;
+}
+
+// Compares the kernels with pixelflinger, set up the way gr_init() does, and the rotation with the
+// per-pixel one, all over a 1080x1920 surface.
+TEST(GraphicsSimdTest, benchmark) {
+  constexpr int kWidth = 1080;
+  constexpr int kHeight = 1920;
+  constexpr int kRuns = 10;
+  constexpr size_t kPixels = static_cast<size_t>(kWidth) * kHeight;
+  std::vector<uint32_t> target = RandomPixels(kPixels, 1);
+  std::vector<uint32_t> image = RandomPixels(kPixels, 2);
+  std::vector<uint8_t> mask = RandomMask(kPixels, 3);
+  std::vector<uint32_t> rotated(kPixels);
+  const gr_kernels* scalar = gr_get_scalar_kernels();
+  const gr_kernels* vector = VectorKernels();
+
+  GGLContext* gl;
+  ASSERT_EQ(0, gglInit(&gl));
+  GGLSurface target_surface = MakeSurface(target.data(), kWidth, kHeight,
+                                          GGL_PIXEL_FORMAT_RGBA_8888);
+  GGLSurface image_surface = MakeSurface(image.data(), kWidth, kHeight,
+                                         GGL_PIXEL_FORMAT_RGBA_8888);
+  GGLSurface mask_surface = MakeSurface(mask.data(), kWidth, kHeight, GGL_PIXEL_FORMAT_A_8);
+  gl->colorBuffer(gl, &target_surface);
+  gl->activeTexture(gl, 0);
+  gl->enable(gl, GGL_BLEND);
+  gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
+  // gr_color(0x40, 0x80, 0xc0, 0x80)
+  GGLint color[4] = { 0x4041, 0x8081, 0xc0c1, 0x8081 };
+  gl->color4xv(gl, color);
+
+  auto pixelflinger_texture = [&](GGLSurface* texture) {
+    gl->bindTexture(gl, texture);
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->enable(gl, GGL_TEXTURE_2D);
+    gl->texCoord2i(gl, 0, 0);
+    gl->recti(gl, 0, 0, kWidth, kHeight);
+    gl->disable(gl, GGL_TEXTURE_2D);
+  };
+  auto report = [&](const char* name, double old_path, double c, double v) {
+    LOG(INFO) << name << " " << kWidth << "x" << kHeight << ": old " << old_path << " ms, "
+              << scalar->name << " " << c << " ms, " << vector->name << " " << v << " ms";
+  };
+
+  report("fill_blend", TimeDraw(kRuns, [&]() { gl->recti(gl, 0, 0, kWidth, kHeight); }),
+         TimeDraw(kRuns, [&]() { scalar->fill_blend(target.data(), kWidth, kWidth, kHeight,
+                                                    0x80c08040); }),
+         TimeDraw(kRuns, [&]() { vector->fill_blend(target.data(), kWidth, kWidth, kHeight,
+                                                    0x80c08040); }));
+  report("blit_blend", TimeDraw(kRuns, [&]() { pixelflinger_texture(&image_surface); }),
+         TimeDraw(kRuns, [&]() { scalar->blit_blend(target.data(), kWidth, image.data(), kWidth,
+                                                    kWidth, kHeight); }),
+         TimeDraw(kRuns, [&]() { vector->blit_blend(target.data(), kWidth, image.data(), kWidth,
+                                                    kWidth, kHeight); }));
+  report("mask_blend", TimeDraw(kRuns, [&]() { pixelflinger_texture(&mask_surface); }),
+         TimeDraw(kRuns, [&]() { scalar->mask_blend(target.data(), kWidth, mask.data(), kWidth,
+                                                    kWidth, kHeight, 0x00c08040); }),
+         TimeDraw(kRuns, [&]() { vector->mask_blend(target.data(), kWidth, mask.data(), kWidth,
+                                                    kWidth, kHeight, 0x00c08040); }));
+  report("rotate32 90",
+         TimeDraw(kRuns, [&]() { RotatePerPixel(rotated.data(), kHeight, image.data(), kWidth,
+                                                kWidth, kHeight, 90); }),
+         TimeDraw(kRuns, [&]() { scalar->rotate32(rotated.data(), kHeight, image.data(), kWidth,
+                                                  kWidth, kHeight, 90); }),
+         TimeDraw(kRuns, [&]() { vector->rotate32(rotated.data(), kHeight, image.data(), kWidth,
+                                                  kWidth, kHeight, 90); }));
+  gglUninit(gl);
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <gtest/gtest.h>
+#include <verity/hash_tree_builder.h>
+
+#include "otautil/rangeset.h"
+#include "private/hash_tree.h"
+
+static constexpr size_t kBlockSize = 4096;
+
+// Fills |blocks| blocks of |fd| with pseudo-random data, leaving every 7th block zeroed.
+static void CreateImage(int fd, size_t blocks) {
+  std::mt19937 rng(blocks);
+  std::vector<uint8_t> block(kBlockSize);
+  for (size_t i = 0; i < blocks; i++) {
+    for (auto& byte : block) {
+      byte = i % 7 == 0 ? 0 : static_cast<uint8_t>(rng());
+    }
+    ASSERT_TRUE(android::base::WriteFully(fd, block.data(), block.size()));
+  }
+}
+
+// Builds the tree over |ranges| of |fd| with the reference HashTreeBuilder and returns the
+// serialized tree and the root hash.
+static void BuildReference(int fd, const RangeSet& ranges, const std::string& algorithm,
+                           const std::vector<unsigned char>& salt, std::string* tree,
+                           std::vector<unsigned char>* root_hash) {
+  HashTreeBuilder builder(kBlockSize, HashTreeBuilder::HashFunction(algorithm));
+  ASSERT_TRUE(builder.Initialize(static_cast<int64_t>(ranges.blocks()) * kBlockSize, salt));
+  std::vector<unsigned char> buffer(kBlockSize);
+  for (const auto& [begin, end] : ranges) {
+    for (size_t i = begin; i < end; i++) {
+      ASSERT_TRUE(android::base::ReadFullyAtOffset(fd, buffer.data(), kBlockSize,
+                                                   static_cast<off64_t>(i) * kBlockSize));
+      ASSERT_TRUE(builder.Update(buffer.data(), kBlockSize));
+    }
+  }
+  ASSERT_TRUE(builder.BuildHashTree());
+
+  TemporaryFile output;
+  ASSERT_TRUE(builder.WriteHashTreeToFd(output.fd, 0));
+  ASSERT_TRUE(android::base::ReadFileToString(output.path, tree));
+  *root_hash = builder.root_hash();
+}
+
+static void BuildParallel(int fd, const RangeSet& ranges, const std::string& algorithm,
+                          const std::vector<unsigned char>& salt, size_t threads,
+                          std::string* tree, std::vector<unsigned char>* root_hash) {
+  ParallelHashTreeBuilder builder(kBlockSize, HashTreeBuilder::HashFunction(algorithm), threads);
+  int read_errno;
+  ASSERT_TRUE(builder.BuildHashTree(fd, ranges, salt, &read_errno));
+  ASSERT_EQ(0, read_errno);
+
+  TemporaryFile output;
+  ASSERT_TRUE(builder.WriteHashTreeToFd(output.fd, 0));
+  ASSERT_TRUE(android::base::ReadFileToString(output.path, tree));
+  *root_hash = builder.root_hash();
+}
+
+static void VerifyMatchesReference(size_t image_blocks, const RangeSet& ranges,
+                                   const std::string& algorithm) {
+  TemporaryFile image;
+  CreateImage(image.fd, image_blocks);
+  std::vector<unsigned char> salt(32, 0x5a);
+
+  std::string expected_tree;
+  std::vector<unsigned char> expected_root;
+  BuildReference(image.fd, ranges, algorithm, salt, &expected_tree, &expected_root);
+
+  for (size_t threads : { 1, 3, 8 }) {
+    std::string tree;
+    std::vector<unsigned char> root;
+    BuildParallel(image.fd, ranges, algorithm, salt, threads, &tree, &root);
+    ASSERT_EQ(expected_root, root) << threads << " threads";
+    ASSERT_EQ(expected_tree, tree) << threads << " threads";
+  }
+}
+
+TEST(HashTreeTest, single_level) {
+  VerifyMatchesReference(128, RangeSet({ { 0, 128 } }), "sha256");
+}
+
+TEST(HashTreeTest, multiple_levels_and_ranges) {
+  // 40000 blocks need three levels of sha256 hashes; the ranges split the chunks unevenly.
+  VerifyMatchesReference(41000, RangeSet({ { 10, 5000 }, { 5001, 5002 }, { 6000, 41000 } }),
+                         "sha256");
+}
+
+TEST(HashTreeTest, padded_sha1) {
+  VerifyMatchesReference(9000, RangeSet({ { 0, 9000 } }), "sha1");
+}
+
+TEST(HashTreeTest, read_failure) {
+  TemporaryFile image;
+  CreateImage(image.fd, 16);
+
+  ParallelHashTreeBuilder builder(kBlockSize, HashTreeBuilder::HashFunction("sha256"), 4);
+  int read_errno;
+  ASSERT_FALSE(builder.BuildHashTree(image.fd, RangeSet({ { 0, 32 } }), {}, &read_errno));
+  ASSERT_NE(0, read_errno);
+}
+
+// Compares the two builders over a synthetic 256 MiB image. Both read the image from the page
+// cache, so this measures the hashing itself.
+TEST(HashTreeTest, benchmark) {
+  constexpr size_t kImageBlocks = 65536;
+  TemporaryFile image;
+  CreateImage(image.fd, kImageBlocks);
+  RangeSet ranges({ { 0, kImageBlocks } });
+  std::vector<unsigned char> salt(32, 0xa5);
+
+  std::string expected_tree;
+  std::vector<unsigned char> expected_root;
+  auto start = std::chrono::steady_clock::now();
+  BuildReference(image.fd, ranges, "sha256", salt, &expected_tree, &expected_root);
+  std::chrono::duration<double> serial = std::chrono::steady_clock::now() - start;
+
+  std::string tree;
+  std::vector<unsigned char> root;
+  start = std::chrono::steady_clock::now();
+  BuildParallel(image.fd, ranges, "sha256", salt, 0, &tree, &root);
+  std::chrono::duration<double> parallel = std::chrono::steady_clock::now() - start;
+
+  ASSERT_EQ(expected_root, root);
+  ASSERT_EQ(expected_tree, tree);
+  LOG(INFO) << "Hash tree over " << kImageBlocks << " blocks: HashTreeBuilder " << serial.count()
+            << "s, ParallelHashTreeBuilder " << parallel.count() << "s";
+}
@@ -1111,3 +1111,57 @@ TEST(ImgdiffTest, zip_mode_large_apk_skipped_small_target_chunk) {
   // src_piece 1: a-0 1 block, CD
   GenerateAndCheckSplitTarget(debug_dir.path, 2, tgt);
 }
+
+TEST(ImgdiffTest, zip_mode_threads_deterministic) {
+  // Generate 20 blocks of random data, and use them in deflated entries, some of which change or
+  // move between the source and the target, and some store entries without a source.
+  std::string random_data;
+  random_data.reserve(4096 * 20);
+  generate_n(back_inserter(random_data), 4096 * 20, []() { return rand() % 256; });
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 0, 2 }, { "b", 2, 3 }, { "c", 5, 4 }, { "d", 9, 1 },
+                            { "e", 10, 5 }, { "f", 15, 5 } },
+                          &src_writer, random_data);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  std::string tgt_data = random_data;
+  for (size_t i = 0; i < tgt_data.size(); i += 1500) {
+    tgt_data[i] = 'x';
+  }
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 2 }, { "c", 2, 4 }, { "b", 6, 3 }, { "e", 10, 5 },
+                            { "g", 15, 5 } },
+                          &tgt_writer, tgt_data);
+  construct_store_entry({ { "h", 3, 'h' }, { "i", 2, 'i' } }, &tgt_writer);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  std::string serial_patch;
+  for (const char* threads_arg : { "--threads=1", "--threads=4", "--threads=0" }) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", "-z", threads_arg, src_file.path, tgt_file.path, patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+    std::string patch;
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+    if (serial_patch.empty()) {
+      serial_patch = patch;
+    } else {
+      ASSERT_EQ(serial_patch, patch) << threads_arg;
+    }
+  }
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file.path, &src));
+  verify_patched_image(src, serial_patch, tgt);
+}
@@ -1073,6 +1073,42 @@ TEST_F(UpdaterTest, brotli_new_data) {
   ASSERT_EQ(brotli_new_data, updated_content);
 }
 
+TEST_F(UpdaterTest, new_data_beyond_buffered) {
+  // 16 MiB of new data is more than the updater extracts ahead of the 'new' commands, so the
+  // extraction has to wait for the move in between.
+  constexpr size_t kNewBlocks = 4096;
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  new_data.reserve(4096 * kNewBlocks);
+  generate_n(back_inserter(new_data), 4096 * kNewBlocks, generator);
+
+  std::vector<std::string> transfer_list{
+    // clang-format off
+    "4",
+    std::to_string(kNewBlocks + 2),
+    "0",
+    "0",
+    "new 2,0,2048",
+    "move " + GetSha1(new_data.substr(0, 4096 * 2)) + " 2,4096,4098 2 2,0,2",
+    "new 2,2048,4096",
+    // clang-format on
+  };
+
+  PackageEntries entries{
+    { "new_data", new_data },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  std::string image(4096 * (kNewBlocks + 2), 0);
+  ASSERT_TRUE(android::base::WriteStringToFile(image, image_file_));
+  RunBlockImageUpdate(false, entries, image_file_, "t");
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file_, &updated_content));
+  ASSERT_EQ(new_data + new_data.substr(0, 4096 * 2), updated_content);
+}
+
 TEST_F(UpdaterTest, last_command_update) {
   std::string block1(4096, '1');
   std::string block2(4096, '2');
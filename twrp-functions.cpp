@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <vector>
 #include <dirent.h>
+#include <pthread.h>
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -59,6 +60,7 @@
 #include <sys/reboot.h>
 #include "gui/rapidxml.hpp"
 #include "gui/pages.hpp"
+#include "twrpChunkStore.hpp"
 #endif // ndef BUILD_TWRPTAR_MAIN
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	#include "openaes/inc/oaes_lib.h"
@@ -213,6 +215,11 @@ Archive_Type TWFunc::Get_File_Type(string fn) {
 	f.open(fn.c_str(), ios::in | ios::binary);
 	f.get(header, 3);
 	f.close();
+#ifndef BUILD_TWRPTAR_MAIN
+	// A deduplicated backup's file is an index, the type is in its first chunk
+	if (twrpChunkStore::Is_Index(fn) && !twrpChunkStore::Read_Head(fn, header, 2))
+		return UNCOMPRESSED;
+#endif
 	firstbyte = header[i] & 0xff;
 	secondbyte = header[++i] & 0xff;
 
@@ -672,47 +679,268 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 	}
 }
 
-int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
+#define REMOVE_MAX_THREADS 8                    // threads emptying a tree at once
+#define REMOVE_MAX_QUEUED 256                   // open directories waiting for a thread, more are emptied inline
+#define REMOVE_PROGRESS_MS 5000
+
+struct twRemoveDir;
+
+// State shared by the threads removing one tree
+struct twRemoveTree {
+	TWExclude *exclusions;
+	vector<twRemoveDir*> queue;             // directories to empty, taken from the back to stay depth first
+	bool finished;                          // the top directory has been emptied
+	bool stop;                              // progress asked to stop
+	int error;                              // errno of the first failure
+	uint64_t removed;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;                  // signaled when the queue is filled or the tree is finished
+	pthread_cond_t done;
+};
+
+// A directory being emptied. It is removed once its listing and all of its
+// subdirectories are done, unless something inside has to stay.
+struct twRemoveDir {
+	DIR *d;
+	string path;
+	string name;                            // in the parent
+	twRemoveDir *parent;                    // NULL for the top directory
+	int pending;                            // listing plus subdirectories not done yet, under the tree lock
+	bool keep;                              // under the tree lock
+};
+
+static void Remove_Failed(twRemoveTree *tree, twRemoveDir *dir, const string& path, const char *what) {
+	int err = errno;
+
+	LOGINFO("Unable to %s '%s': %s\n", what, path.c_str(), strerror(err));
+	pthread_mutex_lock(&tree->lock);
+	if (tree->error == 0)
+		tree->error = err;
+	dir->keep = true;
+	pthread_mutex_unlock(&tree->lock);
+}
+
+// Drops a reference to the directory. The last one removes the directory
+// and drops the reference it held on its parent.
+static void Release_Dir(twRemoveTree *tree, twRemoveDir *dir) {
+	while (dir != NULL) {
+		twRemoveDir *parent = dir->parent;
+		bool last, keep;
+
+		pthread_mutex_lock(&tree->lock);
+		last = --dir->pending == 0;
+		keep = dir->keep || tree->stop;
+		if (last && keep && parent != NULL)
+			parent->keep = true;
+		pthread_mutex_unlock(&tree->lock);
+		if (!last)
+			return;
+
+		closedir(dir->d);
+		dir->d = NULL;
+		if (parent == NULL) {
+			// The top directory is removed by removeDir, if at all
+			pthread_mutex_lock(&tree->lock);
+			tree->finished = true;
+			pthread_cond_broadcast(&tree->queued);
+			pthread_cond_signal(&tree->done);
+			pthread_mutex_unlock(&tree->lock);
+			return;
+		}
+		if (!keep) {
+			if (unlinkat(dirfd(parent->d), dir->name.c_str(), AT_REMOVEDIR) != 0) {
+				Remove_Failed(tree, parent, dir->path, "remove");
+			} else {
+				pthread_mutex_lock(&tree->lock);
+				tree->removed++;
+				pthread_mutex_unlock(&tree->lock);
+			}
+		}
+		delete dir;
+		dir = parent;
+	}
+}
+
+// Removes everything in the directory relative to its fd. Subdirectories
+// are handed to the other threads, or emptied right away when enough are
+// waiting already.
+static void Empty_Dir(twRemoveTree *tree, twRemoveDir *dir) {
+	int fd = dirfd(dir->d);
+	struct dirent *de;
+	struct stat st;
+	unsigned char type;
+	uint64_t removed = 0;
+	bool stop;
+
+	pthread_mutex_lock(&tree->lock);
+	stop = tree->stop;
+	pthread_mutex_unlock(&tree->lock);
+	while (!stop && (de = readdir(dir->d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (tree->exclusions != NULL && tree->exclusions->check_skip_dirs(dir->path + "/" + de->d_name)) {
+			LOGINFO("skipped '%s/%s'\n", dir->path.c_str(), de->d_name);
+			pthread_mutex_lock(&tree->lock);
+			dir->keep = true;
+			pthread_mutex_unlock(&tree->lock);
+			continue;
+		}
+
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				Remove_Failed(tree, dir, dir->path + "/" + de->d_name, "stat");
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type != DT_DIR) {
+			if (unlinkat(fd, de->d_name, 0) != 0)
+				Remove_Failed(tree, dir, dir->path + "/" + de->d_name, "unlink");
+			else if (++removed % 256 == 0) {
+				pthread_mutex_lock(&tree->lock);
+				tree->removed += removed;
+				stop = tree->stop;
+				pthread_mutex_unlock(&tree->lock);
+				removed = 0;
+			}
+			continue;
+		}
+
+		int child_fd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		DIR *child_d = child_fd < 0 ? NULL : fdopendir(child_fd);
+		if (child_d == NULL) {
+			Remove_Failed(tree, dir, dir->path + "/" + de->d_name, "open");
+			if (child_fd >= 0)
+				close(child_fd);
+			continue;
+		}
+		twRemoveDir *child = new twRemoveDir;
+		child->d = child_d;
+		child->path = dir->path + "/" + de->d_name;
+		child->name = de->d_name;
+		child->parent = dir;
+		child->pending = 1;
+		child->keep = false;
+
+		bool inline_child;
+		pthread_mutex_lock(&tree->lock);
+		dir->pending++;
+		inline_child = tree->queue.size() >= REMOVE_MAX_QUEUED;
+		if (!inline_child) {
+			tree->queue.push_back(child);
+			pthread_cond_signal(&tree->queued);
+		}
+		stop = tree->stop;
+		pthread_mutex_unlock(&tree->lock);
+		if (inline_child)
+			Empty_Dir(tree, child);
+	}
+
+	pthread_mutex_lock(&tree->lock);
+	tree->removed += removed;
+	pthread_mutex_unlock(&tree->lock);
+	Release_Dir(tree, dir);
+}
+
+static void* Remove_Thread(void *cookie) {
+	twRemoveTree *tree = (twRemoveTree*) cookie;
+	twRemoveDir *dir;
+
+	pthread_mutex_lock(&tree->lock);
+	for (;;) {
+		while (tree->queue.empty() && !tree->finished)
+			pthread_cond_wait(&tree->queued, &tree->lock);
+		if (tree->queue.empty())
+			break;
+		dir = tree->queue.back();
+		tree->queue.pop_back();
+		pthread_mutex_unlock(&tree->lock);
+		Empty_Dir(tree, dir);
+		pthread_mutex_lock(&tree->lock);
+	}
+	pthread_mutex_unlock(&tree->lock);
+	return NULL;
+}
+
+int TWFunc::removeDir(const string path, bool skipParent, const std::function<bool(uint64_t)>& progress, TWExclude *exclusions) {
+	twRemoveTree tree;
+	twRemoveDir *top;
+	pthread_t threads[REMOVE_MAX_THREADS];
+	int thread_count = 0;
+	long cores;
+	struct timespec ts;
 	int r = 0;
-	string new_path;
 
+	DIR *d = opendir(path.c_str());
 	if (d == NULL) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
 		return -1;
 	}
 
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
+	tree.exclusions = exclusions;
+	tree.finished = false;
+	tree.stop = false;
+	tree.error = 0;
+	tree.removed = 0;
+	pthread_mutex_init(&tree.lock, NULL);
+	pthread_cond_init(&tree.queued, NULL);
+	pthread_cond_init(&tree.done, NULL);
+
+	top = new twRemoveDir;
+	top->d = d;
+	top->path = Remove_Trailing_Slashes(path);
+	top->parent = NULL;
+	top->pending = 1;
+	top->keep = false;
+	tree.queue.push_back(top);
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+	while (thread_count < REMOVE_MAX_THREADS && thread_count < cores) {
+		if (pthread_create(&threads[thread_count], NULL, Remove_Thread, &tree) != 0)
+			break;
+		thread_count++;
+	}
+	if (thread_count == 0) {
+		// Remove on this thread if no thread could be started
+		Remove_Thread(&tree);
+	} else {
+		pthread_mutex_lock(&tree.lock);
+		while (!tree.finished) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += REMOVE_PROGRESS_MS / 1000;
+			pthread_cond_timedwait(&tree.done, &tree.lock, &ts);
+			if (tree.finished || tree.stop || !progress)
 				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
+			uint64_t removed = tree.removed;
+			pthread_mutex_unlock(&tree.lock);
+			bool go_on = progress(removed);
+			pthread_mutex_lock(&tree.lock);
+			if (!go_on) {
+				LOGINFO("Removal of '%s' stopped after %llu entries\n", path.c_str(), (unsigned long long)removed);
+				tree.stop = true;
 			}
 		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
-	}
+		pthread_mutex_unlock(&tree.lock);
+		for (int i = 0; i < thread_count; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	if (tree.stop) {
+		errno = ECANCELED;
+		r = -1;
+	} else if (tree.error != 0) {
+		errno = tree.error;
+		r = -1;
+	} else if (!skipParent && !top->keep) {
+		r = rmdir(path.c_str());
+	}
+	delete top;
+	pthread_cond_destroy(&tree.done);
+	pthread_cond_destroy(&tree.queued);
+	pthread_mutex_destroy(&tree.lock);
 	return r;
 }
 
@@ -19,6 +19,7 @@
 #ifndef _TWRPFUNCTIONS_HPP
 #define _TWRPFUNCTIONS_HPP
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -84,7 +85,7 @@ public:
 	static void Update_Intent_File(string Intent);                              // Updates intent file
 	static int tw_reboot(RebootCommand command);                                // Prepares the device for rebooting
 	static void check_and_run_script(const char* script_file, const char* display_name); // checks for the existence of a script, chmods it to 755, then runs it
-	static int removeDir(const string path, bool removeParent); //recursively remove a directory
+	static int removeDir(const string path, bool removeParent, const std::function<bool(uint64_t)>& progress = NULL, TWExclude *exclusions = NULL); // recursively remove a directory on several threads, progress gets the entries removed so far and stops the removal by returning false, excluded paths are left in place
 	static int copy_file(string src, string dst, int mode, bool mount_paths=true); //copy file from src to dst with mode permissions
 	static unsigned int Get_D_Type_From_Stat(string Path);                      // Returns a dirent dt_type value using stat instead of dirent
 	static int read_file(string fn, vector<string>& results); //read from file
@@ -201,7 +201,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 				memcpy(&twhdr, cmd, sizeof(cmd));
 				LOGINFO("ADB Partition count: %" PRIu64 "\n", twhdr.partition_count);
 				LOGINFO("ADB version: %" PRIu64 "\n", twhdr.version);
-				if (twhdr.version != ADB_BACKUP_VERSION) {
+				if (twhdr.version < ADB_BACKUP_MIN_VERSION || twhdr.version > ADB_BACKUP_VERSION) {
 					LOGERR("Incompatible adb backup version!\n");
 					ret = false;
 					break;
@@ -0,0 +1,620 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+#include "twrpChunkStore.hpp"
+#include "twrpDigestDriver.hpp"
+#include "twrp-functions.hpp"
+#include "set_metadata.h"
+#include "gui/gui.hpp"
+#include "twcommon.h"
+
+#define CHUNK_INDEX_HEADER "twrp chunk index 1"
+#define CHUNK_STORE_DIR ".chunks"
+#define CHUNK_MIN_SIZE (256 * 1024)
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+#define CHUNK_AVG_BITS 20                    // cut about every 1MB past the minimum
+#define CHUNK_PIPE_SIZE 1048576
+#define CHUNK_SYNC_BATCH 64                  // new chunks written before they are synced and renamed into place
+#define CHUNK_HASH_LEN (SHA256_DIGEST_LENGTH * 2)
+
+// Random values for the gear rolling hash, generated once from a fixed seed
+// so every build cuts the same data at the same places.
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void Init_Gear_Table(void) {
+	uint64_t seed = 0x5457525043444321ULL;
+
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+// Returns the length of the next chunk at the start of data. A cut is made
+// where the top bits of the hash of the last 64 bytes are all zero, so an
+// insertion only moves the boundaries next to it.
+static size_t Find_Cut(const unsigned char *data, size_t len) {
+	size_t end = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+	uint64_t hash = 0;
+
+	if (len <= CHUNK_MIN_SIZE)
+		return len;
+	pthread_once(&gear_once, Init_Gear_Table);
+	for (size_t i = CHUNK_MIN_SIZE - 64; i < end; i++) {
+		hash = (hash << 1) + gear_table[data[i]];
+		if (i >= CHUNK_MIN_SIZE && (hash >> (64 - CHUNK_AVG_BITS)) == 0)
+			return i + 1;
+	}
+	return end;
+}
+
+static bool Is_Chunk_Name(const char *name) {
+	if (strlen(name) != CHUNK_HASH_LEN)
+		return false;
+	for (const char *p = name; *p; p++) {
+		if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')))
+			return false;
+	}
+	return true;
+}
+
+// Some FUSE and sdcardfs mounts report DT_UNKNOWN for everything
+static bool Is_Regular_Entry(const string& path, const struct dirent *de) {
+	struct stat st;
+
+	if (de->d_type != DT_UNKNOWN)
+		return de->d_type == DT_REG;
+	return lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+string twrpChunkStore::Store_Path(const string& Index_File) {
+	string folder = TWFunc::Remove_Trailing_Slashes(TWFunc::Get_Path(Index_File));
+
+	return TWFunc::Get_Path(folder) + CHUNK_STORE_DIR;
+}
+
+string twrpChunkStore::Chunk_Path(const string& Store, const string& hash) {
+	return Store + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+bool twrpChunkStore::Is_Index(const string& filename) {
+	char header[sizeof(CHUNK_INDEX_HEADER)];
+	int fd;
+	bool ret;
+
+	fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ret = read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) && memcmp(header, CHUNK_INDEX_HEADER "\n", sizeof(header)) == 0;
+	close(fd);
+	return ret;
+}
+
+bool twrpChunkStore::Load_Index(const string& filename, vector<twrpChunkRef> *chunks, unsigned long long *size) {
+	char line[128], hash[CHUNK_HASH_LEN + 1];
+	unsigned long long total = 0, end_size = 0;
+	size_t len;
+	bool ended = false;
+	FILE *fp;
+
+	chunks->clear();
+	fp = fopen(filename.c_str(), "re");
+	if (fp == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
+		return false;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, CHUNK_INDEX_HEADER "\n") != 0) {
+		fclose(fp);
+		return false;
+	}
+	while (!ended && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "end %llu", &end_size) == 1) {
+			ended = true;
+		} else if (sscanf(line, "%64s %zu", hash, &len) == 2 && Is_Chunk_Name(hash)) {
+			twrpChunkRef chunk;
+
+			chunk.hash = hash;
+			chunk.size = len;
+			chunks->push_back(chunk);
+			total += len;
+		} else {
+			break;
+		}
+	}
+	fclose(fp);
+	if (!ended || end_size != total) {
+		LOGINFO("Chunk index '%s' is truncated or damaged\n", filename.c_str());
+		return false;
+	}
+	if (size)
+		*size = total;
+	return true;
+}
+
+bool twrpChunkStore::Read_Head(const string& filename, char *buf, size_t len) {
+	vector<twrpChunkRef> chunks;
+	string path;
+	int fd;
+	bool ret;
+
+	if (!Load_Index(filename, &chunks, NULL) || chunks.empty() || chunks[0].size < len)
+		return false;
+	path = Chunk_Path(Store_Path(filename), chunks[0].hash);
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ret = read(fd, buf, len) == (ssize_t)len;
+	close(fd);
+	return ret;
+}
+
+unsigned long long twrpChunkStore::Get_Stream_Size(const string& filename) {
+	vector<twrpChunkRef> chunks;
+	unsigned long long size = 0;
+
+	if (Is_Index(filename) && Load_Index(filename, &chunks, &size))
+		return size;
+	return TWFunc::Get_File_Size(filename);
+}
+
+// Mark and sweep over every index in the backup sets of Backups_Folder,
+// which also clears chunks left behind by deleted or failed backups.
+int twrpChunkStore::Collect(const string& Backups_Folder) {
+	string store = Backups_Folder + "/" + CHUNK_STORE_DIR, path;
+	unordered_set<string> used;
+	vector<twrpChunkRef> chunks;
+	vector<string> unused;
+	struct dirent *de, *fe;
+	DIR *d, *f;
+	int indexes = 0, stored = 0, removed = 0;
+
+	if (!TWFunc::Path_Exists(store))
+		return 0;
+	d = opendir(Backups_Folder.c_str());
+	if (d == NULL)
+		return -1;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		string folder = Backups_Folder + "/" + de->d_name;
+		f = opendir(folder.c_str());
+		if (f == NULL)
+			continue;
+		while ((fe = readdir(f)) != NULL) {
+			path = folder + "/" + fe->d_name;
+			if (!Is_Regular_Entry(path, fe) || !Is_Index(path))
+				continue;
+			if (!Load_Index(path, &chunks, NULL)) {
+				// Keep everything rather than lose chunks a damaged index may still need
+				closedir(f);
+				closedir(d);
+				return -1;
+			}
+			indexes++;
+			for (size_t i = 0; i < chunks.size(); i++)
+				used.insert(chunks[i].hash);
+		}
+		closedir(f);
+	}
+	closedir(d);
+
+	d = opendir(store.c_str());
+	if (d == NULL)
+		return -1;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		string folder = store + "/" + de->d_name;
+		f = opendir(folder.c_str());
+		if (f == NULL)
+			continue;
+		while ((fe = readdir(f)) != NULL) {
+			if (strcmp(fe->d_name, ".") == 0 || strcmp(fe->d_name, "..") == 0)
+				continue;
+			if (Is_Chunk_Name(fe->d_name)) {
+				stored++;
+				if (used.count(fe->d_name))
+					continue;
+			}
+			// Also clears the temporary files of chunks that were never committed
+			unused.push_back(folder + "/" + fe->d_name);
+		}
+		closedir(f);
+	}
+	closedir(d);
+
+	// Chunks with no index at all more likely mean the indexes went unseen than
+	// that every backup was deleted, so leave the store alone
+	if (indexes == 0 && stored > 0) {
+		LOGINFO("No chunk index found in '%s', keeping %i chunks in '%s'\n", Backups_Folder.c_str(), stored, store.c_str());
+		return -1;
+	}
+	for (size_t i = 0; i < unused.size(); i++) {
+		if (unlink(unused[i].c_str()) == 0)
+			removed++;
+		else
+			LOGINFO("Unable to unlink '%s': %s\n", unused[i].c_str(), strerror(errno));
+	}
+	LOGINFO("Removed %i unused chunks from '%s', %zu in use\n", removed, store.c_str(), used.size());
+	return removed;
+}
+
+twrpChunkWriter::twrpChunkWriter(const string& Index_File) {
+	index_file = Index_File;
+	store = twrpChunkStore::Store_Path(Index_File);
+	digest = NULL;
+	started = false;
+	failed = false;
+	read_fd = -1;
+	total_bytes = 0;
+	new_bytes = 0;
+	chunk_count = 0;
+	new_count = 0;
+}
+
+twrpChunkWriter::~twrpChunkWriter() {
+	if (started)
+		pthread_join(thread, NULL);
+	if (read_fd >= 0)
+		close(read_fd);
+}
+
+int twrpChunkWriter::Start() {
+	int fds[2];
+
+	if (mkdir(store.c_str(), 0775) != 0 && errno != EEXIST) {
+		gui_msg(Msg(msg::kError, "create_folder_strerr=Can not create '{1}' folder ({2}).")(store)(strerror(errno)));
+		return -1;
+	}
+	tw_set_default_metadata(store.c_str());
+	index = CHUNK_INDEX_HEADER "\n";
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		LOGINFO("Unable to create chunk store pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, CHUNK_PIPE_SIZE);
+	read_fd = fds[0];
+	if (pthread_create(&thread, NULL, Chunk_Thread, this) != 0) {
+		LOGINFO("Unable to start chunk store thread\n");
+		close(fds[1]);
+		return -1;
+	}
+	started = true;
+	return fds[1];
+}
+
+// New chunks are written to temporary names and only renamed to their hash
+// once a batch of them has been synced, so a chunk found under its hash is
+// always complete even after a crash. The batch is shared by the writers of
+// all backup threads.
+static vector<pair<string, string> > pending_chunks;                 // temporary name, final name
+static unordered_set<string> pending_hashes;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with pending_lock held
+static bool Commit_Chunks(const string& store) {
+	bool ret = true;
+	int fd;
+
+	if (pending_chunks.empty())
+		return true;
+	fd = open(store.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || syncfs(fd) != 0) {
+		LOGINFO("Unable to sync '%s': %s\n", store.c_str(), strerror(errno));
+		ret = false;
+	}
+	if (fd >= 0)
+		close(fd);
+	for (size_t i = 0; ret && i < pending_chunks.size(); i++) {
+		if (rename(pending_chunks[i].first.c_str(), pending_chunks[i].second.c_str()) != 0) {
+			LOGINFO("Unable to rename '%s': %s\n", pending_chunks[i].first.c_str(), strerror(errno));
+			ret = false;
+		}
+	}
+	pending_chunks.clear();
+	pending_hashes.clear();
+	return ret;
+}
+
+void* twrpChunkWriter::Chunk_Thread(void *cookie) {
+	twrpChunkWriter *writer = (twrpChunkWriter*) cookie;
+	size_t buf_size = CHUNK_MAX_SIZE * 2, start = 0, len = 0, cut;
+	unsigned char *buf, drain[4096];
+	bool eof = false;
+	ssize_t bs;
+
+	buf = (unsigned char*) malloc(buf_size);
+	if (buf == NULL)
+		writer->failed = true;
+	while (!writer->failed) {
+		// Keep at least a whole chunk in the buffer so cuts only depend on the data
+		while (!eof && len - start < CHUNK_MAX_SIZE) {
+			bs = read(writer->read_fd, buf + len, buf_size - len);
+			if (bs < 0 && errno == EINTR)
+				continue;
+			if (bs < 0) {
+				LOGINFO("Error reading chunk store pipe: %s\n", strerror(errno));
+				writer->failed = true;
+				break;
+			}
+			if (bs == 0)
+				eof = true;
+			len += bs;
+		}
+		if (writer->failed || start == len)
+			break;
+		cut = Find_Cut(buf + start, len - start);
+		if (!writer->Store_Chunk(buf + start, cut))
+			writer->failed = true;
+		start += cut;
+		if (start >= CHUNK_MAX_SIZE) {
+			memmove(buf, buf + start, len - start);
+			len -= start;
+			start = 0;
+		}
+	}
+	// Keep draining after an error so the other side never sees a broken pipe
+	while (!eof) {
+		bs = read(writer->read_fd, drain, sizeof(drain));
+		if (bs == 0 || (bs < 0 && errno != EINTR))
+			break;
+	}
+	free(buf);
+	return NULL;
+}
+
+bool twrpChunkWriter::Store_Chunk(const unsigned char *data, size_t len) {
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	char hex[CHUNK_HASH_LEN + 1], line[CHUNK_HASH_LEN + 32];
+	string path, temp, dir;
+	size_t pos;
+	ssize_t bs;
+	bool ret = true;
+	int fd;
+
+	SHA256(data, len, hash);
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+	snprintf(line, sizeof(line), "%s %zu\n", hex, len);
+	index += line;
+	chunk_count++;
+	total_bytes += len;
+
+	path = twrpChunkStore::Chunk_Path(store, hex);
+	pthread_mutex_lock(&pending_lock);
+	if (access(path.c_str(), F_OK) == 0 || pending_hashes.count(hex)) {
+		// Stored by an earlier backup or another thread of this one
+		pthread_mutex_unlock(&pending_lock);
+		return true;
+	}
+	pending_hashes.insert(hex);
+	pthread_mutex_unlock(&pending_lock);
+
+	dir = store + "/" + string(hex, 2);
+	if (mkdir(dir.c_str(), 0775) == 0)
+		tw_set_default_metadata(dir.c_str());
+	temp = dir + "/.tmp-XXXXXX";
+	fd = mkstemp(&temp[0]);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(temp)(strerror(errno)));
+		ret = false;
+	}
+	for (pos = 0; ret && pos < len; pos += bs) {
+		bs = write(fd, data + pos, len - pos);
+		if (bs < 0 && errno == EINTR) {
+			bs = 0;
+			continue;
+		}
+		if (bs <= 0) {
+			LOGINFO("Error writing chunk '%s': %s\n", temp.c_str(), strerror(errno));
+			ret = false;
+		}
+	}
+	if (fd >= 0) {
+		fchmod(fd, 0644);
+		close(fd);
+		if (ret)
+			tw_set_default_metadata(temp.c_str());
+		else
+			unlink(temp.c_str());
+	}
+
+	pthread_mutex_lock(&pending_lock);
+	if (ret) {
+		pending_chunks.push_back(make_pair(temp, path));
+		new_count++;
+		new_bytes += len;
+		if (pending_chunks.size() >= CHUNK_SYNC_BATCH)
+			ret = Commit_Chunks(store);
+	} else {
+		pending_hashes.erase(hex);
+	}
+	pthread_mutex_unlock(&pending_lock);
+	return ret;
+}
+
+bool twrpChunkWriter::Finish() {
+	char line[64];
+	size_t pos;
+	ssize_t bs;
+	bool committed;
+	int fd;
+
+	if (!started)
+		return false;
+	pthread_join(thread, NULL);
+	started = false;
+	if (failed) {
+		LOGINFO("Unable to store the chunks of '%s'\n", index_file.c_str());
+		return false;
+	}
+	// The index may only point at chunks that are in place
+	pthread_mutex_lock(&pending_lock);
+	committed = Commit_Chunks(store);
+	pthread_mutex_unlock(&pending_lock);
+	if (!committed)
+		return false;
+
+	snprintf(line, sizeof(line), "end %llu\n", total_bytes);
+	index += line;
+	fd = open(index_file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(index_file)(strerror(errno)));
+		return false;
+	}
+	for (pos = 0; pos < index.size(); pos += bs) {
+		bs = write(fd, index.data() + pos, index.size() - pos);
+		if (bs < 0 && errno == EINTR) {
+			bs = 0;
+			continue;
+		}
+		if (bs <= 0) {
+			LOGINFO("Error writing '%s': %s\n", index_file.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+	fsync(fd);
+	close(fd);
+	if (digest)
+		digest->update(index.data(), index.size());
+	LOGINFO("Stored '%s' as %u chunks, %u new: %llu of %llu bytes written\n", index_file.c_str(), chunk_count, new_count, new_bytes, total_bytes);
+	return true;
+}
+
+twrpChunkReader::twrpChunkReader(const string& Index_File) {
+	index_file = Index_File;
+	store = twrpChunkStore::Store_Path(Index_File);
+	started = false;
+	failed = false;
+	write_fd = -1;
+}
+
+twrpChunkReader::~twrpChunkReader() {
+	if (started)
+		pthread_join(thread, NULL);
+	if (write_fd >= 0)
+		close(write_fd);
+}
+
+int twrpChunkReader::Start() {
+	int fds[2];
+
+	if (!twrpChunkStore::Load_Index(index_file, &chunks, NULL))
+		return -1;
+	if (pipe2(fds, O_CLOEXEC) != 0) {
+		LOGINFO("Unable to create chunk store pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	fcntl(fds[1], F_SETPIPE_SZ, CHUNK_PIPE_SIZE);
+	write_fd = fds[1];
+	if (pthread_create(&thread, NULL, Feed_Thread, this) != 0) {
+		LOGINFO("Unable to start chunk store thread\n");
+		close(fds[0]);
+		return -1;
+	}
+	started = true;
+	return fds[0];
+}
+
+void* twrpChunkReader::Feed_Thread(void *cookie) {
+	twrpChunkReader *reader = (twrpChunkReader*) cookie;
+	unsigned char hash[SHA256_DIGEST_LENGTH], *buf;
+	char hex[CHUNK_HASH_LEN + 1];
+	sigset_t set;
+	string path;
+	size_t pos;
+	ssize_t bs;
+	int fd;
+
+	// A reader that stops early, like libtar at the end of archive marker,
+	// only ends the feed instead of killing the process
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	buf = (unsigned char*) malloc(CHUNK_MAX_SIZE);
+	if (buf == NULL)
+		reader->failed = true;
+	for (size_t i = 0; !reader->failed && i < reader->chunks.size(); i++) {
+		const twrpChunkRef& chunk = reader->chunks[i];
+
+		path = twrpChunkStore::Chunk_Path(reader->store, chunk.hash);
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || chunk.size > CHUNK_MAX_SIZE || read(fd, buf, chunk.size) != (ssize_t)chunk.size) {
+			gui_msg(Msg(msg::kError, "chunk_missing=Backup data chunk '{1}' is missing or damaged.")(path));
+			reader->failed = true;
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		close(fd);
+		SHA256(buf, chunk.size, hash);
+		for (int j = 0; j < SHA256_DIGEST_LENGTH; j++)
+			sprintf(hex + j * 2, "%02x", hash[j]);
+		if (chunk.hash != hex) {
+			gui_msg(Msg(msg::kError, "chunk_missing=Backup data chunk '{1}' is missing or damaged.")(path));
+			reader->failed = true;
+			break;
+		}
+		for (pos = 0; pos < chunk.size; pos += bs) {
+			bs = write(reader->write_fd, buf + pos, chunk.size - pos);
+			if (bs < 0 && errno == EINTR) {
+				bs = 0;
+				continue;
+			}
+			if (bs <= 0)
+				break;
+		}
+		if (pos < chunk.size)
+			break;
+	}
+	free(buf);
+	close(reader->write_fd);
+	reader->write_fd = -1;
+	return NULL;
+}
+
+bool twrpChunkReader::Finish() {
+	if (!started)
+		return false;
+	pthread_join(thread, NULL);
+	started = false;
+	return !failed;
+}
@@ -0,0 +1,98 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPCHUNKSTORE_HPP
+#define __TWRPCHUNKSTORE_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+class twrpDigestSink;
+
+struct twrpChunkRef {
+	std::string hash;                                                // sha256 of the chunk, also its name in the store
+	size_t size;
+};
+
+// Deduplicated backups keep the archive and image data in a store shared by
+// every backup set in the same backups folder, <backups>/.chunks. The data
+// is cut into content defined chunks, each one is saved once under its
+// sha256, and the .win file of the backup becomes an index listing the
+// chunks that make up the stream.
+class twrpChunkStore {
+public:
+	static std::string Store_Path(const std::string& Index_File);    // the store shared by the backup holding Index_File
+	static bool Is_Index(const std::string& filename);
+	static bool Load_Index(const std::string& filename, std::vector<twrpChunkRef> *chunks, unsigned long long *size);
+	static bool Read_Head(const std::string& filename, char *buf, size_t len); // first bytes of the stream an index describes
+	static unsigned long long Get_Stream_Size(const std::string& filename); // data size of an index or a plain file
+	static int Collect(const std::string& Backups_Folder);           // removes chunks no index refers to, returns how many or -1
+	static std::string Chunk_Path(const std::string& Store, const std::string& hash);
+};
+
+// Cuts the stream written to the fd from Start() into chunks. Only the
+// chunks the store does not have yet are written.
+class twrpChunkWriter {
+public:
+	explicit twrpChunkWriter(const std::string& Index_File);
+	~twrpChunkWriter();
+	int Start();                                                     // returns the fd to write the stream to, the caller closes it
+	bool Finish();                                                   // after the fd is closed, saves the index
+
+	twrpDigestSink *digest;                                          // hashes the index file, not the stream
+
+private:
+	static void* Chunk_Thread(void *cookie);
+	bool Store_Chunk(const unsigned char *data, size_t len);
+
+	std::string index_file;
+	std::string store;
+	std::string index;                                               // contents of the index file
+	pthread_t thread;
+	bool started;
+	bool failed;
+	int read_fd;
+	unsigned long long total_bytes;
+	unsigned long long new_bytes;
+	unsigned chunk_count;
+	unsigned new_count;
+};
+
+// Feeds the stream an index describes into the fd from Start(), checking
+// every chunk against its hash on the way.
+class twrpChunkReader {
+public:
+	explicit twrpChunkReader(const std::string& Index_File);
+	~twrpChunkReader();
+	int Start();                                                     // returns the fd to read the stream from, the caller closes it
+	bool Finish();                                                   // after the fd is closed, false if a chunk was missing or damaged
+
+private:
+	static void* Feed_Thread(void *cookie);
+
+	std::string index_file;
+	std::string store;
+	std::vector<twrpChunkRef> chunks;
+	pthread_t thread;
+	bool started;
+	bool failed;
+	int write_fd;
+};
+
+#endif // __TWRPCHUNKSTORE_HPP
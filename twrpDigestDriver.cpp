@@ -17,9 +17,17 @@
 */
 
 
+#include <errno.h>
 #include <fcntl.h>
-#include <string>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
 #include "data.hpp"
 #include "partitions.hpp"
 #include "set_metadata.h"
@@ -27,142 +35,440 @@
 #include "twrp-functions.hpp"
 #include "twcommon.h"
 #include "variables.h"
+#include "twrpChunkStore.hpp"
 #include "gui/gui.hpp"
 #include "twrpDigest/twrpDigest.hpp"
 #include "twrpDigest/twrpMD5.hpp"
 #include "twrpDigest/twrpSHA.hpp"
 
 
-bool twrpDigestDriver::Check_File_Digest(const string& Filename) {
-	twrpDigest *digest;
-	string digestfile = Filename, file_name = Filename;
+#define DIGEST_READ_SIZE 1048576               // large sequential reads, the old loop used 4KB
+#define DIGEST_MAX_THREADS 4                   // more readers than this only make the storage seek
+#define DIGEST_PROGRESS_MS 250
+
+enum {
+	DIGEST_PENDING,
+	DIGEST_MATCHED,
+	DIGEST_MISMATCH,
+	DIGEST_NO_SIDECAR,
+	DIGEST_SIDECAR_ERROR,
+	DIGEST_READ_ERROR,
+};
+
+struct twrpDigestCheck {
+	string filename;
+	string digestfile;                         // empty when no sidecar was found
+	bool use_sha2;
 	string digest_str;
-	bool use_sha2 = false;
+	string chunk_hash;                         // set for a chunk of a deduplicated backup, checked against its name
+	size_t chunk_size;
+	int status;
+};
 
+struct twrpDigestVerify {
+	vector<twrpDigestCheck> checks;
+	size_t next;                               // next check a thread may take, taken in order
+	unsigned long long total_bytes;
+	unsigned long long done_bytes;
+	int running;
+	bool abort;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+// Looks for the sidecar once, the verify threads only read the file it names
+static void Find_Digest_File(twrpDigestCheck& check) {
+	const char *ext[] = {
 #ifndef TW_NO_SHA2_LIBRARY
+		".sha2", ".sha256",
+#endif
+		".md5", ".md5sum", NULL
+	};
 
-	digestfile += ".sha2";
-	if (TWFunc::Path_Exists(digestfile)) {
-		digest = new twrpSHA256();
-		use_sha2 = true;
+	check.status = DIGEST_NO_SIDECAR;
+	for (int i = 0; ext[i] != NULL; i++) {
+		if (TWFunc::Path_Exists(check.filename + ext[i])) {
+			check.digestfile = check.filename + ext[i];
+			check.use_sha2 = (ext[i][1] == 's');
+			check.status = DIGEST_PENDING;
+			return;
+		}
 	}
-	else {
-		digestfile = Filename + ".sha256";
-		if (TWFunc::Path_Exists(digestfile)) {
-			digest = new twrpSHA256();
-			use_sha2 = true;
-		} else {
-			digest = new twrpMD5();
-			digestfile = Filename + ".md5";
-			if (!TWFunc::Path_Exists(digestfile)) {
-				digestfile = Filename + ".md5sum";
-			}
+}
+
+static bool Stream_To_Digest(const string& filename, twrpDigest* digest, twrpDigestVerify* verify) {
+	unsigned char *buf;
+	ssize_t bytes;
+	bool abort = false;
+
+	int fd = open(filename.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	buf = (unsigned char*) malloc(DIGEST_READ_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return false;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while ((bytes = read(fd, buf, DIGEST_READ_SIZE)) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		digest->update(buf, bytes);
+		if (verify) {
+			pthread_mutex_lock(&verify->lock);
+			verify->done_bytes += bytes;
+			abort = verify->abort;
+			pthread_mutex_unlock(&verify->lock);
+			if (abort)
+				break;
 		}
 	}
-#else
-	digest = new twrpMD5();
-	digestfile = Filename + ".md5";
-	if (!TWFunc::Path_Exists(digestfile)) {
-		digestfile = Filename + ".md5sum";
+	free(buf);
+	close(fd);
+	return bytes == 0 && !abort;
+}
+
+// A chunk has no sidecar, its size comes from the index and its sha256 is
+// its name in the store
+static int Verify_Chunk(twrpDigestCheck& check, twrpDigestVerify* verify) {
+	unsigned char hash[SHA256_DIGEST_LENGTH], *buf;
+	char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+	SHA256_CTX ctx;
+	struct stat st;
+	ssize_t bytes;
+	bool abort = false;
+	int fd;
+
+	fd = open(check.filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return DIGEST_READ_ERROR;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != check.chunk_size) {
+		close(fd);
+		return DIGEST_MISMATCH;
+	}
+	buf = (unsigned char*) malloc(DIGEST_READ_SIZE);
+	if (buf == NULL) {
+		close(fd);
+		return DIGEST_READ_ERROR;
 	}
+	SHA256_Init(&ctx);
+	while ((bytes = read(fd, buf, DIGEST_READ_SIZE)) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		SHA256_Update(&ctx, buf, bytes);
+		pthread_mutex_lock(&verify->lock);
+		verify->done_bytes += bytes;
+		abort = verify->abort;
+		pthread_mutex_unlock(&verify->lock);
+		if (abort)
+			break;
+	}
+	free(buf);
+	close(fd);
+	if (bytes != 0 || abort)
+		return DIGEST_READ_ERROR;
+	SHA256_Final(hash, &ctx);
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+	return check.chunk_hash == hex ? DIGEST_MATCHED : DIGEST_MISMATCH;
+}
 
+static int Verify_File(twrpDigestCheck& check, twrpDigestVerify* verify) {
+	twrpMD5 md5;
+#ifndef TW_NO_SHA2_LIBRARY
+	twrpSHA256 sha2;
+	twrpDigest *digest = check.use_sha2 ? (twrpDigest*) &sha2 : (twrpDigest*) &md5;
+#else
+	twrpDigest *digest = &md5;
 #endif
 
-	if (!TWFunc::Path_Exists(digestfile)) {
-		delete digest;
-		gui_msg(Msg(msg::kWarning, "no_digest=Skipping Digest check: no Digest file found"));
-		return true;
+	if (TWFunc::read_file(check.digestfile, check.digest_str) != 0)
+		return DIGEST_SIDECAR_ERROR;
+	if (!Stream_To_Digest(check.filename, digest, verify))
+		return DIGEST_READ_ERROR;
+	if (digest->return_digest_string() + "  " + TWFunc::Get_Filename(check.filename) == check.digest_str)
+		return DIGEST_MATCHED;
+	return DIGEST_MISMATCH;
+}
+
+static void* Verify_Thread(void *cookie) {
+	twrpDigestVerify *verify = (twrpDigestVerify*) cookie;
+	size_t i;
+	int status;
+
+	for (;;) {
+		pthread_mutex_lock(&verify->lock);
+		while (verify->next < verify->checks.size() && verify->checks[verify->next].status != DIGEST_PENDING)
+			verify->next++;
+		if (verify->abort || verify->next >= verify->checks.size()) {
+			verify->running--;
+			pthread_cond_signal(&verify->done);
+			pthread_mutex_unlock(&verify->lock);
+			return NULL;
+		}
+		i = verify->next++;
+		pthread_mutex_unlock(&verify->lock);
+
+		if (verify->checks[i].chunk_hash.empty())
+			status = Verify_File(verify->checks[i], verify);
+		else
+			status = Verify_Chunk(verify->checks[i], verify);
+
+		pthread_mutex_lock(&verify->lock);
+		verify->checks[i].status = status;
+		if (status != DIGEST_MATCHED)
+			verify->abort = true;
+		pthread_mutex_unlock(&verify->lock);
 	}
+}
 
+// Reports the results in file order. Files are taken in order and a thread
+// always finishes the file it took, so every file before the first failure
+// has its result and only files after it can be left pending.
+static bool Report_Digests(const twrpDigestVerify& verify) {
+	for (size_t i = 0; i < verify.checks.size(); i++) {
+		const twrpDigestCheck& check = verify.checks[i];
 
-	if (TWFunc::read_file(digestfile, digest_str) != 0) {
-		gui_msg("digest_error=Digest Error!");
-		delete digest;
-		return false;
+		if (!check.chunk_hash.empty()) {
+			if (check.status == DIGEST_MATCHED)
+				continue;
+			gui_msg(Msg(msg::kError, "chunk_missing=Backup data chunk '{1}' is missing or damaged.")(check.filename));
+			return false;
+		}
+		switch (check.status) {
+			case DIGEST_NO_SIDECAR:
+				gui_msg(Msg(msg::kWarning, "no_digest=Skipping Digest check: no Digest file found"));
+				break;
+			case DIGEST_MATCHED:
+				if (check.use_sha2)
+					LOGINFO("SHA2 Digest: %s  %s\n", check.digest_str.c_str(), TWFunc::Get_Filename(check.filename).c_str());
+				else
+					LOGINFO("MD5 Digest: %s  %s\n", check.digest_str.c_str(), TWFunc::Get_Filename(check.filename).c_str());
+				gui_msg(Msg("digest_matched=Digest matched for '{1}'.")(check.filename));
+				break;
+			case DIGEST_MISMATCH:
+				gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(check.filename));
+				return false;
+			case DIGEST_SIDECAR_ERROR:
+				gui_msg("digest_error=Digest Error!");
+				return false;
+			default:
+				LOGINFO("Unable to read '%s'\n", check.filename.c_str());
+				return false;
+		}
 	}
+	return true;
+}
 
-	if (!stream_file_to_digest(file_name, digest)) {
-		delete digest;
-		return false;
+// Hashes every file of the list with up to DIGEST_MAX_THREADS threads while
+// this thread keeps the progress bar moving
+static bool Run_Checks(twrpDigestVerify& verify, bool show_progress) {
+	pthread_t threads[DIGEST_MAX_THREADS];
+	struct timespec ts;
+	struct stat st;
+	long cores;
+	int thread_count = 0;
+	bool ret;
+
+	verify.total_bytes = 0;
+	for (size_t i = 0; i < verify.checks.size(); i++) {
+		if (!verify.checks[i].chunk_hash.empty()) {
+			verify.checks[i].status = DIGEST_PENDING;
+			verify.total_bytes += verify.checks[i].chunk_size;
+			continue;
+		}
+		Find_Digest_File(verify.checks[i]);
+		if (verify.checks[i].status == DIGEST_PENDING && stat(verify.checks[i].filename.c_str(), &st) == 0)
+			verify.total_bytes += st.st_size;
 	}
-	string digest_check = digest->return_digest_string();
-	digest_check = digest_check + "  " + TWFunc::Get_Filename(file_name);
-	if (digest_check == digest_str) {
-		if (use_sha2)
-			LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
-		else
-			LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
-		gui_msg(Msg("digest_matched=Digest matched for '{1}'.")(Filename));
-		delete digest;
-		return true;
+	verify.next = 0;
+	verify.done_bytes = 0;
+	verify.running = 0;
+	verify.abort = false;
+	pthread_mutex_init(&verify.lock, NULL);
+	pthread_cond_init(&verify.done, NULL);
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+	pthread_mutex_lock(&verify.lock);
+	while (thread_count < DIGEST_MAX_THREADS && thread_count < cores && (size_t)thread_count < verify.checks.size()) {
+		if (pthread_create(&threads[thread_count], NULL, Verify_Thread, &verify) != 0)
+			break;
+		verify.running++;
+		thread_count++;
 	}
+	pthread_mutex_unlock(&verify.lock);
+	if (thread_count == 0) {
+		// Hash on this thread if no thread could be started
+		verify.running = 1;
+		Verify_Thread(&verify);
+	}
+	if (thread_count > 1)
+		LOGINFO("Verifying %zu files with %i threads\n", verify.checks.size(), thread_count);
 
-	gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(Filename));
-	delete digest;
-	return false;
+	pthread_mutex_lock(&verify.lock);
+	while (verify.running > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += DIGEST_PROGRESS_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&verify.done, &verify.lock, &ts);
+		if (show_progress && verify.total_bytes > 0)
+			DataManager::SetProgress((float)verify.done_bytes / (float)verify.total_bytes);
+	}
+	pthread_mutex_unlock(&verify.lock);
+	for (int i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&verify.done);
+	pthread_mutex_destroy(&verify.lock);
+
+	ret = Report_Digests(verify);
+	if (show_progress)
+		DataManager::SetProgress(0.0);
+	return ret;
+}
+
+bool twrpDigestDriver::Check_File_Digest(const string& Filename) {
+	twrpDigestVerify verify;
+	twrpDigestCheck check;
+
+	check.filename = Filename;
+	verify.checks.push_back(check);
+	return Run_Checks(verify, false);
 }
 
 bool twrpDigestDriver::Check_Digest(string Full_Filename) {
+	vector<string> files(1, Full_Filename);
+
+	return Check_Digests(files, false);
+}
+
+// Lists the split archives of Full_Filename the way twrpTar names them,
+// <thread ID><00 to 99>, each thread's list ending at its first gap.
+static void Find_Split_Archives(const string& Full_Filename, vector<string>& files) {
 	char split_filename[512];
-	int index = 0;
 
-	sync();
-	if (!TWFunc::Path_Exists(Full_Filename)) {
-		// This is a split archive, we presume
-		memset(split_filename, 0, sizeof(split_filename));
-		while (index < 1000) {
-			sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
+	for (int thread_id = 0; thread_id < TAR_MAX_THREAD_IDS; thread_id++) {
+		for (int index = 0; index < 100; index++) {
+			sprintf(split_filename, "%s%i%02i", Full_Filename.c_str(), thread_id, index);
 			if (!TWFunc::Path_Exists(split_filename))
 				break;
-				LOGINFO("split_filename: %s\n", split_filename);
-				if (!Check_File_Digest(split_filename))
-					return false;
-				index++;
+			files.push_back(split_filename);
 		}
+	}
+}
+
+// Queues every chunk a deduplicated backup file refers to that is not
+// queued yet, backups of a chain share most of their chunks
+static bool Add_Chunk_Checks(const string& filename, twrpDigestVerify& verify, unordered_set<string>& queued) {
+	vector<twrpChunkRef> chunks;
+	string store;
+
+	if (!twrpChunkStore::Is_Index(filename))
 		return true;
+	if (!twrpChunkStore::Load_Index(filename, &chunks, NULL)) {
+		gui_msg(Msg(msg::kError, "chunk_index_damaged=Chunk index '{1}' is truncated or damaged.")(filename));
+		return false;
 	}
-	return Check_File_Digest(Full_Filename); // Single file archive
+	store = twrpChunkStore::Store_Path(filename);
+	for (size_t i = 0; i < chunks.size(); i++) {
+		twrpDigestCheck check;
+
+		if (!queued.insert(chunks[i].hash).second)
+			continue;
+		check.filename = twrpChunkStore::Chunk_Path(store, chunks[i].hash);
+		check.chunk_hash = chunks[i].hash;
+		check.chunk_size = chunks[i].size;
+		verify.checks.push_back(check);
+	}
+	return true;
+}
+
+bool twrpDigestDriver::Check_Digests(const vector<string>& Full_Filenames, bool show_progress) {
+	twrpDigestVerify verify;
+	vector<string> files;
+	unordered_set<string> chunks;
+	size_t indexes;
+
+	sync();
+	for (size_t f = 0; f < Full_Filenames.size(); f++) {
+		if (TWFunc::Path_Exists(Full_Filenames[f])) {
+			files.push_back(Full_Filenames[f]);
+			continue;
+		}
+		// This is a split archive, we presume
+		indexes = files.size();
+		Find_Split_Archives(Full_Filenames[f], files);
+		for (size_t i = indexes; i < files.size(); i++)
+			LOGINFO("split_filename: %s\n", files[i].c_str());
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		twrpDigestCheck check;
+
+		check.filename = files[i];
+		verify.checks.push_back(check);
+	}
+	// The index files are checked first, the chunks they list after them
+	indexes = verify.checks.size();
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!Add_Chunk_Checks(files[i], verify, chunks))
+			return false;
+	}
+	if (verify.checks.size() > indexes)
+		LOGINFO("Verifying %zu chunks of deduplicated backups\n", verify.checks.size() - indexes);
+
+	return Run_Checks(verify, show_progress);
+}
+
+static twrpDigest* New_Backup_Digest(bool& use_sha2) {
+#ifndef TW_NO_SHA2_LIBRARY
+	int sha2 = 0;
+
+	DataManager::GetValue(TW_USE_SHA2, sha2);
+	if (sha2) {
+		use_sha2 = true;
+		return new twrpSHA256();
+	}
+#endif
+	use_sha2 = false;
+	return new twrpMD5();
 }
 
 bool twrpDigestDriver::Write_Digest(string Full_Filename) {
 	twrpDigest *digest;
+	bool use_sha2, ret;
+
+	digest = New_Backup_Digest(use_sha2);
+	if (!stream_file_to_digest(Full_Filename, digest)) {
+		delete digest;
+		return false;
+	}
+	ret = Save_Digest(Full_Filename, digest, use_sha2);
+	delete digest;
+	return ret;
+}
+
+bool twrpDigestDriver::Save_Digest(string Full_Filename, twrpDigest* digest, bool use_sha2) {
 	string digest_filename, digest_str;
-	int use_sha2;
 
-#ifdef TW_NO_SHA2_LIBRARY
-	use_sha2 = 0;
-#else
-	DataManager::GetValue(TW_USE_SHA2, use_sha2);
-#endif
+	digest_str = digest->return_digest_string();
+	if (digest_str.empty())
+		return false;
 
 	if (use_sha2) {
-#ifndef TW_NO_SHA2_LIBRARY
-		digest = new twrpSHA256();
 		digest_filename = Full_Filename + ".sha2";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
 		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
-#endif
-	}
-	else  {
-		digest = new twrpMD5();
+	} else {
 		digest_filename = Full_Filename + ".md5";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
 		LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
 	}
 
@@ -175,10 +481,8 @@ bool twrpDigestDriver::Write_Digest(string Full_Filename) {
 	}
 	else {
 		gui_err("digest_error= * Digest Error!");
-		delete digest;
 		return false;
 	}
-	delete digest;
 	return true;
 }
 
@@ -191,40 +495,87 @@ bool twrpDigestDriver::Make_Digest(string Full_Filename) {
 		if (!Write_Digest(Full_Filename))
 			return false;
 	} else {
-		char filename[512];
-		int index = 0;
-		sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-		while (index < 1000) {
-			string digest_src(filename);
-			if (TWFunc::Path_Exists(filename)) {
-				if (!Write_Digest(filename))
-					return false;
-				}
-				else
-					break;
-				index++;
-				sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-			}
-			if (index == 0) {
-				LOGERR("Backup file: '%s' not found!\n", filename);
-					return false;
-			}
-			gui_msg("digest_created= * Digest Created.");
+		vector<string> split;
+
+		Find_Split_Archives(Full_Filename, split);
+		if (split.empty()) {
+			LOGERR("Backup file: '%s' not found!\n", Full_Filename.c_str());
+			return false;
+		}
+		for (size_t i = 0; i < split.size(); i++) {
+			if (!Write_Digest(split[i]))
+				return false;
+		}
+		gui_msg("digest_created= * Digest Created.");
 	}
 	return true;
 }
 
 bool twrpDigestDriver::stream_file_to_digest(string filename, twrpDigest* digest) {
-	char buf[4096];
-	int bytes;
+	return Stream_To_Digest(filename, digest, NULL);
+}
 
-	int fd = open(filename.c_str(), O_RDONLY);
-	if (fd < 0) {
-		return false;
-	}
-	while ((bytes = read(fd, &buf, sizeof(buf))) != 0) {
-		digest->update((unsigned char*)buf, bytes);
-	}
-	close(fd);
-	return true;
+twrpDigestSink::twrpDigestSink(const string& Full_Filename) {
+	filename = Full_Filename;
+	digest = New_Backup_Digest(use_sha2);
+}
+
+twrpDigestSink::~twrpDigestSink() {
+	delete digest;
+}
+
+void twrpDigestSink::update(const void* stream, size_t len) {
+	digest->update((const unsigned char*)stream, len);
+}
+
+bool twrpDigestSink::finish() {
+	return twrpDigestDriver::Save_Digest(filename, digest, use_sha2);
+}
+
+twrpDigestCheckSink::twrpDigestCheckSink(const string& Filename) {
+	twrpDigestCheck check;
+
+	check.filename = Filename;
+	check.use_sha2 = false;
+	Find_Digest_File(check);
+	filename = Filename;
+	digestfile = check.digestfile;
+	use_sha2 = check.use_sha2;
+#ifndef TW_NO_SHA2_LIBRARY
+	if (use_sha2)
+		digest = new twrpSHA256();
+	else
+#endif
+		digest = new twrpMD5();
+}
+
+twrpDigestCheckSink::~twrpDigestCheckSink() {
+	delete digest;
+}
+
+bool twrpDigestCheckSink::found() {
+	return !digestfile.empty();
+}
+
+void twrpDigestCheckSink::update(const void* stream, size_t len) {
+	digest->update((const unsigned char*)stream, len);
+}
+
+bool twrpDigestCheckSink::finish() {
+	twrpDigestVerify verify;
+	twrpDigestCheck check;
+
+	check.filename = filename;
+	check.digestfile = digestfile;
+	check.use_sha2 = use_sha2;
+	if (!found())
+		check.status = DIGEST_NO_SIDECAR;
+	else if (TWFunc::read_file(digestfile, check.digest_str) != 0)
+		check.status = DIGEST_SIDECAR_ERROR;
+	else if (digest->return_digest_string() + "  " + TWFunc::Get_Filename(filename) == check.digest_str)
+		check.status = DIGEST_MATCHED;
+	else
+		check.status = DIGEST_MISMATCH;
+	verify.checks.push_back(check);
+	return Report_Digests(verify);
 }
@@ -19,6 +19,7 @@
 #ifndef __TWRP_DIGEST_DRIVER
 #define __TWRP_DIGEST_DRIVER
 #include <string>
+#include <vector>
 #include "twrpDigest/twrpDigest.hpp"
 
 class twrpDigestDriver {
@@ -26,8 +27,40 @@ public:
 
 	static bool Check_File_Digest(const string& Filename);		//Check the digest of a TWRP partition backup
 	static bool Check_Digest(string Full_Filename);				//Check to make sure the digest is correct
+	static bool Check_Digests(const std::vector<string>& Full_Filenames, bool show_progress); //Check several backups, hashing their files in parallel
 	static bool Write_Digest(string Full_Filename);				//Write the digest to a file
 	static bool Make_Digest(string Full_Filename);				//Create the digest for a partition backup
 	static bool stream_file_to_digest(string filename, twrpDigest* digest); //Stream the file to twrpDigest
+	static bool Save_Digest(string Full_Filename, twrpDigest* digest, bool use_sha2); //Write the digest sidecar for a file
+};
+
+// Hashes an archive while it is being written so no second read is needed to create the digest
+class twrpDigestSink {
+public:
+	twrpDigestSink(const string& Full_Filename);                   // Pick SHA2 or MD5 the same way Write_Digest does
+	~twrpDigestSink();
+	void update(const void* stream, size_t len);                    // Hash bytes that were just written to Full_Filename
+	bool finish();                                                  // Write the .sha2/.md5 sidecar once the archive is closed
+
+private:
+	twrpDigest* digest;
+	string filename;
+	bool use_sha2;
+};
+
+// Checks a file against its sidecar while the caller streams the file, so the check can share a read with other hashing
+class twrpDigestCheckSink {
+public:
+	twrpDigestCheckSink(const string& Filename);                    // Look for the sidecar the way Check_File_Digest does
+	~twrpDigestCheckSink();
+	bool found();                                                   // False when there is no sidecar, finish() then only warns
+	void update(const void* stream, size_t len);                    // Hash the next bytes of the file
+	bool finish();                                                  // Compare with the sidecar and report like Check_File_Digest
+
+private:
+	twrpDigest* digest;
+	string filename;
+	string digestfile;
+	bool use_sha2;
 };
 #endif //__TWRP_DIGEST_DRIVER
@@ -0,0 +1,376 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "twrpFileManifest.hpp"
+#include "exclude.hpp"
+#include "gui/gui.hpp"
+#include "twcommon.h"
+
+#define GETDENTS_BUF_SIZE 32768
+#define MANIFEST_HEADER "twrp file manifest 2"
+#define MANIFEST_HEADER_V1 "twrp file manifest 1"   // whole second times, still read for older backups
+
+using namespace std;
+
+// Layout the kernel uses for getdents64, bionic does not export the call
+struct twrp_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+twrpFileManifest::twrpFileManifest() {
+	total_size = 0;
+	file_count = 0;
+}
+
+const char* twrpFileManifest::Name(size_t index) const {
+	const char *path = Path(index);
+	const char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
+}
+
+void twrpFileManifest::Get_Stat(size_t index, struct stat *st) const {
+	const twrpManifestEntry& entry = entries[index];
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = entry.mode;
+	st->st_uid = entry.uid;
+	st->st_gid = entry.gid;
+	st->st_size = entry.size;
+	st->st_mtim = entry.mtime;
+	st->st_ctim = entry.ctime;
+	st->st_ino = entry.ino;
+	st->st_dev = entry.dev;
+}
+
+uint64_t twrpFileManifest::Subtree_Size(size_t index) const {
+	uint64_t size = 0;
+
+	for (size_t i = index; i < entries[index].subtree_end; i++) {
+		if (!S_ISDIR(entries[i].mode))
+			size += entries[i].size;
+	}
+	return size;
+}
+
+int twrpFileManifest::Build(const string& Path, TWExclude *exclusions) {
+	string path = Path;
+	int dir_fd;
+
+	entries.clear();
+	arena.clear();
+	total_size = 0;
+	file_count = 0;
+
+	dir_fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		return -1;
+	}
+	if (Walk(dir_fd, path, 1, exclusions, true) != 0)
+		return -1;
+	LOGINFO("Manifest of '%s': %zu entries, %i files, %llu bytes\n", Path.c_str(), entries.size(), file_count, (unsigned long long)total_size);
+	return file_count;
+}
+
+uint64_t twrpFileManifest::Get_Folder_Size(const string& Path, TWExclude *exclusions) {
+	twrpFileManifest manifest;
+	string path = Path;
+	int dir_fd;
+
+	dir_fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		return 0;
+	}
+	manifest.Walk(dir_fd, path, 1, exclusions, false);
+	return manifest.total_size;
+}
+
+// Walks the directory open on dir_fd, which is closed before returning.
+// When only sizing (record is false) unreadable items are skipped, otherwise
+// they fail the walk the same way they would fail the backup.
+int twrpFileManifest::Walk(int dir_fd, string& path, uint32_t depth, TWExclude *exclusions, bool record) {
+	struct twrp_dirent64 *de;
+	struct stat st;
+	size_t path_len = path.size(), index = 0;
+	char *buf;
+	long bytes = 0, pos;
+	int child_fd, ret = 0;
+
+	buf = (char*) malloc(GETDENTS_BUF_SIZE);
+	if (buf == NULL) {
+		close(dir_fd);
+		return -1;
+	}
+	while (ret == 0 && (bytes = syscall(SYS_getdents64, dir_fd, buf, GETDENTS_BUF_SIZE)) > 0) {
+		for (pos = 0; pos < bytes; pos += de->d_reclen) {
+			de = (struct twrp_dirent64*)(buf + pos);
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (de->d_type == DT_BLK || de->d_type == DT_CHR)
+				continue;
+			path.resize(path_len);
+			path += "/";
+			path += de->d_name;
+			if (exclusions != NULL && (exclusions->check_relative_skip_dirs(de->d_name) || exclusions->check_absolute_skip_dirs(path)))
+				continue;
+			if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+				LOGINFO("Real error: Unable to stat '%s'\n", path.c_str());
+				if (record) {
+					ret = -1;
+					break;
+				}
+				continue;
+			}
+			if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+				continue;
+			if (!S_ISDIR(st.st_mode))
+				total_size += (uint64_t)(st.st_size);
+			if (S_ISREG(st.st_mode))
+				file_count++;
+
+			if (record) {
+				twrpManifestEntry entry;
+
+				entry.path = arena.size();
+				arena.insert(arena.end(), path.begin(), path.end());
+				arena.push_back('\0');
+				entry.size = (uint64_t)(st.st_size);
+				entry.ino = (uint64_t)(st.st_ino);
+				entry.dev = st.st_dev;
+				entry.mtime = st.st_mtim;
+				entry.ctime = st.st_ctim;
+				entry.mode = st.st_mode;
+				entry.uid = st.st_uid;
+				entry.gid = st.st_gid;
+				entry.depth = depth;
+				index = entries.size();
+				entries.push_back(entry);
+				entries[index].subtree_end = index + 1;
+			}
+
+			if (S_ISDIR(st.st_mode)) {
+				child_fd = openat(dir_fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (child_fd < 0) {
+					gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+					if (record) {
+						ret = -1;
+						break;
+					}
+					continue;
+				}
+				if (Walk(child_fd, path, depth + 1, exclusions, record) != 0 && record) {
+					ret = -1;
+					break;
+				}
+				if (record)
+					entries[index].subtree_end = entries.size();
+			}
+		}
+	}
+	if (ret == 0 && bytes < 0) {
+		path.resize(path_len);
+		LOGINFO("Unable to read directory '%s' (%s)\n", path.c_str(), strerror(errno));
+		if (record)
+			ret = -1;
+	}
+	path.resize(path_len);
+	free(buf);
+	close(dir_fd);
+	return ret;
+}
+
+// One line per entry: mode uid gid size mtime ctime inode, then the length
+// of the path and the path itself so names with spaces or newlines survive.
+// Times are written as seconds.nanoseconds.
+int twrpFileManifest::Save(const string& filename, const vector<bool> *skip) const {
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(filename.c_str(), "we");
+	if (fp == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
+		return -1;
+	}
+	fprintf(fp, "%s\n", MANIFEST_HEADER);
+	for (size_t i = 0; i < entries.size(); i++) {
+		const twrpManifestEntry& entry = entries[i];
+		const char *path = Path(i);
+
+		if (skip != NULL && (*skip)[i])
+			continue;
+		fprintf(fp, "%o %u %u %llu %lld.%09ld %lld.%09ld %llu %zu %s\n", (unsigned)entry.mode, (unsigned)entry.uid, (unsigned)entry.gid,
+			(unsigned long long)entry.size, (long long)entry.mtime.tv_sec, (long)entry.mtime.tv_nsec, (long long)entry.ctime.tv_sec,
+			(long)entry.ctime.tv_nsec, (unsigned long long)entry.ino, strlen(path), path);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || ferror(fp))
+		ret = -1;
+	if (fclose(fp) != 0)
+		ret = -1;
+	if (ret != 0)
+		LOGINFO("Error writing manifest '%s' (%s)\n", filename.c_str(), strerror(errno));
+	return ret;
+}
+
+int twrpFileManifest::Load(const string& filename) {
+	char header[sizeof(MANIFEST_HEADER) + 1];
+	unsigned mode, uid, gid;
+	unsigned long long size, ino;
+	long long mtime, ctime;
+	long mtime_nsec = 0, ctime_nsec = 0;
+	size_t len;
+	bool whole_seconds;
+	FILE *fp;
+	int ret = 0;
+
+	entries.clear();
+	arena.clear();
+	total_size = 0;
+	file_count = 0;
+
+	fp = fopen(filename.c_str(), "re");
+	if (fp == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(filename)(strerror(errno)));
+		return -1;
+	}
+	if (fgets(header, sizeof(header), fp) == NULL || (strcmp(header, MANIFEST_HEADER "\n") != 0 && strcmp(header, MANIFEST_HEADER_V1 "\n") != 0)) {
+		LOGINFO("'%s' is not a file manifest\n", filename.c_str());
+		fclose(fp);
+		return -1;
+	}
+	whole_seconds = strcmp(header, MANIFEST_HEADER_V1 "\n") == 0;
+	for (;;) {
+		twrpManifestEntry entry;
+
+		if (whole_seconds) {
+			if (fscanf(fp, "%o %u %u %llu %lld %lld %llu %zu ", &mode, &uid, &gid, &size, &mtime, &ctime, &ino, &len) != 8)
+				break;
+		} else if (fscanf(fp, "%o %u %u %llu %lld.%ld %lld.%ld %llu %zu ", &mode, &uid, &gid, &size, &mtime, &mtime_nsec,
+				&ctime, &ctime_nsec, &ino, &len) != 10) {
+			break;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		entry.path = arena.size();
+		arena.resize(entry.path + len + 1);
+		if (fread(&arena[entry.path], 1, len, fp) != len || fgetc(fp) != '\n') {
+			ret = -1;
+			break;
+		}
+		arena[entry.path + len] = '\0';
+		entry.subtree_end = entries.size() + 1;
+		entry.size = size;
+		entry.ino = ino;
+		entry.mtime.tv_sec = (time_t)mtime;
+		entry.mtime.tv_nsec = mtime_nsec;
+		entry.ctime.tv_sec = (time_t)ctime;
+		entry.ctime.tv_nsec = ctime_nsec;
+		entry.mode = (mode_t)mode;
+		entry.uid = (uid_t)uid;
+		entry.gid = (gid_t)gid;
+		entries.push_back(entry);
+		if (!S_ISDIR(entry.mode))
+			total_size += size;
+		if (S_ISREG(entry.mode))
+			file_count++;
+	}
+	if (ret == 0 && !feof(fp))
+		ret = -1;
+	fclose(fp);
+	if (ret != 0)
+		LOGINFO("Manifest '%s' is truncated or damaged\n", filename.c_str());
+	return ret;
+}
+
+static bool Same_Time(const struct timespec& a, const struct timespec& b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Keeps directories and every file or symlink that is new or whose size,
+// times, inode, mode or owner differ from the base manifest, and records
+// what the base has that this tree no longer does in deleted_filename.
+// Contents are not hashed, reading every unchanged file again would cost
+// what the incremental backup is meant to save.
+int twrpFileManifest::Apply_Base(const twrpFileManifest& base, const string& deleted_filename) {
+	unordered_map<string, size_t> base_index;
+	unordered_map<string, size_t>::const_iterator found;
+	vector<bool> seen(base.Count(), false);
+	vector<size_t> kept_before(entries.size() + 1, 0);
+	vector<twrpManifestEntry> kept;
+	size_t i;
+
+	base_index.reserve(base.Count());
+	for (i = 0; i < base.Count(); i++)
+		base_index[base.Path(i)] = i;
+
+	total_size = 0;
+	file_count = 0;
+	for (i = 0; i < entries.size(); i++) {
+		const twrpManifestEntry& entry = entries[i];
+		bool keep = true;
+
+		kept_before[i] = kept.size();
+		found = base_index.find(Path(i));
+		if (found != base_index.end()) {
+			const twrpManifestEntry& old = base.Entry(found->second);
+
+			// A path that changed type is removed before the new one is extracted
+			if ((entry.mode & S_IFMT) == (old.mode & S_IFMT))
+				seen[found->second] = true;
+			keep = S_ISDIR(entry.mode) || entry.size != old.size || !Same_Time(entry.mtime, old.mtime) || !Same_Time(entry.ctime, old.ctime) ||
+				entry.ino != old.ino || entry.mode != old.mode || entry.uid != old.uid || entry.gid != old.gid;
+		}
+		if (!keep)
+			continue;
+		kept.push_back(entry);
+		if (!S_ISDIR(entry.mode))
+			total_size += entry.size;
+		if (S_ISREG(entry.mode))
+			file_count++;
+	}
+	kept_before[entries.size()] = kept.size();
+
+	if (base.Save(deleted_filename, &seen) != 0)
+		return -1;
+
+	// Directories keep covering the same range of what is left
+	for (i = 0; i < kept.size(); i++)
+		kept[i].subtree_end = kept_before[kept[i].subtree_end];
+	LOGINFO("Incremental manifest: %zu of %zu entries changed, %i files, %llu bytes\n", kept.size(), entries.size(), file_count, (unsigned long long)total_size);
+	entries.swap(kept);
+	return file_count;
+}
@@ -0,0 +1,75 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_FILE_MANIFEST_HPP
+#define __TWRP_FILE_MANIFEST_HPP
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class TWExclude;
+
+// One directory, regular file or symlink found by the walk. Entries are
+// stored in the order a recursive readdir would return them, with each
+// directory ahead of its contents.
+struct twrpManifestEntry {
+	size_t path;                                                    // offset of the full path in the path arena
+	size_t subtree_end;                                             // index after the last entry inside this directory
+	uint64_t size;
+	uint64_t ino;
+	dev_t dev;
+	struct timespec mtime;                                          // with nanoseconds, a file rewritten within a second still differs
+	struct timespec ctime;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	uint32_t depth;                                                 // 1 for items directly inside the walked path
+};
+
+// Walks a tree once with getdents64 and fstatat relative to directory fds
+// and keeps what sizing, thread partitioning and the tar writer need, so
+// none of them has to stat the files again.
+class twrpFileManifest {
+public:
+	twrpFileManifest();
+	int Build(const std::string& Path, TWExclude *exclusions);     // returns the number of regular files or -1 on error
+	size_t Count() const { return entries.size(); }
+	const twrpManifestEntry& Entry(size_t index) const { return entries[index]; }
+	const char* Path(size_t index) const { return &arena[entries[index].path]; }
+	const char* Name(size_t index) const;                          // last component of the path
+	void Get_Stat(size_t index, struct stat *st) const;            // fills in the fields libtar uses
+	uint64_t Subtree_Size(size_t index) const;                     // size of an entry and everything inside it
+	uint64_t Total_Size() const { return total_size; }              // regular files and symlinks
+	int Save(const std::string& filename, const std::vector<bool> *skip = NULL) const; // entries with skip[i] set are left out
+	int Load(const std::string& filename);                         // only the paths and stat fields are restored
+	int Apply_Base(const twrpFileManifest& base, const std::string& deleted_filename); // drops files unchanged since base, returns the files left or -1
+	static uint64_t Get_Folder_Size(const std::string& Path, TWExclude *exclusions); // same walk without keeping the entries
+
+private:
+	int Walk(int dir_fd, std::string& path, uint32_t depth, TWExclude *exclusions, bool record);
+
+	std::vector<twrpManifestEntry> entries;
+	std::vector<char> arena;
+	uint64_t total_size;
+	int file_count;
+};
+
+#endif // __TWRP_FILE_MANIFEST_HPP
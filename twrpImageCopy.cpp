@@ -0,0 +1,315 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <string>
+
+using namespace std;
+
+#include "twrpImageCopy.hpp"
+#include "twrpDigestDriver.hpp"
+#include "progresstracking.hpp"
+#include "partitions.hpp"
+#include "gui/gui.hpp"
+#include "twcommon.h"
+
+#define COPY_BUFFER_SIZE 1048576             // 1MB, same chunk size the old read / write loop used
+#define COPY_BUFFER_COUNT 4
+#define SPLICE_CHUNK 1048576
+#define DIRECT_IO_ALIGN 4096
+
+static unsigned long long Monotonic_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool Is_Zero(const unsigned char *data, size_t len) {
+	return len > 0 && data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+twrpImageCopy::twrpImageCopy(const string& Source, const string& Destination) {
+	source = Source;
+	destination = Destination;
+	digest = NULL;
+	progress = NULL;
+	src_fd = -1;
+	dest_fd = -1;
+	src_fifo = false;
+	dest_fifo = false;
+	dest_blk = false;
+	dest_reg = false;
+	sparse = false;
+	hole_at_end = false;
+	offset = 0;
+	remain = 0;
+	start_ms = 0;
+}
+
+twrpImageCopy::~twrpImageCopy() {
+	if (src_fd >= 0)
+		close(src_fd);
+	if (dest_fd >= 0)
+		close(dest_fd);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		free(jobs[i]->in);
+		delete jobs[i];
+	}
+}
+
+void twrpImageCopy::Set_Source_Fd(int fd) {
+	src_fd = fd;
+}
+
+void twrpImageCopy::Set_Destination_Fd(int fd) {
+	dest_fd = fd;
+}
+
+bool twrpImageCopy::Open_Files(unsigned long long size) {
+	struct stat st;
+	bool src_blk = false, direct, src_open = src_fd >= 0, dest_open = dest_fd >= 0;
+
+	if (src_open ? fstat(src_fd, &st) == 0 : stat(source.c_str(), &st) == 0) {
+		src_fifo = S_ISFIFO(st.st_mode);
+		src_blk = S_ISBLK(st.st_mode);
+	}
+	if (dest_open ? fstat(dest_fd, &st) == 0 : stat(destination.c_str(), &st) == 0) {
+		dest_fifo = S_ISFIFO(st.st_mode);
+		dest_blk = S_ISBLK(st.st_mode);
+	}
+	dest_reg = !dest_fifo && !dest_blk;
+	// Bypass the page cache on block devices unless splice() will be used
+	direct = !src_fifo && !dest_fifo && size % DIRECT_IO_ALIGN == 0;
+
+	if (src_blk && direct && !src_open)
+		src_fd = open(source.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC | O_DIRECT);
+	if (src_fd < 0)
+		src_fd = open(source.c_str(), O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(source)(strerror(errno)));
+		return false;
+	}
+
+	if (dest_blk && direct && !dest_open)
+		dest_fd = open(destination.c_str(), O_WRONLY | O_LARGEFILE | O_CLOEXEC | O_DIRECT);
+	if (dest_fd < 0)
+		dest_fd = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destination)(strerror(errno)));
+		return false;
+	}
+	// The adb stream has to carry every byte
+	sparse = !dest_fifo;
+	return true;
+}
+
+bool twrpImageCopy::Copy(unsigned long long size) {
+	bool supported = false, ret = false;
+	unsigned long long elapsed;
+
+	if (!Open_Files(size))
+		return false;
+
+	LOGINFO("Reading '%s', writing '%s'\n", source.c_str(), destination.c_str());
+	start_ms = Monotonic_ms();
+	if ((src_fifo || dest_fifo) && digest == NULL) {
+		supported = true;
+		ret = Splice_Copy(size, &supported);
+		if (!supported)
+			LOGINFO("splice not supported, copying through buffers\n");
+	}
+	if (!supported)
+		ret = Buffered_Copy(size);
+	if (!ret)
+		return false;
+
+	fsync(dest_fd);
+	elapsed = Monotonic_ms() - start_ms;
+	if (elapsed == 0)
+		elapsed = 1;
+	LOGINFO("Copied %llu bytes in %llu ms (%llu MB/s)\n", size, elapsed, size * 1000 / elapsed / 1048576);
+	return true;
+}
+
+void twrpImageCopy::Update_Progress(unsigned long long done) {
+	unsigned long long elapsed;
+
+	if (!progress)
+		return;
+	elapsed = Monotonic_ms() - start_ms;
+	if (elapsed != 0)
+		progress->SetRate(done * 1000 / elapsed);
+	progress->UpdateSize(done);
+}
+
+bool twrpImageCopy::Splice_Copy(unsigned long long size, bool *supported) {
+	unsigned long long done = 0;
+	size_t len;
+	ssize_t bs;
+
+	while (done < size) {
+		len = size - done < SPLICE_CHUNK ? (size_t)(size - done) : SPLICE_CHUNK;
+		bs = splice(src_fd, NULL, dest_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (bs < 0 && errno == EINTR)
+			continue;
+		if (bs < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+			*supported = false;
+			return false;
+		}
+		if (bs <= 0) {
+			LOGINFO("Error copying '%s' to '%s' (%s)\n", source.c_str(), destination.c_str(), bs < 0 ? strerror(errno) : "unexpected end of data");
+			return false;
+		}
+		done += (unsigned long long)bs;
+		Update_Progress(done);
+		if (PartitionManager.Check_Backup_Cancel() != 0)
+			return false;
+	}
+	return true;
+}
+
+void* twrpImageCopy::Read_Thread(void *cookie) {
+	twrpImageCopy *copy = (twrpImageCopy*) cookie;
+	twrpPipelineJob *job;
+	size_t len, pos;
+	ssize_t bs;
+
+	while (copy->remain > 0) {
+		job = copy->free_jobs.Pop();
+		if (job == NULL)
+			break;
+		len = copy->remain < job->in_size ? (size_t)copy->remain : job->in_size;
+		for (pos = 0; pos < len; pos += bs) {
+			bs = read(copy->src_fd, job->in + pos, len - pos);
+			if (bs < 0 && errno == EINTR) {
+				bs = 0;
+				continue;
+			}
+			if (bs <= 0) {
+				LOGINFO("Error reading source fd (%s)\n", bs < 0 ? strerror(errno) : "unexpected end of data");
+				job->in_len = 0;
+				copy->full_jobs.Push(job);
+				return NULL;
+			}
+		}
+		job->in_len = len;
+		copy->remain -= len;
+		job->last = (copy->remain == 0);
+		copy->full_jobs.Push(job);
+	}
+	return NULL;
+}
+
+bool twrpImageCopy::Write_Chunk(const unsigned char *data, size_t len) {
+	size_t pos;
+	ssize_t bs;
+
+	if (sparse && Is_Zero(data, len)) {
+		if (dest_blk) {
+			uint64_t range[2] = { offset, len };
+
+			if (((offset | len) & 511) == 0 && ioctl(dest_fd, BLKZEROOUT, &range) == 0 && lseek64(dest_fd, len, SEEK_CUR) >= 0) {
+				offset += len;
+				return true;
+			}
+		} else if (dest_reg && lseek64(dest_fd, len, SEEK_CUR) >= 0) {
+			offset += len;
+			hole_at_end = true;
+			return true;
+		}
+	}
+	hole_at_end = false;
+	for (pos = 0; pos < len; pos += bs) {
+		bs = write(dest_fd, data + pos, len - pos);
+		if (bs < 0 && errno == EINTR) {
+			bs = 0;
+			continue;
+		}
+		if (bs <= 0)
+			return false;
+	}
+	offset += len;
+	return true;
+}
+
+bool twrpImageCopy::Buffered_Copy(unsigned long long size) {
+	twrpPipelineJob *job;
+	pthread_t reader;
+	unsigned long long done = 0;
+	bool ret = true;
+
+	for (int i = 0; i < COPY_BUFFER_COUNT; i++) {
+		job = new twrpPipelineJob();
+		memset(job, 0, sizeof(*job));
+		if (posix_memalign((void**)&job->in, DIRECT_IO_ALIGN, COPY_BUFFER_SIZE) != 0) {
+			delete job;
+			LOGINFO("Raw_Read_Write failed to malloc\n");
+			return false;
+		}
+		job->in_size = COPY_BUFFER_SIZE;
+		jobs.push_back(job);
+		free_jobs.Push(job);
+	}
+
+	remain = size;
+	if (pthread_create(&reader, NULL, Read_Thread, this) != 0) {
+		LOGINFO("Unable to start image reader thread\n");
+		return false;
+	}
+	while (done < size) {
+		job = full_jobs.Pop();
+		if (job == NULL || job->in_len == 0) {
+			ret = false;
+			break;
+		}
+		if (!Write_Chunk(job->in, job->in_len)) {
+			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+			ret = false;
+			break;
+		}
+		if (digest)
+			digest->update(job->in, job->in_len);
+		done += job->in_len;
+		free_jobs.Push(job);
+		Update_Progress(done);
+		if (PartitionManager.Check_Backup_Cancel() != 0) {
+			ret = false;
+			break;
+		}
+	}
+	if (!ret) {
+		free_jobs.Abort();
+		full_jobs.Abort();
+	}
+	pthread_join(reader, NULL);
+	if (ret && hole_at_end && ftruncate64(dest_fd, offset) != 0) {
+		LOGINFO("Error extending '%s' (%s)\n", destination.c_str(), strerror(errno));
+		ret = false;
+	}
+	return ret;
+}
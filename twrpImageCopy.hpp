@@ -0,0 +1,72 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPIMAGECOPY_HPP
+#define __TWRPIMAGECOPY_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "twrpTarPipeline.hpp"
+
+class twrpDigestSink;
+class ProgressTracking;
+
+// Copies a raw image between a block device and an image file or the adb
+// stream. A reader thread fills buffers while the caller's thread writes
+// them out, block devices are opened with O_DIRECT when the size allows it,
+// zero filled chunks become holes in image files or BLKZEROOUT on block
+// devices, and copies to or from the adb fifo use splice().
+class twrpImageCopy {
+public:
+	twrpImageCopy(const std::string& Source, const std::string& Destination);
+	~twrpImageCopy();
+	bool Copy(unsigned long long size);                             // copies size bytes from the start of Source
+	void Set_Source_Fd(int fd);                                      // read from an already open stream instead, which is closed when done
+	void Set_Destination_Fd(int fd);                                 // write to an already open stream instead, which is closed when done
+
+	twrpDigestSink *digest;                                          // hashes the data as it is written
+	ProgressTracking *progress;
+
+private:
+	bool Open_Files(unsigned long long size);
+	bool Splice_Copy(unsigned long long size, bool *supported);
+	bool Buffered_Copy(unsigned long long size);
+	bool Write_Chunk(const unsigned char *data, size_t len);
+	void Update_Progress(unsigned long long done);
+	static void* Read_Thread(void *cookie);
+
+	std::string source;
+	std::string destination;
+	int src_fd;
+	int dest_fd;
+	bool src_fifo;
+	bool dest_fifo;
+	bool dest_blk;
+	bool dest_reg;
+	bool sparse;                                                     // zero chunks are skipped instead of written
+	bool hole_at_end;                                                // the file needs extending to its full size
+	unsigned long long offset;                                       // write position in the destination
+	unsigned long long remain;                                       // bytes left for the reader thread
+	unsigned long long start_ms;
+	twrpPipelineQueue free_jobs;
+	twrpPipelineQueue full_jobs;
+	std::vector<twrpPipelineJob*> jobs;
+};
+
+#endif // __TWRPIMAGECOPY_HPP
@@ -55,6 +55,7 @@ bool twrpRepacker::Backup_Image_For_Repack(TWPartition* Part, const std::string&
 	part_settings.adbbackup = false;
 	part_settings.generate_digest = false;
 	part_settings.generate_md5 = false;
+	part_settings.verify_digest = false;
 	part_settings.PM_Method = PM_BACKUP;
 	part_settings.progress = NULL;
 	pid_t not_a_pid = 0;
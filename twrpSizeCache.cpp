@@ -0,0 +1,523 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "twrpSizeCache.hpp"
+#include "data.hpp"
+#include "exclude.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "variables.h"
+#include "gui/gui.hpp"
+
+#define SIZE_CACHE_HEADER "twrp size cache 1"
+#define SIZE_GETDENTS_BUF_SIZE 32768
+#define SIZE_MAX_THREADS 4                     // more walkers than this only make the storage seek
+#define SIZE_PROGRESS_MS 250
+#define SIZE_MAX_ERRORS 20                     // errors shown once the walk is done, the rest are counted
+
+using namespace std;
+
+// Layout the kernel uses for getdents64, bionic does not export the call
+struct twrp_size_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct twrpSizeRoot {
+	string signature;                          // exclusions the tree was sized with
+	twrpSizeTree tree;
+};
+
+struct twrpSizeWalk {
+	const twrpSizeTree *old_tree;              // NULL when nothing is known about the root
+	TWExclude *exclusions;
+	int root_fd;
+	string root;
+	vector<string> top;                        // directories directly inside the root, taken in order
+	size_t next;
+	bool top_failed;
+	uint64_t done_bytes;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+struct twrpSizeWorker {
+	twrpSizeWalk *walk;
+	twrpSizeTree tree;
+	uint64_t size;
+	uint64_t unreported;                       // bytes not added to done_bytes yet
+	vector<pair<string, int> > errors;
+	int error_count;
+	size_t dirs;
+	size_t listed;                             // directories that changed since the last sizing
+	pthread_t thread;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, twrpSizeRoot> cache;       // every root sized since boot or found in the cache file
+
+static int64_t To_Ns(const struct timespec& ts) {
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static string Cache_File() {
+	return DataManager::GetSettingsStoragePath() + DataManager::GetStrValue(TW_RECOVERY_NAME) + TW_SIZE_CACHE_FILE;
+}
+
+// Everything TWExclude skips changes what a directory adds up to
+static string Exclusion_Signature(TWExclude *exclusions) {
+	return exclusions == NULL ? "none" : exclusions->signature();
+}
+
+static void Add_Error(twrpSizeWorker *worker, const string& path, int err) {
+	if (worker->errors.size() < SIZE_MAX_ERRORS)
+		worker->errors.push_back(make_pair(path, err));
+	worker->error_count++;
+}
+
+static void Add_Progress(twrpSizeWorker *worker, uint64_t bytes) {
+	worker->unreported += bytes;
+	if (worker->unreported < 64 * 1048576ULL)
+		return;
+	pthread_mutex_lock(&worker->walk->lock);
+	worker->walk->done_bytes += worker->unreported;
+	pthread_mutex_unlock(&worker->walk->lock);
+	worker->unreported = 0;
+}
+
+// Lists the directory the way twrpFileManifest::Walk does, adding up the
+// files and keeping the names of the subdirectories
+static bool List_Dir(twrpSizeWorker *worker, int dir_fd, string& path, twrpSizeDir *dir) {
+	struct twrp_size_dirent64 *de;
+	struct stat st;
+	TWExclude *exclusions = worker->walk->exclusions;
+	size_t path_len = path.size();
+	char *buf;
+	long bytes, pos;
+
+	buf = (char*) malloc(SIZE_GETDENTS_BUF_SIZE);
+	if (buf == NULL)
+		return false;
+	while ((bytes = syscall(SYS_getdents64, dir_fd, buf, SIZE_GETDENTS_BUF_SIZE)) > 0) {
+		for (pos = 0; pos < bytes; pos += de->d_reclen) {
+			de = (struct twrp_size_dirent64*)(buf + pos);
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (de->d_type == DT_BLK || de->d_type == DT_CHR)
+				continue;
+			path.resize(path_len);
+			path += "/";
+			path += de->d_name;
+			if (exclusions != NULL && (exclusions->check_relative_skip_dirs(de->d_name) || exclusions->check_absolute_skip_dirs(path)))
+				continue;
+			if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				Add_Error(worker, path, errno);
+				continue;
+			}
+			if (S_ISDIR(st.st_mode))
+				dir->subdirs.push_back(de->d_name);
+			else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+				dir->files_size += (uint64_t)(st.st_size);
+		}
+	}
+	path.resize(path_len);
+	free(buf);
+	if (bytes < 0) {
+		LOGINFO("Unable to read directory '%s' (%s)\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Fills in dir from the last sizing when the directory did not change since,
+// otherwise lists it. st is taken before the directory is listed, so a change
+// made during the listing shows up as a changed directory next time.
+static void Read_Dir(twrpSizeWorker *worker, int dir_fd, string& path, const struct stat& st, twrpSizeDir *dir) {
+	const twrpSizeTree *old_tree = worker->walk->old_tree;
+	twrpSizeTree::const_iterator old;
+
+	dir->ino = (uint64_t)st.st_ino;
+	dir->mtime = To_Ns(st.st_mtim);
+	dir->ctime = To_Ns(st.st_ctim);
+	dir->files_size = 0;
+	if (old_tree != NULL && (old = old_tree->find(path)) != old_tree->end() && old->second.mtime >= 0 &&
+		old->second.ino == dir->ino && old->second.mtime == dir->mtime && old->second.ctime == dir->ctime) {
+		dir->files_size = old->second.files_size;
+		dir->subdirs = old->second.subdirs;
+		return;
+	}
+	worker->listed++;
+	if (!List_Dir(worker, dir_fd, path, dir))
+		dir->mtime = -1;
+}
+
+// Sizes the directory open on dir_fd, which is closed before returning
+static uint64_t Size_Dir(twrpSizeWorker *worker, int dir_fd, string& path, const struct stat& st) {
+	twrpSizeDir dir;
+	struct stat child_st;
+	size_t path_len = path.size();
+	uint64_t total;
+	int child_fd;
+
+	Read_Dir(worker, dir_fd, path, st, &dir);
+	Add_Progress(worker, dir.files_size);
+
+	total = dir.files_size;
+	for (size_t i = 0; i < dir.subdirs.size(); i++) {
+		path.resize(path_len);
+		path += "/";
+		path += dir.subdirs[i];
+		child_fd = openat(dir_fd, dir.subdirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (child_fd < 0 || fstat(child_fd, &child_st) != 0) {
+			Add_Error(worker, path, errno);
+			if (child_fd >= 0)
+				close(child_fd);
+			// Not trusted next time, or the missing subdirectory would never be counted
+			dir.mtime = -1;
+			continue;
+		}
+		total += Size_Dir(worker, child_fd, path, child_st);
+	}
+	path.resize(path_len);
+	close(dir_fd);
+	worker->dirs++;
+	worker->tree[path] = dir;
+	return total;
+}
+
+static void* Size_Thread(void *cookie) {
+	twrpSizeWorker *worker = (twrpSizeWorker*) cookie;
+	twrpSizeWalk *walk = worker->walk;
+	struct stat st;
+	string path;
+	size_t i;
+	int dir_fd;
+
+	for (;;) {
+		pthread_mutex_lock(&walk->lock);
+		if (walk->next >= walk->top.size()) {
+			walk->done_bytes += worker->unreported;
+			worker->unreported = 0;
+			walk->running--;
+			pthread_cond_signal(&walk->done);
+			pthread_mutex_unlock(&walk->lock);
+			return NULL;
+		}
+		i = walk->next++;
+		pthread_mutex_unlock(&walk->lock);
+
+		path = walk->root + "/" + walk->top[i];
+		dir_fd = openat(walk->root_fd, walk->top[i].c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dir_fd < 0 || fstat(dir_fd, &st) != 0) {
+			Add_Error(worker, path, errno);
+			if (dir_fd >= 0)
+				close(dir_fd);
+			pthread_mutex_lock(&walk->lock);
+			walk->top_failed = true;
+			pthread_mutex_unlock(&walk->lock);
+			continue;
+		}
+		worker->size += Size_Dir(worker, dir_fd, path, st);
+	}
+}
+
+// Reads the roots of the cache file that are not known in memory yet. A
+// damaged file is ignored as a whole: a directory that lost a subdirectory
+// record would otherwise keep leaving it out.
+static void Load_Cache() {
+	char header[sizeof(SIZE_CACHE_HEADER) + 1];
+	unsigned long long ino, files_size;
+	long long mtime, ctime;
+	size_t len, sig_len;
+	map<string, twrpSizeRoot> loaded;
+	map<string, twrpSizeRoot>::iterator root = loaded.end();
+	string path, signature;
+	bool damaged = false;
+	FILE *fp;
+	char type;
+
+	fp = fopen(Cache_File().c_str(), "re");
+	if (fp == NULL)
+		return;
+	if (fgets(header, sizeof(header), fp) == NULL || strcmp(header, SIZE_CACHE_HEADER "\n") != 0) {
+		fclose(fp);
+		return;
+	}
+	while (!damaged && fscanf(fp, "%c ", &type) == 1) {
+		if (type == 'R' && fscanf(fp, "%zu ", &len) == 1) {
+			path.resize(len);
+			signature.clear();
+			if (fread(&path[0], 1, len, fp) != len || fscanf(fp, " %zu ", &sig_len) != 1) {
+				damaged = true;
+				break;
+			}
+			signature.resize(sig_len);
+			if (fread(&signature[0], 1, sig_len, fp) != sig_len || fgetc(fp) != '\n') {
+				damaged = true;
+				break;
+			}
+			root = loaded.insert(make_pair(path, twrpSizeRoot())).first;
+			root->second.signature = signature;
+		} else if (type == 'D' && root != loaded.end() &&
+			fscanf(fp, "%llu %lld %lld %llu %zu ", &ino, &mtime, &ctime, &files_size, &len) == 5) {
+			path.resize(len);
+			if (fread(&path[0], 1, len, fp) != len || fgetc(fp) != '\n') {
+				damaged = true;
+				break;
+			}
+			twrpSizeTree& tree = root->second.tree;
+			twrpSizeDir& dir = tree[path];
+			dir.ino = ino;
+			dir.mtime = mtime;
+			dir.ctime = ctime;
+			dir.files_size = files_size;
+			// Directories are saved ahead of their contents, the parent is already there
+			if (path != root->first) {
+				twrpSizeTree::iterator parent = tree.find(path.substr(0, path.rfind('/')));
+				if (parent == tree.end()) {
+					damaged = true;
+					break;
+				}
+				parent->second.subdirs.push_back(path.substr(path.rfind('/') + 1));
+			}
+		} else {
+			damaged = true;
+		}
+	}
+	if (damaged || !feof(fp)) {
+		LOGINFO("Size cache '%s' is truncated or damaged\n", Cache_File().c_str());
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	for (root = loaded.begin(); root != loaded.end(); root++) {
+		if (cache.find(root->first) == cache.end())
+			cache[root->first] = root->second;
+	}
+}
+
+static void Save_Dir(FILE *fp, const twrpSizeTree& tree, string& path) {
+	twrpSizeTree::const_iterator dir = tree.find(path);
+	size_t path_len = path.size();
+
+	if (dir == tree.end())
+		return;
+	fprintf(fp, "D %llu %lld %lld %llu %zu %s\n", (unsigned long long)dir->second.ino, (long long)dir->second.mtime,
+		(long long)dir->second.ctime, (unsigned long long)dir->second.files_size, path.size(), path.c_str());
+	for (size_t i = 0; i < dir->second.subdirs.size(); i++) {
+		path += "/";
+		path += dir->second.subdirs[i];
+		Save_Dir(fp, tree, path);
+		path.resize(path_len);
+	}
+}
+
+// Writes every root known in memory. Nothing is saved while the settings
+// folder is not there, the sizes are still kept in memory until then.
+static void Save_Cache() {
+	string filename = Cache_File(), temp = filename + ".tmp", path;
+	FILE *fp;
+	int ret = 0;
+
+	if (!TWFunc::Path_Exists(TWFunc::Get_Path(filename)))
+		return;
+	fp = fopen(temp.c_str(), "we");
+	if (fp == NULL) {
+		LOGINFO("Unable to write size cache '%s' (%s)\n", temp.c_str(), strerror(errno));
+		return;
+	}
+	fprintf(fp, "%s\n", SIZE_CACHE_HEADER);
+	for (map<string, twrpSizeRoot>::const_iterator root = cache.begin(); root != cache.end(); root++) {
+		fprintf(fp, "R %zu %s %zu %s\n", root->first.size(), root->first.c_str(), root->second.signature.size(), root->second.signature.c_str());
+		path = root->first;
+		Save_Dir(fp, root->second.tree, path);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || ferror(fp))
+		ret = -1;
+	if (fclose(fp) != 0)
+		ret = -1;
+	if (ret != 0 || rename(temp.c_str(), filename.c_str()) != 0) {
+		LOGINFO("Unable to write size cache '%s' (%s)\n", filename.c_str(), strerror(errno));
+		unlink(temp.c_str());
+	}
+}
+
+void twrpSizeCache::Invalidate() {
+	pthread_mutex_lock(&cache_lock);
+	cache.clear();
+	// Or Load_Cache() would bring the trees back
+	if (unlink(Cache_File().c_str()) != 0 && errno != ENOENT)
+		LOGINFO("Unable to remove size cache '%s' (%s)\n", Cache_File().c_str(), strerror(errno));
+	pthread_mutex_unlock(&cache_lock);
+}
+
+uint64_t twrpSizeCache::Get_Folder_Size(const string& Path, TWExclude *exclusions, const function<void(uint64_t)>& progress) {
+	twrpSizeWalk walk;
+	twrpSizeWorker workers[SIZE_MAX_THREADS];
+	twrpSizeTree old_tree, tree;
+	twrpSizeDir root_dir;
+	twrpSizeWorker root_worker;
+	map<string, twrpSizeRoot>::iterator cached;
+	string signature = Exclusion_Signature(exclusions), path = Path;
+	struct timespec ts;
+	struct stat st;
+	uint64_t total;
+	size_t dirs = 1, listed = 0;
+	long cores;
+	int thread_count = 0, error_count = 0;
+
+	walk.root_fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (walk.root_fd < 0 || fstat(walk.root_fd, &st) != 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		if (walk.root_fd >= 0)
+			close(walk.root_fd);
+		return 0;
+	}
+
+	// The tree is taken out of the cache while it is being walked
+	pthread_mutex_lock(&cache_lock);
+	if (cache.find(Path) == cache.end())
+		Load_Cache();
+	cached = cache.find(Path);
+	if (cached != cache.end()) {
+		if (cached->second.signature == signature)
+			old_tree.swap(cached->second.tree);
+		cache.erase(cached);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	walk.old_tree = old_tree.empty() ? NULL : &old_tree;
+	walk.exclusions = exclusions;
+	walk.root = Path;
+	walk.next = 0;
+	walk.top_failed = false;
+	walk.done_bytes = 0;
+	walk.running = 0;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.done, NULL);
+
+	root_worker.walk = &walk;
+	root_worker.size = 0;
+	root_worker.unreported = 0;
+	root_worker.error_count = 0;
+	root_worker.dirs = 0;
+	root_worker.listed = 0;
+	Read_Dir(&root_worker, walk.root_fd, path, st, &root_dir);
+	walk.top = root_dir.subdirs;
+	walk.done_bytes = root_dir.files_size;
+	for (int i = 0; i < SIZE_MAX_THREADS; i++) {
+		workers[i].walk = &walk;
+		workers[i].size = 0;
+		workers[i].unreported = 0;
+		workers[i].error_count = 0;
+		workers[i].dirs = 0;
+		workers[i].listed = 0;
+	}
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+	pthread_mutex_lock(&walk.lock);
+	while (thread_count < SIZE_MAX_THREADS && thread_count < cores && (size_t)thread_count < walk.top.size()) {
+		if (pthread_create(&workers[thread_count].thread, NULL, Size_Thread, &workers[thread_count]) != 0)
+			break;
+		walk.running++;
+		thread_count++;
+	}
+	pthread_mutex_unlock(&walk.lock);
+	if (thread_count == 0 && !walk.top.empty()) {
+		// Walk on this thread if no thread could be started
+		walk.running = 1;
+		Size_Thread(&workers[0]);
+		thread_count = 1;
+	} else {
+		pthread_mutex_lock(&walk.lock);
+		while (walk.running > 0) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += SIZE_PROGRESS_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&walk.done, &walk.lock, &ts);
+			if (progress)
+				progress(walk.done_bytes);
+		}
+		pthread_mutex_unlock(&walk.lock);
+		for (int i = 0; i < thread_count; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	pthread_cond_destroy(&walk.done);
+	pthread_mutex_destroy(&walk.lock);
+	close(walk.root_fd);
+
+	total = root_dir.files_size;
+	listed = root_worker.listed;
+	if (walk.top_failed)
+		root_dir.mtime = -1;
+	tree[Path] = root_dir;
+	for (int i = 0; i < thread_count; i++) {
+		twrpSizeWorker& worker = workers[i];
+
+		total += worker.size;
+		dirs += worker.dirs;
+		listed += worker.listed;
+		error_count += worker.error_count;
+		for (twrpSizeTree::iterator dir = worker.tree.begin(); dir != worker.tree.end(); dir++)
+			tree[dir->first] = std::move(dir->second);
+		for (size_t e = 0; e < worker.errors.size(); e++)
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(worker.errors[e].first)(strerror(worker.errors[e].second)));
+	}
+	error_count += root_worker.error_count;
+	for (size_t e = 0; e < root_worker.errors.size(); e++)
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(root_worker.errors[e].first)(strerror(root_worker.errors[e].second)));
+	if (error_count > SIZE_MAX_ERRORS)
+		LOGINFO("%i items of '%s' could not be sized\n", error_count, Path.c_str());
+	if (progress)
+		progress(total);
+	LOGINFO("Size of '%s' is %llu bytes, %zu of %zu directories changed since the last sizing\n", Path.c_str(), (unsigned long long)total, listed, dirs);
+
+	pthread_mutex_lock(&cache_lock);
+	twrpSizeRoot& root = cache[Path];
+	root.signature = signature;
+	root.tree.swap(tree);
+	Save_Cache();
+	pthread_mutex_unlock(&cache_lock);
+	return total;
+}
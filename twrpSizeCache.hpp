@@ -0,0 +1,55 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPSIZECACHE_HPP
+#define __TWRPSIZECACHE_HPP
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TWExclude;
+
+// What the last sizing saw of one directory
+struct twrpSizeDir {
+	uint64_t ino;
+	int64_t mtime;                                                   // nanoseconds, -1 if the listing was incomplete
+	int64_t ctime;
+	uint64_t files_size;                                             // regular files and symlinks directly inside
+	std::vector<std::string> subdirs;                                // names of the directories directly inside
+};
+
+typedef std::unordered_map<std::string, twrpSizeDir> twrpSizeTree; // keyed by full path
+
+// Sizes a tree the way TWExclude::Get_Folder_Size does, but remembers the
+// files total of every directory, in memory and in the TWRP settings folder.
+// A directory whose inode, mtime and ctime did not change since is not
+// listed again and only its subdirectories are visited, so a rescan costs a
+// stat per directory instead of one per file. A file that grows in place
+// does not touch its directory, so its new size is only picked up once its
+// directory changes; a backup therefore drops the cache before it is sized
+// and once it is done. The top level directories are walked in parallel.
+class twrpSizeCache {
+public:
+	static uint64_t Get_Folder_Size(const std::string& Path, TWExclude *exclusions, const std::function<void(uint64_t)>& progress = NULL); // progress gets the running total
+	static void Invalidate();                                        // the next sizing of every root lists all of it again
+};
+
+#endif // __TWRPSIZECACHE_HPP
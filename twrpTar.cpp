@@ -47,11 +47,15 @@ extern "C" {
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
+#include "twrpTarPipeline.hpp"
+#include "twrpFileManifest.hpp"
 
 #ifndef BUILD_TWRPTAR_MAIN
 #include "data.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
+#include "twrpDigestDriver.hpp"
+#include "twrpChunkStore.hpp"
 #endif //ndef BUILD_TWRPTAR_MAIN
 
 #ifdef TW_INCLUDE_FBE
@@ -66,15 +70,151 @@ extern "C" {
 #define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR
 #endif
 
+#define TAR_BATCH_SIZE (32ULL * 1024 * 1024)
+#define TAR_BATCH_ENTRIES 1024
+
 using namespace std;
 
+#ifndef BUILD_TWRPTAR_MAIN
+// Digest of the uncompressed archive this thread is writing through write_tar()
+static __thread twrpDigestSink* tar_digest_sink = NULL;
+#endif
+// Compression / encryption pipeline of the archive this thread has open
+static __thread twrpTarPipeline* tar_pipeline = NULL;
+
+static bool Is_Chunk_Index(const string& filename) {
+#ifndef BUILD_TWRPTAR_MAIN
+	return twrpChunkStore::Is_Index(filename);
+#else
+	return false;
+#endif
+}
+
+twrpTarWorkQueue::twrpTarWorkQueue() {
+	total_size = 0;
+	aborted = false;
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpTarWorkQueue::~twrpTarWorkQueue() {
+	pthread_mutex_destroy(&lock);
+}
+
+int twrpTarWorkQueue::Add_Range(twrpFileManifest *manifest, size_t first, size_t last) {
+	twrpTarBatch batch;
+	int file_count = 0;
+
+	batch.first = first;
+	batch.size = 0;
+	for (size_t i = first; i < last; i++) {
+		const twrpManifestEntry& entry = manifest->Entry(i);
+
+		if (S_ISREG(entry.mode))
+			file_count++;
+		if (!S_ISDIR(entry.mode))
+			batch.size += entry.size;
+		if (batch.size >= TAR_BATCH_SIZE || i + 1 - batch.first >= TAR_BATCH_ENTRIES) {
+			batch.last = i + 1;
+			batches.push_back(batch);
+			total_size += batch.size;
+			batch.first = i + 1;
+			batch.size = 0;
+		}
+	}
+	if (batch.first < last) {
+		batch.last = last;
+		batches.push_back(batch);
+		total_size += batch.size;
+	}
+	return file_count;
+}
+
+unsigned twrpTarWorkQueue::Assign_Shares(unsigned workers) {
+	unsigned long long share, assigned = 0;
+	unsigned worker = 0;
+
+	if (workers > batches.size())
+		workers = batches.size();
+	if (workers < 1)
+		workers = 1;
+	queues.assign(workers, std::deque<twrpTarBatch>());
+	remaining.assign(workers, 0);
+	// Hand out contiguous runs so each archive holds whole directories where it can
+	share = total_size / workers + 1;
+	for (size_t i = 0; i < batches.size(); i++) {
+		if (worker + 1 < workers && assigned >= share * (worker + 1))
+			worker++;
+		queues[worker].push_back(batches[i]);
+		remaining[worker] += batches[i].size;
+		assigned += batches[i].size;
+	}
+	batches.clear();
+	return workers;
+}
+
+bool twrpTarWorkQueue::Next(unsigned worker, size_t *first, size_t *last) {
+	twrpTarBatch batch;
+	unsigned victim = worker;
+
+	pthread_mutex_lock(&lock);
+	if (aborted) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+	if (queues[worker].empty()) {
+		// Steal from the back of whichever worker has the most left to do
+		for (unsigned i = 0; i < queues.size(); i++) {
+			if (!queues[i].empty() && (queues[victim].empty() || remaining[i] > remaining[victim]))
+				victim = i;
+		}
+		if (queues[victim].empty()) {
+			pthread_mutex_unlock(&lock);
+			return false;
+		}
+		batch = queues[victim].back();
+		queues[victim].pop_back();
+	} else {
+		batch = queues[worker].front();
+		queues[worker].pop_front();
+	}
+	remaining[victim] -= batch.size;
+	pthread_mutex_unlock(&lock);
+	*first = batch.first;
+	*last = batch.last;
+	return true;
+}
+
+void twrpTarWorkQueue::Abort() {
+	pthread_mutex_lock(&lock);
+	aborted = true;
+	pthread_mutex_unlock(&lock);
+}
+
+bool twrpTarWorkQueue::Empty() {
+	bool empty = true;
+
+	pthread_mutex_lock(&lock);
+	for (unsigned i = 0; i < queues.size(); i++) {
+		if (!queues[i].empty())
+			empty = false;
+	}
+	pthread_mutex_unlock(&lock);
+	return empty;
+}
+
 twrpTar::twrpTar(void) {
 	use_encryption = 0;
 	userdata_encryption = 0;
 	use_compression = 0;
 	split_archives = 0;
-	pigz_pid = 0;
-	oaes_pid = 0;
+	pipeline = NULL;
+	pipeline_threads = 0;
+	write_manifest = false;
+	restore_progress_base = 0;
+	use_chunk_store = false;
+	chunk_writer = NULL;
+	chunk_reader = NULL;
+	manifest = NULL;
 	Total_Backup_Size = 0;
 	Archive_Current_Size = 0;
 	include_root_dir = true;
@@ -83,7 +223,11 @@ twrpTar::twrpTar(void) {
 	tar_type.readfunc = read;
 	input_fd = -1;
 	output_fd = -1;
+	WorkQueue = NULL;
+	worker_id = 0;
+	archive_count = 0;
 	backup_exclusions = NULL;
+	digest_sink = NULL;
 
 #ifdef USE_FSCRYPT
 	fscrypt_set_mode();
@@ -91,7 +235,11 @@ twrpTar::twrpTar(void) {
 }
 
 twrpTar::~twrpTar(void) {
-	// Do nothing
+#ifndef BUILD_TWRPTAR_MAIN
+	// Only left over after an error, so no index is written
+	delete chunk_writer;
+	delete chunk_reader;
+#endif
 }
 
 void twrpTar::setfn(string fn) {
@@ -156,126 +304,87 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		close(progress_pipe[0]);
 		progress_pipe_fd = progress_pipe[1];
 
+		// Walk the tree once, sizing, the thread lists and the archives all work from this
+		twrpFileManifest file_manifest;
+		if (file_manifest.Build(tardir, backup_exclusions) < 0) {
+			LOGINFO("Error building the file list for '%s'\n", tardir.c_str());
+			gui_err("backup_error=Error creating backup.");
+			close(progress_pipe[1]);
+			_exit(-1);
+		}
+		manifest = &file_manifest;
+
+#ifndef BUILD_TWRPTAR_MAIN
+		if (write_manifest && !part_settings->adbbackup) {
+			// The next incremental backup compares against the whole tree, so save it before filtering
+			if (file_manifest.Save(backup_folder + "/" + partition_name + ".manifest") != 0) {
+				gui_err("backup_error=Error creating backup.");
+				close(progress_pipe[1]);
+				_exit(-1);
+			}
+			if (!incremental_base.empty()) {
+				twrpFileManifest base_manifest;
+
+				LOGINFO("Backing up changes since '%s'\n", incremental_base.c_str());
+				if (base_manifest.Load(incremental_base + "/" + partition_name + ".manifest") != 0 ||
+					file_manifest.Apply_Base(base_manifest, backup_folder + "/" + partition_name + ".deleted") < 0) {
+					gui_err("backup_error=Error creating backup.");
+					close(progress_pipe[1]);
+					_exit(-1);
+				}
+				Total_Backup_Size = file_manifest.Total_Size();
+			}
+		}
+#endif
+
 		if (use_encryption || userdata_encryption) {
 			LOGINFO("Using encryption\n");
-			DIR* d;
-			struct dirent* de;
 			unsigned long long regular_size = 0, encrypt_size = 0, target_size = 0, total_size;
-			unsigned enc_thread_id = 1, regular_thread_id = 0, i, start_thread_id = 1, core_count = 1;
+			unsigned regular_thread_id = 0, i, start_thread_id = 1, core_count, worker_count;
 			int item_len, ret, thread_error = 0;
+			size_t item, item_end;
 			std::vector<TarListStruct> RegularList;
-			std::vector<TarListStruct> EncryptList;
-			string FileName;
-			struct TarListStruct TarItem;
-			twrpTar reg, enc[9];
-			struct stat st;
-			pthread_t enc_thread[9];
+			const char *name;
+			twrpTar reg;
+			std::vector<twrpTar*> enc;
+			std::vector<pthread_t> enc_thread;
+			std::vector<bool> enc_started;
 			pthread_attr_t tattr;
 			void *thread_return;
 
-			core_count = sysconf(_SC_NPROCESSORS_CONF);
-			if (core_count > 8)
-				core_count = 8;
-			LOGINFO("   Core Count      : %u\n", core_count);
+			ret = sysconf(_SC_NPROCESSORS_ONLN);
+			core_count = ret > 0 ? ret : 1;
+			if (!userdata_encryption)
+				start_thread_id = 0;
+			// Restore looks for thread IDs 0 to 8, extra cores go to each archive's pipeline
+			worker_count = core_count;
+			if (worker_count > TAR_MAX_THREAD_IDS - start_thread_id)
+				worker_count = TAR_MAX_THREAD_IDS - start_thread_id;
+			twrpTarWorkQueue queue;
 			Archive_Current_Size = 0;
 
-			d = opendir(tardir.c_str());
-			if (d == NULL) {
-				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			// Figure out the size of all data to be encrypted and create a list of unencrypted files
-			while ((de = readdir(d)) != NULL) {
-				FileName = tardir + "/" + de->d_name;
-
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-					continue;
-				if (de->d_type == DT_DIR) {
-					item_len = strlen(de->d_name);
-					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						ret = Generate_TarList(FileName, &RegularList, &target_size, &regular_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with regular list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe_fd);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count = (unsigned long long)(ret);
-						regular_size += backup_exclusions->Get_Folder_Size(FileName);
-					} else {
-						encrypt_size += backup_exclusions->Get_Folder_Size(FileName);
+			// Create a list of unencrypted files and queue everything else for encryption
+			for (item = 0; item < manifest->Count(); item = item_end) {
+				const twrpManifestEntry& entry = manifest->Entry(item);
+
+				item_end = entry.subtree_end;
+				if (S_ISDIR(entry.mode)) {
+					name = manifest->Name(item);
+					item_len = strlen(name);
+					if (userdata_encryption && ((item_len >= 3 && strncmp(name, "app", 3) == 0) || (item_len >= 6 && strncmp(name, "dalvik", 6) == 0))) {
+						file_count += (unsigned long long)Generate_TarList(item, item_end, &RegularList, &target_size, &regular_thread_id);
+						regular_size += manifest->Subtree_Size(item);
+						continue;
 					}
-				} else if (de->d_type == DT_REG) {
-					stat(FileName.c_str(), &st);
-					encrypt_size += (unsigned long long)(st.st_size);
 				}
+				file_count += (unsigned long long)queue.Add_Range(manifest, item, item_end);
 			}
-			closedir(d);
-
-			target_size = encrypt_size / core_count;
-			target_size++;
+			encrypt_size = queue.Total_Size();
+			worker_count = queue.Assign_Shares(worker_count);
+			LOGINFO("   Core Count      : %u\n", core_count);
+			LOGINFO("   Worker Count    : %u\n", worker_count);
 			LOGINFO("   Unencrypted size: %llu\n", regular_size);
 			LOGINFO("   Encrypted size  : %llu\n", encrypt_size);
-			LOGINFO("   Target size     : %llu\n", target_size);
-			if (!userdata_encryption) {
-				enc_thread_id = 0;
-				start_thread_id = 0;
-				core_count--;
-			}
-			Archive_Current_Size = 0;
-
-			d = opendir(tardir.c_str());
-			if (d == NULL) {
-				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			// Divide up the encrypted file list for threading
-			while ((de = readdir(d)) != NULL) {
-				FileName = tardir + "/" + de->d_name;
-
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-					continue;
-				if (de->d_type == DT_DIR) {
-					item_len = strlen(de->d_name);
-					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						// Do nothing, we added these to RegularList earlier
-					} else {
-						FileName = tardir + "/" + de->d_name;
-						ret = Generate_TarList(FileName, &EncryptList, &target_size, &enc_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with encrypted list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count += (unsigned long long)(ret);
-					}
-				} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-					stat(FileName.c_str(), &st);
-					if (de->d_type == DT_REG)
-						Archive_Current_Size += (unsigned long long)(st.st_size);
-					TarItem.fn = FileName;
-					TarItem.thread_id = enc_thread_id;
-					EncryptList.push_back(TarItem);
-					file_count++;
-				}
-			}
-			closedir(d);
-			if (enc_thread_id != core_count) {
-				LOGINFO("Error dividing up threads for encryption, %u threads for %u cores!\n", enc_thread_id, core_count);
-				if (enc_thread_id > core_count) {
-					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
-					_exit(-1);
-				} else {
-					LOGINFO("Continuining anyway.");
-				}
-			}
 
 			// Send file count to parent
 			write(progress_pipe_fd, &file_count, sizeof(file_count));
@@ -287,6 +396,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				// Create a backup of unencrypted data
 				reg.setfn(tarfn);
 				reg.ItemList = &RegularList;
+				reg.manifest = manifest;
 				reg.thread_id = 0;
 				reg.use_encryption = 0;
 				reg.use_compression = use_compression;
@@ -320,65 +430,61 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			/*if (pthread_attr_setstacksize(&tattr, 524288)) {
-				LOGERR("Error setting pthread_attr_setstacksize\n");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}*/
-
-			// Create threads for the divided up encryption lists
-			for (i = start_thread_id; i <= core_count; i++) {
-				enc[i].setdir(tardir);
-				enc[i].setfn(tarfn);
-				enc[i].ItemList = &EncryptList;
-				enc[i].thread_id = i;
-				enc[i].use_encryption = use_encryption;
-				enc[i].setpassword(password);
-				enc[i].use_compression = use_compression;
-				enc[i].split_archives = 1;
-				enc[i].progress_pipe_fd = progress_pipe_fd;
-				enc[i].part_settings = part_settings;
-				LOGINFO("Start encryption thread %i\n", i);
-				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
+
+			// Start the archive workers, each writes its own set of split archives
+			enc.resize(worker_count);
+			enc_thread.resize(worker_count);
+			enc_started.resize(worker_count, false);
+			for (i = 0; i < worker_count; i++) {
+				enc[i] = new twrpTar();
+				enc[i]->setdir(tardir);
+				enc[i]->setfn(tarfn);
+				enc[i]->WorkQueue = &queue;
+				enc[i]->worker_id = i;
+				enc[i]->manifest = manifest;
+				enc[i]->thread_id = start_thread_id + i;
+				enc[i]->use_encryption = use_encryption;
+				enc[i]->setpassword(password);
+				enc[i]->use_compression = use_compression;
+				enc[i]->split_archives = 1;
+				enc[i]->progress_pipe_fd = progress_pipe_fd;
+				enc[i]->pipeline_threads = core_count > worker_count ? core_count / worker_count : 1;
+				enc[i]->part_settings = part_settings;
+				LOGINFO("Start encryption thread %i\n", enc[i]->thread_id);
+				ret = pthread_create(&enc_thread[i], &tattr, createQueue, (void*)enc[i]);
 				if (ret) {
-					LOGINFO("Unable to create %i thread for encryption! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
-					if (createList((void*)&enc[i]) != 0) {
-						LOGINFO("Error creating encrypted backup %i.\n", i);
+					// The workers that did start will steal this one's share
+					LOGINFO("Unable to create %i thread for encryption! %i\nContinuing with the other threads (backup will be slower).\n", enc[i]->thread_id, ret);
+					if (i == 0 && createQueue((void*)enc[i]) != 0) {
+						LOGINFO("Error creating encrypted backup %i.\n", enc[i]->thread_id);
 						gui_err("backup_error=Error creating backup.");
 						close(progress_pipe[1]);
 						_exit(-1);
-					} else {
-						enc[i].thread_id = i + 1;
 					}
+					break;
 				}
-				usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
+				enc_started[i] = true;
 			}
 			if (pthread_attr_destroy(&tattr)) {
 				LOGINFO("Failed to pthread_attr_destroy\n");
 			}
-			for (i = start_thread_id; i <= core_count; i++) {
-				if (enc[i].thread_id == i) {
+			for (i = 0; i < worker_count; i++) {
+				if (enc_started[i]) {
 					if (pthread_join(enc_thread[i], &thread_return)) {
-						LOGINFO("Error joining thread %i\n", i);
-						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
-						_exit(-1);
+						LOGINFO("Error joining thread %i\n", enc[i]->thread_id);
+						thread_error = 1;
 					} else {
-						LOGINFO("Joined thread %i.\n", i);
+						LOGINFO("Joined thread %i.\n", enc[i]->thread_id);
 						ret = (int)(intptr_t)thread_return;
 						if (ret != 0) {
 							thread_error = 1;
-							LOGINFO("Thread %i returned an error %i.\n", i, ret);
-							gui_err("backup_error=Error creating backup.");
-							close(progress_pipe[1]);
-							_exit(-1);
+							LOGINFO("Thread %i returned an error %i.\n", enc[i]->thread_id, ret);
 						}
 					}
-				} else {
-					LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
 				}
+				delete enc[i];
 			}
-			if (thread_error) {
+			if (thread_error || !queue.Empty()) {
 				LOGINFO("Error returned by one or more threads.\n");
 				gui_err("backup_error=Error creating backup.");
 				close(progress_pipe[1]);
@@ -393,20 +499,13 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			unsigned thread_id = 0;
 			unsigned long long target_size = 0;
 			twrpTar reg;
-			int ret;
 
 			// Generate list of files to back up
-			ret = Generate_TarList(tardir, &FileList, &target_size, &thread_id);
-			if (ret < 0) {
-				LOGINFO("Error in Generate_TarList!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			file_count = (unsigned long long)(ret);
+			file_count = (unsigned long long)Generate_TarList(0, manifest->Count(), &FileList, &target_size, &thread_id);
 			// Create a backup
 			reg.setfn(tarfn);
 			reg.ItemList = &FileList;
+			reg.manifest = manifest;
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
@@ -478,6 +577,8 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			else
 				backup_info.SetValue("backup_type", UNCOMPRESSED);
 			backup_info.SetValue("file_count", files_backup);
+			if (!incremental_base.empty())
+				backup_info.SetValue("incremental_base", TWFunc::Get_Filename(incremental_base));
 			backup_info.SaveValues();
 		}
 #endif //ndef BUILD_TWRPTAR_MAIN
@@ -516,8 +617,10 @@ int twrpTar::extractTarFork() {
 				LOGINFO("Multiple archives\n");
 				string temp;
 				char actual_filename[255];
-				twrpTar tars[9];
-				pthread_t tar_thread[9];
+				twrpTar reg;
+				std::vector<twrpTar*> tars;
+				std::vector<pthread_t> tar_thread;
+				std::vector<bool> tar_started;
 				pthread_attr_t tattr;
 				unsigned thread_count = 0, i, start_thread_id = 1;
 				int ret, thread_error = 0;
@@ -534,11 +637,11 @@ int twrpTar::extractTarFork() {
 				}
 				if (TWFunc::Get_File_Type(tarfn) != 2) {
 					LOGINFO("First tar file '%s' not encrypted\n", tarfn.c_str());
-					tars[0].basefn = basefn;
-					tars[0].thread_id = 0;
-					tars[0].progress_pipe_fd = progress_pipe_fd;
-					tars[0].part_settings = part_settings;
-					if (extractMulti((void*)&tars[0]) != 0) {
+					reg.basefn = basefn;
+					reg.thread_id = 0;
+					reg.progress_pipe_fd = progress_pipe_fd;
+					reg.part_settings = part_settings;
+					if (extractMulti((void*)&reg) != 0) {
 						LOGINFO("Error extracting split archive.\n");
 						gui_err("restore_error=Error during restore process.");
 						close(progress_pipe_fd);
@@ -571,54 +674,54 @@ int twrpTar::extractTarFork() {
 					close(progress_pipe_fd);
 					_exit(-1);
 				}*/
-				for (i = start_thread_id; i < 9; i++) {
+				// One thread per backup thread ID that left archives
+				for (i = start_thread_id; i < TAR_MAX_THREAD_IDS; i++) {
 					sprintf(actual_filename, temp.c_str(), i, 0);
-					if (TWFunc::Path_Exists(actual_filename)) {
-						thread_count++;
-						tars[i].basefn = basefn;
-						tars[i].setpassword(password);
-						tars[i].thread_id = i;
-						tars[i].progress_pipe_fd = progress_pipe_fd;
-						tars[i].part_settings = part_settings;
-						LOGINFO("Creating extract thread ID %i\n", i);
-						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
-						if (ret) {
-							LOGINFO("Unable to create %i thread for extraction! %i\nContinuing in same thread (restore will be slower).\n", i, ret);
-							if (extractMulti((void*)&tars[i]) != 0) {
-								LOGINFO("Error extracting backup in thread %i.\n", i);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
-							} else {
-								tars[i].thread_id = i + 1;
-							}
-						}
-						usleep(100000); // Need a short delay before starting the next thread or the threads will never finish for some reason.
-					} else {
+					if (!TWFunc::Path_Exists(actual_filename))
 						break;
+					thread_count++;
+				}
+				tars.resize(thread_count);
+				tar_thread.resize(thread_count);
+				tar_started.resize(thread_count, false);
+				for (i = 0; i < thread_count; i++) {
+					tars[i] = new twrpTar();
+					tars[i]->basefn = basefn;
+					tars[i]->setpassword(password);
+					tars[i]->thread_id = start_thread_id + i;
+					tars[i]->progress_pipe_fd = progress_pipe_fd;
+					tars[i]->part_settings = part_settings;
+					LOGINFO("Creating extract thread ID %i\n", tars[i]->thread_id);
+					ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)tars[i]);
+					if (ret) {
+						LOGINFO("Unable to create %i thread for extraction! %i\nContinuing in same thread (restore will be slower).\n", tars[i]->thread_id, ret);
+						if (extractMulti((void*)tars[i]) != 0) {
+							LOGINFO("Error extracting backup in thread %i.\n", tars[i]->thread_id);
+							thread_error = 1;
+							break;
+						}
+						continue;
 					}
+					tar_started[i] = true;
 				}
-				for (i = start_thread_id; i < thread_count + start_thread_id; i++) {
-					if (tars[i].thread_id == i) {
+				if (pthread_attr_destroy(&tattr)) {
+					LOGINFO("Failed to pthread_attr_destroy\n");
+				}
+				for (i = 0; i < thread_count; i++) {
+					if (tar_started[i]) {
 						if (pthread_join(tar_thread[i], &thread_return)) {
-							LOGINFO("Error joining thread %i\n", i);
-							gui_err("restore_error=Error during restore process.");
-							close(progress_pipe_fd);
-							_exit(-1);
+							LOGINFO("Error joining thread %i\n", tars[i]->thread_id);
+							thread_error = 1;
 						} else {
-							LOGINFO("Joined thread %i.\n", i);
+							LOGINFO("Joined thread %i.\n", tars[i]->thread_id);
 							ret = (int)(intptr_t)thread_return;
 							if (ret != 0) {
 								thread_error = 1;
-								LOGINFO("Thread %i returned an error %i.\n", i, ret);
-								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
-								_exit(-1);
+								LOGINFO("Thread %i returned an error %i.\n", tars[i]->thread_id, ret);
 							}
 						}
-					} else {
-						LOGINFO("Skipping joining thread %i because of pthread failure.\n", i);
 					}
+					delete tars[i];
 				}
 				if (thread_error) {
 					LOGINFO("Error returned by one or more threads.\n");
@@ -641,7 +744,7 @@ int twrpTar::extractTarFork() {
 			// Read progress data from children
 			while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
 				size_backup += fs;
-				part_settings->progress->UpdateSize(size_backup);
+				part_settings->progress->UpdateSize(restore_progress_base + size_backup);
 			}
 			close(progress_pipe[0]);
 			part_settings->progress->UpdateDisplayDetails(true);
@@ -660,48 +763,27 @@ int twrpTar::extractTarFork() {
 	return 0;
 }
 
-int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	string FileName;
+int twrpTar::Generate_TarList(size_t first, size_t last, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id) {
 	struct TarListStruct TarItem;
-	int ret, file_count;
-	file_count = 0;
+	int file_count = 0;
 
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		closedir(d);
-		return -1;
-	}
-	while ((de = readdir(d)) != NULL) {
-		FileName = Path + "/" + de->d_name;
+	for (size_t i = first; i < last; i++) {
+		const twrpManifestEntry& entry = manifest->Entry(i);
 
-		if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-			continue;
-		TarItem.fn = FileName;
+		TarItem.entry = i;
 		TarItem.thread_id = *thread_id;
-		if (de->d_type == DT_DIR) {
-			TarList->push_back(TarItem);
-			ret = Generate_TarList(FileName, TarList, Target_Size, thread_id);
-			if (ret < 0)
-				return -1;
-			file_count += ret;
-		} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-			stat(FileName.c_str(), &st);
-			TarList->push_back(TarItem);
-			if (de->d_type == DT_REG) {
-				file_count++;
-				Archive_Current_Size += st.st_size;
-			}
-			if (Archive_Current_Size != 0 && *Target_Size != 0 && Archive_Current_Size > *Target_Size) {
-				*thread_id = *thread_id + 1;
-				Archive_Current_Size = 0;
-			}
+		TarList->push_back(TarItem);
+		if (S_ISDIR(entry.mode))
+			continue;
+		if (S_ISREG(entry.mode)) {
+			file_count++;
+			Archive_Current_Size += entry.size;
+		}
+		if (Archive_Current_Size != 0 && *Target_Size != 0 && Archive_Current_Size > *Target_Size) {
+			*thread_id = *thread_id + 1;
+			Archive_Current_Size = 0;
 		}
 	}
-	closedir(d);
 	return file_count;
 }
 
@@ -712,13 +794,19 @@ int twrpTar::extractTar() {
 	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
 		gui_err("restore_error=Error during restore process.");
+		closePipeline(true);
 		return -1;
 	}
+	closePipeline(true);
 	if (tar_close(t) != 0) {
 		LOGINFO("Unable to close tar file\n");
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	if (closeChunks() != 0) {
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
 #ifndef BUILD_TWRPTAR_MAIN
 	if (part_settings->adbbackup) {
 		if (!twadbbu::Write_TWEOF())
@@ -769,17 +857,53 @@ int twrpTar::extract() {
 }
 
 int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
-	struct stat st;
-	char buf[PATH_MAX];
-	int list_size = TarList->size(), i = 0, archive_count = 0;
-	string temp;
+	int ret;
+
+	ret = beginArchives(thread_id);
+	if (ret != 0)
+		return ret;
+	for (size_t i = 0; i < TarList->size(); i++) {
+		if (TarList->at(i).thread_id == thread_id) {
+			ret = archiveEntry(TarList->at(i).entry, thread_id);
+			if (ret != 0)
+				return ret;
+		}
+	}
+	return endArchives(thread_id);
+}
+
+int twrpTar::tarQueue(twrpTarWorkQueue *queue, unsigned thread_id) {
+	size_t first, last, entry;
+	int ret;
+
+	ret = beginArchives(thread_id);
+	if (ret != 0) {
+		queue->Abort();
+		return ret;
+	}
+	while (queue->Next(worker_id, &first, &last)) {
+		for (entry = first; entry < last; entry++) {
+			ret = archiveEntry(entry, thread_id);
+			if (ret != 0) {
+				queue->Abort();
+				return ret;
+			}
+		}
+	}
+	ret = endArchives(thread_id);
+	if (ret != 0)
+		queue->Abort();
+	return ret;
+}
+
+int twrpTar::beginArchives(unsigned thread_id) {
 	char actual_filename[PATH_MAX];
-	unsigned long long fs;
 
+	archive_count = 0;
 	if (split_archives) {
 		basefn = tarfn;
-		temp = basefn + "%i%02i";
-		sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
+		archive_format = basefn + "%i%02i";
+		sprintf(actual_filename, archive_format.c_str(), thread_id, archive_count);
 		tarfn = actual_filename;
 		include_root_dir = true;
 	} else {
@@ -797,54 +921,58 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 		return -2;
 	}
 	Archive_Current_Size = 0;
+	return 0;
+}
 
-	while (i < list_size) {
-		if (TarList->at(i).thread_id == thread_id) {
-			strcpy(buf, TarList->at(i).fn.c_str());
-			lstat(buf, &st);
-			if (S_ISREG(st.st_mode)) { // item is a regular file
-				fs = (unsigned long long)(st.st_size);
-				if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
-					if (closeTar() != 0) {
-						LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -3;
-					}
-					archive_count++;
-					gui_msg(Msg("split_thread=Splitting thread ID {1} into archive {2}")(thread_id)(archive_count + 1));
-					if (archive_count > 99) {
-						LOGINFO("Too many archives for thread %i\n", thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -4;
-					}
-					sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
-					tarfn = actual_filename;
-					if (createTar() != 0) {
-						LOGINFO("Error creating tar '%s' for thread %i\n", tarfn.c_str(), thread_id);
-						gui_err("backup_error=Error creating backup.");
-						return -2;
-					}
-					Archive_Current_Size = 0;
-				}
-				Archive_Current_Size += fs;
-				fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
-				write(progress_pipe_fd, &fs, sizeof(fs));
+int twrpTar::archiveEntry(size_t entry, unsigned thread_id) {
+	char actual_filename[PATH_MAX];
+	const char *buf = manifest->Path(entry);
+	unsigned long long fs;
+
+	if (S_ISREG(manifest->Entry(entry).mode)) { // item is a regular file
+		fs = manifest->Entry(entry).size;
+		if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
+			if (closeTar() != 0) {
+				LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
+				gui_err("backup_error=Error creating backup.");
+				return -3;
 			}
-			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
-			if (addFile(buf, include_root_dir) != 0) {
-				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
+			archive_count++;
+			gui_msg(Msg("split_thread=Splitting thread ID {1} into archive {2}")(thread_id)(archive_count + 1));
+			if (archive_count > 99) {
+				LOGINFO("Too many archives for thread %i\n", thread_id);
 				gui_err("backup_error=Error creating backup.");
-				return -1;
+				return -4;
+			}
+			sprintf(actual_filename, archive_format.c_str(), thread_id, archive_count);
+			tarfn = actual_filename;
+			if (createTar() != 0) {
+				LOGINFO("Error creating tar '%s' for thread %i\n", tarfn.c_str(), thread_id);
+				gui_err("backup_error=Error creating backup.");
+				return -2;
 			}
+			Archive_Current_Size = 0;
 		}
-		i++;
+		Archive_Current_Size += fs;
+		fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
+		write(progress_pipe_fd, &fs, sizeof(fs));
+	}
+	LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
+	if (addFile(entry, include_root_dir) != 0) {
+		LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
+		gui_err("backup_error=Error creating backup.");
+		return -1;
 	}
+	return 0;
+}
+
+int twrpTar::endArchives(unsigned thread_id) {
 	if (closeTar() != 0) {
 		LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
 		gui_err("backup_error=Error creating backup.");
 		return -3;
 	}
-	LOGINFO("Thread id %i tarList done, %i archives.\n", thread_id, archive_count);
+	LOGINFO("Thread id %i done, %i archives.\n", thread_id, archive_count + 1);
 	return 0;
 }
 
@@ -858,6 +986,16 @@ void* twrpTar::createList(void *cookie) {
 	return (void*)0;
 }
 
+void* twrpTar::createQueue(void *cookie) {
+	twrpTar* threadTar = (twrpTar*) cookie;
+	if (threadTar->tarQueue(threadTar->WorkQueue, threadTar->thread_id) != 0) {
+		LOGINFO("ERROR tarQueue for thread ID %i\n", threadTar->thread_id);
+		return (void*)-2;
+	}
+	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
+	return (void*)0;
+}
+
 void* twrpTar::extractMulti(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
 	int archive_count = 0;
@@ -903,186 +1041,57 @@ int twrpTar::createTar() {
 	char* charTarFile = (char*) tarfn.c_str();
 	char* charRootDir = (char*) tardir.c_str();
 
-	if (use_encryption && use_compression) {
-		// Compressed and encrypted
-		current_archive_type = COMPRESSED_ENCRYPTED;
-		LOGINFO("Using encryption and compression...\n");
-		int i, pipes[4];
-
-		if (pipe2(pipes, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
-		}
-		if (pipe2(pipes + 2, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
-		}
-		output_fd = open(tarfn.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		}
-		pigz_pid = fork();
+#ifndef BUILD_TWRPTAR_MAIN
+	if (!part_settings->adbbackup && part_settings->generate_digest)
+		digest_sink = new twrpDigestSink(tarfn);
+#endif
 
-		if (pigz_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		} else if (pigz_pid == 0) {
-			// pigz Child
-			dup2(pipes[0], STDIN_FILENO);
-			dup2(pipes[3], STDOUT_FILENO);
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				_exit(-1);
-			}
+	if (use_encryption || use_compression) {
+		if (use_encryption && use_compression) {
+			// Compressed and encrypted
+			current_archive_type = COMPRESSED_ENCRYPTED;
+			LOGINFO("Using encryption and compression...\n");
+		} else if (use_compression) {
+			// Compressed
+			current_archive_type = COMPRESSED;
+			LOGINFO("Using compression...\n");
 		} else {
-			// Parent
-			oaes_pid = fork();
-
-			if (oaes_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (oaes_pid == 0) {
-				// openaes Child
-				dup2(pipes[2], STDIN_FILENO);
-				dup2(output_fd, STDOUT_FILENO);
-				if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-					LOGINFO("execlp openaes ERROR!\n");
-					gui_err("backup_error=Error creating backup.");
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]);
-				close(pipes[2]);
-				close(pipes[3]);
-				fd = pipes[1];
-				init_libtar_no_buffer(progress_pipe_fd);
-				tar_type.writefunc = write_tar_no_buffer;
-				if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("backup_error=Error creating backup.");
-					return -1;
-				}
-				return 0;
-			}
+			// Encrypted
+			current_archive_type = ENCRYPTED;
+			LOGINFO("Using encryption...\n");
 		}
-	} else if (use_compression) {
-		// Compressed
-		current_archive_type = COMPRESSED;
-		LOGINFO("Using compression...\n");
-		int pigzfd[2];
-		if (part_settings->adbbackup) {
+		if (part_settings->adbbackup && current_archive_type == COMPRESSED) {
 			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
 			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
 		}
 		else {
-			output_fd = open(tarfn.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			output_fd = openOutput();
 		}
 		if (output_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-
-		if (pipe2(pigzfd, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating pipe\n");
+		pipeline = new twrpTarPipeline();
+		if (pipeline->Open_Write(output_fd, use_compression, use_encryption, password, pipeline_threads, progress_pipe_fd, use_chunk_store ? NULL : digest_sink) != 0) {
+			LOGINFO("Unable to start the archive pipeline\n");
 			gui_err("backup_error=Error creating backup.");
+			delete pipeline;
+			pipeline = NULL;
 			close(output_fd);
+			output_fd = -1;
 			return -1;
 		}
-		pigz_pid = fork();
-
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
+		tar_pipeline = pipeline;
+		tar_type.writefunc = write_tar_pipeline;
+		if (tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("backup_error=Error creating backup.");
+			closePipeline(false);
 			close(output_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
+			output_fd = -1;
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			dup2(pigzfd[0], STDIN_FILENO); // remap stdin
-			dup2(output_fd, STDOUT_FILENO); // remap stdout to output file
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[0]); // close parent input
-			fd = pigzfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-		}
-	} else if (use_encryption) {
-		// Encrypted
-		current_archive_type = ENCRYPTED;
-		LOGINFO("Using encryption...\n");
-		int oaesfd[2];
-		output_fd = open(tarfn.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
-		}
-		if (pipe2(oaesfd, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			return -1;
-		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
-			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			dup2(oaesfd[0], STDIN_FILENO); // remap stdin
-			dup2(output_fd, STDOUT_FILENO); // remap stdout to output file
-			if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[0]); // close parent input
-			fd = oaesfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-			return 0;
 		}
+		return 0;
 	} else {
 		// Not compressed or encrypted
 		current_archive_type = UNCOMPRESSED;
@@ -1097,8 +1106,23 @@ int twrpTar::createTar() {
 				return -1;
 			}
 		}
+		else if (use_chunk_store) {
+			tar_type.writefunc = write_tar;
+			output_fd = openOutput();
+			if (output_fd < 0 || tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+				LOGERR("tar_fdopen error opening '%s'\n", tarfn.c_str());
+				gui_err("backup_error=Error creating backup.");
+				if (output_fd >= 0)
+					close(output_fd);
+				output_fd = -1;
+				return -1;
+			}
+		}
 		else {
 			tar_type.writefunc = write_tar;
+#ifndef BUILD_TWRPTAR_MAIN
+			tar_digest_sink = digest_sink;
+#endif
 			if (tar_open(&t, charTarFile, &tar_type, O_CLOEXEC | O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1) {
 				LOGERR("tar_open error opening '%s'\n", tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
@@ -1114,175 +1138,45 @@ int twrpTar::openTar() {
 	char* charTarFile = (char*) tarfn.c_str();
 	string Password;
 
-	if (current_archive_type == COMPRESSED_ENCRYPTED) {
-		LOGINFO("Opening encrypted and compressed backup...\n");
-		int i, pipes[4];
-		input_fd = open(tarfn.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
-		}
-
-		if (pipe2(pipes, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-		if (pipe2(pipes + 2, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(pipes[0]);
-			close(pipes[1]);
-			close(input_fd);
-			return -1;
-		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		} else if (oaes_pid == 0) {
-			// openaes Child
-			dup2(input_fd, STDIN_FILENO);
-			dup2(pipes[1], STDOUT_FILENO);
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			pigz_pid = fork();
+	if (current_archive_type == COMPRESSED_ENCRYPTED || current_archive_type == ENCRYPTED || current_archive_type == COMPRESSED) {
+		bool compressed = current_archive_type != ENCRYPTED;
+		bool encrypted = current_archive_type != COMPRESSED;
 
-			if (pigz_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (pigz_pid == 0) {
-				// pigz Child
-				dup2(pipes[0], STDIN_FILENO);
-				dup2(pipes[3], STDOUT_FILENO);
-				if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-					LOGINFO("execlp pigz ERROR!\n");
-					gui_err("restore_error=Error during restore process.");
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
-				close(pipes[3]);
-				fd = pipes[2];
-				if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("restore_error=Error during restore process.");
-					return -1;
-				}
-			}
-		}
-	} else if (current_archive_type == ENCRYPTED) {
-		LOGINFO("Opening encrypted backup...\n");
-		int oaesfd[2];
-		input_fd = open(tarfn.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
-		}
-
-		if (pipe2(oaesfd, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-
-		oaes_pid = fork();
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
-			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			dup2(oaesfd[1], STDOUT_FILENO); // remap stdout
-			dup2(input_fd, STDIN_FILENO); // remap input fd to stdin
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[1]); // close parent output
-			fd = oaesfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
-		}
-	} else if (current_archive_type == COMPRESSED) {
-		int pigzfd[2];
-
-		LOGINFO("Opening gzip compressed tar...\n");
-		if (part_settings->adbbackup)  {
+		if (current_archive_type == COMPRESSED_ENCRYPTED)
+			LOGINFO("Opening encrypted and compressed backup...\n");
+		else if (encrypted)
+			LOGINFO("Opening encrypted backup...\n");
+		else
+			LOGINFO("Opening gzip compressed tar...\n");
+		if (part_settings->adbbackup && !encrypted) {
 			LOGINFO("opening TW_ADB_RESTORE compressed stream\n");
 			input_fd = open(TW_ADB_RESTORE, O_CLOEXEC | O_RDONLY | O_LARGEFILE);
 		}
 		else
-			input_fd = open(tarfn.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
+			input_fd = openInput();
 
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-
-		if (pipe2(pigzfd, O_CLOEXEC) < 0) {
-			LOGINFO("Error creating pipe\n");
+		pipeline = new twrpTarPipeline();
+		if (pipeline->Open_Read(input_fd, compressed, encrypted, password, pipeline_threads) != 0) {
+			LOGINFO("Unable to start the archive pipeline\n");
 			gui_err("restore_error=Error during restore process.");
+			closePipeline(true);
 			close(input_fd);
+			input_fd = -1;
 			return -1;
 		}
-
-		pigz_pid = fork();
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
+		tar_pipeline = pipeline;
+		tar_type.readfunc = read_tar_pipeline;
+		if (tar_fdopen(&t, input_fd, charRootDir, &tar_type, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			LOGINFO("tar_fdopen failed\n");
 			gui_err("restore_error=Error during restore process.");
+			closePipeline(true);
 			close(input_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
+			input_fd = -1;
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			dup2(pigzfd[1], STDOUT_FILENO); // remap stdout
-			dup2(input_fd, STDIN_FILENO); // remap input fd to stdin
-			if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[1]); // close parent output
-			fd = pigzfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
 		}
 	} else  {
 		if (part_settings->adbbackup) {
@@ -1294,6 +1188,14 @@ int twrpTar::openTar() {
 				return -1;
 			}
 		}
+		else if (Is_Chunk_Index(tarfn)) {
+			input_fd = openInput();
+			if (input_fd < 0 || tar_fdopen(&t, input_fd, charRootDir, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+				LOGERR("Unable to open tar archive '%s'\n", charTarFile);
+				gui_err("restore_error=Error during restore process.");
+				return -1;
+			}
+		}
 		else {
 			if (tar_open(&t, charTarFile, NULL, O_CLOEXEC | O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				LOGERR("Unable to open tar archive '%s'\n", charTarFile);
@@ -1305,6 +1207,79 @@ int twrpTar::openTar() {
 	return 0;
 }
 
+int twrpTar::closePipeline(bool restore) {
+	int ret;
+
+	if (pipeline == NULL)
+		return 0;
+	if (restore)
+		ret = pipeline->Close_Read();
+	else
+		ret = pipeline->Close_Write();
+	delete pipeline;
+	pipeline = NULL;
+	tar_pipeline = NULL;
+	return ret;
+}
+
+int twrpTar::openOutput() {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (use_chunk_store) {
+		// The digest covers the index, which is what Check_Digest reads back
+		chunk_writer = new twrpChunkWriter(tarfn);
+		chunk_writer->digest = digest_sink;
+		return chunk_writer->Start();
+	}
+#endif
+	return open(tarfn.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+}
+
+int twrpTar::openInput() {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (twrpChunkStore::Is_Index(tarfn)) {
+		chunk_reader = new twrpChunkReader(tarfn);
+		return chunk_reader->Start();
+	}
+#endif
+	return open(tarfn.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE);
+}
+
+// Called once libtar has closed the stream
+int twrpTar::closeChunks() {
+	int ret = 0;
+
+#ifndef BUILD_TWRPTAR_MAIN
+	if (chunk_writer != NULL) {
+		if (!chunk_writer->Finish())
+			ret = -1;
+		delete chunk_writer;
+		chunk_writer = NULL;
+	}
+	if (chunk_reader != NULL) {
+		if (!chunk_reader->Finish())
+			ret = -1;
+		delete chunk_reader;
+		chunk_reader = NULL;
+	}
+#endif
+	return ret;
+}
+
+int twrpTar::finishDigest() {
+	int ret = 0;
+
+#ifndef BUILD_TWRPTAR_MAIN
+	tar_digest_sink = NULL;
+	if (digest_sink != NULL) {
+		if (!digest_sink->finish())
+			ret = -1;
+		delete digest_sink;
+		digest_sink = NULL;
+	}
+#endif
+	return ret;
+}
+
 string twrpTar::Strip_Root_Dir(string Path) {
 	string temp;
 	size_t slash;
@@ -1325,25 +1300,39 @@ string twrpTar::Strip_Root_Dir(string Path) {
 	return temp;
 }
 
-int twrpTar::addFile(string fn, bool include_root) {
-	char* charTarFile = (char*) fn.c_str();
+int twrpTar::addFile(size_t entry, bool include_root) {
+	const char* charTarFile = manifest->Path(entry);
+	struct stat st;
+
+	// The manifest already has the lstat() data, so libtar does not need to stat again
+	manifest->Get_Stat(entry, &st);
 	if (include_root) {
-		if (tar_append_file(t, charTarFile, NULL) == -1)
+		if (tar_append_file_stat(t, charTarFile, NULL, &st) == -1)
 			return -1;
 	} else {
-		string temp = Strip_Root_Dir(fn);
+		string temp = Strip_Root_Dir(charTarFile);
 		char* charTarPath = (char*) temp.c_str();
-		if (tar_append_file(t, charTarFile, charTarPath) == -1)
+		if (tar_append_file_stat(t, charTarFile, charTarPath, &st) == -1)
 			return -1;
 	}
 	return 0;
 }
 
 int twrpTar::closeTar() {
+	bool buffered = (pipeline == NULL); // only the uncompressed writer uses the tarWrite.c buffer
+
 	LOGINFO("Closing tar\n");
-	flush_libtar_buffer(t->fd);
+	if (buffered)
+		flush_libtar_buffer(t->fd);
 	if (tar_append_eof(t) != 0) {
 		LOGINFO("tar_append_eof(): %s\n", strerror(errno));
+		closePipeline(false);
+		tar_close(t);
+		return -1;
+	}
+	// Flush the pipeline before libtar closes the archive fd under it
+	if (closePipeline(false) != 0) {
+		LOGINFO("Unable to compress or encrypt tar archive: '%s'\n", tarfn.c_str());
 		tar_close(t);
 		return -1;
 	}
@@ -1351,14 +1340,18 @@ int twrpTar::closeTar() {
 		LOGINFO("Unable to close tar archive: '%s'\n", tarfn.c_str());
 		return -1;
 	}
-	if (current_archive_type > 0) {
-		int status;
-		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
-			return -1;
-		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
-			return -1;
+	if (current_archive_type > 0 || use_chunk_store)
+		output_fd = -1; // closed by tar_close()
+	if (closeChunks() != 0) {
+		LOGINFO("Unable to save '%s' to the chunk store\n", tarfn.c_str());
+		return -1;
+	}
+	if (finishDigest() != 0) {
+		LOGINFO("Unable to create digest for '%s'\n", tarfn.c_str());
+		return -1;
 	}
-	free_libtar_buffer();
+	if (buffered)
+		free_libtar_buffer();
 	if (!part_settings->adbbackup) {
 		if (use_compression && !use_encryption) {
 			string gzname = tarfn + ".gz";
@@ -1440,7 +1433,7 @@ unsigned long long twrpTar::get_size() {
 				LOGERR("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
 				return 0;
 			}
-			for (int i = 0; i < 9; i++) {
+			for (int i = 0; i < TAR_MAX_THREAD_IDS; i++) {
 				archive_count = 0;
 				sprintf(actual_filename, temp.c_str(), i, archive_count);
 				while (TWFunc::Path_Exists(actual_filename)) {
@@ -1467,29 +1460,19 @@ unsigned long long twrpTar::get_size() {
 
 unsigned long long twrpTar::uncompressedSize(string filename) {
 	unsigned long long total_size = 0;
-	string Tar, Command, result;
-	vector<string> split;
+
+#ifndef BUILD_TWRPTAR_MAIN
+	// Chunked archives only record the size they were stored at, close enough for progress
+	if (twrpChunkStore::Is_Index(filename))
+		return twrpChunkStore::Get_Stream_Size(filename);
+#endif
 
 	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
 	if (current_archive_type == UNCOMPRESSED) {
 		total_size = TWFunc::Get_File_Size(filename);
 	} else if (current_archive_type == COMPRESSED) {
-		// Compressed
-		Command = "pigz -l '" + filename + "'";
-		/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
-		we get the uncompressed size at once. */
-		TWFunc::Exec_Cmd(Command, result, false);
-		if (!result.empty()) {
-			/* Expected output:
-			compressed original  reduced name
-			95855838   179403776 -1.3%   data.yaffs2.win
-			^
-			split[5]
-			*/
-			split = TWFunc::split_string(result, ' ', true);
-			if (split.size() > 4)
-				total_size = atoi(split[5].c_str());
-		}
+		// Compressed, the gzip trailer holds the original size
+		total_size = twrpTarPipeline::Get_Uncompressed_Size(filename, false, password);
 	} else if (current_archive_type == COMPRESSED_ENCRYPTED) {
 		// File is encrypted and may be compressed
 		int ret = TWFunc::Try_Decrypting_File(filename, password);
@@ -1500,22 +1483,7 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 			LOGERR("Decrypted file is not in tar format.\n");
 			total_size = TWFunc::Get_File_Size(filename);
 		} else if (ret == 3) {
-			Command = "openaes dec --key \"" + password + "\" --in '" + filename + "' | pigz -l";
-			/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
-			we get the uncompressed size at once. */
-			TWFunc::Exec_Cmd(Command, result, false);
-			if (!result.empty()) {
-				LOGINFO("result was: '%s'\n", result.c_str());
-				/* Expected output:
-				compressed original  reduced name
-				95855838   179403776 -1.3%   data.yaffs2.win
-				^
-				split[5]
-				*/
-				split = TWFunc::split_string(result, ' ', true);
-				if (split.size() > 4)
-					total_size = atoi(split[5].c_str());
-			}
+			total_size = twrpTarPipeline::Get_Uncompressed_Size(filename, true, password);
 		} else {
 			total_size = TWFunc::Get_File_Size(filename);
 		}
@@ -1525,9 +1493,21 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 }
 
 extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (tar_digest_sink != NULL)
+		tar_digest_sink->update(buffer, size);
+#endif
 	return (ssize_t) write_libtar_buffer(fd, buffer, size);
 }
 
 extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
 	return (ssize_t) write_libtar_no_buffer(fd, buffer, size);
 }
+
+extern "C" ssize_t write_tar_pipeline(int fd __unused, const void *buffer, size_t size) {
+	return tar_pipeline->Write(buffer, size);
+}
+
+extern "C" ssize_t read_tar_pipeline(int fd __unused, void *buffer, size_t size) {
+	return tar_pipeline->Read(buffer, size);
+}
@@ -21,5 +21,7 @@
 
 ssize_t write_tar(int fd, const void *buffer, size_t size);
 ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size);
+ssize_t write_tar_pipeline(int fd, const void *buffer, size_t size);
+ssize_t read_tar_pipeline(int fd, void *buffer, size_t size);
 
 #endif  // _TWRPTAR_HEADER
@@ -24,6 +24,8 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <deque>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -34,8 +36,14 @@ extern "C" {
 
 using namespace std;
 
+class twrpDigestSink;
+class twrpTarPipeline;
+class twrpFileManifest;
+class twrpChunkWriter;
+class twrpChunkReader;
+
 struct TarListStruct {
-	std::string fn;
+	size_t entry;                                                                   // index in the twrpFileManifest
 	unsigned thread_id;
 };
 
@@ -44,6 +52,35 @@ struct thread_data_struct {
 	unsigned thread_id;
 };
 
+// Contiguous run of manifest entries archived together
+struct twrpTarBatch {
+	size_t first;
+	size_t last;                                                                    // one past the final entry
+	unsigned long long size;
+};
+
+// Batches of files shared by the archive workers. Each worker starts on its
+// own contiguous share and steals from the busiest worker once it runs out.
+class twrpTarWorkQueue {
+public:
+	twrpTarWorkQueue();
+	~twrpTarWorkQueue();
+	int Add_Range(twrpFileManifest *manifest, size_t first, size_t last);           // returns the number of regular files
+	unsigned Assign_Shares(unsigned workers);                                       // returns the number of workers worth starting
+	bool Next(unsigned worker, size_t *first, size_t *last);                        // false when there is nothing left
+	void Abort();
+	bool Empty();
+	unsigned long long Total_Size() { return total_size; }
+
+private:
+	std::vector<twrpTarBatch> batches;                                              // filled by Add_Range until shares are assigned
+	std::vector<std::deque<twrpTarBatch> > queues;
+	std::vector<unsigned long long> remaining;                                      // bytes left in each queue
+	pthread_mutex_t lock;
+	unsigned long long total_size;
+	bool aborted;
+};
+
 class twrpTar {
 public:
 	twrpTar();
@@ -66,6 +103,11 @@ public:
 	int progress_pipe_fd;
 	string partition_name;
 	string backup_folder;
+	unsigned pipeline_threads;                                                      // compression / encryption threads, 0 for one per core
+	bool write_manifest;                                                            // save partition_name.manifest for later incremental backups
+	string incremental_base;                                                        // backup folder to archive changes against, empty for a full backup
+	unsigned long long restore_progress_base;                                       // bytes already restored from earlier backups of an incremental chain
+	bool use_chunk_store;                                                           // save the archive data in the shared chunk store, tarfn becomes its index
 	PartitionSettings *part_settings;
 	TWExclude *backup_exclusions;
 
@@ -73,19 +115,29 @@ private:
 	int extract();
 	int addFilesToExistingTar(vector <string> files, string tarFile);
 	int createTar();
-	int addFile(string fn, bool include_root);
+	int addFile(size_t entry, bool include_root);
 	int entryExists(string entry);
 	int closeTar();
 	int removeEOT(string tarFile);
 	int extractTar();
 	string Strip_Root_Dir(string Path);
 	int openTar();
-	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
+	int Generate_TarList(size_t first, size_t last, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
 	static void* createList(void *cookie);
+	static void* createQueue(void *cookie);
 	static void* extractMulti(void *cookie);
 	int tarList(std::vector<TarListStruct> *TarList, unsigned thread_id);
+	int tarQueue(twrpTarWorkQueue *queue, unsigned thread_id);
+	int beginArchives(unsigned thread_id);
+	int archiveEntry(size_t entry, unsigned thread_id);
+	int endArchives(unsigned thread_id);
 	unsigned long long uncompressedSize(string filename);
 	static void Signal_Kill(int signum);
+	int closePipeline(bool restore);
+	int openOutput();                                                               // opens tarfn or the chunk store stream behind it
+	int openInput();
+	int closeChunks();
+	int finishDigest();
 
 	enum Archive_Type current_archive_type;
 	unsigned long long Archive_Current_Size;
@@ -95,8 +147,7 @@ private:
 	tartype_t tar_type; // Only used in createTar() but variable must persist while the tar is open
 	int fd;
 	int input_fd;                                                                   // this stores the fd for libtar to write to
-	pid_t pigz_pid;
-	pid_t oaes_pid;
+	twrpTarPipeline *pipeline;                                                      // compresses / encrypts the archive in process
 	unsigned long long file_count;
 
 	string tardir;
@@ -105,6 +156,14 @@ private:
 	string password;
 
 	std::vector<TarListStruct> *ItemList;
-	int output_fd;                                                                  // this stores the output fd that gzip will read from
+	twrpTarWorkQueue *WorkQueue;                                                    // shared by the encrypted backup workers
+	unsigned worker_id;                                                             // this worker's share of WorkQueue
+	int archive_count;                                                              // current split archive of this thread
+	string archive_format;                                                          // basefn + "%i%02i"
+	twrpFileManifest *manifest;                                                     // files to back up, shared by all threads
+	int output_fd;                                                                  // this stores the output fd that the pipeline writes to
 	unsigned thread_id;
+	twrpDigestSink *digest_sink;                                                    // hashes the archive while it is written
+	twrpChunkWriter *chunk_writer;
+	twrpChunkReader *chunk_reader;
 };
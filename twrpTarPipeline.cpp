@@ -0,0 +1,985 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "twrpTarPipeline.hpp"
+#include "twcommon.h"
+
+using namespace std;
+
+#ifndef BUILD_TWRPTAR_MAIN
+#include "twrpDigestDriver.hpp"
+#endif
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+extern "C" {
+	#include "openaes/inc/oaes_lib.h"
+}
+#endif
+
+#define DEFLATE_JOB_SIZE 131072              // same block size pigz uses
+#define DEFLATE_DICT_SIZE 32768
+#define OAES_PLAIN_CHUNK 4064                // "openaes enc" encrypts 4096 - 2 * OAES_BLOCK_SIZE bytes at a time
+#define OAES_CIPHER_CHUNK 4096               // and "openaes dec" decrypts 4096 bytes at a time
+#define OAES_JOB_CHUNKS 32
+#define READ_SIZE 131072
+#define INFLATE_BUF_SIZE 262144
+#define INFLATE_BUF_COUNT 4
+
+twrpPipelineQueue::twrpPipelineQueue() {
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	aborted = false;
+}
+
+twrpPipelineQueue::~twrpPipelineQueue() {
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpPipelineQueue::Push(twrpPipelineJob *job) {
+	pthread_mutex_lock(&lock);
+	jobs.push_back(job);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+twrpPipelineJob* twrpPipelineQueue::Pop() {
+	twrpPipelineJob *job = NULL;
+
+	pthread_mutex_lock(&lock);
+	while (jobs.empty() && !aborted)
+		pthread_cond_wait(&cond, &lock);
+	if (!aborted) {
+		job = jobs.front();
+		jobs.pop_front();
+	}
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+void twrpPipelineQueue::Abort() {
+	pthread_mutex_lock(&lock);
+	aborted = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+twrpPipelineStage::twrpPipelineStage() {
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	next_seq = 0;
+	aborted = false;
+	stopping = false;
+	failed = false;
+}
+
+twrpPipelineStage::~twrpPipelineStage() {
+	Stop();
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpPipelineStage::Start(unsigned threads, unsigned job_count, size_t in_size, size_t out_size) {
+	pthread_t thread;
+	unsigned i;
+
+	for (i = 0; i < job_count; i++) {
+		twrpPipelineJob *job = new twrpPipelineJob();
+		memset(job, 0, sizeof(*job));
+		job->owner = this;
+		job->in_size = in_size;
+		job->out_size = out_size;
+		job->in = (unsigned char*) malloc(in_size);
+		job->out = (unsigned char*) malloc(out_size);
+		jobs.push_back(job);
+		if (job->in == NULL || job->out == NULL) {
+			LOGINFO("twrpPipelineStage failed to allocate job buffers\n");
+			return false;
+		}
+		free_jobs.push_back(job);
+	}
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&thread, NULL, Worker_Thread, (void*)this) != 0) {
+			LOGINFO("Unable to create pipeline thread %u\n", i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	return !workers.empty();
+}
+
+void* twrpPipelineStage::Worker_Thread(void *cookie) {
+	twrpPipelineStage *stage = (twrpPipelineStage*) cookie;
+	twrpPipelineJob *job;
+	void *worker_data = stage->Worker_Init();
+	bool ret;
+
+	pthread_mutex_lock(&stage->lock);
+	for (;;) {
+		while (stage->pending.empty() && !stage->aborted && !stage->stopping)
+			pthread_cond_wait(&stage->cond, &stage->lock);
+		if (stage->aborted || stage->pending.empty())
+			break;
+		job = stage->pending.front();
+		stage->pending.pop_front();
+		pthread_mutex_unlock(&stage->lock);
+
+		ret = stage->Process(job, worker_data);
+
+		pthread_mutex_lock(&stage->lock);
+		job->done = true;
+		if (!ret) {
+			stage->failed = true;
+			stage->aborted = true;
+		}
+		pthread_cond_broadcast(&stage->cond);
+	}
+	pthread_mutex_unlock(&stage->lock);
+	stage->Worker_Free(worker_data);
+	return NULL;
+}
+
+twrpPipelineJob* twrpPipelineStage::Get_Free_Job() {
+	twrpPipelineJob *job = NULL;
+
+	pthread_mutex_lock(&lock);
+	while (free_jobs.empty() && !aborted)
+		pthread_cond_wait(&cond, &lock);
+	if (!aborted) {
+		job = free_jobs.front();
+		free_jobs.pop_front();
+		job->in_len = 0;
+		job->out_len = 0;
+		job->crc = 0;
+		job->prev = NULL;
+		job->last = false;
+		job->done = false;
+	}
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+void twrpPipelineStage::Submit(twrpPipelineJob *job) {
+	pthread_mutex_lock(&lock);
+	job->seq = next_seq++;
+	pending.push_back(job);
+	submitted.push_back(job);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+twrpPipelineJob* twrpPipelineStage::Next_Done() {
+	twrpPipelineJob *job = NULL;
+
+	pthread_mutex_lock(&lock);
+	while (!aborted && (submitted.empty() || !submitted.front()->done))
+		pthread_cond_wait(&cond, &lock);
+	if (!aborted) {
+		job = submitted.front();
+		submitted.pop_front();
+	}
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+void twrpPipelineStage::Release_Job(twrpPipelineJob *job) {
+	pthread_mutex_lock(&lock);
+	free_jobs.push_back(job);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPipelineStage::Abort() {
+	pthread_mutex_lock(&lock);
+	aborted = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPipelineStage::Stop() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	workers.clear();
+	for (size_t i = 0; i < jobs.size(); i++) {
+		free(jobs[i]->in);
+		free(jobs[i]->out);
+		delete jobs[i];
+	}
+	jobs.clear();
+	free_jobs.clear();
+	pending.clear();
+	submitted.clear();
+}
+
+bool twrpPipelineStage::Failed() {
+	bool ret;
+
+	pthread_mutex_lock(&lock);
+	ret = failed;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+// Compresses each job as raw deflate primed with the last 32K of the previous
+// job and ended with a sync flush, the same way pigz does, so that the jobs
+// concatenate into one deflate stream
+class twrpDeflateStage : public twrpPipelineStage {
+protected:
+	void* Worker_Init() {
+		z_stream *strm = new z_stream();
+		memset(strm, 0, sizeof(*strm));
+		if (deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			delete strm;
+			return NULL;
+		}
+		return strm;
+	}
+
+	void Worker_Free(void *worker_data) {
+		z_stream *strm = (z_stream*) worker_data;
+		if (strm) {
+			deflateEnd(strm);
+			delete strm;
+		}
+	}
+
+	bool Process(twrpPipelineJob *job, void *worker_data) {
+		z_stream *strm = (z_stream*) worker_data;
+		int ret;
+
+		if (strm == NULL)
+			return false;
+		deflateReset(strm);
+		if (job->prev) {
+			size_t dict_len = job->prev->in_len < DEFLATE_DICT_SIZE ? job->prev->in_len : DEFLATE_DICT_SIZE;
+			deflateSetDictionary(strm, job->prev->in + job->prev->in_len - dict_len, dict_len);
+		}
+		strm->next_in = job->in;
+		strm->avail_in = job->in_len;
+		strm->next_out = job->out;
+		strm->avail_out = job->out_size;
+		ret = deflate(strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (job->last ? ret != Z_STREAM_END : (ret != Z_OK || strm->avail_in != 0 || strm->avail_out == 0)) {
+			LOGINFO("deflate failed: %i\n", ret);
+			return false;
+		}
+		job->out_len = job->out_size - strm->avail_out;
+		job->crc = crc32(crc32(0L, Z_NULL, 0), job->in, job->in_len);
+		return true;
+	}
+};
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// Same key setup as oaes.c and TWFunc::Try_Decrypting_File
+static OAES_CTX* New_AES_Context(const string& password) {
+	uint8_t key_data[32];
+	size_t key_data_len = password.size();
+	OAES_CTX *ctx;
+
+	for (size_t i = 0; i < sizeof(key_data); i++)
+		key_data[i] = i + 1;
+	if (key_data_len > sizeof(key_data))
+		key_data_len = sizeof(key_data);
+	memcpy(key_data, password.c_str(), key_data_len);
+	if (key_data_len <= 16)
+		key_data_len = 16;
+	else if (key_data_len <= 24)
+		key_data_len = 24;
+	else
+		key_data_len = 32;
+
+	ctx = oaes_alloc();
+	if (ctx == NULL) {
+		LOGINFO("Failed to allocate OAES\n");
+		return NULL;
+	}
+	if (oaes_key_import_data(ctx, key_data, key_data_len) != OAES_RET_SUCCESS) {
+		LOGINFO("Failed to import OAES key\n");
+		oaes_free(&ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+// Each 4064 byte chunk is encrypted on its own by openaes, so whole jobs of
+// chunks can be handled by different threads
+class twrpAESStage : public twrpPipelineStage {
+public:
+	twrpAESStage(const string& pass, bool decrypt) {
+		password = pass;
+		decrypting = decrypt;
+	}
+
+protected:
+	void* Worker_Init() {
+		return New_AES_Context(password);
+	}
+
+	void Worker_Free(void *worker_data) {
+		OAES_CTX *ctx = (OAES_CTX*) worker_data;
+		if (ctx)
+			oaes_free(&ctx);
+	}
+
+	bool Process(twrpPipelineJob *job, void *worker_data) {
+		OAES_CTX *ctx = (OAES_CTX*) worker_data;
+		size_t chunk = decrypting ? OAES_CIPHER_CHUNK : OAES_PLAIN_CHUNK;
+		size_t pos = 0, len, out_len;
+		OAES_RET ret;
+
+		if (ctx == NULL)
+			return false;
+		job->out_len = 0;
+		while (pos < job->in_len) {
+			len = job->in_len - pos < chunk ? job->in_len - pos : chunk;
+			out_len = job->out_size - job->out_len;
+			if (decrypting)
+				ret = oaes_decrypt(ctx, job->in + pos, len, job->out + job->out_len, &out_len);
+			else
+				ret = oaes_encrypt(ctx, job->in + pos, len, job->out + job->out_len, &out_len);
+			if (ret != OAES_RET_SUCCESS) {
+				LOGINFO("openaes %s failed: %i\n", decrypting ? "decrypt" : "encrypt", ret);
+				return false;
+			}
+			job->out_len += out_len;
+			pos += len;
+		}
+		return true;
+	}
+
+private:
+	string password;
+	bool decrypting;
+};
+#endif
+
+twrpTarPipeline::twrpTarPipeline() {
+	fd = -1;
+	progress_fd = -1;
+	compress = false;
+	encrypt = false;
+	error = false;
+	stopped = false;
+	digest = NULL;
+	first_stage = NULL;
+	encrypt_stage = NULL;
+	input_job = NULL;
+	encrypt_job = NULL;
+	prev_job = NULL;
+	crc = 0;
+	total_in = 0;
+	inflate_stream = NULL;
+	inflate_job = NULL;
+	read_job = NULL;
+	read_pos = 0;
+	read_eof = false;
+	stream_end = false;
+	pthread_mutex_init(&error_lock, NULL);
+}
+
+twrpTarPipeline::~twrpTarPipeline() {
+	Stop_Threads();
+	pthread_mutex_destroy(&error_lock);
+}
+
+static twrpPipelineStage* New_AES_Stage(const string& password, bool decrypt) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	return new twrpAESStage(password, decrypt);
+#else
+	LOGINFO("Encrypted backups are not supported in this build\n");
+	return NULL;
+#endif
+}
+
+static unsigned Pipeline_Threads(unsigned threads) {
+	long cores;
+
+	if (threads > 0)
+		return threads;
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? (unsigned)cores : 1;
+}
+
+int twrpTarPipeline::Open_Write(int out_fd, bool use_compression, bool use_encryption, const string& password, unsigned thread_count, int progress_pipe_fd, twrpDigestSink *digest_sink) {
+	pthread_t thread;
+	unsigned job_count;
+
+	fd = out_fd;
+	progress_fd = progress_pipe_fd;
+	compress = use_compression;
+	encrypt = use_encryption;
+	digest = digest_sink;
+	thread_count = Pipeline_Threads(thread_count);
+	job_count = thread_count * 2 + 2;
+
+	if (encrypt) {
+		encrypt_stage = New_AES_Stage(password, false);
+		if (encrypt_stage == NULL || !encrypt_stage->Start(thread_count, job_count, OAES_PLAIN_CHUNK * OAES_JOB_CHUNKS, OAES_CIPHER_CHUNK * OAES_JOB_CHUNKS))
+			return -1;
+	}
+	if (compress) {
+		first_stage = new twrpDeflateStage();
+		if (!first_stage->Start(thread_count, job_count, DEFLATE_JOB_SIZE, DEFLATE_JOB_SIZE + DEFLATE_JOB_SIZE / 8 + 1024))
+			return -1;
+	} else {
+		// Encrypt the tar stream directly
+		first_stage = encrypt_stage;
+		encrypt_stage = NULL;
+	}
+	if (first_stage == NULL)
+		return -1;
+
+	input_job = first_stage->Get_Free_Job();
+	if (compress) {
+		static const unsigned char gzip_header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+
+		if (encrypt_stage)
+			encrypt_job = encrypt_stage->Get_Free_Job();
+		crc = crc32(0L, Z_NULL, 0);
+		if (!Emit_Compressed(gzip_header, sizeof(gzip_header), false))
+			return -1;
+	}
+
+	if (pthread_create(&thread, NULL, Write_Thread, (void*)this) != 0) {
+		LOGINFO("Unable to create pipeline writer thread\n");
+		return -1;
+	}
+	threads.push_back(thread);
+	if (encrypt_stage) {
+		if (pthread_create(&thread, NULL, Encrypt_Write_Thread, (void*)this) != 0) {
+			LOGINFO("Unable to create pipeline encryption writer thread\n");
+			Set_Error();
+			return -1;
+		}
+		threads.push_back(thread);
+	}
+	return 0;
+}
+
+ssize_t twrpTarPipeline::Write(const void *buffer, size_t size) {
+	const unsigned char *data = (const unsigned char*) buffer;
+	size_t copied = 0, len;
+
+	while (copied < size) {
+		if (input_job == NULL)
+			return -1;
+		len = input_job->in_size - input_job->in_len;
+		if (len > size - copied)
+			len = size - copied;
+		memcpy(input_job->in + input_job->in_len, data + copied, len);
+		input_job->in_len += len;
+		copied += len;
+		if (input_job->in_len == input_job->in_size && !Submit_Input(false))
+			return -1;
+	}
+	return (ssize_t) size;
+}
+
+bool twrpTarPipeline::Submit_Input(bool last) {
+	unsigned long long fs = (unsigned long long) input_job->in_len;
+
+	input_job->last = last;
+	if (compress) {
+		input_job->prev = prev_job;
+		prev_job = input_job;
+	}
+	first_stage->Submit(input_job);
+	if (progress_fd >= 0 && fs > 0)
+		write(progress_fd, &fs, sizeof(fs));
+	input_job = last ? NULL : first_stage->Get_Free_Job();
+	return last || input_job != NULL;
+}
+
+void* twrpTarPipeline::Write_Thread(void *cookie) {
+	twrpTarPipeline *pipe = (twrpTarPipeline*) cookie;
+	twrpPipelineJob *job, *held = NULL;
+	bool ret = true;
+
+	while (ret && (job = pipe->first_stage->Next_Done()) != NULL) {
+		if (pipe->compress) {
+			pipe->crc = crc32_combine(pipe->crc, job->crc, job->in_len);
+			pipe->total_in += job->in_len;
+			ret = pipe->Emit_Compressed(job->out, job->out_len, false);
+			if (ret && job->last) {
+				unsigned char trailer[8];
+				for (int i = 0; i < 4; i++) {
+					trailer[i] = (pipe->crc >> (8 * i)) & 0xff;
+					trailer[i + 4] = (pipe->total_in >> (8 * i)) & 0xff;
+				}
+				ret = pipe->Emit_Compressed(trailer, sizeof(trailer), true);
+			}
+		} else {
+			ret = pipe->Write_Output(job->out, job->out_len);
+		}
+		// The next job needs this one as its dictionary, so hold on to it
+		// until that job has been compressed
+		if (held)
+			pipe->first_stage->Release_Job(held);
+		held = job;
+		if (job->last)
+			break;
+	}
+	if (held)
+		pipe->first_stage->Release_Job(held);
+	if (!ret || job == NULL)
+		pipe->Set_Error();
+	return NULL;
+}
+
+bool twrpTarPipeline::Emit_Compressed(const unsigned char *data, size_t len, bool last) {
+	size_t copied = 0, chunk;
+
+	if (encrypt_stage == NULL)
+		return Write_Output(data, len);
+
+	// Refill whole 4064 byte chunks so the output matches "pigz | openaes enc"
+	while (copied < len || last) {
+		if (encrypt_job == NULL)
+			return false;
+		chunk = encrypt_job->in_size - encrypt_job->in_len;
+		if (chunk > len - copied)
+			chunk = len - copied;
+		memcpy(encrypt_job->in + encrypt_job->in_len, data + copied, chunk);
+		encrypt_job->in_len += chunk;
+		copied += chunk;
+		if (copied == len && last) {
+			encrypt_job->last = true;
+			encrypt_stage->Submit(encrypt_job);
+			encrypt_job = NULL;
+			break;
+		}
+		if (encrypt_job->in_len == encrypt_job->in_size) {
+			encrypt_stage->Submit(encrypt_job);
+			encrypt_job = encrypt_stage->Get_Free_Job();
+		}
+	}
+	return true;
+}
+
+void* twrpTarPipeline::Encrypt_Write_Thread(void *cookie) {
+	twrpTarPipeline *pipe = (twrpTarPipeline*) cookie;
+	twrpPipelineJob *job;
+	bool ret = true, last = false;
+
+	while (!last && (job = pipe->encrypt_stage->Next_Done()) != NULL) {
+		ret = pipe->Write_Output(job->out, job->out_len);
+		last = job->last;
+		pipe->encrypt_stage->Release_Job(job);
+		if (!ret)
+			break;
+	}
+	if (!ret || !last)
+		pipe->Set_Error();
+	return NULL;
+}
+
+bool twrpTarPipeline::Write_Output(const unsigned char *data, size_t len) {
+	ssize_t bytes;
+	size_t written = 0;
+
+#ifndef BUILD_TWRPTAR_MAIN
+	if (digest)
+		digest->update(data, len);
+#endif
+	while (written < len) {
+		bytes = write(fd, data + written, len - written);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			LOGINFO("Error writing archive (%s)\n", strerror(errno));
+			return false;
+		}
+		written += bytes;
+	}
+	return true;
+}
+
+int twrpTarPipeline::Close_Write() {
+	if (input_job != NULL)
+		Submit_Input(true);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	threads.clear();
+	Stop_Threads();
+	return error ? -1 : 0;
+}
+
+int twrpTarPipeline::Open_Read(int in_fd, bool compressed, bool encrypted, const string& password, unsigned thread_count) {
+	pthread_t thread;
+
+	fd = in_fd;
+	compress = compressed;
+	encrypt = encrypted;
+	thread_count = Pipeline_Threads(thread_count);
+	if (!compress && !encrypt)
+		return -1;                                               // libtar can read a plain archive itself
+
+	if (encrypt) {
+		first_stage = New_AES_Stage(password, true);
+		if (first_stage == NULL || !first_stage->Start(thread_count, thread_count * 2 + 2, OAES_CIPHER_CHUNK * OAES_JOB_CHUNKS, OAES_CIPHER_CHUNK * OAES_JOB_CHUNKS))
+			return -1;
+	}
+	if (compress) {
+		z_stream *strm = new z_stream();
+		memset(strm, 0, sizeof(*strm));
+		inflate_stream = strm;
+		if (inflateInit2(strm, 16 + MAX_WBITS) != Z_OK) {
+			LOGINFO("inflateInit2 failed\n");
+			delete strm;
+			inflate_stream = NULL;
+			return -1;
+		}
+		for (int i = 0; i < INFLATE_BUF_COUNT; i++) {
+			twrpPipelineJob *job = new twrpPipelineJob();
+			memset(job, 0, sizeof(*job));
+			job->out_size = INFLATE_BUF_SIZE;
+			job->out = (unsigned char*) malloc(INFLATE_BUF_SIZE);
+			inflate_jobs.push_back(job);
+			if (job->out == NULL)
+				return -1;
+			inflate_free.Push(job);
+		}
+	}
+
+	if (pthread_create(&thread, NULL, Read_Thread, (void*)this) != 0) {
+		LOGINFO("Unable to create pipeline reader thread\n");
+		return -1;
+	}
+	threads.push_back(thread);
+	if (encrypt) {
+		if (pthread_create(&thread, NULL, Decrypt_Read_Thread, (void*)this) != 0) {
+			LOGINFO("Unable to create pipeline decryption thread\n");
+			Set_Error();
+			return -1;
+		}
+		threads.push_back(thread);
+	}
+	return 0;
+}
+
+// Waits for archive data without blocking forever on an adb fifo once the
+// pipeline is being shut down
+static bool Wait_For_Input(int fd, bool *stopped, pthread_mutex_t *lock) {
+	struct pollfd pfd;
+	bool stop;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		pthread_mutex_lock(lock);
+		stop = *stopped;
+		pthread_mutex_unlock(lock);
+		if (stop)
+			return false;
+		if (poll(&pfd, 1, 500) != 0)
+			return true;
+	}
+}
+
+// Reads up to size bytes, or only what is available when fill is false
+static ssize_t Read_Input(int fd, unsigned char *buffer, size_t size, bool fill, bool *stopped, pthread_mutex_t *lock) {
+	ssize_t bytes;
+	size_t total = 0;
+
+	while (total < size) {
+		if (!Wait_For_Input(fd, stopped, lock))
+			return -1;
+		bytes = read(fd, buffer + total, size - total);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes < 0)
+			return -1;
+		if (bytes == 0)
+			break;
+		total += bytes;
+		if (!fill)
+			break;
+	}
+	return total;
+}
+
+void* twrpTarPipeline::Read_Thread(void *cookie) {
+	twrpTarPipeline *pipe = (twrpTarPipeline*) cookie;
+	twrpPipelineJob *job;
+	unsigned char *buffer;
+	ssize_t bytes;
+	bool ret = true;
+
+	if (pipe->encrypt) {
+		// Read whole cipher chunks and let the AES workers decrypt them
+		while ((job = pipe->first_stage->Get_Free_Job()) != NULL) {
+			bytes = Read_Input(pipe->fd, job->in, job->in_size, true, &pipe->stopped, &pipe->error_lock);
+			if (bytes < 0) {
+				pipe->first_stage->Release_Job(job);
+				ret = false;
+				break;
+			}
+			job->in_len = bytes;
+			job->last = (size_t)bytes < job->in_size;
+			pipe->first_stage->Submit(job);
+			if (job->last)
+				break;
+		}
+		if (ret && job == NULL)
+			ret = false;
+	} else {
+		buffer = (unsigned char*) malloc(READ_SIZE);
+		if (buffer == NULL) {
+			pipe->Set_Error();
+			return NULL;
+		}
+		do {
+			bytes = Read_Input(pipe->fd, buffer, READ_SIZE, false, &pipe->stopped, &pipe->error_lock);
+			if (bytes < 0) {
+				ret = false;
+				break;
+			}
+			ret = pipe->Consume_Plain(buffer, bytes, NULL, bytes == 0);
+		} while (ret && bytes > 0 && !pipe->stream_end);
+		// Stop at the end of the gzip stream so an adb fifo is not read past the archive
+		if (ret && bytes > 0)
+			ret = pipe->Consume_Plain(buffer, 0, NULL, true);
+		free(buffer);
+	}
+	if (!ret)
+		pipe->Set_Error();
+	return NULL;
+}
+
+void* twrpTarPipeline::Decrypt_Read_Thread(void *cookie) {
+	twrpTarPipeline *pipe = (twrpTarPipeline*) cookie;
+	twrpPipelineJob *job;
+	bool ret = true, last = false;
+
+	while (ret && !last && (job = pipe->first_stage->Next_Done()) != NULL) {
+		last = job->last;
+		ret = pipe->Consume_Plain(job->out, job->out_len, job, last);
+	}
+	if (!ret || !last)
+		pipe->Set_Error();
+	return NULL;
+}
+
+// Hands decrypted or raw data to Read(), inflating it first if needed. job
+// (if any) is given back to its stage once the data has been used.
+bool twrpTarPipeline::Consume_Plain(unsigned char *data, size_t len, twrpPipelineJob *job, bool last) {
+	z_stream *strm = (z_stream*) inflate_stream;
+	int ret;
+
+	if (!compress) {
+		ready.Push(job);
+		return true;
+	}
+
+	strm->next_in = data;
+	strm->avail_in = len;
+	while (!stream_end && (strm->avail_in > 0 || inflate_job == NULL)) {
+		if (inflate_job == NULL && (inflate_job = inflate_free.Pop()) == NULL)
+			break;
+		strm->next_out = inflate_job->out + inflate_job->out_len;
+		strm->avail_out = inflate_job->out_size - inflate_job->out_len;
+		ret = inflate(strm, Z_NO_FLUSH);
+		inflate_job->out_len = inflate_job->out_size - strm->avail_out;
+		if (ret == Z_STREAM_END) {
+			stream_end = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LOGINFO("inflate failed: %i\n", ret);
+			return false;
+		}
+		if (strm->avail_out == 0) {
+			ready.Push(inflate_job);
+			inflate_job = NULL;
+		} else if (ret == Z_BUF_ERROR) {
+			break; // needs more input
+		}
+	}
+	if (job)
+		job->owner->Release_Job(job);
+	if (last) {
+		if (!stream_end) {
+			LOGINFO("Compressed archive is truncated\n");
+			return false;
+		}
+		if (inflate_job == NULL && (inflate_job = inflate_free.Pop()) == NULL)
+			return false;
+		inflate_job->last = true;
+		ready.Push(inflate_job);
+		inflate_job = NULL;
+	}
+	return true;
+}
+
+ssize_t twrpTarPipeline::Read(void *buffer, size_t size) {
+	unsigned char *data = (unsigned char*) buffer;
+	size_t copied = 0, len;
+
+	while (copied < size) {
+		if (read_job == NULL) {
+			if (read_eof)
+				break;
+			read_job = ready.Pop();
+			if (read_job == NULL)
+				return -1;
+			read_pos = 0;
+		}
+		len = read_job->out_len - read_pos;
+		if (len > size - copied)
+			len = size - copied;
+		memcpy(data + copied, read_job->out + read_pos, len);
+		copied += len;
+		read_pos += len;
+		if (read_pos == read_job->out_len) {
+			if (read_job->last)
+				read_eof = true;
+			if (read_job->owner) {
+				read_job->owner->Release_Job(read_job);
+			} else {
+				read_job->out_len = 0;
+				read_job->last = false;
+				inflate_free.Push(read_job);
+			}
+			read_job = NULL;
+		}
+	}
+	return (ssize_t) copied;
+}
+
+int twrpTarPipeline::Close_Read() {
+	// libtar stops at the end of archive marker, so the threads may still be
+	// waiting for Read() to take more data
+	pthread_mutex_lock(&error_lock);
+	stopped = true;
+	pthread_mutex_unlock(&error_lock);
+	ready.Abort();
+	inflate_free.Abort();
+	if (first_stage)
+		first_stage->Abort();
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	threads.clear();
+	Stop_Threads();
+	return 0;
+}
+
+void twrpTarPipeline::Set_Error() {
+	pthread_mutex_lock(&error_lock);
+	error = true;
+	stopped = true;
+	pthread_mutex_unlock(&error_lock);
+	if (first_stage)
+		first_stage->Abort();
+	if (encrypt_stage)
+		encrypt_stage->Abort();
+	ready.Abort();
+	inflate_free.Abort();
+}
+
+void twrpTarPipeline::Stop_Threads() {
+	if (!threads.empty()) {
+		Set_Error();
+		for (size_t i = 0; i < threads.size(); i++)
+			pthread_join(threads[i], NULL);
+		threads.clear();
+	}
+	// Join the workers before deleting so they still see the derived stage
+	if (first_stage)
+		first_stage->Stop();
+	delete first_stage;
+	first_stage = NULL;
+	if (encrypt_stage)
+		encrypt_stage->Stop();
+	delete encrypt_stage;
+	encrypt_stage = NULL;
+	if (inflate_stream) {
+		inflateEnd((z_stream*) inflate_stream);
+		delete (z_stream*) inflate_stream;
+		inflate_stream = NULL;
+	}
+	for (size_t i = 0; i < inflate_jobs.size(); i++) {
+		free(inflate_jobs[i]->out);
+		delete inflate_jobs[i];
+	}
+	inflate_jobs.clear();
+}
+
+unsigned long long twrpTarPipeline::Get_Uncompressed_Size(const string& filename, bool encrypted, const string& password) {
+	unsigned char tail[OAES_CIPHER_CHUNK * 2];
+	size_t tail_len = 0;
+	struct stat st;
+	int in_fd;
+
+	in_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+	if (in_fd < 0)
+		return 0;
+	if (fstat(in_fd, &st) != 0 || st.st_size < 18) {
+		close(in_fd);
+		return 0;
+	}
+
+	// The gzip trailer ends with the uncompressed size mod 2^32, which is
+	// what "pigz -l" reports
+	if (!encrypted) {
+		if (pread(in_fd, tail, 4, st.st_size - 4) == 4)
+			tail_len = 4;
+	} else {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		OAES_CTX *ctx = New_AES_Context(password);
+		unsigned char cipher[OAES_CIPHER_CHUNK];
+		off_t chunk_start = ((st.st_size - 1) / OAES_CIPHER_CHUNK) * OAES_CIPHER_CHUNK;
+		size_t out_len;
+		ssize_t bytes;
+
+		// The last chunk may hold fewer than 4 bytes, so work back through
+		// the one before it too, keeping the decrypted data in file order
+		while (ctx && chunk_start >= 0 && tail_len < 4 && sizeof(tail) - tail_len >= OAES_CIPHER_CHUNK) {
+			bytes = pread(in_fd, cipher, OAES_CIPHER_CHUNK, chunk_start);
+			out_len = sizeof(tail) - tail_len;
+			memmove(tail + out_len, tail, tail_len);
+			if (bytes <= 0 || oaes_decrypt(ctx, cipher, bytes, tail, &out_len) != OAES_RET_SUCCESS) {
+				tail_len = 0;
+				break;
+			}
+			memmove(tail + out_len, tail + sizeof(tail) - tail_len, tail_len);
+			tail_len += out_len;
+			chunk_start -= OAES_CIPHER_CHUNK;
+		}
+		if (ctx)
+			oaes_free(&ctx);
+		if (tail_len >= 4) {
+			memmove(tail, tail + tail_len - 4, 4);
+			tail_len = 4;
+		}
+#endif
+	}
+	close(in_fd);
+	if (tail_len != 4)
+		return 0;
+	return (unsigned long long)tail[0] | ((unsigned long long)tail[1] << 8) | ((unsigned long long)tail[2] << 16) | ((unsigned long long)tail[3] << 24);
+}
@@ -0,0 +1,156 @@
+/*
+	Copyright 2013 to 2020 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPTARPIPELINE_HPP
+#define __TWRPTARPIPELINE_HPP
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+// In-process replacement for the pigz and openaes children that used to sit
+// between libtar and the archive. Deflate and AES run on worker threads in
+// fixed size jobs and the results are written out in order, so the archives
+// stay byte compatible with "pigz -d" and "openaes dec".
+
+class twrpDigestSink;
+class twrpPipelineStage;
+
+struct twrpPipelineJob {
+	unsigned long long seq;                                         // submission order
+	unsigned char *in;                                              // input data
+	size_t in_len;
+	size_t in_size;                                                 // capacity of in
+	unsigned char *out;                                             // transformed data
+	size_t out_len;
+	size_t out_size;                                                // capacity of out
+	unsigned long crc;                                              // crc32 of in when deflating
+	twrpPipelineJob *prev;                                          // supplies the deflate dictionary
+	twrpPipelineStage *owner;                                       // stage to give the job back to, NULL for pipeline buffers
+	bool last;                                                      // final job of the stream
+	bool done;
+};
+
+// FIFO of jobs shared between threads
+class twrpPipelineQueue {
+public:
+	twrpPipelineQueue();
+	~twrpPipelineQueue();
+	void Push(twrpPipelineJob *job);
+	twrpPipelineJob* Pop();                                          // blocks, returns NULL after Abort()
+	void Abort();
+
+private:
+	std::deque<twrpPipelineJob*> jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool aborted;
+};
+
+// A pool of worker threads transforming jobs. Jobs are handed back by
+// Next_Done() in the order they were submitted.
+class twrpPipelineStage {
+public:
+	twrpPipelineStage();
+	virtual ~twrpPipelineStage();
+	bool Start(unsigned threads, unsigned job_count, size_t in_size, size_t out_size);
+	twrpPipelineJob* Get_Free_Job();                                 // blocks until a job is free
+	void Submit(twrpPipelineJob *job);
+	twrpPipelineJob* Next_Done();                                    // blocks, returns NULL after Abort()
+	void Release_Job(twrpPipelineJob *job);
+	void Abort();
+	void Stop();                                                     // joins the workers and frees the jobs
+	bool Failed();
+
+protected:
+	virtual void* Worker_Init() { return NULL; }
+	virtual void Worker_Free(void*) {}
+	virtual bool Process(twrpPipelineJob *job, void *worker_data) = 0;
+
+private:
+	static void* Worker_Thread(void *cookie);
+
+	std::vector<pthread_t> workers;
+	std::vector<twrpPipelineJob*> jobs;
+	std::deque<twrpPipelineJob*> free_jobs;
+	std::deque<twrpPipelineJob*> pending;                            // waiting for a worker
+	std::deque<twrpPipelineJob*> submitted;                          // submission order
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long next_seq;
+	bool aborted;
+	bool stopping;
+	bool failed;
+};
+
+class twrpTarPipeline {
+public:
+	twrpTarPipeline();
+	~twrpTarPipeline();
+	int Open_Write(int fd, bool compress, bool encrypt, const std::string& password, unsigned threads, int progress_fd, twrpDigestSink *digest);
+	ssize_t Write(const void *buffer, size_t size);
+	int Close_Write();
+	int Open_Read(int fd, bool compressed, bool encrypted, const std::string& password, unsigned threads);
+	ssize_t Read(void *buffer, size_t size);
+	int Close_Read();
+	static unsigned long long Get_Uncompressed_Size(const std::string& filename, bool encrypted, const std::string& password);
+
+private:
+	static void* Write_Thread(void *cookie);
+	static void* Encrypt_Write_Thread(void *cookie);
+	static void* Read_Thread(void *cookie);
+	static void* Decrypt_Read_Thread(void *cookie);
+	bool Submit_Input(bool last);
+	bool Emit_Compressed(const unsigned char *data, size_t len, bool last);
+	bool Write_Output(const unsigned char *data, size_t len);
+	bool Consume_Plain(unsigned char *data, size_t len, twrpPipelineJob *job, bool last);
+	void Set_Error();
+	void Stop_Threads();
+
+	int fd;
+	int progress_fd;
+	bool compress;
+	bool encrypt;
+	bool error;
+	bool stopped;                                                   // tells the reader to stop polling the archive
+	twrpDigestSink *digest;
+	twrpPipelineStage *first_stage;                                  // deflate, or AES when not compressing
+	twrpPipelineStage *encrypt_stage;                                // AES after deflate
+	twrpPipelineJob *input_job;                                      // job being filled by Write()
+	twrpPipelineJob *encrypt_job;                                    // compressed data waiting for AES
+	twrpPipelineJob *prev_job;
+	unsigned long crc;
+	unsigned long long total_in;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t error_lock;
+
+	// restore side
+	void *inflate_stream;
+	twrpPipelineQueue ready;                                         // plain data for Read()
+	twrpPipelineQueue inflate_free;                                  // empty buffers for inflate
+	std::vector<twrpPipelineJob*> inflate_jobs;
+	twrpPipelineJob *inflate_job;                                    // buffer inflate is filling
+	twrpPipelineJob *read_job;                                       // job Read() is copying from
+	size_t read_pos;
+	bool read_eof;
+	bool stream_end;
+};
+
+#endif // __TWRPTARPIPELINE_HPP
@@ -17,8 +17,11 @@
 #include "twinstall/package.h"
 
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <thread>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/stringprintf.h>
@@ -68,6 +71,22 @@ class MemoryPackage : public Package {
   ZipArchiveHandle zip_handle_;
 };
 
+// Feeds |length| bytes at |addr| to every hasher. Each hasher owns its context, so they run on
+// their own threads over the same buffer, and a pass costs the slowest hash rather than the sum.
+static void UpdateHashers(const std::vector<HasherUpdateCallback>& hashers, const uint8_t* addr,
+                          uint64_t length) {
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < hashers.size(); i++) {
+    threads.emplace_back(hashers[i], addr, length);
+  }
+  if (!hashers.empty()) {
+    hashers[0](addr, length);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
 void Package::SetProgress(float progress) {
   if (set_progress_) {
     set_progress_(progress);
@@ -170,9 +189,17 @@ bool MemoryPackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>&
     return false;
   }
 
-  for (const auto& hasher : hashers) {
-    hasher(addr_ + start, length);
+  // Callers hash the package front to back, so ask the kernel to start reading the next window
+  // of the mapped file while this one is hashed. That also leaves the package in the page cache
+  // for the updater.
+  if (map_ && start + length < package_size_) {
+    static const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t next = reinterpret_cast<uintptr_t>(addr_ + start + length) & ~page_mask;
+    uint64_t next_length = std::min(length, package_size_ - start - length);
+    madvise(reinterpret_cast<void*>(next), next_length, MADV_WILLNEED);
   }
+
+  UpdateHashers(hashers, addr_ + start, length);
   return true;
 }
 
@@ -234,9 +261,7 @@ bool FilePackage::UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& ha
       return false;
     }
 
-    for (const auto& hasher : hashers) {
-      hasher(buffer.data(), read_size);
-    }
+    UpdateHashers(hashers, buffer.data(), read_size);
     so_far += read_size;
   }
 
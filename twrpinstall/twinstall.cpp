@@ -34,6 +34,11 @@
 #include <stdio.h>
 #include <cutils/properties.h>
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+
 #include <android-base/unique_fd.h>
 
 #include "twcommon.h"
@@ -97,7 +102,7 @@ static int Install_Theme(const char* path, ZipArchiveHandle Zip) {
 #endif
 }
 
-static int Prepare_Update_Binary(ZipArchiveHandle Zip) {
+static void Find_Update_Binary(ZipArchiveHandle Zip, ZipEntry64* binary_entry) {
 	char arches[PATH_MAX];
 	property_get("ro.product.cpu.abilist", arches, "error");
 	if (strcmp(arches, "error") == 0)
@@ -106,31 +111,31 @@ static int Prepare_Update_Binary(ZipArchiveHandle Zip) {
 	std::vector<string>::iterator arch;
 	std::string base_name = UPDATE_BINARY_NAME;
 	base_name += "-";
-	ZipEntry64 binary_entry;
 	std::string update_binary_string(UPDATE_BINARY_NAME);
-	if (FindEntry(Zip, update_binary_string, &binary_entry) != 0) {
+	if (FindEntry(Zip, update_binary_string, binary_entry) != 0) {
 		for (arch = split.begin(); arch != split.end(); arch++) {
 			std::string temp = base_name + *arch;
 			std::string binary_name(temp.c_str());
-			if (FindEntry(Zip, binary_name, &binary_entry) != 0) {
+			if (FindEntry(Zip, binary_name, binary_entry) != 0) {
 				std::string binary_name(temp.c_str());
 				break;
 			}
 		}
 	}
-	LOGINFO("Extracting updater binary '%s'\n", UPDATE_BINARY_NAME);
+}
+
+// Does not log, so it can run on a thread next to the package verification
+static bool Extract_Update_Binary(ZipArchiveHandle Zip, ZipEntry64* binary_entry) {
 	unlink(TMP_UPDATER_BINARY_PATH);
 	android::base::unique_fd fd(
 		open(TMP_UPDATER_BINARY_PATH, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0755));
 	if (fd == -1) {
-		return INSTALL_ERROR;
-	}
-	int32_t err = ExtractEntryToFile(Zip, &binary_entry, fd);
-	if (err != 0) {
-		LOGERR("Could not extract '%s'\n", UPDATE_BINARY_NAME);
-		return INSTALL_ERROR;
+		return false;
 	}
+	return ExtractEntryToFile(Zip, binary_entry, fd) == 0;
+}
 
+static int Extract_File_Contexts(ZipArchiveHandle Zip) {
 	// If exists, extract file_contexts from the zip file
 	std::string file_contexts("file_contexts");
 	ZipEntry64 file_contexts_entry;
@@ -152,6 +157,113 @@ static int Prepare_Update_Binary(ZipArchiveHandle Zip) {
 	return INSTALL_SUCCESS;
 }
 
+static int Prepare_Update_Binary(ZipArchiveHandle Zip) {
+	ZipEntry64 binary_entry;
+	Find_Update_Binary(Zip, &binary_entry);
+	LOGINFO("Extracting updater binary '%s'\n", UPDATE_BINARY_NAME);
+	if (!Extract_Update_Binary(Zip, &binary_entry)) {
+		LOGERR("Could not extract '%s'\n", UPDATE_BINARY_NAME);
+		return INSTALL_ERROR;
+	}
+	return Extract_File_Contexts(Zip);
+}
+
+// Extracts the updater binary while the package is being verified. The binary is only
+// a file in /tmp until Finish() is called after the verification passed, and it is
+// removed again if the install is aborted first.
+class Update_Binary_Extractor {
+public:
+	Update_Binary_Extractor(ZipArchiveHandle Zip) : zip(Zip), extracted(false), finished(false) {
+		Find_Update_Binary(zip, &binary_entry);
+		LOGINFO("Extracting updater binary '%s' during verification\n", UPDATE_BINARY_NAME);
+		extract_thread = std::thread([this]() { extracted = Extract_Update_Binary(zip, &binary_entry); });
+	}
+
+	~Update_Binary_Extractor() {
+		Wait();
+		if (!finished)
+			unlink(TMP_UPDATER_BINARY_PATH);
+	}
+
+	// The zip handle is not shared between threads, wait before using it elsewhere
+	void Wait() {
+		if (extract_thread.joinable())
+			extract_thread.join();
+	}
+
+	// Extracts the rest of what Prepare_Update_Binary does
+	int Finish() {
+		Wait();
+		finished = true;
+		if (!extracted) {
+			LOGERR("Could not extract '%s'\n", UPDATE_BINARY_NAME);
+			return INSTALL_ERROR;
+		}
+		return Extract_File_Contexts(zip);
+	}
+
+private:
+	ZipArchiveHandle zip;
+	ZipEntry64 binary_entry;
+	bool extracted;
+	bool finished;
+	std::thread extract_thread;
+};
+
+// Adds the sidecar digest to the hashes of the signature check, so that one read of
+// the zip serves both checks
+class Digesting_Package : public VerifierInterface {
+public:
+	Digesting_Package(Package* Pkg, twrpDigestCheckSink* Digest) : package(Pkg), digest(Digest), digested(0) {}
+
+	uint64_t GetPackageSize() const override {
+		return package->GetPackageSize();
+	}
+
+	bool ReadFullyAtOffset(uint8_t* buffer, uint64_t byte_count, uint64_t offset) override {
+		return package->ReadFullyAtOffset(buffer, byte_count, offset);
+	}
+
+	bool UpdateHashAtOffset(const std::vector<HasherUpdateCallback>& hashers, uint64_t start,
+							uint64_t length) override {
+		if (!digest || start != digested)
+			return package->UpdateHashAtOffset(hashers, start, length);
+		std::vector<HasherUpdateCallback> all_hashers(hashers);
+		all_hashers.emplace_back([this](const uint8_t* addr, uint64_t size) { digest->update(addr, size); });
+		if (!package->UpdateHashAtOffset(all_hashers, start, length))
+			return false;
+		digested += length;
+		return true;
+	}
+
+	void SetProgress(float progress) override {
+		package->SetProgress(progress);
+	}
+
+	// Digests what the signature check did not cover: the signature itself, or the
+	// whole zip when signatures are not checked
+	bool Finish_Digest(const std::function<void(float)>& set_progress) {
+		uint64_t length = package->GetPackageSize();
+		std::vector<HasherUpdateCallback> hashers = {
+			[this](const uint8_t* addr, uint64_t size) { digest->update(addr, size); }
+		};
+		uint64_t start = digested;
+		while (digested < length) {
+			uint64_t read_size = std::min<uint64_t>(length - digested, 16 * MiB);
+			if (!package->UpdateHashAtOffset(hashers, digested, read_size))
+				return false;
+			digested += read_size;
+			if (start == 0)
+				set_progress((float)digested / (float)length);
+		}
+		return digest->finish();
+	}
+
+private:
+	Package* package;
+	twrpDigestCheckSink* digest;
+	uint64_t digested;
+};
 
 static int Run_Update_Binary(const char *path, int* wipe_cache, zip_type ztype) {
 	int ret_val, pipe_fd[2], status, zip_verify;
@@ -242,15 +354,18 @@ int TWinstall_zip(const char* path, int* wipe_cache, bool check_for_digest) {
 	int ret_val, zip_verify = 1, unmount_system = 1, reflashtwrp = 0;
 
 	gui_msg(Msg("installing_zip=Installing zip file '{1}'")(path));
+	std::unique_ptr<twrpDigestCheckSink> digest_check;
 	if (strlen(path) < 9 || strncmp(path, "/sideload", 9) != 0) {
-		string digest_str;
 		string Full_Filename = path;
 
 		if (check_for_digest) {
 			gui_msg("check_for_digest=Checking for Digest file...");
-			if (*path != '@' && !twrpDigestDriver::Check_File_Digest(Full_Filename)) {
-				LOGERR("Aborting zip install: Digest verification failed\n");
-				return INSTALL_CORRUPT;
+			if (*path != '@') {
+				digest_check.reset(new twrpDigestCheckSink(Full_Filename));
+				if (!digest_check->found()) {
+					digest_check->finish();
+					digest_check.reset();
+				}
 			}
 		}
 	}
@@ -267,6 +382,18 @@ int TWinstall_zip(const char* path, int* wipe_cache, bool check_for_digest) {
 		return INSTALL_CORRUPT;
 	}
 
+	// The digest and the signature are checked in one read of the zip, and the updater
+	// binary is extracted meanwhile
+	std::unique_ptr<Update_Binary_Extractor> binary_extractor;
+	if (zip_verify || digest_check) {
+		ZipArchiveHandle Early_Zip = package->GetZipArchiveHandle();
+		std::string update_binary_name(UPDATE_BINARY_NAME);
+		ZipEntry64 update_binary_entry;
+		if (Early_Zip && FindEntry(Early_Zip, update_binary_name, &update_binary_entry) == 0)
+			binary_extractor.reset(new Update_Binary_Extractor(Early_Zip));
+	}
+	Digesting_Package verify_package(package.get(), digest_check.get());
+
 	if (zip_verify) {
 		gui_msg("verify_zip_sig=Verifying zip signature...");
 		static constexpr const char* CERTIFICATE_ZIP_FILE = "/system/etc/security/otacerts.zip";
@@ -277,7 +404,7 @@ int TWinstall_zip(const char* path, int* wipe_cache, bool check_for_digest) {
 		}
 		LOGINFO("%zu key(s) loaded from %s\n", loaded_keys.size(), CERTIFICATE_ZIP_FILE);
 
-		ret_val = verify_file(package.get(), loaded_keys, std::bind(&DataManager::SetProgress, std::placeholders::_1));
+		ret_val = verify_file(&verify_package, loaded_keys, std::bind(&DataManager::SetProgress, std::placeholders::_1));
 		if (ret_val != VERIFY_SUCCESS) {
 			LOGINFO("Zip signature verification failed: %i\n", ret_val);
 			gui_err("verify_zip_fail=Zip signature verification failed!");
@@ -290,6 +417,17 @@ int TWinstall_zip(const char* path, int* wipe_cache, bool check_for_digest) {
 		}
 	}
 
+	if (digest_check) {
+		if (!verify_package.Finish_Digest(std::bind(&DataManager::SetProgress, std::placeholders::_1))) {
+			LOGERR("Aborting zip install: Digest verification failed\n");
+			return INSTALL_CORRUPT;
+		}
+		if (!zip_verify)
+			DataManager::SetProgress(0);
+	}
+	if (binary_extractor)
+		binary_extractor->Wait();
+
 	ZipArchiveHandle Zip = package->GetZipArchiveHandle();
 	if (!Zip) {
 		return INSTALL_CORRUPT;
@@ -317,7 +455,10 @@ int TWinstall_zip(const char* path, int* wipe_cache, bool check_for_digest) {
 			gui_err("zip_compatible_err=Zip Treble compatibility error!");
 			ret_val = INSTALL_CORRUPT;
 		} else {
-			ret_val = Prepare_Update_Binary(Zip);
+			if (binary_extractor)
+				ret_val = binary_extractor->Finish();
+			else
+				ret_val = Prepare_Update_Binary(Zip);
 			if (ret_val == INSTALL_SUCCESS)
 				ret_val = Run_Update_Binary(path, wipe_cache, UPDATE_BINARY_ZIP_TYPE);
 		}
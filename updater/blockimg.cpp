@@ -32,10 +32,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -60,6 +65,7 @@
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
 #include "private/commands.h"
+#include "private/hash_tree.h"
 #include "updater/install.h"
 
 #ifdef __ANDROID__
@@ -227,15 +233,155 @@ static void allocate(size_t size, std::vector<uint8_t>* buffer) {
 }
 
 /**
- * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
+ * AsyncBlockWriter writes target blocks from a background thread, so that patching and new data
+ * extraction can carry on while the previous output is being written. Writes and discards are
+ * carried out in the order they are queued. Flush() waits for all of them, and must be called
+ * before anything that expects the data on the block device, such as the fsync at the end of each
+ * command.
+ */
+class AsyncBlockWriter {
+ public:
+  explicit AsyncBlockWriter(int fd) : fd_(fd), thread_(&AsyncBlockWriter::Run, this) {}
+
+  ~AsyncBlockWriter() {
+    Flush();
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Queues a copy of |data| to be written at |offset|. Returns false if an earlier write or
+  // discard has failed.
+  bool Write(off64_t offset, const uint8_t* data, size_t size) {
+    std::unique_lock<std::mutex> lock(mu_);
+    // Bounds the memory held by the queue, but always lets one job through.
+    cv_.wait(lock, [&] {
+      return failed_ || queued_bytes_ == 0 || queued_bytes_ + size <= kMaxQueuedBytes;
+    });
+    if (failed_) {
+      failure_type = failure_;
+      return false;
+    }
+
+    // Patchers emit their output in small pieces; merge adjacent ones into a single write.
+    if (!queue_.empty() && !queue_.back().discard &&
+        queue_.back().offset + static_cast<off64_t>(queue_.back().data.size()) == offset &&
+        queue_.back().data.size() < kMaxJobBytes) {
+      queue_.back().data.insert(queue_.back().data.end(), data, data + size);
+    } else {
+      queue_.push_back({ false, offset, 0, std::vector<uint8_t>(data, data + size) });
+    }
+    queued_bytes_ += size;
+    cv_.notify_all();
+    return true;
+  }
+
+  // Queues discard_blocks() on the given region.
+  bool Discard(off64_t offset, uint64_t size, bool force = false) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (failed_) {
+      failure_type = failure_;
+      return false;
+    }
+    queue_.push_back({ true, offset, size, {}, force });
+    cv_.notify_all();
+    return true;
+  }
+
+  // Waits for every queued job to finish. Returns false if any of them failed.
+  bool Flush() {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&] { return queue_.empty() && !busy_; });
+    if (failed_) {
+      failure_type = failure_;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  // Writes are merged up to this size.
+  static constexpr size_t kMaxJobBytes = 1 << 20;
+  // Bytes of queued data that make Write() wait for the writer thread.
+  static constexpr size_t kMaxQueuedBytes = 8 << 20;
+
+  struct Job {
+    bool discard;
+    off64_t offset;
+    // Size of the region to discard; writes use the size of |data|.
+    uint64_t size;
+    std::vector<uint8_t> data;
+    bool force{ false };
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+
+      Job job = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = true;
+      bool skip = failed_;
+      lock.unlock();
+
+      // Once a job has failed, the rest of the queue is dropped.
+      bool success = true;
+      CauseCode cause = kNoCause;
+      if (!skip && job.discard) {
+        success = discard_blocks(fd_, job.offset, job.size, job.force);
+      } else if (!skip &&
+                 !android::base::WriteFullyAtOffset(fd_, job.data.data(), job.data.size(),
+                                                    job.offset)) {
+        cause = errno == EIO ? kEioFailure : kFwriteFailure;
+        PLOG(ERROR) << "Failed to write " << job.data.size() << " bytes of data";
+        success = false;
+      }
+
+      lock.lock();
+      if (!success && !failed_) {
+        failed_ = true;
+        failure_ = cause;
+      }
+      queued_bytes_ -= job.data.size();
+      busy_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  int fd_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<Job> queue_;
+  size_t queued_bytes_{ 0 };
+  // Whether the writer thread is working on a job taken off the queue.
+  bool busy_{ false };
+  bool failed_{ false };
+  // The failure_type of the failed job, passed to the main thread by the next call.
+  CauseCode failure_{ kNoCause };
+  bool stop_{ false };
+
+  std::thread thread_;
+};
+
+/**
+ * RangeSinkWriter takes the data written to it, and queues them to the destination specified by the
  * given RangeSet.
  */
 class RangeSinkWriter {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
-      : fd_(fd),
+  RangeSinkWriter(AsyncBlockWriter* writer, const RangeSet& tgt)
+      : writer_(writer),
         tgt_(tgt),
         next_range_(0),
+        current_offset_(0),
         current_range_left_(0),
         bytes_written_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
@@ -268,15 +414,15 @@ class RangeSinkWriter {
         write_now = current_range_left_;
       }
 
-      if (!android::base::WriteFully(fd_, data, write_now)) {
-        failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-        PLOG(ERROR) << "Failed to write " << write_now << " bytes of data";
+      if (!writer_->Write(current_offset_, data, write_now)) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes of data";
         break;
       }
 
       data += write_now;
       size -= write_now;
 
+      current_offset_ += write_now;
       current_range_left_ -= write_now;
       written += write_now;
     }
@@ -303,25 +449,21 @@ class RangeSinkWriter {
     }
 
     const Range& range = tgt_[next_range_];
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
+    current_offset_ = static_cast<off64_t>(range.first) * BLOCKSIZE;
     current_range_left_ = (range.second - range.first) * BLOCKSIZE;
     next_range_++;
 
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
-    }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
-      return false;
-    }
-    return true;
+    return writer_->Discard(current_offset_, current_range_left_);
   }
 
-  // The output file descriptor.
-  int fd_;
+  // The writer for the output block device.
+  AsyncBlockWriter* writer_;
   // The destination ranges for the data.
   const RangeSet& tgt_;
   // The next range that we should write to.
   size_t next_range_;
+  // The offset on the block device of the next byte to write.
+  off64_t current_offset_;
   // The number of bytes to write before moving to the next range.
   size_t current_range_left_;
   // Total bytes written by the writer.
@@ -334,65 +476,86 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a ring of
+ * buffers. Decompression runs ahead of the transfer list while the main thread executes the other
+ * commands, and only blocks once every buffer in the ring is full. When the main thread reaches a
+ * 'new' command, it takes the data it needs out of the ring, waiting for the background thread if
+ * the ring runs empty, and writes it to the target ranges.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * NewThreadInfo is the struct used to pass information back and forth between the two threads. The
+ * background thread fills the buffer at head, and hands it over by bumping filled. The main thread
+ * consumes the buffers from tail, and gives them back by decrementing filled. Either thread clears
+ * receiver_available to tell the other one that no more data is coming, or wanted.
  */
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry64 entry{};
   bool brotli_compressed;
 
-  std::unique_ptr<RangeSinkWriter> writer;
   BrotliDecoderState* brotli_decoder_state;
   bool receiver_available;
 
+  // The ring of decompressed data, and the number of valid bytes in each buffer.
+  std::vector<std::vector<uint8_t>> buffers;
+  std::vector<size_t> sizes;
+  // The buffer being filled, and the bytes filled so far. Only used by the background thread.
+  size_t head;
+  size_t head_size;
+  // The next buffer to consume, and the bytes consumed so far. Only used by the main thread.
+  size_t tail;
+  size_t tail_offset;
+  // The number of buffers handed over to the main thread.
+  size_t filled;
+
   pthread_mutex_t mu;
   pthread_cond_t cv;
 };
 
+static constexpr size_t kNewDataBuffers = 8;
+static constexpr size_t kNewDataBufferSize = 1024 * 1024;
+
+// Waits until the buffer at nti->head is free. Returns false if the main thread doesn't want any
+// more data.
+static bool WaitForNewDataBuffer(NewThreadInfo* nti) {
+  pthread_mutex_lock(&nti->mu);
+  while (nti->receiver_available && nti->filled == nti->buffers.size()) {
+    pthread_cond_wait(&nti->cv, &nti->mu);
+  }
+  bool available = nti->receiver_available;
+  pthread_mutex_unlock(&nti->mu);
+  return available;
+}
+
+// Hands the buffer at nti->head over to the main thread.
+static void PublishNewDataBuffer(NewThreadInfo* nti) {
+  pthread_mutex_lock(&nti->mu);
+  nti->sizes[nti->head] = nti->head_size;
+  nti->head = (nti->head + 1) % nti->buffers.size();
+  nti->head_size = 0;
+  nti->filled++;
+  pthread_cond_broadcast(&nti->cv);
+  pthread_mutex_unlock(&nti->mu);
+}
+
 static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+    // End the new data receiver if we encounter an error when performing block image update.
+    if (!WaitForNewDataBuffer(nti)) {
       return false;
     }
 
-    data += write_now;
-    size -= write_now;
+    std::vector<uint8_t>& buffer = nti->buffers[nti->head];
+    size_t copy_now = std::min(size, buffer.size() - nti->head_size);
+    memcpy(buffer.data() + nti->head_size, data, copy_now);
+    nti->head_size += copy_now;
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+    data += copy_now;
+    size -= copy_now;
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+    if (nti->head_size == buffer.size()) {
+      PublishNewDataBuffer(nti);
     }
   }
 
@@ -403,30 +566,16 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+    // End the receiver if we encounter an error when performing block image update.
+    if (!WaitForNewDataBuffer(nti)) {
       return false;
     }
-    uint8_t buffer[buffer_size];
+
+    std::vector<uint8_t>& buffer = nti->buffers[nti->head];
+    size_t buffer_size = buffer.size() - nti->head_size;
     size_t available_in = size;
     size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
+    uint8_t* next_out = buffer.data() + nti->head_size;
 
     // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
     BrotliDecoderResult result = BrotliDecoderDecompressStream(
@@ -438,25 +587,16 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
       return false;
     }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+    LOG(DEBUG) << "bytes decompressed: " << buffer_size - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+    nti->head_size += buffer_size - available_out;
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+    if (nti->head_size == buffer.size()) {
+      PublishNewDataBuffer(nti);
     }
   }
 
@@ -465,16 +605,19 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
 
 static void* unzip_new_data(void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  bool success;
   if (nti->brotli_compressed) {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
+    success = ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti) == 0;
   } else {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
+    success = ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti) == 0;
+  }
+  // Hands over the partially filled last buffer.
+  if (success && nti->head_size > 0 && WaitForNewDataBuffer(nti)) {
+    PublishNewDataBuffer(nti);
   }
   pthread_mutex_lock(&nti->mu);
   nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
+  pthread_cond_broadcast(&nti->cv);
   pthread_mutex_unlock(&nti->mu);
   return nullptr;
 }
@@ -482,12 +625,9 @@ static void* unzip_new_data(void* cookie) {
 static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd) {
   size_t p = 0;
   for (const auto& [begin, end] : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      return -1;
-    }
-
+    off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
     size_t size = (end - begin) * BLOCKSIZE;
-    if (!android::base::ReadFully(fd, buffer->data() + p, size)) {
+    if (!android::base::ReadFullyAtOffset(fd, buffer->data() + p, size, offset)) {
       failure_type = errno == EIO ? kEioFailure : kFreadFailure;
       PLOG(ERROR) << "Failed to read " << size << " bytes of data";
       return -1;
@@ -499,22 +639,14 @@ static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>* buffer, int fd)
   return 0;
 }
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
+static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
+                       AsyncBlockWriter* writer) {
   size_t written = 0;
   for (const auto& [begin, end] : tgt) {
     off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
     size_t size = (end - begin) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
-    }
-
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
-    }
-
-    if (!android::base::WriteFully(fd, buffer.data() + written, size)) {
-      failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-      PLOG(ERROR) << "Failed to write " << size << " bytes of data";
+    if (!writer->Discard(offset, size) || !writer->Write(offset, buffer.data() + written, size)) {
+      LOG(ERROR) << "Failed to write " << size << " bytes of data";
       return -1;
     }
 
@@ -542,6 +674,7 @@ struct CommandParameters {
     size_t stashed;
     NewThreadInfo nti;
     pthread_t thread;
+    std::unique_ptr<AsyncBlockWriter> block_writer;
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
@@ -1192,7 +1325,7 @@ static int PerformCommandMove(CommandParameters& params) {
     if (status == 0) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
+      if (WriteBlocks(tgt, params.buffer, params.block_writer.get()) == -1) {
         return -1;
       }
     } else {
@@ -1283,28 +1416,18 @@ static int PerformCommandZero(CommandParameters& params) {
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, &params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
+  // Zeroes up to this many blocks per write.
+  static constexpr size_t kZeroBlocks = 256;
+  allocate(kZeroBlocks * BLOCKSIZE, &params.buffer);
+  memset(params.buffer.data(), 0, kZeroBlocks * BLOCKSIZE);
 
   if (params.canwrite) {
-    for (const auto& [begin, end] : tgt) {
-      off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
-      size_t size = (end - begin) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
+    RangeSinkWriter writer(params.block_writer.get(), tgt);
+    while (!writer.Finished()) {
+      size_t write_now = std::min(kZeroBlocks * BLOCKSIZE, writer.AvailableSpace());
+      if (writer.Write(params.buffer.data(), write_now) != write_now) {
         return -1;
       }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
-        return -1;
-      }
-
-      for (size_t j = begin; j < end; ++j) {
-        if (!android::base::WriteFully(params.fd, params.buffer.data(), BLOCKSIZE)) {
-          failure_type = errno == EIO ? kEioFailure : kFwriteFailure;
-          PLOG(ERROR) << "Failed to write " << BLOCKSIZE << " bytes of data";
-          return -1;
-        }
-      }
     }
   }
 
@@ -1329,21 +1452,38 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
+    NewThreadInfo& nti = params.nti;
+    RangeSinkWriter writer(params.block_writer.get(), tgt);
+    while (!writer.Finished()) {
+      pthread_mutex_lock(&nti.mu);
+      while (nti.filled == 0) {
+        if (!nti.receiver_available) {
+          LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - writer.BytesWritten())
+                     << " bytes of new data";
+          pthread_mutex_unlock(&nti.mu);
+          return -1;
+        }
+        pthread_cond_wait(&nti.cv, &nti.mu);
+      }
+      pthread_mutex_unlock(&nti.mu);
 
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+      // The buffer at nti.tail belongs to this thread until it's handed back.
+      size_t write_now = std::min(nti.sizes[nti.tail] - nti.tail_offset, writer.AvailableSpace());
+      if (writer.Write(nti.buffers[nti.tail].data() + nti.tail_offset, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
-    }
 
-    pthread_mutex_unlock(&params.nti.mu);
+      nti.tail_offset += write_now;
+      if (nti.tail_offset == nti.sizes[nti.tail]) {
+        pthread_mutex_lock(&nti.mu);
+        nti.tail = (nti.tail + 1) % nti.buffers.size();
+        nti.tail_offset = 0;
+        nti.filled--;
+        pthread_cond_broadcast(&nti.cv);
+        pthread_mutex_unlock(&nti.mu);
+      }
+    }
   }
 
   params.written += tgt.blocks();
@@ -1395,7 +1535,7 @@ static int PerformCommandDiff(CommandParameters& params) {
           Value::Type::BLOB,
           std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
 
-      RangeSinkWriter writer(params.fd, tgt);
+      RangeSinkWriter writer(params.block_writer.get(), tgt);
       if (params.cmdname[0] == 'i') {  // imgdiff
         if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
@@ -1528,40 +1668,16 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
     return -1;
   }
 
-  // Starts the hash_tree computation.
-  HashTreeBuilder builder(BLOCKSIZE, hash_function);
-  if (!builder.Initialize(static_cast<int64_t>(source_ranges.blocks()) * BLOCKSIZE, salt)) {
-    LOG(ERROR) << "Failed to initialize hash tree computation, source " << source_ranges.ToString()
-               << ", salt " << salt_hex;
-    return -1;
-  }
-
-  // Iterates through every block in the source_ranges and updates the hash tree structure
-  // accordingly.
-  for (const auto& [begin, end] : source_ranges) {
-    uint8_t buffer[BLOCKSIZE];
-    if (!check_lseek(params.fd, static_cast<off64_t>(begin) * BLOCKSIZE, SEEK_SET)) {
-      PLOG(ERROR) << "Failed to seek to block: " << begin;
-      return -1;
-    }
-
-    for (size_t i = begin; i < end; i++) {
-      if (!android::base::ReadFully(params.fd, buffer, BLOCKSIZE)) {
-        failure_type = errno == EIO ? kEioFailure : kFreadFailure;
-        LOG(ERROR) << "Failed to read data in " << begin << ":" << end;
-        return -1;
-      }
-
-      if (!builder.Update(reinterpret_cast<unsigned char*>(buffer), BLOCKSIZE)) {
-        LOG(ERROR) << "Failed to update hash tree builder";
-        return -1;
-      }
-#endif
+  // Starts the hash_tree computation. The data blocks are read in large chunks and hashed on
+  // several threads; the resulting tree is identical to the one from HashTreeBuilder.
+  ParallelHashTreeBuilder builder(BLOCKSIZE, hash_function);
+  int read_errno;
+  if (!builder.BuildHashTree(params.fd, source_ranges, salt, &read_errno)) {
+    if (read_errno != 0) {
+      failure_type = read_errno == EIO ? kEioFailure : kFreadFailure;
     }
-  }
-
-  if (!builder.BuildHashTree()) {
-    LOG(ERROR) << "Failed to build hash tree";
+    LOG(ERROR) << "Failed to build hash tree, source " << source_ranges.ToString() << ", salt "
+               << salt_hex;
     return -1;
   }
 
@@ -1583,6 +1699,136 @@ static int PerformCommandComputeHashTree(CommandParameters& params) {
   return 0;
 }
 
+/**
+ * BlockPrefetcher asks the kernel to read the blocks of the upcoming move/bsdiff/imgdiff/stash
+ * commands into the page cache, while the main thread is still busy with the current command. It
+ * stays up to kPrefetchCommands commands, and kPrefetchBytes of blocks, ahead of the main thread.
+ *
+ * The hints go through the page cache of the block device, which also sees every write the update
+ * makes. Prefetching blocks that an earlier command is yet to overwrite is therefore harmless.
+ */
+class BlockPrefetcher {
+ public:
+  BlockPrefetcher(int fd, const std::vector<std::string>& lines, size_t first_line)
+      : fd_(fd), lines_(lines), current_(first_line), next_(first_line) {
+    thread_ = std::thread(&BlockPrefetcher::Run, this);
+  }
+
+  ~BlockPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Tells the prefetcher that the main thread is about to execute lines_[line].
+  void Advance(size_t line) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      current_ = line;
+      while (!window_.empty() && window_.front().first <= line) {
+        window_bytes_ -= window_.front().second;
+        window_.pop_front();
+      }
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  static constexpr size_t kPrefetchCommands = 16;
+  static constexpr uint64_t kPrefetchBytes = 64 * 1024 * 1024;
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      cv_.wait(lock, [&] { return stop_ || NextLine() < lines_.size(); });
+      if (stop_) {
+        return;
+      }
+
+      size_t line = NextLine();
+      next_ = line + 1;
+      lock.unlock();
+
+      uint64_t bytes = Prefetch(lines_[line], line);
+
+      lock.lock();
+      if (line > current_) {
+        window_.emplace_back(line, bytes);
+        window_bytes_ += bytes;
+      }
+    }
+  }
+
+  // Returns the next line to prefetch, or lines_.size() if the prefetcher is far enough ahead.
+  size_t NextLine() const {
+    // The current command reads its own blocks.
+    size_t line = std::max(next_, current_ + 1);
+    if (line >= lines_.size() || line > current_ + kPrefetchCommands ||
+        window_bytes_ >= kPrefetchBytes) {
+      return lines_.size();
+    }
+    return line;
+  }
+
+  // Issues the read-ahead for the blocks that lines_[line] will read, and returns their size.
+  uint64_t Prefetch(const std::string& line, size_t index) const {
+    if (line.empty()) {
+      return 0;
+    }
+
+    std::string err;
+    Command command = Command::Parse(line, index, &err);
+    if (!command) {
+      return 0;
+    }
+
+    std::vector<const RangeSet*> ranges;
+    switch (command.type()) {
+      case Command::Type::MOVE:
+      case Command::Type::BSDIFF:
+      case Command::Type::IMGDIFF:
+        // The target blocks are read first, to tell if the command has completed already.
+        ranges = { &command.target().ranges(), &command.source().ranges() };
+        break;
+      case Command::Type::STASH:
+        ranges = { &command.stash().ranges() };
+        break;
+      default:
+        return 0;
+    }
+
+    uint64_t bytes = 0;
+    for (const RangeSet* range_set : ranges) {
+      for (const auto& [begin, end] : *range_set) {
+        off64_t offset = static_cast<off64_t>(begin) * BLOCKSIZE;
+        off64_t size = static_cast<off64_t>(end - begin) * BLOCKSIZE;
+        posix_fadvise(fd_, offset, size, POSIX_FADV_WILLNEED);
+        bytes += size;
+      }
+    }
+    return bytes;
+  }
+
+  int fd_;
+  const std::vector<std::string>& lines_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  // The line being executed by the main thread.
+  size_t current_;
+  // The next line to prefetch.
+  size_t next_;
+  // The lines prefetched ahead of current_, with the bytes prefetched for each.
+  std::deque<std::pair<size_t, uint64_t>> window_;
+  uint64_t window_bytes_{ 0 };
+  bool stop_{ false };
+
+  std::thread thread_;
+};
+
 using CommandFunction = std::function<int(CommandParameters&)>;
 
 using CommandMap = std::unordered_map<Command::Type, CommandFunction>;
@@ -1789,6 +2035,10 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
     }
     params.nti.receiver_available = true;
+    params.nti.buffers.assign(kNewDataBuffers, std::vector<uint8_t>(kNewDataBufferSize));
+    params.nti.sizes.assign(kNewDataBuffers, 0);
+
+    params.block_writer = std::make_unique<AsyncBlockWriter>(params.fd);
 
     pthread_mutex_init(&params.nti.mu, nullptr);
     pthread_cond_init(&params.nti.cv, nullptr);
@@ -1823,10 +2073,14 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   int rc = -1;
 
+  std::optional<BlockPrefetcher> prefetcher;
+  prefetcher.emplace(params.fd, lines, kTransferListHeaderLines);
+
   // Subsequent lines are all individual transfer commands
   for (size_t i = kTransferListHeaderLines; i < lines.size(); i++) {
     const std::string& line = lines[i];
     if (line.empty()) continue;
+    prefetcher->Advance(i);
 
     size_t cmdindex = i - kTransferListHeaderLines;
     params.tokens = android::base::Split(line, " ");
@@ -1883,6 +2137,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     }
 
     if (params.canwrite) {
+      // The command's writes must be on the device before it counts as executed.
+      if (!params.block_writer->Flush()) {
+        LOG(ERROR) << "failed to write the target blocks of [" << line << "]";
+        goto pbiudone;
+      }
+
       if (fsync(params.fd) == -1) {
         failure_type = errno == EIO ? kEioFailure : kFsyncFailure;
         PLOG(ERROR) << "fsync failed";
@@ -1903,7 +2163,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
+  prefetcher.reset();
+
   if (params.canwrite) {
+    // Finishes the queued writes, if any, before anything else touches the block device.
+    params.block_writer.reset();
+
     pthread_mutex_lock(&params.nti.mu);
     if (params.nti.receiver_available) {
       LOG(WARNING) << "new data receiver is still available after executing all commands.";
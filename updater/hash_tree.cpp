@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "private/hash_tree.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+// Number of blocks read and hashed as one unit of work. 512 blocks of 4 KiB make 2 MiB reads,
+// which keep the block device streaming while leaving enough chunks to balance the workers.
+static constexpr size_t kBlocksPerChunk = 512;
+
+// A run of data blocks that is contiguous on the block device.
+struct DataChunk {
+  // First block on the device.
+  size_t src_block;
+  // Index of that block in the hash tree's data, i.e. among all the source ranges.
+  size_t data_block;
+  size_t count;
+};
+
+ParallelHashTreeBuilder::ParallelHashTreeBuilder(size_t block_size, const EVP_MD* md,
+                                                 size_t threads)
+    : block_size_(block_size), md_(md), threads_(threads) {
+  CHECK(md_ != nullptr) << "Failed to initialize md";
+
+  hash_size_raw_ = EVP_MD_size(md_);
+  hash_size_ = 1;
+  while (hash_size_ < hash_size_raw_) {
+    hash_size_ <<= 1;
+  }
+  CHECK_LT(hash_size_ * 2, block_size_);
+
+  if (threads_ == 0) {
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+bool ParallelHashTreeBuilder::HashBlocks(const unsigned char* data, size_t count,
+                                         unsigned char* out) const {
+  // Absorbs the salt once, then starts every block from a copy of that state.
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> salted(EVP_MD_CTX_new(),
+                                                                 EVP_MD_CTX_free);
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  if (!salted || !ctx || EVP_DigestInit_ex(salted.get(), md_, nullptr) != 1 ||
+      EVP_DigestUpdate(salted.get(), salt_.data(), salt_.size()) != 1) {
+    LOG(ERROR) << "Failed to initialize the digest context";
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned int size;
+    if (EVP_MD_CTX_copy_ex(ctx.get(), salted.get()) != 1 ||
+        EVP_DigestUpdate(ctx.get(), data + i * block_size_, block_size_) != 1 ||
+        EVP_DigestFinal_ex(ctx.get(), out, &size) != 1 || size != hash_size_raw_) {
+      LOG(ERROR) << "Failed to hash block " << i;
+      return false;
+    }
+    std::fill(out + hash_size_raw_, out + hash_size_, 0);
+    out += hash_size_;
+  }
+  return true;
+}
+
+template <typename Work>
+bool ParallelHashTreeBuilder::ForEachChunk(size_t chunks, Work work) const {
+  size_t workers = std::min(threads_, chunks);
+  if (workers <= 1) {
+    for (size_t i = 0; i < chunks; i++) {
+      if (!work(i)) return false;
+    }
+    return true;
+  }
+
+  std::atomic<size_t> next{ 0 };
+  std::atomic<bool> failed{ false };
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next++) < chunks) {
+      if (!work(i)) failed = true;
+    }
+  };
+
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  for (size_t t = 1; t < workers; t++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  return !failed;
+}
+
+bool ParallelHashTreeBuilder::HashData(int fd, const RangeSet& ranges, int* read_errno) {
+  std::vector<DataChunk> chunks;
+  size_t data_block = 0;
+  for (const auto& [begin, end] : ranges) {
+    for (size_t block = begin; block < end; block += kBlocksPerChunk) {
+      size_t count = std::min(kBlocksPerChunk, end - block);
+      chunks.push_back({ block, data_block, count });
+      data_block += count;
+    }
+  }
+
+  // Leaves the level padded to whole blocks, the way HashTreeBuilder::AppendPaddings does.
+  size_t hashes_per_block = block_size_ / hash_size_;
+  size_t level_blocks = (data_block + hashes_per_block - 1) / hashes_per_block;
+  std::vector<unsigned char> level(level_blocks * block_size_, 0);
+
+  std::atomic<int> first_errno{ 0 };
+  bool result = ForEachChunk(chunks.size(), [&](size_t index) {
+    const DataChunk& chunk = chunks[index];
+    // Each call gets its own buffer, as workers only come back here a few hundred times per GiB.
+    std::vector<unsigned char> buffer(chunk.count * block_size_);
+    off64_t offset = static_cast<off64_t>(chunk.src_block) * block_size_;
+    errno = 0;
+    if (!android::base::ReadFullyAtOffset(fd, buffer.data(), buffer.size(), offset)) {
+      int expected = 0;
+      first_errno.compare_exchange_strong(expected, errno != 0 ? errno : ENODATA);
+      PLOG(ERROR) << "Failed to read data in " << chunk.src_block << ":"
+                  << chunk.src_block + chunk.count;
+      return false;
+    }
+    return HashBlocks(buffer.data(), chunk.count, level.data() + chunk.data_block * hash_size_);
+  });
+  if (!result) {
+    *read_errno = first_errno;
+    return false;
+  }
+
+  verity_tree_.emplace_back(std::move(level));
+  return true;
+}
+
+bool ParallelHashTreeBuilder::HashLevel(const std::vector<unsigned char>& level,
+                                        std::vector<unsigned char>* next) const {
+  size_t blocks = level.size() / block_size_;
+  size_t hashes_per_block = block_size_ / hash_size_;
+  size_t next_blocks = (blocks + hashes_per_block - 1) / hashes_per_block;
+  next->assign(next_blocks * block_size_, 0);
+
+  size_t chunks = (blocks + kBlocksPerChunk - 1) / kBlocksPerChunk;
+  return ForEachChunk(chunks, [&](size_t index) {
+    size_t first = index * kBlocksPerChunk;
+    size_t count = std::min(kBlocksPerChunk, blocks - first);
+    return HashBlocks(level.data() + first * block_size_, count,
+                      next->data() + first * hash_size_);
+  });
+}
+
+bool ParallelHashTreeBuilder::BuildHashTree(int fd, const RangeSet& ranges,
+                                            const std::vector<unsigned char>& salt,
+                                            int* read_errno) {
+  *read_errno = 0;
+  verity_tree_.clear();
+  root_hash_.clear();
+  salt_ = salt;
+
+  if (!ranges || ranges.blocks() == 0) {
+    LOG(ERROR) << "No data to build the hash tree from";
+    return false;
+  }
+
+  if (!HashData(fd, ranges, read_errno)) {
+    return false;
+  }
+
+  while (verity_tree_.back().size() > block_size_) {
+    std::vector<unsigned char> next;
+    if (!HashLevel(verity_tree_.back(), &next)) {
+      return false;
+    }
+    verity_tree_.emplace_back(std::move(next));
+  }
+
+  root_hash_.resize(hash_size_);
+  return HashBlocks(verity_tree_.back().data(), 1, root_hash_.data());
+}
+
+bool ParallelHashTreeBuilder::WriteHashTreeToFd(int fd, uint64_t offset) const {
+  CHECK(!verity_tree_.empty());
+
+  // Writes the levels in reverse order to output the tree top-down.
+  for (auto level = verity_tree_.rbegin(); level != verity_tree_.rend(); level++) {
+    if (!android::base::WriteFullyAtOffset(fd, level->data(), level->size(), offset)) {
+      PLOG(ERROR) << "Failed to write the hash tree at offset " << offset;
+      return false;
+    }
+    offset += level->size();
+  }
+  return true;
+}
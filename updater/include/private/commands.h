@@ -135,6 +135,11 @@ class SourceInfo {
     return hash_;
   }
 
+  // The source blocks read from the block device, not including the stashes.
+  const RangeSet& ranges() const {
+    return ranges_;
+  }
+
   size_t blocks() const {
     return blocks_;
   }
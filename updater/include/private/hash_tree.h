@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "otautil/rangeset.h"
+
+// Builds the same dm-verity hash tree as HashTreeBuilder from libverity_tree, but reads the data
+// blocks in large chunks and hashes them on several threads, then reduces every upper level of
+// the tree in parallel as well.
+class ParallelHashTreeBuilder {
+ public:
+  // |threads| of 0 picks one per CPU.
+  ParallelHashTreeBuilder(size_t block_size, const EVP_MD* md, size_t threads = 0);
+
+  // Reads the blocks in |ranges| from |fd| as the tree's data and builds the whole tree. Returns
+  // false on errors. A failed read leaves its errno (ENODATA for a short read) in |read_errno|,
+  // which is 0 otherwise.
+  bool BuildHashTree(int fd, const RangeSet& ranges, const std::vector<unsigned char>& salt,
+                     int* read_errno);
+
+  // Writes the tree, top level first, at |offset| of |fd|.
+  bool WriteHashTreeToFd(int fd, uint64_t offset) const;
+
+  const std::vector<unsigned char>& root_hash() const {
+    return root_hash_;
+  }
+
+  size_t threads() const {
+    return threads_;
+  }
+
+ private:
+  // Hashes |count| blocks from |data| into |out|, one padded hash per block.
+  bool HashBlocks(const unsigned char* data, size_t count, unsigned char* out) const;
+
+  // Runs |work| on |chunks| chunk indices spread over the worker threads, stopping at the first
+  // failure.
+  template <typename Work>
+  bool ForEachChunk(size_t chunks, Work work) const;
+
+  bool HashData(int fd, const RangeSet& ranges, int* read_errno);
+  bool HashLevel(const std::vector<unsigned char>& level, std::vector<unsigned char>* next) const;
+
+  size_t block_size_;
+  const EVP_MD* md_;
+  size_t hash_size_raw_;
+  // Hashes are zero padded to the next power of two, as in HashTreeBuilder.
+  size_t hash_size_;
+  size_t threads_;
+  std::vector<unsigned char> salt_;
+  // The data hashes first, the single top level block last.
+  std::vector<std::vector<unsigned char>> verity_tree_;
+  std::vector<unsigned char> root_hash_;
+};
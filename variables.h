@@ -20,6 +20,7 @@
 #define TW_MAIN_VERSION_STR       "3.7.1_14"
 #define TW_VERSION_STR TW_MAIN_VERSION_STR TW_DEVICE_VERSION
 #define TW_SETTINGS_FILE            ".twrps"
+#define TW_SIZE_CACHE_FILE          ".twrpsizes"
 #define TW_RECOVERY_NAME            "TWRP"
 #define TW_DEFAULT_RECOVERY_FOLDER  "/" TW_RECOVERY_NAME
 #define TW_STORAGE_PATH             "/data/recovery/"
@@ -75,6 +76,9 @@
 #define TW_FORCE_DIGEST_CHECK_VAR   "tw_force_digest_check"
 #define TW_SKIP_DIGEST_CHECK_VAR    "tw_skip_digest_check"
 #define TW_SKIP_DIGEST_GENERATE_VAR "tw_skip_digest_generate"
+#define TW_VERIFY_DIGEST_AFTER_WRITE_VAR "tw_verify_digest_after_write"
+#define TW_INCREMENTAL_BACKUP_VAR   "tw_incremental_backup"
+#define TW_DEDUP_BACKUP_VAR         "tw_dedup_backup"
 #define TW_SKIP_DIGEST_CHECK_ZIP_VAR    "tw_skip_digest_check_zip"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
 #define TW_INSTALL_REBOOT_VAR       "tw_install_reboot"